@@ -32,19 +32,39 @@
 /* Contains: imcreat            - Image initialization routines              */
 /*           imopen                                                          */
 /*           imclose                                                         */
+/*           imsetcodec                                                      */
 /*                                                                           */
 /*           imread             - Pixel access routines                      */
 /*           imwrite                                                         */
+/*           imread64                                                        */
+/*           imwrite64                                                       */
+/*           imread_as                                                       */
 /*           imgetpix                                                        */
+/*           imgetpix_batch                                                  */
+/*           imgetpix_as                                                     */
 /*           imputpix                                                        */
 /*           GetPut2D                                                        */
 /*           GetPut3D                                                        */
 /*           GetPutND                                                        */
+/*           GetPutCoarse                                                    */
+/*           immap                                                           */
+/*           imgetpix_async                                                  */
+/*           imasync_poll                                                    */
+/*           imasync_wait                                                    */
+/*           imunmap                                                         */
 /*                                                                           */
 /*           imheader           - Information access routines                */
+/*           impixcnt                                                        */
+/*           imsetopt                                                        */
 /*           imdim                                                           */
 /*           imbounds                                                        */
 /*           imgetdesc                                                       */
+/*           imgetstats                                                      */
+/*           imindex                                                         */
+/*           imgetslicestats                                                 */
+/*           imgetpercentile                                                 */
+/*           imgetabove                                                      */
+/*           imgetbbox                                                       */
 /*           imtest                                                         */
 /*           imgettitle                                                      */
 /*           imputtitle                                                      */
@@ -86,12 +106,39 @@
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 
+/* Use 64 bit file offsets on 32 bit systems, and get O_DIRECT */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
 #ifndef WIN32
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_SWAP
+#include <immintrin.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 
 #ifdef WIN32
@@ -99,13 +146,14 @@
 #pragma warning( disable : 4313 )
 #pragma warning( disable : 4267 )
 #include <io.h>
-#define ftruncate _chsize
+#define ftruncate _chsize_s
 #define open _open
 #define close _close
 #define read _read
 #define write _write
-#define lseek _lseek
+#define lseek _lseeki64
 #define unlink _unlink
+#define atoll _atoi64
 #endif
 
 #ifdef WIN32
@@ -142,22 +190,277 @@ int strcasecmp(const char * s1, const char * s2)
 /* compression flags */
 #define COMPRESSED	65536
 
+/* Chunked compression flag and the chunk size aimed for (see NewChunks) */
+#define CHUNKED		131072
+#define CHUNKBYTES	(1 << 20)
+#define CHUNKLOADED	1
+#define CHUNKDIRTY	2
+#define CHUNKBUSY	4
+
+/* The prefilter of a chunked image is kept as PREFILTER_ flags times   */
+/* PREFILTERED in the version field (see PickPrefilter).                */
+#define PREFILTERED	262144
+
+/* Decompressed pixels of up to UCMEMORY bytes are kept in memory rather */
+/* than a temporary file.  This is the default of the OPT_UCMEMORY option */
+/* (see UCOpen), which IMAGE_UCMEMORY sets in megabytes.                 */
+#define UCMEMORY	((IMINDEX)512 << 20)
+
+/* Large file flag.  The 32 bit address table can not describe images    */
+/* of 2 GB or more, so the full 64 bit addresses are kept in a record    */
+/* in the unused bytes that follow the histogram (see WriteAddresses).   */
+#define LARGEFILE	2
+#define EXTMAGIC	0x494d3634
+
 /* a few globals used for compression routines */
 compMethod compressionMethods[MAX_NUM_COMP_METHODS];
 int haveNotReadCompressionConfigFile = TRUE;
 char *tempDir;
 int NumberOfCompressionMethods = 0;
 
-#ifndef COMPRESSION_TYPE_FILE
-#define NO_COMPRESSION
-#endif
-
 /* Modes for GetPut routines */
 #define READMODE	0
 #define WRITEMODE	1
 
-/* Blocking factor for imgetdesc */
-#define MAXGET 4096
+/* Limits for the vectored reads in GetPut2D and GetPut3D.  A batch is   */
+/* capped at 256 pages so it stays friendly to the page cache, and gaps  */
+/* between rows up to IOVGAP bytes are read into a scratch sink.         */
+#define IOVBATCH	512
+#define IOVBYTES	(1 << 20)
+#define IOVGAP		(64 << 10)
+
+/* Largest read GetPutND makes when it merges runs separated by small     */
+/* gaps (see ReadRuns).  The gap limit itself is the OPT_COALESCE option, */
+/* defaulting to IMAGE_COALESCE or IOVGAP bytes.                          */
+#define SPANBYTES	(4 << 20)
+
+/* Direct (uncached) bulk reads, see DirectRead.  Reads of DIRECTMIN     */
+/* bytes or more go through bounce buffers aligned to DIRECTALIGN.       */
+#define DIRECTMIN	(1 << 20)
+#define DIRECTALIGN	4096
+
+/* Pooled scratch blocks of BLOCKBYTES for direct reads and swapped      */
+/* writes (see GetBlock); up to BLOCKPOOL idle blocks are kept.          */
+#define BLOCKBYTES	(4 << 20)
+#define BLOCKPOOL	4
+
+/* Reads smaller than HINTMIN bytes are left to the kernel's readahead */
+#define HINTMIN		(64 << 10)
+
+/* imread_as and imgetpix_as read CONVBYTES of raw pixels at a time and  */
+/* convert them while they are still in cache.                           */
+#define CONVBYTES	(512 << 10)
+
+/* Information fields that cache the imgetstats results of an image, */
+/* the per slice statistics of imindex and the histogram behind       */
+/* imgetpercentile                                                     */
+#define STATSINFO	"Pixel Statistics"
+#define SLICEINFO	"Slice Statistics"
+#define HISTOINFO	"Pixel Histogram"
+#define ZONEINFO	"Zone Map"
+
+/* Pixels per zone of the zone map (see imgetabove), which keeps the */
+/* smallest and largest value of each zone                            */
+#define ZONEPIXELS	16384
+
+/* Buckets of the imgetpercentile histogram of USERPACKED, LONG and REAL */
+/* pixels.  8 and 16 bit pixels get one bucket per value.                */
+#define HISTOBINS	4096
+
+/* Values kept per slice in Image->SliceStats: Min, Max, Sum, SumSq and */
+/* the number of pixels that are not NaN                                */
+#define SLICEVALS	5
+
+#ifdef WIN32
+struct iovec { void *iov_base; size_t iov_len; };
+#endif
+
+/* Pending vectored read */
+typedef struct {
+   IMAGE *Image;
+   IMINDEX Start;
+   IMINDEX End;
+   int   Count;
+   struct iovec Iov[IOVBATCH];
+   char *Sink;			/* gap bytes, never looked at */
+   } READBATCH;
+
+/* Run of pixel bytes in a subwindow.  A run is contiguous in the file   */
+/* unless Step is set, in which case its pixels are Step bytes apart.    */
+typedef struct {
+   IMINDEX Offset;		/* offset from first pixel */
+   int   Length;		/* bytes in run (in the buffer) */
+   int   Step;			/* file bytes between pixels, or 0 */
+   char *Buffer;		/* where the bytes go */
+   } PIXRUN;
+
+/* Bytes of the file that a run covers */
+#define RUNEXTENT(Run, PixelSize) ((Run)->Step == 0 ? (IMINDEX)(Run)->Length : \
+   ((IMINDEX)(Run)->Length / (PixelSize) - 1) * (Run)->Step + (PixelSize))
+
+#ifndef WIN32
+/* Shared worker pool */
+#define MAXTHREADS	64
+
+typedef struct POOLJOB {
+   void (*Func)(void *);
+   void *Arg;
+   struct POOLJOB *Next;
+   } POOLJOB;
+
+static pthread_mutex_t _impoollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _impoolwake = PTHREAD_COND_INITIALIZER;
+static POOLJOB *_impoolhead = NULL;
+static POOLJOB *_impooltail = NULL;
+static int _impoolsize = 0;
+
+/* Set on pool workers, whose jobs run everything serially */
+static __thread int _imonpool = FALSE;
+
+/* Idle scratch blocks */
+static pthread_mutex_t _imblocklock = PTHREAD_MUTEX_INITIALIZER;
+static char *_imblockpool[BLOCKPOOL];
+static int _imblockcnt = 0;
+
+/* Decompression of chunks (see LoadChunks) */
+static pthread_mutex_t _imchunklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _imchunkdone = PTHREAD_COND_INITIALIZER;
+
+/* Opening of the O_DIRECT descriptors (see DirectRead) */
+static pthread_mutex_t _imdirectlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Readahead hint state of the images (see AccessHint) */
+static pthread_mutex_t _imhintlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Backends for imgetpix_async */
+#define ASYNCURING	1
+#define ASYNCTHREADS	2
+#define URINGDEPTH	64
+
+/* Up to RINGPOOL idle io_urings are kept for later reads (see RingOpen) */
+#define RINGPOOL	4
+
+/* Worker pool job reading runs [First, Last) of an asynchronous read */
+typedef struct {
+   POOLJOB Job;
+   IMASYNC *Handle;
+   int   First;
+   int   Last;
+   } ASYNCTASK;
+
+/* Worker pool job scanning pixels [First, Last] for imgetdesc */
+typedef struct {
+   POOLJOB Job;
+   IMAGE *Image;
+   IMINDEX First;
+   IMINDEX Last;
+   int   Min;			/* private accumulators */
+   int   Max;
+   IMINDEX *Count;
+   int   Status;
+   int  *Pending;		/* shared by all slabs of a scan */
+   pthread_mutex_t *Lock;
+   pthread_cond_t *Finished;
+   } SCANTASK;
+#endif
+
+/* Job decompressing or compressing chunks [First, Last) */
+typedef struct {
+#ifndef WIN32
+   POOLJOB Job;
+   int  *Pending;		/* shared by all tasks */
+   pthread_mutex_t *Lock;
+   pthread_cond_t *Finished;
+#endif
+   IMAGE *Image;
+   IMCODEC *Codec;
+   IMINDEX First;
+   IMINDEX Last;
+   IMINDEX *Lengths;		/* compressed length of each chunk */
+   char *Packed;		/* compressed chunks, back to back */
+   IMINDEX Used;
+   int   Status;
+   } CODECTASK;
+
+#ifdef HAVE_IO_URING
+/* Mapped submission and completion queues of one io_uring */
+typedef struct {
+   int   Fd;
+   unsigned Entries;
+   unsigned *SqTail;
+   unsigned *SqMask;
+   unsigned *SqArray;
+   unsigned *CqHead;
+   unsigned *CqTail;
+   unsigned *CqMask;
+   struct io_uring_sqe *Sqes;
+   struct io_uring_cqe *Cqes;
+   void *SqMap;
+   void *CqMap;
+   size_t SqMapLength;
+   size_t CqMapLength;
+   size_t SqesLength;
+   int   SingleMap;
+   } URING;
+
+/* One READV request of an asynchronous read: Count iovecs from Iov, */
+/* read from pixel byte Offset on.  A short read moves all three on. */
+typedef struct {
+   IMINDEX Offset;
+   int   Iov;
+   int   Count;
+   } URINGREQ;
+
+/* Idle io_urings, all of URINGDEPTH entries */
+static pthread_mutex_t _imringlock = PTHREAD_MUTEX_INITIALIZER;
+static URING _imringpool[RINGPOOL];
+static int _imringcnt = 0;
+#endif
+
+/* State of one imgetpix_async call */
+struct imasync {
+   IMAGE *Image;
+   GREYTYPE *Pixels;
+   IMINDEX Bytes;		/* bytes in the whole window */
+   PIXRUN *Runs;
+   int   RunCnt;
+   IMCALLBACK Callback;
+   void *Data;
+   int   Backend;
+   int   Status;
+   int   Done;
+#ifndef WIN32
+   pthread_mutex_t Lock;
+   pthread_cond_t Finished;
+   int   Pending;		/* worker pool tasks still running */
+   ASYNCTASK *Tasks;
+#endif
+#ifdef HAVE_IO_URING
+   URING Ring;
+   URINGREQ *Reqs;
+   int   ReqCnt;
+   struct iovec *Iov;		/* runs and gaps of every request */
+   char *Sink;			/* gap bytes, never looked at */
+   int   Fd;
+   IMINDEX Base;
+   int   Next;			/* next request to queue */
+   int   InFlight;
+#endif
+   };
+
+/* Optional I/O call counters (see imiostats) */
+#ifdef IMAGE_IOSTATS
+static long _imiocalls = 0;
+static long _imiobytes = 0;
+#ifdef __GNUC__
+#define IOSTAT(Bytes) { __sync_fetch_and_add(&_imiocalls, 1);\
+   __sync_fetch_and_add(&_imiobytes, (long)(Bytes)); }
+#else
+#define IOSTAT(Bytes) { _imiocalls++; _imiobytes += (Bytes); }
+#endif
+#else
+#define IOSTAT(Bytes)
+#endif
 
 /* Error string buffer */
 static char _imerrbuf[nERROR];
@@ -181,2462 +484,7923 @@ static char _imerrbuf[nERROR];
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine creates an image.  The user specified image        */
-/*           parameters are stored in the new image record.  For historical  */
-/*           reasons, 4092 bytes are unused between the end of the           */
-/*           histogram and the start of the pixel format field - gauchj.     */
+/* Purpose:  These routines read and write a block of bytes at an absolute   */
+/*           file position.  Positioned I/O leaves the file offset alone,    */
+/*           so several threads may access the same open image at once.      */
+/*           Short transfers are retried; the byte count is returned.        */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-#define UNUSED 4092
-IMAGE *imcreat (char *Name, int Protection, int PixForm, int Dimc, int *Dimv)
+static IMINDEX ReadAt(int Fd, char *Buffer, IMINDEX Length, IMINDEX Offset)
 {
-	IMAGE *Image;
-	int Cnt;
-	int Fd;
-	int i;
-	char Null = '\0';
-#ifndef NO_COMPRESSION
-	char *envVar;
-#endif
-
-	/* Check parameters */
-	if (Name == NULL) ErrorNull("Null image name");
-	if ((PixForm != GREY) && (PixForm != COLOR) && (PixForm != COLORPACKED) && 
-		(PixForm != BYTE) && (PixForm != SHORT) && (PixForm != LONG) && 
-		(PixForm != REAL) && (PixForm != COMPLEX) && (PixForm != USERPACKED)) 
-		ErrorNull("Invalid pixel format");
-	if ((Dimc < 1) || (Dimc > nDIMV)) ErrorNull("Illegal number of dimensions");
+	IMINDEX Total = 0;
+	IMINDEX Cnt;
 
-
-	/* Check to see if the environment variable IMAGE_CLOBBER is set.  If it
-		 is set, then allow user to create an image on top of an existing 
-		 image file */
-	if(getenv("IMAGE_CLOBBER") != NULL)
+	while (Total < Length)
 	{
-		/* Create image file, modifying the mode flags to remove the  */
-		/* O_EXCL flag and add the O_TRUNC flag                       */
-		Fd = open(Name,
-			(CREATE - (CREATE & O_EXCL) - (CREATE & O_TRUNC) + O_TRUNC),
-			Protection);
+#ifdef WIN32
+		if (lseek(Fd, Offset + Total, FROMBEG) == -1) break;
+		Cnt = read(Fd, Buffer + Total, (unsigned)(Length - Total));
+#else
+		Cnt = pread(Fd, Buffer + Total, (size_t)(Length - Total),
+			Offset + Total);
+#endif
+		IOSTAT(Cnt);
+		if (Cnt <= 0) break;
+		Total += Cnt;
 	}
-	else
+	return(Total);
+}
+
+static IMINDEX WriteAt(int Fd, const char *Buffer, IMINDEX Length,
+	IMINDEX Offset)
+{
+	IMINDEX Total = 0;
+	IMINDEX Cnt;
+
+	while (Total < Length)
 	{
-		/* Create image file */
 #ifdef WIN32
-		Fd = open(Name,CREATE|O_BINARY,Protection);
+		if (lseek(Fd, Offset + Total, FROMBEG) == -1) break;
+		Cnt = write(Fd, Buffer + Total, (unsigned)(Length - Total));
 #else
-		Fd = open(Name,CREATE,Protection);
+		Cnt = pwrite(Fd, Buffer + Total, (size_t)(Length - Total),
+			Offset + Total);
 #endif
-		if (Fd == EOF) ErrorNull("Image already exists");
+		IOSTAT(Cnt);
+		if (Cnt <= 0) break;
+		Total += Cnt;
 	}
+	return(Total);
+}
 
-	/* Allocate image record */
-	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
-	if (Image == NULL) ErrorNull("Allocation error");
+/* Compression codecs (see GetCodec) */
+static int OpenTemp(char *FileName);
+static int UCOpen(IMAGE *Image);
+static void UCClose(IMAGE *Image);
+static int UCLoad(IMAGE *Image);
+static int UCSave(IMAGE *Image);
+static int PickCodec(IMAGE *Image, char *Setting);
+static char *CodecName(int Method);
+static int NewChunks(IMAGE *Image);
+static int LoadChunks(IMAGE *Image, IMINDEX Offset, IMINDEX Length,
+   int Write);
+static int LoadChunksParallel(IMAGE *Image, IMINDEX Offset, IMINDEX Length);
+static void FreeChunks(IMAGE *Image);
 
-	/* Initialize image record */   
-	Image->Title[0] = Null;
-	Image->ValidMaxMin = FALSE;
-	Image->MaxMin[0] = MAXVAL;
-	Image->MaxMin[1] = MINVAL;
-	Image->ValidHistogram = FALSE;
-	for (i=0; i<nHISTOGRAM; i++)
-		Image->Histogram[i] = 0;
-	Image->PixelFormat = PixForm;
-	Image->Dimc = Dimc;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines read and write the decompressed pixels of a      */
+/*           compressed image, which UCOpen has set up.  They are held in    */
+/*           memory, or in a temporary file if they did not fit there.       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMINDEX UCRead(IMAGE *Image, char *Buffer, IMINDEX Length,
+	IMINDEX Offset)
+{
+	IMINDEX Total = Image->PixelCnt * Image->PixelSize;
+
+	if (Image->UCPixels == NULL)
+		return(ReadAt(Image->UCPixelsFd, Buffer, Length, Offset));
+	if (Offset < 0 || Offset >= Total) return(0);
+	if (Length > Total - Offset) Length = Total - Offset;
+	memcpy(Buffer, Image->UCPixels + Offset, (size_t)Length);
+	return(Length);
+}
 
-	/* Determine number of pixels in image */
-	Image->PixelCnt = 1;
-	for (i=0; i<Image->Dimc; i++) {
-		Image->Dimv[i] = Dimv[i];
-		Image->PixelCnt = Image->PixelCnt * Dimv[i];
+static IMINDEX UCWrite(IMAGE *Image, const char *Buffer, IMINDEX Length,
+	IMINDEX Offset)
+{
+	IMINDEX Total = Image->PixelCnt * Image->PixelSize;
+
+	if (Image->UCPixels == NULL)
+		return(WriteAt(Image->UCPixelsFd, Buffer, Length, Offset));
+	if (Offset < 0 || Offset >= Total) return(0);
+	if (Length > Total - Offset) Length = Total - Offset;
+	memcpy(Image->UCPixels + Offset, Buffer, (size_t)Length);
+	return(Length);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines read and write pixel bytes.  The offset is       */
+/*           measured from the first pixel.  Compressed images are served    */
+/*           from the decompressed pixels, which must already exist.         */
+/*           The chunks of a chunked image are decompressed as needed.       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMINDEX PixelRead(IMAGE *Image, IMINDEX Offset, char *Buffer,
+	IMINDEX Length)
+{
+	if (Image->Compressed)
+	{
+		if (Image->Chunked &&
+			LoadChunks(Image, Offset, Length, FALSE) == INVALID) return(-1);
+		return(UCRead(Image, Buffer, Length, Offset));
 	}
+	else
+		return(ReadAt(Image->Fd, Buffer, Length,
+			Offset + Image->Address[aPIXELS]));
+}
 
-	/* Determine size of each pixel */
-	switch (Image->PixelFormat) {
-		case GREY         : Image->PixelSize = sizeof (GREYTYPE); break;
-		case COLOR        : Image->PixelSize = sizeof (COLORTYPE); break;
-		case COLORPACKED  : Image->PixelSize = sizeof (CPACKEDTYPE); break;
-		case BYTE         : Image->PixelSize = sizeof (BYTETYPE); break;
-		case SHORT        : Image->PixelSize = sizeof (SHORTTYPE); break;
-		case LONG         : Image->PixelSize = sizeof (LONGTYPE); break;
-		case REAL         : Image->PixelSize = sizeof (REALTYPE); break;
-		case COMPLEX      : Image->PixelSize = sizeof (COMPLEXTYPE); break;
-		case USERPACKED   : Image->PixelSize = sizeof (USERTYPE); break;
+static IMINDEX PixelWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+	IMINDEX Length)
+{
+	if (Image->Compressed)
+	{
+		if (Image->Chunked &&
+			LoadChunks(Image, Offset, Length, TRUE) == INVALID) return(-1);
+		return(UCWrite(Image, Buffer, Length, Offset));
 	}
+	else
+		return(WriteAt(Image->Fd, Buffer, Length,
+			Offset + Image->Address[aPIXELS]));
+}
 
-	/* Initialize image addresses (do NOT change this) */
-	Image->Address[aTITLE] = sizeof( Image->Address );
-	Image->Address[aMAXMIN] = Image->Address[aTITLE] 
-		+ sizeof( Image->Title );
-	Image->Address[aHISTO] = Image->Address[aMAXMIN] 
-		+ sizeof( Image->ValidMaxMin ) + sizeof( Image->MaxMin );
-	Image->Address[aPIXFORM] = Image->Address[aHISTO] + UNUSED
-		+ sizeof( Image->ValidHistogram ) + sizeof( Image->Histogram );
-	Image->Address[aDIMC] = Image->Address[aPIXFORM] 
-		+ sizeof( Image->PixelFormat );
-	Image->Address[aDIMV] = Image->Address[aDIMC] 
-		+ sizeof( Image->Dimc );
-	Image->Address[aPIXELS] = Image->Address[aDIMV] 
-		+ sizeof( Image->Dimv );
-	Image->Address[aINFO] = Image->Address[aPIXELS] 
-		+ Image->PixelCnt * Image->PixelSize;
-	Image->Address[aVERNO] = 1;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines take a BLOCKBYTES scratch block from the pool    */
+/*           and give it back.  GetBlock returns NULL if it has to allocate  */
+/*           a block and can not.                                            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static char *GetBlock(void)
+{
+	char *Block = NULL;
 
-	/* Save file pointer */
-	/* this must be done before we try to compress the image */
-	Image->Fd = Fd;
+#ifdef WIN32
+	Block = (char *)malloc(BLOCKBYTES);
+#else
+	pthread_mutex_lock(&_imblocklock);
+	if (_imblockcnt > 0) Block = _imblockpool[--_imblockcnt];
+	pthread_mutex_unlock(&_imblocklock);
+	if (Block == NULL &&
+		posix_memalign((void **)&Block, DIRECTALIGN, BLOCKBYTES) != 0)
+		Block = NULL;
+#endif
+	return(Block);
+}
 
-	Image->Compressed = FALSE;
-	
-#ifndef NO_COMPRESSION
-	/* check for COMPRESS flag */
-	if((envVar = getenv("IMAGE_COMPRESS")) != NULL)
+static void PutBlock(char *Block)
+{
+#ifndef WIN32
+	pthread_mutex_lock(&_imblocklock);
+	if (_imblockcnt < BLOCKPOOL)
 	{
-		Image->Compressed = TRUE;
-		/* find the specified compression method; if it can't be determined,
-			 it defaults to 0 */
-		if(sscanf(envVar,"%d", &(Image->CompressionMethod)) != 1)
-			Image->CompressionMethod = 0;
-		if(haveNotReadCompressionConfigFile) readCompressionConfigFile();
-
-		/* this step assumes that NumberOfCompressionMethods > 0 */
-		if(Image->CompressionMethod >= NumberOfCompressionMethods)
-		{
-			char message[256];
-			sprintf(message, "Compression method %d out of bounds (only %d methods defined).\nDefaulting to method 0",
-				Image->CompressionMethod, NumberOfCompressionMethods);
-			Warn(message);
-			Image->CompressionMethod = 0;
-		}
+		_imblockpool[_imblockcnt++] = Block;
+		Block = NULL;
+	}
+	pthread_mutex_unlock(&_imblocklock);
+#endif
+	if (Block != NULL) free(Block);
+}
 
-		Image->PixelsAccessed = TRUE;
-		Image->PixelsModified = FALSE;
-		Image->Address[aVERNO] =
-			Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
+/* Histogram tracking of written pixels (see TrackWrite) */
+static void TrackWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+   IMINDEX Length);
+static void StopTracking(IMAGE *Image);
+static void FinishTracking(IMAGE *Image);
 
-		/* write some bogus data to the uncompressed pixel file; compress it */
-		if((tempDir = getenv("IMAGE_TEMPDIR")) == NULL)
-			tempDir = "/usr/tmp";
-		sprintf(Image->UCPixelsFileName, "%s/tempimXXXXXX", tempDir);
-		mkstemp(Image->UCPixelsFileName);
-		if((Image->UCPixelsFd = open(Image->UCPixelsFileName,
-		      O_RDWR | O_CREAT | O_TRUNC,
-		      DEFAULT)) == -1) Error("Could not open temp file");
-		lseek(Image->UCPixelsFd, Image->PixelCnt * Image->PixelSize, FROMBEG);
-		Null = '1';
-		write(Image->UCPixelsFd, (char *)&Null, sizeof(Null));
-		ftruncate(Image->UCPixelsFd,
-			(off_t)(Image->PixelCnt * Image->PixelSize + 1));
+/* Zone map tracking of written pixels (see ZoneWrite) */
+static void ZoneWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+   IMINDEX Length);
+static void StopZones(IMAGE *Image);
+static void FinishZones(IMAGE *Image);
 
-		compressImage(Image);
-	}else{
-		Image->Compressed = FALSE;
-	}
-#endif
-		
-	/* Write null information field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aINFO], FROMBEG);
-	Null = '\0';
-	Cnt = write(Fd, (char *)&Null, sizeof(Null));
-	if (Cnt != sizeof(Null)) ErrorNull("Image write failed");
-	Image->InfoCnt = 0;
+/* Cached pixel statistics (see imgetstats and imindex) */
+static void FreeStats(IMAGE *Image);
+static void DropStats(IMAGE *Image);
+static void DropStaleStats(IMAGE *Image);
+static void FinishIndex(IMAGE *Image);
 
-	/* save the compression type as an info field */
-	if(Image->Compressed)
-		imputinfo(Image, "Pixel Compression Method", 
-			compressionMethods[Image->CompressionMethod].methodName);
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine writes pixel bytes like PixelWrite, in the byte    */
+/*           order of the file.  When the image needs swapping the bytes     */
+/*           are copied into a scratch block a block at a time and swapped   */
+/*           there, so the caller's buffer is left as it was.  The pixels    */
+/*           are tracked (see TrackWrite and ZoneWrite) once all of them     */
+/*           are written; a short write stops tracking.                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMINDEX SwapWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+	IMINDEX Length)
+{
+	char *Block;
+	IMINDEX Done;
+	IMINDEX Want;
+	IMINDEX Cnt;
 
+	if (!Image->SwapNeeded)
+		Done = PixelWrite(Image, Offset, Buffer, Length);
+	else
+	{
+		if ((Block = GetBlock()) == NULL) return(0);
+		for (Done=0; Done<Length; Done+=Want)
+		{
+			Want = Length - Done;
+			if (Want > BLOCKBYTES) Want = BLOCKBYTES;
+			memcpy(Block, Buffer + Done, (size_t)Want);
+			Swap(Block, Want, Image->PixelFormat);
+			Cnt = PixelWrite(Image, Offset + Done, Block, Want);
+			if (Cnt != Want)
+			{
+				if (Cnt > 0) Done += Cnt;
+				break;
+			}
+		}
+		PutBlock(Block);
+	}
 
-	/* Initialize swap flag */
-	Image->SwapNeeded = FALSE;
-	Image->nImgFormat = 0;
-	return(Image);
+	if (Done != Length)
+	{
+		StopTracking(Image);
+		StopZones(Image);
+	}
+	else
+	{
+		if (Image->TrackHisto) TrackWrite(Image, Offset, Buffer, Length);
+		if (Image->TrackZones) ZoneWrite(Image, Offset, Buffer, Length);
+	}
+	return(Done);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine opens an image.  The image parameters are          */
-/*           read from the file and stored in the image record.              */
+/* Purpose:  This routine fills a list of buffers from consecutive pixel     */
+/*           bytes with preadv.  The iovec list is consumed as it goes.      */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-
-IMAGE *dcmopen(char * Name, int Mode)
+static IMINDEX PixelReadv(IMAGE *Image, IMINDEX Offset, struct iovec *Iov,
+	int Count)
 {
-	IMAGE *Image;
 	int Fd;
-	unsigned int    tag;
-	unsigned int    length;
-	int				i=0, bImplicit=0, bCompressed=0;
-	char            strDICM[5] = "";
-	char            strVR[3] = "";
-	char            is_FNum[128] = "1";
-	char			strTemp[128];
-	unsigned short
-		us = 0,
-		us_Rows = 0,
-		us_Cols = 0,
-		us_Bits = 0,
-		us_BSto = 0,
-		us_HBit = 0,
-		us_Samp = 0,
-		us_PixR = 0,
-		us_FNum = 1;
-	int bFirstItemCheck = 0;
+	int i;
+	IMINDEX Total = 0;
+	IMINDEX Cnt;
 
-	/* Check parameters */
-	if (Name == NULL) ErrorNull("Null image name");
-	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
+	if (Image->Compressed)
+	{
+		Fd = Image->UCPixelsFd;
+		if (Image->Chunked)
+		{
+			for (i=0; i<Count; i++)
+				Total += (IMINDEX)Iov[i].iov_len;
+			if (LoadChunks(Image, Offset, Total, FALSE) == INVALID)
+				return(-1);
+			Total = 0;
+		}
+	}
+	else
+	{
+		Fd = Image->Fd;
+		Offset += Image->Address[aPIXELS];
+	}
 
-	/* Open image file */
+	while (Count > 0)
+	{
+		/* Decompressed pixels in memory are copied a buffer at a time */
+		if (Fd == -1)
+			Cnt = UCRead(Image, (char *)Iov->iov_base,
+				(IMINDEX)Iov->iov_len, Offset + Total);
+		else
+		{
 #ifdef WIN32
-		Fd = open(Name,Mode|O_BINARY);
+			Cnt = ReadAt(Fd, (char *)Iov->iov_base, (IMINDEX)Iov->iov_len,
+				Offset + Total);
 #else
-	Fd = open(Name,Mode);
+			Cnt = preadv(Fd, Iov, Count, Offset + Total);
+			IOSTAT(Cnt);
 #endif
-	if (Fd == EOF) ErrorNull("Image file not found");
+		}
+		if (Cnt <= 0) break;
+		Total += Cnt;
 
-	/* Allocate image record */
-	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
-	if (Image == NULL) ErrorNull("Allocation error");
+		/* Skip the buffers that are full and trim a partial one */
+		while (Count > 0 && (size_t)Cnt >= Iov->iov_len)
+		{
+			Cnt -= (IMINDEX)Iov->iov_len;
+			Iov++;
+			Count--;
+		}
+		if (Count > 0)
+		{
+			Iov->iov_base = (char *)Iov->iov_base + Cnt;
+			Iov->iov_len -= Cnt;
+		}
+	}
+	return(Total);
+}
 
-	lseek(Fd, 0x80, FROMBEG);
-	if ((read(Fd, strDICM, 4)) != 4)
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines collect row reads into one vectored read.  Rows  */
+/*           must be added in increasing file order.  Short gaps between     */
+/*           rows are read into a sink so that a batch covers one range of   */
+/*           the file; long gaps and full batches start a new preadv call.   */
+/*           Each batch has its own sink, as reads may run concurrently.     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int FlushBatch(READBATCH *Batch)
+{
+	IMINDEX Length;
+	IMINDEX Cnt;
+
+	if (Batch->Count == 0) return(VALID);
+	Length = Batch->End - Batch->Start;
+	Cnt = PixelReadv(Batch->Image, Batch->Start, Batch->Iov, Batch->Count);
+	Batch->Count = 0;
+	if (Batch->Sink != NULL) free(Batch->Sink);
+	Batch->Sink = NULL;
+	return(Cnt == Length ? VALID : INVALID);
+}
+
+static int BatchRead(READBATCH *Batch, IMINDEX Offset, char *Buffer,
+	IMINDEX Length)
+{
+	IMINDEX Gap = Offset - Batch->End;
+
+	/* Start a new batch if this row does not fit the current one */
+	if ((Batch->Count > 0) && ((Gap < 0) || (Gap > IOVGAP) ||
+		(Batch->Count + 2 > IOVBATCH) ||
+		(Offset + Length - Batch->Start > IOVBYTES)))
+		if (FlushBatch(Batch) == INVALID) return(INVALID);
+
+	/* Without a sink for the gap, start a new batch too */
+	if ((Batch->Count > 0) && (Gap > 0) && (Batch->Sink == NULL) &&
+		((Batch->Sink = (char *)malloc(IOVGAP)) == NULL))
+		if (FlushBatch(Batch) == INVALID) return(INVALID);
+
+	if (Batch->Count == 0)
+		Batch->Start = Offset;
+	else if (Gap > 0)
 	{
-		close(Fd);
-		free(Image);
-		return NULL;
+		Batch->Iov[Batch->Count].iov_base = Batch->Sink;
+		Batch->Iov[Batch->Count].iov_len = (size_t)Gap;
+		Batch->Count++;
 	}
-	if (strcmp(strDICM, "DICM") != 0)
+	Batch->Iov[Batch->Count].iov_base = Buffer;
+	Batch->Iov[Batch->Count].iov_len = (size_t)Length;
+	Batch->Count++;
+	Batch->End = Offset + Length;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine lists the runs of pixel bytes that make up a       */
+/*           subwindow, in file order, together with where each run goes     */
+/*           in the caller's buffer.  Coarseness (NULL for all 1) gives the  */
+/*           sampling step in each dimension.  Trailing dimensions that are  */
+/*           read in full are folded into one run, as GetPut3D does, and     */
+/*           runs longer than IOVBYTES are split.  When the last dimension   */
+/*           is subsampled, a run is a row of pixels Step bytes apart if     */
+/*           the gaps are within Image->Coalesce, and single pixels if not.  */
+/*           The number of runs is returned, or -1 if the list could not     */
+/*           be allocated.                                                   */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int PlanRuns(IMAGE *Image, int Endpts[][2], int *Coarseness,
+	char *Pixels, PIXRUN **Runs)
+{
+	IMINDEX SliceSize[nDIMV];
+	int Step[nDIMV];
+	int Index[nDIMV];
+	IMINDEX RunBytes;
+	IMINDEX Offset;
+	IMINDEX Done;
+	IMINDEX PieceBytes;
+	int PixelStep;
+	int RunDim;
+	int RunCnt;
+	int Pieces;
+	int i;
+	int n;
+
+	/* Determine size of one "slice" in each dimension */
+	SliceSize[Image->Dimc-1] = Image->PixelSize;
+	for (i=Image->Dimc-2; i>=0; i--)
+		SliceSize[i] = SliceSize[i+1] * Image->Dimv[i+1];
+	for (i=0; i<Image->Dimc; i++)
+		Step[i] = (Coarseness == NULL) ? 1 : Coarseness[i];
+
+	/* Fold trailing dimensions that are read in full into the run */
+	RunDim = Image->Dimc-1;
+	while ((RunDim > 0) && (Step[RunDim] == 1) && (Endpts[RunDim][0] == 0) &&
+		(Endpts[RunDim][1] == Image->Dimv[RunDim]-1))
+		RunDim--;
+
+	/* A subsampled outer dimension can not be part of a run */
+	if ((Step[RunDim] > 1) && (RunDim < Image->Dimc-1))
+		RunDim++;
+
+	/* Pixels of the run are PixelStep bytes apart in the file (0 if the  */
+	/* run is contiguous), and each piece of the run holds PieceBytes     */
+	RunBytes = ((Endpts[RunDim][1] - Endpts[RunDim][0]) / Step[RunDim] + 1)
+		* SliceSize[RunDim];
+	PixelStep = 0;
+	PieceBytes = IOVBYTES;
+	if (Step[RunDim] > 1)
 	{
-		lseek(Fd, 0, FROMBEG);
-		bImplicit = 1;
-		bFirstItemCheck = 1;
-#ifdef DICOM_DEBUG
-		printf("Implicit\n");
-#endif
+		PixelStep = Step[RunDim] * Image->PixelSize;
+		if (PixelStep - Image->PixelSize > Image->Coalesce)
+			PieceBytes = Image->PixelSize;
+		else
+			PieceBytes = (IOVBYTES / PixelStep + 1) * Image->PixelSize;
 	}
 
-	i = 0;
-	// Read TAG and VR
-	while (read(Fd, &tag, sizeof(unsigned int)) == sizeof(unsigned int))
+	/* Count runs before splitting */
+	RunCnt = 1;
+	for (i=0; i<RunDim; i++)
+		RunCnt = RunCnt * ((Endpts[i][1] - Endpts[i][0]) / Step[i] + 1);
+	Pieces = (int)((RunBytes + PieceBytes - 1) / PieceBytes);
+
+	*Runs = (PIXRUN *)malloc((size_t)RunCnt * Pieces * sizeof(PIXRUN));
+	if (*Runs == NULL) return(-1);
+
+	/* Walk the outer dimensions like an odometer */
+	for (i=0; i<RunDim; i++)
+		Index[i] = Endpts[i][0];
+	n = 0;
+	while (n < RunCnt * Pieces)
 	{
-		if (bFirstItemCheck && (((tag & 0xFFFF) < 2) || ((tag & 0xFFFF) > 8)))	// For implicit transfer systax, no "DICM" identity, need check if first element belongs to (0x0002, 0x0008] group
-		{
-#ifdef DICOM_DEBUG
-			printf("failed first tag check for implicit file: %xd",tag);
-#endif
-			close(Fd);
-			free(Image);
-			return NULL;
-		}
-		else
-			bFirstItemCheck = 0;
+		Offset = Endpts[RunDim][0] * SliceSize[RunDim];
+		for (i=0; i<RunDim; i++)
+			Offset = Offset + Index[i] * SliceSize[i];
 
-		// Implicit Transfer Syntax (except group 0002) or Element (FFFE,E000), (FFFE,E00D), (FFFE,E0DD) have no VR
-		if ((bImplicit && ((tag & 0xFFFF) != 0x0002)) || (tag == 0xE000FFFE) || (tag == 0xE00DFFFE) || (tag == 0xE0DDFFFE))
-		{
-			read(Fd, &length, sizeof(unsigned int));
-			if (length == -1) length = 0;
-#ifdef DICOM_DEBUG
-			printf("tag=%xd,implicit,%d\n",tag,length);
-#endif
-		}
-		else
+		for (Done=0; Done<RunBytes; Done+=PieceBytes, n++)
 		{
-			read(Fd, strVR, sizeof(unsigned short));
-			if ((strcmp(strVR, "OB") == 0) | (strcmp(strVR, "OW") == 0) | 
-				(strcmp(strVR, "SQ") == 0) | (strcmp(strVR, "UN") == 0) | 
-				(strcmp(strVR, "OF") == 0) | (strcmp(strVR, "UT") == 0))
+			(*Runs)[n].Length = (int)((RunBytes - Done < PieceBytes) ?
+				RunBytes - Done : PieceBytes);
+			(*Runs)[n].Buffer = Pixels;
+			if (PixelStep == 0)
 			{
-				lseek(Fd, 2, FROMHERE);
-				read(Fd, &length, sizeof(unsigned int));
+				(*Runs)[n].Offset = Offset + Done;
+				(*Runs)[n].Step = 0;
 			}
 			else
 			{
-				read(Fd, &us, sizeof(unsigned short));
-				length = (unsigned int) us;
+				(*Runs)[n].Offset = Offset + Done / Image->PixelSize * PixelStep;
+				(*Runs)[n].Step = ((*Runs)[n].Length > Image->PixelSize) ?
+					PixelStep : 0;
 			}
-			// For unknown length SQ
-			if (length == -1) length = 0;
-#ifdef DICOM_DEBUG
-			printf("tag=%xd,%s,%d,%d\n",tag,strVR,length);
-#endif
+			Pixels += (*Runs)[n].Length;
 		}
 
-		switch (tag)
+		for (i=RunDim-1; i>=0; i--)
 		{
-			case 0x00100002: // Check if implict or compressed
-				read(Fd, strTemp, length);
-				if (strcmp(strTemp, "1.2.840.10008.1.2") == 0)
-					bImplicit = 1;
-				else if ((strcmp(strTemp, "1.2.840.10008.1.2.1") != 0) && (strcmp(strTemp, "1.2.840.10008.1.2.2") != 0))
-					bCompressed = 1;
-				break;
-			case 0x00100028:
-				i |= 1;
-				read(Fd, &us_Rows, length);
-				break;
-			case 0x00110028:
-				i |= 2;
-				read(Fd, &us_Cols, length);
-				break;
-			case 0x01010028:
-				i |= 4;
-				read(Fd, &us_BSto, length);
-				break;
-			case 0x01000028:
-				i |= 8;
-				read(Fd, &us_Bits, length);
-				break;
-			case 0x00020028:
-				i |= 16;
-				read(Fd, &us_Samp, length);
-				break;
-			case 0x01020028:
-				i |= 32;
-				read(Fd, &us_HBit, length);
-				break;
-			case 0x01030028:
-				i |= 64;
-				read(Fd, &us_PixR, length);
-				break;
-			case 0x00080028:
-				read(Fd, is_FNum, length);
-				us_FNum = atoi(is_FNum);
-				break;
-			case 0x00107FE0:
-				break;
-			default:
-				lseek(Fd, length, FROMHERE);
-				break;
+			if ((Index[i] += Step[i]) <= Endpts[i][1]) break;
+			Index[i] = Endpts[i][0];
 		}
-		// Reach Pixels, break out
-		if (tag == 0x00107FE0) break;
 	}
+	return(n);
+}
 
-	if ((i != 127) || (us_Samp != 1) || (bCompressed))
-	{
-		close(Fd);
-		free(Image);
-		return NULL;
-	}
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads a list of runs sorted by file offset.  Runs  */
+/*           whose gap is at most MaxGap bytes (Image->Coalesce for most     */
+/*           callers) are merged into one span of up to SPANBYTES, read into */
+/*           a scratch buffer and copied out, so many short runs cost a few  */
+/*           large reads.  A span of a single contiguous run is read         */
+/*           straight into place.  Runs may overlap.  The pixels of a        */
+/*           strided run are picked out of its span.                         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int ReadRuns(IMAGE *Image, PIXRUN *Runs, int RunCnt, IMINDEX MaxGap)
+{
+	char *Scratch = NULL;
+	char *From;
+	char *To;
+	IMINDEX SpanStart;
+	IMINDEX SpanEnd;
+	IMINDEX RunEnd;
+	int PixelSize;
+	int First;
+	int Last;
+	int i;
+	int j;
 
-	// Check if Image size correct
-	if (length != (unsigned int) us_Rows * us_Cols * us_Samp * us_Bits * us_FNum / 8)
+	PixelSize = Image->PixelSize;
+	for (First=0; First<RunCnt; First=Last)
 	{
-		close(Fd);
-		free(Image);
-		return NULL;
-	}
+		/* Grow the span while the next run is close enough */
+		SpanStart = Runs[First].Offset;
+		SpanEnd = SpanStart + RUNEXTENT(&Runs[First], PixelSize);
+		for (Last=First+1; Last<RunCnt; Last++)
+		{
+			RunEnd = Runs[Last].Offset + RUNEXTENT(&Runs[Last], PixelSize);
+			if (Runs[Last].Offset - SpanEnd > MaxGap) break;
+			if (RunEnd - SpanStart > SPANBYTES) break;
+			if (RunEnd > SpanEnd) SpanEnd = RunEnd;
+		}
 
-	// Set class member variables
-	Image->PixelSize = us_Bits / 8;
-	if (us_Bits == 8)
-		Image->PixelFormat = 0001;
-	else if (us_Bits == 16)
-		Image->PixelFormat = 0010;
-  // What? GREY and SHORT are both typedef'd to short in image.h!
-  //		Image->PixelFormat = (us_PixR == 1 ? 0010:0002);	// If us_PixR == 1, singed else unsigned
-	else if (us_Bits == 32)
-		Image->PixelFormat = 0004;
-	else
-	{
-		close(Fd);
-		free(Image);
-		return NULL;
-	}
-	Image->Address[aPIXELS] = lseek(Fd, 0, FROMHERE);
+		if (Last == First+1 && Runs[First].Step == 0)
+		{
+			if (PixelRead(Image, SpanStart, Runs[First].Buffer,
+				Runs[First].Length) != Runs[First].Length) break;
+			continue;
+		}
 
-	Image->Dimc = 3;
-	Image->Dimv[0] = us_FNum;
-	Image->Dimv[1] = us_Rows;
-	Image->Dimv[2] = us_Cols;
-	Image->PixelCnt = us_FNum * us_Rows * us_Cols;
-	Image->InfoCnt = 0;
-	Image->Fd = Fd;
-	Image->nImgFormat = 1;
-	Image->Compressed = FALSE;
-  Image->SwapNeeded = FALSE;
+		if (Scratch == NULL && (Scratch = (char *)malloc(SPANBYTES)) == NULL)
+			break;
+		if (PixelRead(Image, SpanStart, Scratch, SpanEnd - SpanStart)
+			!= SpanEnd - SpanStart) break;
+		for (i=First; i<Last; i++)
+		{
+			From = Scratch + (Runs[i].Offset - SpanStart);
+			if (Runs[i].Step == 0)
+				memcpy(Runs[i].Buffer, From, (size_t)Runs[i].Length);
+			else
+				for (j=0, To=Runs[i].Buffer; j<Runs[i].Length; j+=PixelSize)
+				{
+					memcpy(To + j, From, (size_t)PixelSize);
+					From += Runs[i].Step;
+				}
+		}
+	}
 
-	return Image;
+	if (Scratch != NULL) free(Scratch);
+	return(First >= RunCnt ? VALID : INVALID);
 }
 
 /*---------------------------------------------------------------------------*/
-// Interperate interfile element, return name and value pointer
-// (For Name field, remove all space, !, LF and CR, and change to low case)
+/*                                                                           */
+/* Purpose:  This routine writes a list of runs.  A strided run is merged    */
+/*           into the pixels around it: its span is read, patched and        */
+/*           written back.                                                   */
+/*                                                                           */
 /*---------------------------------------------------------------------------*/
-int GetIFElement(char *buffer, char ** strName, char ** strValue)
+static int WriteRuns(IMAGE *Image, PIXRUN *Runs, int RunCnt)
 {
-    char *ch1 = buffer;
-    char *ch2 = buffer;
-    *strName  = buffer;
+	char *Scratch = NULL;
+	char *To;
+	IMINDEX Extent;
+	int PixelSize;
+	int i;
+	int j;
 
-	for (; *ch2 != 0 && ((*ch2 != ':') || (*(ch2+1) != '=')); ch2++)
+	PixelSize = Image->PixelSize;
+	for (i=0; i<RunCnt; i++)
 	{
-		// Ignore !, space, LF and CR
-		if ((*ch2 == '!') || (*ch2 == ' ') || (*ch2 == 10)  || (*ch2 == 13))
+		if (Runs[i].Step == 0)
+		{
+			if (SwapWrite(Image, Runs[i].Offset, Runs[i].Buffer,
+				Runs[i].Length) != Runs[i].Length) break;
 			continue;
-		//change to low case
-		if ((*ch2 >= 'A') && (*ch2 <= 'Z')) *ch2 += 32;
-		*(ch1++) = *ch2;
-    }
+		}
 
-	if (*ch2 == 0) // No :=
-		return 0;
-	
-	*(ch1++) = 0;
-	ch2+=2;
-	
-	// Remove Value leading space
-	while (*ch2 == ' ')
-		ch2++;
-	*strValue = ch2;
-	
-	// Remove LF and CR
-	while ((*ch2 != 0) && (*ch2 != 10) && (*ch2 != 13))
-		ch2++;
-	*ch2 = 0;
-	
-	// Remove string padding space
-	//strtrimr(*strValue);
-    return 1;
+		Extent = RUNEXTENT(&Runs[i], PixelSize);
+		StopTracking(Image);
+		StopZones(Image);
+		if (Scratch == NULL && (Scratch = (char *)malloc(SPANBYTES)) == NULL)
+			break;
+		if (PixelRead(Image, Runs[i].Offset, Scratch, Extent) != Extent)
+			break;
+		for (j=0, To=Scratch; j<Runs[i].Length; j+=PixelSize)
+		{
+			memcpy(To, Runs[i].Buffer + j, (size_t)PixelSize);
+			if (Image->SwapNeeded) Swap(To, PixelSize, Image->PixelFormat);
+			To += Runs[i].Step;
+		}
+		if (PixelWrite(Image, Runs[i].Offset, Scratch, Extent) != Extent)
+			break;
+	}
+
+	if (Scratch != NULL) free(Scratch);
+	return(i >= RunCnt ? VALID : INVALID);
+}
+
+/* qsort comparison of runs by file offset */
+static int CompareRuns(const void *A, const void *B)
+{
+	IMINDEX OffsetA = ((const PIXRUN *)A)->Offset;
+	IMINDEX OffsetB = ((const PIXRUN *)B)->Offset;
+
+	return((OffsetA > OffsetB) - (OffsetA < OffsetB));
 }
 
+#if !defined(WIN32) && defined(O_DIRECT)
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine opens an Interfile heder. The image parameters are */
-/*           read from the file and stored in the image record.              */
+/* Purpose:  This routine reads pixel bytes with O_DIRECT, so a bulk load    */
+/*           does not fill the page cache.  A second descriptor is opened    */
+/*           on the image through /proc the first time, under a lock as      */
+/*           pool workers may get here together.  The file is read in        */
+/*           aligned blocks into a pooled bounce buffer and the wanted bytes */
+/*           are copied out, which handles the unaligned head at             */
+/*           Address[aPIXELS].  If direct I/O is not available (e.g. tmpfs)  */
+/*           the option is turned off and an ordinary read is done.          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-IMAGE *ifopen(char * Name, int Mode)
+static IMINDEX DirectRead(IMAGE *Image, IMINDEX Offset, char *Buffer,
+	IMINDEX Length)
 {
-	IMAGE *Image;
-	int Fd;
-	int i, nRows, nCols, nFNum;
-	FILE *fp;
-	char buffer[255];
-	char strPixelFormat[20];
-	char *ch, *strIFName, *strIFValue;
-	char strName[256], strDataFile[256];
-
-	/* Check parameters */
-	if (Name == NULL) ErrorNull("Null image name");
-	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
+	char Path[64];
+	char *Bounce = NULL;
+	IMINDEX Position;
+	IMINDEX Done;
+	IMINDEX Skip;
+	IMINDEX Want;
+	IMINDEX Cnt;
+	size_t Chunk;
+
+	pthread_mutex_lock(&_imdirectlock);
+	if (Image->DirectFd == -1)
+	{
+		sprintf(Path, "/proc/self/fd/%d", Image->Fd);
+		Image->DirectFd = open(Path, O_RDONLY | O_DIRECT);
+	}
+	pthread_mutex_unlock(&_imdirectlock);
 
-	/* Allocate image record */
-	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
-	if (Image == NULL) ErrorNull("Allocation error");
+	/* Take a bounce buffer from the pool */
+	Bounce = GetBlock();
 
-	// Open image header file
-	if ((fp = fopen(Name,"r"))==NULL)
-		ErrorNull("Image file not found");
+	if (Image->DirectFd == -1 || Bounce == NULL)
+	{
+		Image->DirectIO = FALSE;
+		if (Bounce != NULL) PutBlock(Bounce);
+		return(PixelRead(Image, Offset, Buffer, Length));
+	}
 
-	if ((fgets(buffer, sizeof(buffer), fp)) == NULL)
+	Position = Offset + Image->Address[aPIXELS];
+	for (Done=0; Done<Length; Done+=Want)
 	{
-		free(Image);
-		fclose(fp);
-		return NULL;
+		Skip = (Position + Done) % DIRECTALIGN;
+		Want = Length - Done;
+		if (Want > BLOCKBYTES - Skip) Want = BLOCKBYTES - Skip;
+		Chunk = (size_t)((Skip + Want + DIRECTALIGN - 1) / DIRECTALIGN
+			* DIRECTALIGN);
+		Cnt = pread(Image->DirectFd, Bounce, Chunk, Position + Done - Skip);
+		IOSTAT(Cnt);
+
+		/* The file system refused the first direct read */
+		if (Cnt < 0 && Done == 0)
+		{
+			Image->DirectIO = FALSE;
+			Done = PixelRead(Image, Offset, Buffer, Length);
+			break;
+		}
+		if (Cnt < Skip + Want) break;
+		memcpy(Buffer + Done, Bounce + Skip, (size_t)Want);
 	}
 
-	// Check if Interfile Header
-	GetIFElement(buffer, &strIFName, &strIFValue);
-	if (strcmp(buffer, "interfile") != 0)
-	{
-		free(Image);
-		fclose(fp);
-		return NULL;
-	}
+	/* Give the bounce buffer back */
+	PutBlock(Bounce);
+	return(Done);
+}
+#endif
 
-	//
-	i = 0;
-	nFNum = -1;
-	while ((fgets(buffer, sizeof(buffer), fp)) != NULL)
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine gives the kernel readahead hints after a read of   */
+/*           pixel bytes [Start, End).  The distance from the previous read  */
+/*           is compared with the one before: a walk that moves by the       */
+/*           length of the read (forward or backward), or by the same        */
+/*           stride twice running, has the next region fetched with          */
+/*           POSIX_FADV_WILLNEED.  In streaming mode the region just read    */
+/*           is dropped from the page cache with POSIX_FADV_DONTNEED.  The   */
+/*           previous reads are kept under a lock, as pool workers read too. */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void AccessHint(IMAGE *Image, IMINDEX Start, IMINDEX End)
+{
+#ifdef POSIX_FADV_WILLNEED
+	IMINDEX Delta;
+	IMINDEX Base;
+	IMINDEX DropStart;
+	IMINDEX DropEnd;
+	int Pattern;
+	int Fd;
+
+	if (End - Start < HINTMIN || Image->DirectIO) return;
+	if (Image->Compressed)
 	{
-		if (!GetIFElement(buffer, &strIFName, &strIFValue))
-			continue;
-		//printf("Name=%s; Value=%s\n", strIFName,strIFValue);
-		
-		if (strcmp(strIFName, "nameofdatafile") == 0)
-		{
-			// Get image data file full path (assume it is in the same dir as header file)
-			strcpy(strDataFile, strName);
-#ifdef WIN32
-			ch = strrchr(strDataFile, '\\');
-#else
-			ch = strrchr(strDataFile, '/');
-#endif
-			if (ch != NULL)
-			{
-				ch[1] = 0;
-				strcat(strDataFile, strIFValue);
-			}
-			else
-			{
-				strcpy(strDataFile, strIFValue);
-			}
-			i|=1;
-		}
-		else if ((strcmp(strIFName, "dataoffsetinbytes") == 0) || (strcmp(strIFName, "dataoffsetinbytes[1]") == 0))  //"!data starting block"
-		{
-			Image->Address[aPIXELS] = atoi(strIFValue);
-			i|=2;
-		}
-		else if (strcmp(strIFName, "matrixsize[1]") == 0)
-		{
-			nCols = atoi(strIFValue);
-			i|=4;
-		}
-		else if (strcmp(strIFName, "matrixsize[2]") == 0)
-		{
-			nRows = atoi(strIFValue);
-			i|=8;
-		}
-		else if (strcmp(strIFName, "totalnumberofimages") == 0)
-		{
-			if (nFNum == -1) nFNum = atoi(strIFValue);	// some files have both matrixsize[3] and totalnumberofimages, but only matrixsize[3] contains correct info
-			i|=16;
-		}
-		else if (strcmp(strIFName, "matrixsize[3]") == 0) // in order to support STIR interfile
-		{
-			nFNum = atoi(strIFValue);
-			i|=16;
-		}
-		else if (strcmp(strIFName, "numberformat") == 0)
-		{
-			strcpy(strPixelFormat, strIFValue);
-			i|=32;
-		}
-		else if (strcmp(strIFName, "numberofbytesperpixel") == 0)
-		{
-			Image->PixelSize = atoi(strIFValue);
-			i|=64;
-		}
+		if (Image->UCPixels != NULL) return;
+		Fd = Image->UCPixelsFd;
+		Base = 0;
 	}
-	
-	if ((i & 2) == 0)
+	else
 	{
-		// No dataoffsetinbytes, default it as 0
-		Image->Address[aPIXELS] = 0;
-		i|= 2;
+		Fd = Image->Fd;
+		Base = Image->Address[aPIXELS];
 	}
 
-	if (i != 127)
+	/* Look for a sequential, reverse or strided walk */
+	pthread_mutex_lock(&_imhintlock);
+	Delta = (Image->HintStart < 0) ? 0 : Start - Image->HintStart;
+	Pattern = (Delta != 0) && (Delta == Image->HintDelta ||
+		Delta == End - Start || Delta == Start - End);
+	Image->HintStart = Start;
+	Image->HintDelta = Delta;
+	pthread_mutex_unlock(&_imhintlock);
+
+	if (Pattern && Start + Delta >= 0)
+		posix_fadvise(Fd, Base + Start + Delta, End - Start,
+			POSIX_FADV_WILLNEED);
+
+	/* Drop what was read, but not the part that is read next */
+	if (Image->Streaming)
 	{
-		free(Image);
-		fclose(fp);
-		return NULL;
+		DropStart = Start;
+		DropEnd = End;
+		if (Pattern && Delta > 0 && Start + Delta < DropEnd)
+			DropEnd = Start + Delta;
+		if (Pattern && Delta < 0 && End + Delta > DropStart)
+			DropStart = End + Delta;
+		if (DropEnd > DropStart)
+			posix_fadvise(Fd, Base + DropStart, DropEnd - DropStart,
+				POSIX_FADV_DONTNEED);
 	}
+#endif
+}
 
-	if ((strcasecmp(strPixelFormat, "unsigned integer") != 0) &&
-		(strcasecmp(strPixelFormat, "signed integer") != 0)  &&
-		(strcasecmp(strPixelFormat, "float") != 0) &&
-		(strcasecmp(strPixelFormat, "short float") != 0) )
+#ifndef WIN32
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines run a shared pool of worker threads.  Jobs are   */
+/*           taken from a FIFO queue; a job must not wait on another job.    */
+/*           The pool is started on first use with IMAGE_THREADS workers,    */
+/*           or one per online processor.  On a worker PoolSize returns 0,   */
+/*           so a job that reads pixels (an imgetpix_async callback, say)    */
+/*           runs serially instead of waiting on jobs queued behind it.      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void *PoolWorker(void *Unused)
+{
+	POOLJOB *Job;
+
+	(void)Unused;
+	_imonpool = TRUE;
+	for (;;)
 	{
-		free(Image);
-		fclose(fp);
-		return NULL;
+		pthread_mutex_lock(&_impoollock);
+		while (_impoolhead == NULL)
+			pthread_cond_wait(&_impoolwake, &_impoollock);
+		Job = _impoolhead;
+		_impoolhead = Job->Next;
+		if (_impoolhead == NULL) _impooltail = NULL;
+		pthread_mutex_unlock(&_impoollock);
+
+		Job->Func(Job->Arg);
 	}
+	return(NULL);
+}
 
-	if (Image->PixelSize == 2)
-    {
-        if (strcasecmp(strPixelFormat, "unsigned integer") == 0)
-            Image->PixelFormat = 0002;	//short type (Unsigned Signed)
-        else
-            Image->PixelFormat = 0010;	//GREY type (Signed)
-    }
-	else if (Image->PixelSize == 4)
-		Image->PixelFormat = 0004;
-
-	Image->Dimc = 3;
-	Image->Dimv[0] = nFNum;
-	Image->Dimv[1] = nRows;
-	Image->Dimv[2] = nCols;
-	Image->PixelCnt = nFNum * nRows * nCols;
+static int PoolSize(void)
+{
+	pthread_t Thread;
+	char *envVar;
+	int Size;
 
-	// Get image data file full path (assume it is in the same dir as header file)
-	if ( ((ch = strrchr(Name, '\\')) != NULL) || ((ch = strrchr(Name, '/')) != NULL) )
+	if (_imonpool) return(0);
+	pthread_mutex_lock(&_impoollock);
+	if (_impoolsize == 0)
 	{
-		strcpy(buffer, strName);
-		strcpy(strName, Name);
-		strName[ch-Name+1] = 0;
-		strcat(strName, buffer);
+		Size = 0;
+		if ((envVar = getenv("IMAGE_THREADS")) != NULL)
+			Size = atoi(envVar);
+		if (Size < 1)
+			Size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (Size < 1) Size = 1;
+		if (Size > MAXTHREADS) Size = MAXTHREADS;
+
+		for (_impoolsize=0; _impoolsize<Size; _impoolsize++)
+		{
+			if (pthread_create(&Thread, NULL, PoolWorker, NULL) != 0) break;
+			pthread_detach(Thread);
+		}
 	}
+	Size = _impoolsize;
+	pthread_mutex_unlock(&_impoollock);
+	return(Size);
+}
 
-	// Open image file
-#ifdef WIN32
-	if ((Fd = open(strName,Mode|O_BINARY))==EOF)
-#else
-	if ((Fd = open(strName,Mode))==EOF)
-#endif
-	{
-		close(Fd);
-		free(Image);
-		return NULL;
-	}
-	fclose(fp);
+static int PoolSubmit(POOLJOB *Job)
+{
+	if (PoolSize() == 0) return(INVALID);
 
-	Image->Fd = Fd;
-	Image->nImgFormat = 2;
-	Image->Compressed = FALSE;
-	return Image;
+	Job->Next = NULL;
+	pthread_mutex_lock(&_impoollock);
+	if (_impooltail == NULL)
+		_impoolhead = Job;
+	else
+		_impooltail->Next = Job;
+	_impooltail = Job;
+	pthread_cond_signal(&_impoolwake);
+	pthread_mutex_unlock(&_impoollock);
+	return(VALID);
 }
+#endif
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine opens an image.  The image parameters are          */
-/*           read from the file and stored in the image record.              */
+/* Purpose:  These routines read and write the address table at the start    */
+/*           of an image file.  On disk the table holds nADDRESS 32 bit      */
+/*           ints.  When an address does not fit, the LARGEFILE bit is set   */
+/*           in the version and a copy of the table with 64 bit entries,     */
+/*           preceded by EXTMAGIC, is kept in the unused bytes following     */
+/*           the histogram.  The 32 bit entries that overflow are written    */
+/*           as -1 so that older readers fail instead of seeking wildly.     */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-IMAGE *imopen (char *ImName, int Mode)
+static int ReadAddresses(int Fd, IMAGE *Image)
 {
-	IMAGE *Image;
-	int Cnt;
-	int Fd;
+	int Header[nADDRESS];
+	IMINDEX Extension[nADDRESS+1];
+	IMINDEX Offset;
 	int i;
-	int Length;
-	char *Buffer;
-	char *StrPtr;
-	char *Name;
-	char *Data;
-
-	// Try to open as DICOM file
-	if ((Image = dcmopen(ImName, Mode)) != NULL)
-		return Image;
-#ifdef DICOM_DEBUG
-	else
-		printf("not dicom image\n");
-#endif
-
-	// Try to open as Interfile Header file
-	if ((Image = ifopen(ImName, Mode)) != NULL)
-		return Image;
-
-	/* Check parameters */
-	if (ImName == NULL) ErrorNull("Null image name");
-	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
-
-	/* Open image file */
-#ifdef WIN32	
-	Fd = open(ImName,Mode|O_BINARY);
-#else
-	Fd = open(ImName,Mode);
-#endif
-	if (Fd == EOF) ErrorNull("Image file not found");
 
-	/* Allocate image record */
-	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
-	if (Image == NULL) ErrorNull("Allocation error");
+	if (ReadAt(Fd, (char *)Header, sizeof(Header), (IMINDEX)0)
+		!= sizeof(Header)) return(INVALID);
 
-	/* Read addresses of image header fields */
-	Cnt = read(Fd, (char *)&Image->Address[0], sizeof(Image->Address));
-	if (Cnt != sizeof(Image->Address)) ErrorNull("Image read failed");
-   
 	/* this is a bitwise comparison b/c we are using some of the
 		 bits in the Version int to indicate whether and what type of
 		 compression was used in the image.  */
-	if (!(Image->Address[aVERNO] & 1))
-		/* Swap the byte order of each address */
-	{
-		Swap((char *)&Image->Address[0], sizeof(Image->Address), INT);
-		Image->SwapNeeded = TRUE;
-	}
-	else
-	{
-		Image->SwapNeeded = FALSE;
-	}
-	
-	/* is the image compressed? */
-	if (Image->Address[aVERNO] & COMPRESSED)
-	{
-		Image->Compressed = TRUE;
-		Image->CompressionMethod =
-			(int)((Image->Address[aVERNO] - COMPRESSED) / 4096);
-	}
+	Image->SwapNeeded = !(Header[aVERNO] & 1);
+	if (Image->SwapNeeded)
+		Swap((char *)Header, sizeof(Header), INT);
+	for (i=0; i<nADDRESS; i++)
+		Image->Address[i] = Header[i];
+	if (!(Header[aVERNO] & LARGEFILE)) return(VALID);
+
+	/* Replace the table with the 64 bit copy */
+	Offset = Image->Address[aHISTO] + sizeof(Image->ValidHistogram)
+		+ sizeof(Image->Histogram);
+	if (ReadAt(Fd, (char *)Extension, sizeof(Extension), Offset)
+		!= sizeof(Extension)) return(INVALID);
+	if (Image->SwapNeeded)
+		Swap((char *)Extension, sizeof(Extension), INT64);
+	if (Extension[0] != EXTMAGIC) return(INVALID);
+	for (i=0; i<nADDRESS; i++)
+		Image->Address[i] = Extension[i+1];
+	return(VALID);
+}
+
+static int WriteAddresses(IMAGE *Image)
+{
+	int Header[nADDRESS];
+	IMINDEX Extension[nADDRESS+1];
+	IMINDEX Offset;
+	int Large;
+	int i;
+
+	/* Flag the image if any address needs more than 32 bits */
+	Large = FALSE;
+	for (i=0; i<nADDRESS; i++)
+		if (Image->Address[i] > INT_MAX) Large = TRUE;
+	if (Large)
+		Image->Address[aVERNO] |= LARGEFILE;
 	else
+		Image->Address[aVERNO] &= ~(IMINDEX)LARGEFILE;
+
+	if (Large)
 	{
-		Image->Compressed = FALSE;
+		Extension[0] = EXTMAGIC;
+		for (i=0; i<nADDRESS; i++)
+			Extension[i+1] = Image->Address[i];
+		if (Image->SwapNeeded)
+			Swap((char *)Extension, sizeof(Extension), INT64);
+		Offset = Image->Address[aHISTO] + sizeof(Image->ValidHistogram)
+			+ sizeof(Image->Histogram);
+		if (WriteAt(Image->Fd, (char *)Extension, sizeof(Extension), Offset)
+			!= sizeof(Extension)) return(INVALID);
 	}
-	Image->PixelsAccessed = FALSE;
-	Image->PixelsModified = FALSE;
-
-
-	/* Read Title field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aTITLE], FROMBEG);
-	Cnt = read(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
-	if (Cnt != sizeof(Image->Title)) ErrorNull("Image read failed");
 
-	/* Read MaxMin field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aMAXMIN], FROMBEG);
-	Cnt = read(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
-	if (Cnt != sizeof(Image->ValidMaxMin)) ErrorNull("Image read failed");
-	Cnt = read(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
-	if (Cnt != sizeof(Image->MaxMin)) ErrorNull("Image read failed");
+	for (i=0; i<nADDRESS; i++)
+		Header[i] = (Image->Address[i] > INT_MAX) ? -1 : (int)Image->Address[i];
+	if (Image->SwapNeeded)
+		Swap((char *)Header, sizeof(Header), INT);
+	if (WriteAt(Image->Fd, (char *)Header, sizeof(Header), (IMINDEX)0)
+		!= sizeof(Header)) return(INVALID);
+	return(VALID);
+}
 
-	/* Read Histogram field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aHISTO], FROMBEG);
-	Cnt = read(Fd, (char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
-	if (Cnt != sizeof(Image->ValidHistogram)) ErrorNull("Image read failed");
-	Cnt = read(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
-	if (Cnt != sizeof(Image->Histogram)) ErrorNull("Image read failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine sets the access options of a new image record to   */
+/*           their defaults.  See imsetopt.                                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void InitOptions(IMAGE *Image)
+{
+	char *envVar;
 
-	/* Read PixelFormat field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aPIXFORM], FROMBEG);
-	Cnt = read(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
-	if (Cnt != sizeof(Image->PixelFormat)) ErrorNull("Image read failed");
+	Image->Coalesce = IOVGAP;
+	if ((envVar = getenv("IMAGE_COALESCE")) != NULL && atoi(envVar) >= 0)
+		Image->Coalesce = atoi(envVar);
+
+	Image->DirectIO = (getenv("IMAGE_DIRECTIO") != NULL);
+	Image->DirectFd = -1;
+
+	Image->Streaming = (getenv("IMAGE_STREAMING") != NULL);
+	Image->Parallel = (getenv("IMAGE_PARALLEL") != NULL);
+	Image->UCMemory = UCMEMORY;
+	if ((envVar = getenv("IMAGE_UCMEMORY")) != NULL && atoi(envVar) >= 0)
+		Image->UCMemory = (IMINDEX)atoi(envVar) << 20;
+	Image->UCPixels = NULL;
+	Image->UCPixelsFd = -1;
+	Image->UCPixelsFileName[0] = '\0';
+	Image->TrackHisto = (getenv("IMAGE_TRACKHISTO") != NULL);
+	Image->HistoCount = NULL;
+	Image->HistoNext = 0;
+	Image->SliceIndex = (getenv("IMAGE_SLICEINDEX") != NULL);
+	Image->SliceStats = NULL;
+	Image->PixelHisto = NULL;
+	Image->TrackZones = (getenv("IMAGE_ZONEMAP") != NULL);
+	Image->ZoneTrack = NULL;
+	Image->ZoneNext = 0;
+	Image->ZoneMap = NULL;
+	Image->HintStart = -1;
+	Image->HintDelta = 0;
+}
 
-	/* Read DimC field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aDIMC], FROMBEG);
-	Cnt = read(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
-	if (Cnt != sizeof(Image->Dimc)) ErrorNull("Image read failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine undoes an imcreat that failed part way.  It        */
+/*           releases the image record and any compressed pixel state,       */
+/*           closes the file and removes it.                                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void DropCreat(IMAGE *Image, char *Name)
+{
+	UCClose(Image);
+	FreeChunks(Image);
+	close(Image->Fd);
+	free((char *)Image);
+	unlink(Name);
+}
 
-	/* Read DimV field */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aDIMV], FROMBEG);
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine creates an image.  The user specified image        */
+/*           parameters are stored in the new image record.  For historical  */
+/*           reasons, 4092 bytes are unused between the end of the           */
+/*           histogram and the start of the pixel format field - gauchj.     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+#define UNUSED 4092
+IMAGE *imcreat (char *Name, int Protection, int PixForm, int Dimc, int *Dimv)
+{
+	IMAGE *Image;
+	IMINDEX Cnt;
+	int Fd;
+	int i;
+	char Null = '\0';
+	char *envVar;
+
+	/* Check parameters */
+	if (Name == NULL) ErrorNull("Null image name");
+	if ((PixForm != GREY) && (PixForm != COLOR) && (PixForm != COLORPACKED) && 
+		(PixForm != BYTE) && (PixForm != SHORT) && (PixForm != LONG) && 
+		(PixForm != REAL) && (PixForm != COMPLEX) && (PixForm != USERPACKED)) 
+		ErrorNull("Invalid pixel format");
+	if ((Dimc < 1) || (Dimc > nDIMV)) ErrorNull("Illegal number of dimensions");
+
+
+	/* Check to see if the environment variable IMAGE_CLOBBER is set.  If it
+		 is set, then allow user to create an image on top of an existing 
+		 image file */
+	if(getenv("IMAGE_CLOBBER") != NULL)
+	{
+		/* Create image file, modifying the mode flags to remove the  */
+		/* O_EXCL flag and add the O_TRUNC flag                       */
+		Fd = open(Name,
+			(CREATE - (CREATE & O_EXCL) - (CREATE & O_TRUNC) + O_TRUNC),
+			Protection);
+	}
+	else
+	{
+		/* Create image file */
+#ifdef WIN32
+		Fd = open(Name,CREATE|O_BINARY,Protection);
+#else
+		Fd = open(Name,CREATE,Protection);
+#endif
+		if (Fd == EOF) ErrorNull("Image already exists");
+	}
+
+	/* Allocate image record */
+	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
+	if (Image == NULL)
+	{
+		close(Fd);
+		unlink(Name);
+		ErrorNull("Allocation error");
+	}
+
+	/* Initialize image record */   
+	Image->Title[0] = Null;
+	Image->ValidMaxMin = FALSE;
+	Image->MaxMin[0] = MAXVAL;
+	Image->MaxMin[1] = MINVAL;
+	Image->ValidHistogram = FALSE;
+	for (i=0; i<nHISTOGRAM; i++)
+		Image->Histogram[i] = 0;
+	Image->PixelFormat = PixForm;
+	Image->Dimc = Dimc;
+
+	/* Determine number of pixels in image */
+	Image->PixelCnt = 1;
+	for (i=0; i<Image->Dimc; i++) {
+		Image->Dimv[i] = Dimv[i];
+		Image->PixelCnt = Image->PixelCnt * Dimv[i];
+	}
+
+	/* Determine size of each pixel */
+	switch (Image->PixelFormat) {
+		case GREY         : Image->PixelSize = sizeof (GREYTYPE); break;
+		case COLOR        : Image->PixelSize = sizeof (COLORTYPE); break;
+		case COLORPACKED  : Image->PixelSize = sizeof (CPACKEDTYPE); break;
+		case BYTE         : Image->PixelSize = sizeof (BYTETYPE); break;
+		case SHORT        : Image->PixelSize = sizeof (SHORTTYPE); break;
+		case LONG         : Image->PixelSize = sizeof (LONGTYPE); break;
+		case REAL         : Image->PixelSize = sizeof (REALTYPE); break;
+		case COMPLEX      : Image->PixelSize = sizeof (COMPLEXTYPE); break;
+		case USERPACKED   : Image->PixelSize = sizeof (USERTYPE); break;
+	}
+
+	/* Initialize image addresses (do NOT change this) */
+	Image->Address[aTITLE] = sizeof( int ) * nADDRESS;
+	Image->Address[aMAXMIN] = Image->Address[aTITLE] 
+		+ sizeof( Image->Title );
+	Image->Address[aHISTO] = Image->Address[aMAXMIN] 
+		+ sizeof( Image->ValidMaxMin ) + sizeof( Image->MaxMin );
+	Image->Address[aPIXFORM] = Image->Address[aHISTO] + UNUSED
+		+ sizeof( Image->ValidHistogram ) + sizeof( Image->Histogram );
+	Image->Address[aDIMC] = Image->Address[aPIXFORM] 
+		+ sizeof( Image->PixelFormat );
+	Image->Address[aDIMV] = Image->Address[aDIMC] 
+		+ sizeof( Image->Dimc );
+	Image->Address[aPIXELS] = Image->Address[aDIMV] 
+		+ sizeof( Image->Dimv );
+	Image->Address[aINFO] = Image->Address[aPIXELS] 
+		+ Image->PixelCnt * Image->PixelSize;
+	Image->Address[aVERNO] = 1;
+
+	/* Save file pointer */
+	/* this must be done before we try to compress the image */
+	Image->Fd = Fd;
+
+	/* Initialize swap flag and options, which compression relies on */
+	Image->SwapNeeded = FALSE;
+	Image->nImgFormat = 0;
+	Image->MapBase = NULL;
+	InitOptions(Image);
+
+	Image->Compressed = FALSE;
+	Image->Chunked = FALSE;
+	Image->Prefilter = 0;
+	Image->PixelsModified = FALSE;
+	
+	/* check for COMPRESS flag */
+	if((envVar = getenv("IMAGE_COMPRESS")) != NULL &&
+		PickCodec(Image, envVar) == VALID)
+	{
+		Image->Compressed = TRUE;
+		Image->PixelsAccessed = TRUE;
+		Image->PixelsModified = FALSE;
+		Image->Address[aVERNO] =
+			Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
+		if (NewChunks(Image) == INVALID)
+		{
+			DropCreat(Image, Name);
+			ErrorNull("Allocation error");
+		}
+
+		/* start from zeroed uncompressed pixels; compress them */
+		if (UCOpen(Image) == INVALID)
+		{
+			DropCreat(Image, Name);
+			ErrorNull("Could not open temp file");
+		}
+
+		compressImage(Image);
+	}else{
+		Image->Compressed = FALSE;
+	}
+		
+	/* Write null information field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aINFO], FROMBEG);
+	Null = '\0';
+	Cnt = write(Fd, (char *)&Null, sizeof(Null));
+	if (Cnt != sizeof(Null))
+	{
+		DropCreat(Image, Name);
+		ErrorNull("Image write failed");
+	}
+	Image->InfoCnt = 0;
+
+	/* save the compression type as an info field */
+	if(Image->Compressed)
+		imputinfo(Image, "Pixel Compression Method", 
+			CodecName(Image->CompressionMethod));
+
+
+	return(Image);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine opens an image.  The image parameters are          */
+/*           read from the file and stored in the image record.              */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+
+IMAGE *dcmopen(char * Name, int Mode)
+{
+	IMAGE *Image;
+	int Fd;
+	unsigned int    tag;
+	unsigned int    length;
+	int				i=0, bImplicit=0, bCompressed=0;
+	char            strDICM[5] = "";
+	char            strVR[3] = "";
+	char            is_FNum[128] = "1";
+	char			strTemp[128];
+	unsigned short
+		us = 0,
+		us_Rows = 0,
+		us_Cols = 0,
+		us_Bits = 0,
+		us_BSto = 0,
+		us_HBit = 0,
+		us_Samp = 0,
+		us_PixR = 0,
+		us_FNum = 1;
+	int bFirstItemCheck = 0;
+
+	/* Check parameters */
+	if (Name == NULL) ErrorNull("Null image name");
+	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
+
+	/* Open image file */
+#ifdef WIN32
+		Fd = open(Name,Mode|O_BINARY);
+#else
+	Fd = open(Name,Mode);
+#endif
+	if (Fd == EOF) ErrorNull("Image file not found");
+
+	/* Allocate image record */
+	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
+	if (Image == NULL) ErrorNull("Allocation error");
+
+	lseek(Fd, 0x80, FROMBEG);
+	if ((read(Fd, strDICM, 4)) != 4)
+	{
+		close(Fd);
+		free(Image);
+		return NULL;
+	}
+	if (strcmp(strDICM, "DICM") != 0)
+	{
+		lseek(Fd, 0, FROMBEG);
+		bImplicit = 1;
+		bFirstItemCheck = 1;
+#ifdef DICOM_DEBUG
+		printf("Implicit\n");
+#endif
+	}
+
+	i = 0;
+	// Read TAG and VR
+	while (read(Fd, &tag, sizeof(unsigned int)) == sizeof(unsigned int))
+	{
+		if (bFirstItemCheck && (((tag & 0xFFFF) < 2) || ((tag & 0xFFFF) > 8)))	// For implicit transfer systax, no "DICM" identity, need check if first element belongs to (0x0002, 0x0008] group
+		{
+#ifdef DICOM_DEBUG
+			printf("failed first tag check for implicit file: %xd",tag);
+#endif
+			close(Fd);
+			free(Image);
+			return NULL;
+		}
+		else
+			bFirstItemCheck = 0;
+
+		// Implicit Transfer Syntax (except group 0002) or Element (FFFE,E000), (FFFE,E00D), (FFFE,E0DD) have no VR
+		if ((bImplicit && ((tag & 0xFFFF) != 0x0002)) || (tag == 0xE000FFFE) || (tag == 0xE00DFFFE) || (tag == 0xE0DDFFFE))
+		{
+			read(Fd, &length, sizeof(unsigned int));
+			if (length == -1) length = 0;
+#ifdef DICOM_DEBUG
+			printf("tag=%xd,implicit,%d\n",tag,length);
+#endif
+		}
+		else
+		{
+			read(Fd, strVR, sizeof(unsigned short));
+			if ((strcmp(strVR, "OB") == 0) | (strcmp(strVR, "OW") == 0) | 
+				(strcmp(strVR, "SQ") == 0) | (strcmp(strVR, "UN") == 0) | 
+				(strcmp(strVR, "OF") == 0) | (strcmp(strVR, "UT") == 0))
+			{
+				lseek(Fd, 2, FROMHERE);
+				read(Fd, &length, sizeof(unsigned int));
+			}
+			else
+			{
+				read(Fd, &us, sizeof(unsigned short));
+				length = (unsigned int) us;
+			}
+			// For unknown length SQ
+			if (length == -1) length = 0;
+#ifdef DICOM_DEBUG
+			printf("tag=%xd,%s,%d,%d\n",tag,strVR,length);
+#endif
+		}
+
+		switch (tag)
+		{
+			case 0x00100002: // Check if implict or compressed
+				read(Fd, strTemp, length);
+				if (strcmp(strTemp, "1.2.840.10008.1.2") == 0)
+					bImplicit = 1;
+				else if ((strcmp(strTemp, "1.2.840.10008.1.2.1") != 0) && (strcmp(strTemp, "1.2.840.10008.1.2.2") != 0))
+					bCompressed = 1;
+				break;
+			case 0x00100028:
+				i |= 1;
+				read(Fd, &us_Rows, length);
+				break;
+			case 0x00110028:
+				i |= 2;
+				read(Fd, &us_Cols, length);
+				break;
+			case 0x01010028:
+				i |= 4;
+				read(Fd, &us_BSto, length);
+				break;
+			case 0x01000028:
+				i |= 8;
+				read(Fd, &us_Bits, length);
+				break;
+			case 0x00020028:
+				i |= 16;
+				read(Fd, &us_Samp, length);
+				break;
+			case 0x01020028:
+				i |= 32;
+				read(Fd, &us_HBit, length);
+				break;
+			case 0x01030028:
+				i |= 64;
+				read(Fd, &us_PixR, length);
+				break;
+			case 0x00080028:
+				read(Fd, is_FNum, length);
+				us_FNum = atoi(is_FNum);
+				break;
+			case 0x00107FE0:
+				break;
+			default:
+				lseek(Fd, length, FROMHERE);
+				break;
+		}
+		// Reach Pixels, break out
+		if (tag == 0x00107FE0) break;
+	}
+
+	if ((i != 127) || (us_Samp != 1) || (bCompressed))
+	{
+		close(Fd);
+		free(Image);
+		return NULL;
+	}
+
+	// Check if Image size correct
+	if (length != (unsigned int) us_Rows * us_Cols * us_Samp * us_Bits * us_FNum / 8)
+	{
+		close(Fd);
+		free(Image);
+		return NULL;
+	}
+
+	// Set class member variables
+	Image->PixelSize = us_Bits / 8;
+	if (us_Bits == 8)
+		Image->PixelFormat = 0001;
+	else if (us_Bits == 16)
+		Image->PixelFormat = 0010;
+  // What? GREY and SHORT are both typedef'd to short in image.h!
+  //		Image->PixelFormat = (us_PixR == 1 ? 0010:0002);	// If us_PixR == 1, singed else unsigned
+	else if (us_Bits == 32)
+		Image->PixelFormat = 0004;
+	else
+	{
+		close(Fd);
+		free(Image);
+		return NULL;
+	}
+	Image->Address[aPIXELS] = lseek(Fd, 0, FROMHERE);
+
+	Image->Dimc = 3;
+	Image->Dimv[0] = us_FNum;
+	Image->Dimv[1] = us_Rows;
+	Image->Dimv[2] = us_Cols;
+	Image->PixelCnt = (IMINDEX)us_FNum * us_Rows * us_Cols;
+	Image->InfoCnt = 0;
+	Image->Fd = Fd;
+	Image->nImgFormat = 1;
+	Image->Compressed = FALSE;
+  Image->SwapNeeded = FALSE;
+	Image->MapBase = NULL;
+	InitOptions(Image);
+
+	return Image;
+}
+
+/*---------------------------------------------------------------------------*/
+// Interperate interfile element, return name and value pointer
+// (For Name field, remove all space, !, LF and CR, and change to low case)
+/*---------------------------------------------------------------------------*/
+int GetIFElement(char *buffer, char ** strName, char ** strValue)
+{
+    char *ch1 = buffer;
+    char *ch2 = buffer;
+    *strName  = buffer;
+
+	for (; *ch2 != 0 && ((*ch2 != ':') || (*(ch2+1) != '=')); ch2++)
+	{
+		// Ignore !, space, LF and CR
+		if ((*ch2 == '!') || (*ch2 == ' ') || (*ch2 == 10)  || (*ch2 == 13))
+			continue;
+		//change to low case
+		if ((*ch2 >= 'A') && (*ch2 <= 'Z')) *ch2 += 32;
+		*(ch1++) = *ch2;
+    }
+
+	if (*ch2 == 0) // No :=
+		return 0;
+	
+	*(ch1++) = 0;
+	ch2+=2;
+	
+	// Remove Value leading space
+	while (*ch2 == ' ')
+		ch2++;
+	*strValue = ch2;
+	
+	// Remove LF and CR
+	while ((*ch2 != 0) && (*ch2 != 10) && (*ch2 != 13))
+		ch2++;
+	*ch2 = 0;
+	
+	// Remove string padding space
+	//strtrimr(*strValue);
+    return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine opens an Interfile heder. The image parameters are */
+/*           read from the file and stored in the image record.              */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+IMAGE *ifopen(char * Name, int Mode)
+{
+	IMAGE *Image;
+	int Fd;
+	int i, nRows, nCols, nFNum;
+	FILE *fp;
+	char buffer[255];
+	char strPixelFormat[20];
+	char *ch, *strIFName, *strIFValue;
+	char strName[256], strDataFile[256];
+
+	/* Check parameters */
+	if (Name == NULL) ErrorNull("Null image name");
+	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
+
+	/* Allocate image record */
+	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
+	if (Image == NULL) ErrorNull("Allocation error");
+
+	// Open image header file
+	if ((fp = fopen(Name,"r"))==NULL)
+		ErrorNull("Image file not found");
+
+	if ((fgets(buffer, sizeof(buffer), fp)) == NULL)
+	{
+		free(Image);
+		fclose(fp);
+		return NULL;
+	}
+
+	// Check if Interfile Header
+	GetIFElement(buffer, &strIFName, &strIFValue);
+	if (strcmp(buffer, "interfile") != 0)
+	{
+		free(Image);
+		fclose(fp);
+		return NULL;
+	}
+
+	//
+	i = 0;
+	nFNum = -1;
+	while ((fgets(buffer, sizeof(buffer), fp)) != NULL)
+	{
+		if (!GetIFElement(buffer, &strIFName, &strIFValue))
+			continue;
+		//printf("Name=%s; Value=%s\n", strIFName,strIFValue);
+		
+		if (strcmp(strIFName, "nameofdatafile") == 0)
+		{
+			// Get image data file full path (assume it is in the same dir as header file)
+			strcpy(strDataFile, strName);
+#ifdef WIN32
+			ch = strrchr(strDataFile, '\\');
+#else
+			ch = strrchr(strDataFile, '/');
+#endif
+			if (ch != NULL)
+			{
+				ch[1] = 0;
+				strcat(strDataFile, strIFValue);
+			}
+			else
+			{
+				strcpy(strDataFile, strIFValue);
+			}
+			i|=1;
+		}
+		else if ((strcmp(strIFName, "dataoffsetinbytes") == 0) || (strcmp(strIFName, "dataoffsetinbytes[1]") == 0))  //"!data starting block"
+		{
+			Image->Address[aPIXELS] = atoll(strIFValue);
+			i|=2;
+		}
+		else if (strcmp(strIFName, "matrixsize[1]") == 0)
+		{
+			nCols = atoi(strIFValue);
+			i|=4;
+		}
+		else if (strcmp(strIFName, "matrixsize[2]") == 0)
+		{
+			nRows = atoi(strIFValue);
+			i|=8;
+		}
+		else if (strcmp(strIFName, "totalnumberofimages") == 0)
+		{
+			if (nFNum == -1) nFNum = atoi(strIFValue);	// some files have both matrixsize[3] and totalnumberofimages, but only matrixsize[3] contains correct info
+			i|=16;
+		}
+		else if (strcmp(strIFName, "matrixsize[3]") == 0) // in order to support STIR interfile
+		{
+			nFNum = atoi(strIFValue);
+			i|=16;
+		}
+		else if (strcmp(strIFName, "numberformat") == 0)
+		{
+			strcpy(strPixelFormat, strIFValue);
+			i|=32;
+		}
+		else if (strcmp(strIFName, "numberofbytesperpixel") == 0)
+		{
+			Image->PixelSize = atoi(strIFValue);
+			i|=64;
+		}
+	}
+	
+	if ((i & 2) == 0)
+	{
+		// No dataoffsetinbytes, default it as 0
+		Image->Address[aPIXELS] = 0;
+		i|= 2;
+	}
+
+	if (i != 127)
+	{
+		free(Image);
+		fclose(fp);
+		return NULL;
+	}
+
+	if ((strcasecmp(strPixelFormat, "unsigned integer") != 0) &&
+		(strcasecmp(strPixelFormat, "signed integer") != 0)  &&
+		(strcasecmp(strPixelFormat, "float") != 0) &&
+		(strcasecmp(strPixelFormat, "short float") != 0) )
+	{
+		free(Image);
+		fclose(fp);
+		return NULL;
+	}
+
+	if (Image->PixelSize == 2)
+    {
+        if (strcasecmp(strPixelFormat, "unsigned integer") == 0)
+            Image->PixelFormat = 0002;	//short type (Unsigned Signed)
+        else
+            Image->PixelFormat = 0010;	//GREY type (Signed)
+    }
+	else if (Image->PixelSize == 4)
+		Image->PixelFormat = 0004;
+
+	Image->Dimc = 3;
+	Image->Dimv[0] = nFNum;
+	Image->Dimv[1] = nRows;
+	Image->Dimv[2] = nCols;
+	Image->PixelCnt = (IMINDEX)nFNum * nRows * nCols;
+
+	// Get image data file full path (assume it is in the same dir as header file)
+	if ( ((ch = strrchr(Name, '\\')) != NULL) || ((ch = strrchr(Name, '/')) != NULL) )
+	{
+		strcpy(buffer, strName);
+		strcpy(strName, Name);
+		strName[ch-Name+1] = 0;
+		strcat(strName, buffer);
+	}
+
+	// Open image file
+#ifdef WIN32
+	if ((Fd = open(strName,Mode|O_BINARY))==EOF)
+#else
+	if ((Fd = open(strName,Mode))==EOF)
+#endif
+	{
+		close(Fd);
+		free(Image);
+		return NULL;
+	}
+	fclose(fp);
+
+	Image->Fd = Fd;
+	Image->nImgFormat = 2;
+	Image->Compressed = FALSE;
+	Image->SwapNeeded = FALSE;
+	Image->MapBase = NULL;
+	InitOptions(Image);
+	return Image;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine opens an image.  The image parameters are          */
+/*           read from the file and stored in the image record.              */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+IMAGE *imopen (char *ImName, int Mode)
+{
+	IMAGE *Image;
+	IMINDEX Cnt;
+	int Fd;
+	int i;
+	int Length;
+	char *Buffer;
+	char *StrPtr;
+	char *Name;
+	char *Data;
+
+	// Try to open as DICOM file
+	if ((Image = dcmopen(ImName, Mode)) != NULL)
+		return Image;
+#ifdef DICOM_DEBUG
+	else
+		printf("not dicom image\n");
+#endif
+
+	// Try to open as Interfile Header file
+	if ((Image = ifopen(ImName, Mode)) != NULL)
+		return Image;
+
+	/* Check parameters */
+	if (ImName == NULL) ErrorNull("Null image name");
+	if ((Mode != READ) && (Mode != UPDATE)) ErrorNull("Invalid open mode");
+
+	/* Open image file */
+#ifdef WIN32	
+	Fd = open(ImName,Mode|O_BINARY);
+#else
+	Fd = open(ImName,Mode);
+#endif
+	if (Fd == EOF) ErrorNull("Image file not found");
+
+	/* Allocate image record */
+	Image = (IMAGE *)malloc((unsigned)sizeof(IMAGE));
+	if (Image == NULL) ErrorNull("Allocation error");
+
+	/* Read addresses of image header fields */
+	if (ReadAddresses(Fd, Image) == INVALID)
+		ErrorNull("Image read failed");
+	
+	/* is the image compressed? */
+	if (Image->Address[aVERNO] & COMPRESSED)
+	{
+		Image->Compressed = TRUE;
+		Image->CompressionMethod =
+			(int)((Image->Address[aVERNO] / 4096) & 15);
+	}
+	else
+	{
+		Image->Compressed = FALSE;
+	}
+	Image->Chunked = (Image->Address[aVERNO] & CHUNKED) != 0;
+	Image->Prefilter = Image->Chunked ?
+		(int)((Image->Address[aVERNO] / PREFILTERED) & 3) : 0;
+	Image->ChunkTable = NULL;
+	Image->ChunkState = NULL;
+	Image->PixelsAccessed = FALSE;
+	Image->PixelsModified = FALSE;
+
+
+	/* Read Title field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aTITLE], FROMBEG);
+	Cnt = read(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
+	if (Cnt != sizeof(Image->Title)) ErrorNull("Image read failed");
+
+	/* Read MaxMin field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aMAXMIN], FROMBEG);
+	Cnt = read(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
+	if (Cnt != sizeof(Image->ValidMaxMin)) ErrorNull("Image read failed");
+	Cnt = read(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
+	if (Cnt != sizeof(Image->MaxMin)) ErrorNull("Image read failed");
+
+	/* Read Histogram field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aHISTO], FROMBEG);
+	Cnt = read(Fd, (char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
+	if (Cnt != sizeof(Image->ValidHistogram)) ErrorNull("Image read failed");
+	Cnt = read(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
+	if (Cnt != sizeof(Image->Histogram)) ErrorNull("Image read failed");
+
+	/* Read PixelFormat field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aPIXFORM], FROMBEG);
+	Cnt = read(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
+	if (Cnt != sizeof(Image->PixelFormat)) ErrorNull("Image read failed");
+
+	/* Read DimC field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMC], FROMBEG);
+	Cnt = read(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
+	if (Cnt != sizeof(Image->Dimc)) ErrorNull("Image read failed");
+
+	/* Read DimV field */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMV], FROMBEG);
 	Cnt = read(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
 	if (Cnt != sizeof(Image->Dimv)) ErrorNull("Image read failed");
     
-	/* Swap the byte order of header fields except the address and title */
-	if (Image->SwapNeeded) Swapheader(Image);
+	/* Swap the byte order of header fields except the address and title */
+	if (Image->SwapNeeded) Swapheader(Image);
+
+	/* Determine number of pixels in image */
+	Image->PixelCnt = 1;
+	for (i=0; i<Image->Dimc; i++)
+		Image->PixelCnt = Image->PixelCnt * Image->Dimv[i];
+
+	/* Determine length of information field */
+	Cnt = lseek(Fd, (IMINDEX)0, FROMEND);
+	if (Cnt == -1) ErrorNull("Seek EOF failed");
+	Length = (int)(Cnt - Image->Address[aINFO]);
+
+	/* Allocate buffer for information field */
+	if (Length < 1) ErrorNull("Invalid information field");
+	Buffer = (char *)malloc((unsigned)Length);
+	if (Buffer == NULL) ErrorNull("Allocation error");
+
+	/* Read whole information field into a buffer */
+	Cnt = lseek(Fd, (IMINDEX)Image->Address[aINFO], FROMBEG);
+	Cnt = read(Fd, (char *)Buffer, Length);
+	if (Cnt != Length) ErrorNull("Image read failed");
+
+	/* Prepare to loop through all fields */
+	StrPtr = Buffer;
+	Length = (int) strlen(StrPtr) + 1;
+	Image->InfoCnt = 0;
+
+	/* Loop through all fields */
+	while ((Length > 1) && (Image->InfoCnt < nINFO))
+	{
+		/* Reading field name from buffer */
+		Name = (char *)malloc((unsigned)Length);
+		if (Name == NULL) ErrorNull("Allocation error");
+		strcpy(Name, StrPtr);
+		StrPtr = StrPtr + Length;
+		Length = (int) strlen(StrPtr) + 1;
+
+		/* Reading field data from buffer */
+		Data = (char *)malloc((unsigned)Length);
+		if (Data == NULL) ErrorNull("Allocation error");
+		strcpy(Data, StrPtr);
+		StrPtr = StrPtr + Length;
+		Length = (int) strlen(StrPtr) + 1;
+
+		/* Saving name and data in image header */
+		Image->InfoName[Image->InfoCnt] = Name;
+		Image->InfoData[Image->InfoCnt] = Data;
+		Image->InfoCnt ++;
+	}
+
+	/* Free buffer used for information string */
+	free(Buffer);
+
+	/* Save file pointer */
+	Image->Fd = Fd;
+
+	/* Determine size of each pixel */
+	switch (Image->PixelFormat) {
+		case GREY         : Image->PixelSize = sizeof (GREYTYPE); break;
+		case COLOR        : Image->PixelSize = sizeof (COLORTYPE); break;
+		case COLORPACKED  : Image->PixelSize = sizeof (CPACKEDTYPE); break;
+		case BYTE         : Image->PixelSize = sizeof (BYTETYPE); break;
+		case SHORT        : Image->PixelSize = sizeof (SHORTTYPE); break;
+		case LONG         : Image->PixelSize = sizeof (LONGTYPE); break;
+		case REAL         : Image->PixelSize = sizeof (REALTYPE); break;
+		case COMPLEX      : Image->PixelSize = sizeof (COMPLEXTYPE); break;
+		case USERPACKED   : Image->PixelSize = sizeof (USERTYPE); break;
+	}
+
+	/* set flag indicating this is .im format */
+	Image->nImgFormat=0;
+	Image->MapBase = NULL;
+	InitOptions(Image);
+
+	/* Statistics are only good while the MAXMIN field is */
+	DropStaleStats(Image);
+	return(Image);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine closes an image.  The image parameters are         */
+/*           written to the file from the image record.                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imclose (IMAGE *Image)
+{
+	int Fd;
+	IMINDEX Cnt;
+	int Length;
+	int InfoLength;
+	char Null = '\0';
+	int i;
+	char* envVar;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+
+	/* Check that file is open */
+	Fd = Image->Fd;
+	if (Fd == EOF) Error("Image not open");
+
+	/* Release any pixel mapping before the file is rewritten */
+	if (Image->MapBase != NULL) imunmap(Image);
+
+	/* Settle the histogram and zone map tracked while writing */
+	/* and the slice index                                     */
+	FinishTracking(Image);
+	FinishZones(Image);
+	FinishIndex(Image);
+
+	if (Image->nImgFormat == 0)
+	{
+		/* if the image was opened as an uncompressed file, but the FORCE_COMPRESS
+			 environment variable was set, then close it as a compressed file */
+		if((envVar = getenv("IMAGE_COMPRESS")) == NULL) envVar = "0";
+		if(!Image->Compressed && getenv("IMAGE_FORCE_COMPRESS") &&
+			PickCodec(Image, envVar) == VALID)
+		{
+			/* copy the pixel data to the uncompressed pixels */
+			if (UCOpen(Image) == INVALID) return(INVALID);
+			if (UCLoad(Image) == INVALID)
+			{
+				UCClose(Image);
+				return(INVALID);
+			}
+
+			Image->Compressed = TRUE;
+			Image->PixelsAccessed = TRUE;
+			Image->Address[aVERNO] =
+				Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
+			if (NewChunks(Image) == INVALID) Error("Allocation error");
+
+			compressImage(Image);
+			Image->PixelsAccessed = FALSE;
+			UCClose(Image);
+
+			/* save the compression type as an info field */
+			if(Image->Compressed)
+				imputinfo(Image, "Pixel Compression Method", 
+					CodecName(Image->CompressionMethod));
+		}
+
+		/* if the image was opened as a compressed file, but the
+			 IMAGE_FORCE_UNCOMPRESS environment variable was set, then close it as
+			 an uncompressed file */
+		if(Image->Compressed && getenv("IMAGE_FORCE_UNCOMPRESS"))
+		{
+			/* Nothing may be written over the compressed pixels unless all */
+			/* of them decompressed */
+			if (decompressImage(Image) == INVALID || (Image->Chunked &&
+				LoadChunksParallel(Image, 0, Image->PixelCnt*Image->PixelSize)
+				== INVALID))
+				Error("Image decompression failed");
+
+			/* Write pixels into image file */
+			if (UCSave(Image) == INVALID) return(INVALID);
+
+			/* set a few things straight */
+			FreeChunks(Image);
+			Image->Compressed = FALSE;
+			Image->Chunked = FALSE;
+			Image->Prefilter = 0;
+			Image->Address[aVERNO] = Image->Address[aVERNO] & ~(IMINDEX)
+				(COMPRESSED | CHUNKED | 15 * 4096 | 3 * PREFILTERED);
+			Image->Address[aINFO] =
+				Image->Address[aPIXELS] + Image->PixelCnt*Image->PixelSize;
+
+			imputinfo(Image, "Pixel Compression Method", NULL);
+
+			UCClose(Image);
+		}
+
+		/* if the image has been compressed, and we have modified the pixels,
+			 we must compress the pixels back into the image file and remove
+			 the temp file */
+		if(Image->Compressed && Image->PixelsModified)
+		{
+			compressImage(Image);
+			UCClose(Image);
+			/* save the compression type as an info field */
+			if(Image->Compressed)
+				imputinfo(Image, "Pixel Compression Method", 
+					CodecName(Image->CompressionMethod));
+		}
+		else if(Image->Compressed && Image->PixelsAccessed)
+		{
+			UCClose(Image);
+		}
+
+		/* Swap the byte order of header fields except the title and address */
+		if (Image->SwapNeeded) Swapheader(Image); 
+ 
+		/* Write Title field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aTITLE], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
+		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
+
+		/* Write MaxMin field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aMAXMIN], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
+		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
+		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
+
+		/* Write Histogram field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aHISTO], FROMBEG);
+		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
+		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
+		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
+
+		/* Write PixelFormat field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aPIXFORM], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
+		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
+
+		/* Write DimC field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMC], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
+		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+
+		/* Write DimV field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMV], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
+		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+
+		/* Write Info field */
+		InfoLength = 0;
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aINFO], FROMBEG);
+		for (i=0; i<Image->InfoCnt; i++)
+		{
+      /* Write name of field and free string */
+      Length = (int) strlen(Image->InfoName[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoName[i]);
+      InfoLength += Length;
+
+      /* Write field data and free string */
+      Length = (int) strlen(Image->InfoData[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoData[i]);
+      InfoLength += Length;
+		}
+		Cnt = write(Fd, (char *)&Null, sizeof(Null));
+		InfoLength += 1;
+
+		/* change the length of the file */
+		ftruncate(Fd, (IMINDEX)(Image->Address[aINFO] + InfoLength));
+
+		/* Write addresses of image header fields */
+		if (WriteAddresses(Image) == INVALID) Warn("Image write failed");
+	}
+
+	/* Close file and free image record */
+	if (Image->DirectFd >= 0) close(Image->DirectFd);
+	FreeChunks(Image);
+	free((char *)Image);
+	close(Fd);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine closes an image, forcing it to be compressed.      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imcloseC (IMAGE *Image)
+{
+	int Fd;
+	IMINDEX Cnt;
+	int Length;
+	int InfoLength;
+	char Null = '\0';
+	int i;
+	char* envVar;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+
+	/* Check that file is open */
+	Fd = Image->Fd;
+	if (Fd == EOF) Error("Image not open");
+
+	/* Release any pixel mapping before the file is rewritten */
+	if (Image->MapBase != NULL) imunmap(Image);
+
+	/* Settle the histogram and zone map tracked while writing */
+	/* and the slice index                                     */
+	FinishTracking(Image);
+	FinishZones(Image);
+	FinishIndex(Image);
+
+	if (Image->nImgFormat == 0)
+	{
+		/* if the image was opened as an uncompressed file, close it as a
+			 compressed file */
+		if((envVar = getenv("IMAGE_COMPRESS")) == NULL) envVar = "0";
+		if(!Image->Compressed && PickCodec(Image, envVar) == VALID)
+		{
+			/* copy the pixel data to the uncompressed pixels */
+			if (UCOpen(Image) == INVALID) return(INVALID);
+			if (UCLoad(Image) == INVALID)
+			{
+				UCClose(Image);
+				return(INVALID);
+			}
+
+			Image->Compressed = TRUE;
+			Image->PixelsAccessed = TRUE;
+			Image->PixelsModified = TRUE;
+			Image->Address[aVERNO] =
+				Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
+			if (NewChunks(Image) == INVALID) Error("Allocation error");
+		}
+
+		if(Image->Compressed && Image->PixelsModified)
+		{
+			compressImage(Image);
+			UCClose(Image);
+		}
+		else if(Image->Compressed && Image->PixelsAccessed)
+		{
+			UCClose(Image);
+		}
+
+		/* save the compression type as an info field */
+		if(Image->Compressed)
+			imputinfo(Image, "Pixel Compression Method", 
+				CodecName(Image->CompressionMethod));
+
+		/* Swap the byte order of header fields except the title and address */
+		if (Image->SwapNeeded) Swapheader(Image); 
+ 
+		/* Write Title field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aTITLE], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
+		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
+
+		/* Write MaxMin field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aMAXMIN], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
+		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
+		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
+
+		/* Write Histogram field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aHISTO], FROMBEG);
+		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
+		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
+		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
+
+		/* Write PixelFormat field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aPIXFORM], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
+		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
+
+		/* Write DimC field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMC], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
+		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+
+		/* Write DimV field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMV], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
+		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+
+		/* Write Info field */
+		InfoLength = 0;
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aINFO], FROMBEG);
+		for (i=0; i<Image->InfoCnt; i++)
+		{
+      /* Write name of field and free string */
+      Length = (int) strlen(Image->InfoName[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoName[i]);
+      InfoLength += Length;
+
+      /* Write field data and free string */
+      Length = (int) strlen(Image->InfoData[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoData[i]);
+      InfoLength += Length;
+		}
+		Cnt = write(Fd, (char *)&Null, sizeof(Null));
+		InfoLength += 1;
+
+		/* change the length of the file */
+		ftruncate(Fd, (IMINDEX)(Image->Address[aINFO] + InfoLength));
+
+		/* Write addresses of image header fields */
+		if (WriteAddresses(Image) == INVALID) Warn("Image write failed");
+	}else{
+		fprintf(stderr,"can only compress .im format images\n");
+	}
+	
+	/* Close file and free image record */
+	if (Image->DirectFd >= 0) close(Image->DirectFd);
+	FreeChunks(Image);
+	free((char *)Image);
+	close(Fd);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine closes an image, forcing it to be uncompressed.    */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imcloseU (IMAGE *Image)
+{
+	int Fd;
+	IMINDEX Cnt;
+	int Length;
+	int InfoLength;
+	char Null = '\0';
+	int i;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+
+	/* Check that file is open */
+	Fd = Image->Fd;
+	if (Fd == EOF) Error("Image not open");
+
+	/* Release any pixel mapping before the file is rewritten */
+	if (Image->MapBase != NULL) imunmap(Image);
+
+	/* Settle the histogram and zone map tracked while writing */
+	/* and the slice index                                     */
+	FinishTracking(Image);
+	FinishZones(Image);
+	FinishIndex(Image);
+
+	if (Image->nImgFormat == 0)
+	{
+		/* if the image was opened as a compressed file, close it as an
+			 uncompressed file */
+		if(Image->Compressed)
+		{
+			/* Nothing may be written over the compressed pixels unless all */
+			/* of them decompressed */
+			if (decompressImage(Image) == INVALID || (Image->Chunked &&
+				LoadChunksParallel(Image, 0, Image->PixelCnt*Image->PixelSize)
+				== INVALID))
+				Error("Image decompression failed");
+
+			/* Write pixels into image file */
+			if (UCSave(Image) == INVALID) return(INVALID);
+
+			/* set a few things straight */
+			FreeChunks(Image);
+			Image->Compressed = FALSE;
+			Image->Chunked = FALSE;
+			Image->Prefilter = 0;
+			Image->Address[aVERNO] = Image->Address[aVERNO] & ~(IMINDEX)
+				(COMPRESSED | CHUNKED | 15 * 4096 | 3 * PREFILTERED);
+			Image->Address[aINFO] =
+				Image->Address[aPIXELS] + Image->PixelCnt*Image->PixelSize;
+
+			imputinfo(Image, "Pixel Compression Method", NULL);
+
+			UCClose(Image);
+		}
+
+		/* Swap the byte order of header fields except the title and address */
+		if (Image->SwapNeeded) Swapheader(Image); 
+ 
+		/* Write Title field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aTITLE], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
+		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
+
+		/* Write MaxMin field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aMAXMIN], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
+		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
+		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
+
+		/* Write Histogram field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aHISTO], FROMBEG);
+		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
+		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
+		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
+		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
+
+		/* Write PixelFormat field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aPIXFORM], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
+		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
+
+		/* Write DimC field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMC], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
+		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+
+		/* Write DimV field */
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aDIMV], FROMBEG);
+		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
+		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+
+		/* Write Info field */
+		InfoLength = 0;
+		Cnt = lseek(Fd, (IMINDEX)Image->Address[aINFO], FROMBEG);
+		for (i=0; i<Image->InfoCnt; i++)
+		{
+      /* Write name of field and free string */
+      Length = (int) strlen(Image->InfoName[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoName[i]);
+      InfoLength += Length;
+
+      /* Write field data and free string */
+      Length = (int) strlen(Image->InfoData[i]) + 1;
+      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
+      if (Cnt != Length) Warn("Image write failed");
+      free(Image->InfoData[i]);
+      InfoLength += Length;
+		}
+		Cnt = write(Fd, (char *)&Null, sizeof(Null));
+		InfoLength += 1;
+
+		/* change the length of the file */
+		ftruncate(Fd, (IMINDEX)(Image->Address[aINFO] + InfoLength));
+
+		/* Write addresses of image header fields */
+		if (WriteAddresses(Image) == INVALID) Warn("Image write failed");
+	}
+	/* Close file and free image record */
+	if (Image->DirectFd >= 0) close(Image->DirectFd);
+	FreeChunks(Image);
+	free((char *)Image);
+	close(Fd);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines reverse the bytes of nWord words of nByte        */
+/*           (2, 4 or 8) bytes.  SwapScalar works anywhere; the SSSE3 and    */
+/*           AVX2 versions reverse 16 or 32 bytes per shuffle and finish     */
+/*           the tail with SwapScalar.  SelectSimd picks the best one the    */
+/*           processor supports when the program starts; IMAGE_NOSIMD        */
+/*           forces the scalar version.                                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef void (*SWAPFUNC)(char *Buffer, IMINDEX nWord, int nByte);
+
+static void SwapScalar(char *Buffer, IMINDEX nWord, int nByte)
+{
+	unsigned short W2;
+	unsigned int W4;
+	unsigned long long W8;
+	IMINDEX Word;
+
+	switch (nByte) {
+		case 2:
+			for (Word = 0; Word < nWord; Word++, Buffer += 2) {
+				memcpy(&W2, Buffer, 2);
+				W2 = (unsigned short)((W2 << 8) | (W2 >> 8));
+				memcpy(Buffer, &W2, 2);
+			}
+			break;
+		case 4:
+			for (Word = 0; Word < nWord; Word++, Buffer += 4) {
+				memcpy(&W4, Buffer, 4);
+				W4 = (W4 << 24) | ((W4 << 8) & 0xff0000) |
+					((W4 >> 8) & 0xff00) | (W4 >> 24);
+				memcpy(Buffer, &W4, 4);
+			}
+			break;
+		case 8:
+			for (Word = 0; Word < nWord; Word++, Buffer += 8) {
+				memcpy(&W8, Buffer, 8);
+				W8 = ((W8 & 0x00000000000000ffULL) << 56) |
+					((W8 & 0x000000000000ff00ULL) << 40) |
+					((W8 & 0x0000000000ff0000ULL) << 24) |
+					((W8 & 0x00000000ff000000ULL) << 8) |
+					((W8 & 0x000000ff00000000ULL) >> 8) |
+					((W8 & 0x0000ff0000000000ULL) >> 24) |
+					((W8 & 0x00ff000000000000ULL) >> 40) |
+					((W8 & 0xff00000000000000ULL) >> 56);
+				memcpy(Buffer, &W8, 8);
+			}
+			break;
+	}
+}
+
+#ifdef HAVE_SIMD_SWAP
+/* Shuffle controls that reverse each 2, 4 and 8 byte word of 16 bytes */
+static const char _imswapmask[3][16] = {
+   { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+   { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+   { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 } };
+
+__attribute__((target("ssse3")))
+static void SwapSsse3(char *Buffer, IMINDEX nWord, int nByte)
+{
+	__m128i Mask;
+	__m128i Data;
+	IMINDEX Bytes;
+	IMINDEX i;
+
+	Mask = _mm_loadu_si128((const __m128i *)
+		_imswapmask[nByte == 2 ? 0 : nByte == 4 ? 1 : 2]);
+	Bytes = nWord * nByte;
+	for (i = 0; i + 16 <= Bytes; i += 16) {
+		Data = _mm_loadu_si128((__m128i *)(Buffer + i));
+		_mm_storeu_si128((__m128i *)(Buffer + i), _mm_shuffle_epi8(Data, Mask));
+	}
+	SwapScalar(Buffer + i, (Bytes - i) / nByte, nByte);
+}
+
+__attribute__((target("avx2")))
+static void SwapAvx2(char *Buffer, IMINDEX nWord, int nByte)
+{
+	__m256i Mask;
+	__m256i Data0;
+	__m256i Data1;
+	IMINDEX Bytes;
+	IMINDEX i;
+
+	Mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+		_imswapmask[nByte == 2 ? 0 : nByte == 4 ? 1 : 2]));
+	Bytes = nWord * nByte;
+	for (i = 0; i + 64 <= Bytes; i += 64) {
+		Data0 = _mm256_loadu_si256((__m256i *)(Buffer + i));
+		Data1 = _mm256_loadu_si256((__m256i *)(Buffer + i + 32));
+		_mm256_storeu_si256((__m256i *)(Buffer + i),
+			_mm256_shuffle_epi8(Data0, Mask));
+		_mm256_storeu_si256((__m256i *)(Buffer + i + 32),
+			_mm256_shuffle_epi8(Data1, Mask));
+	}
+	for (; i + 32 <= Bytes; i += 32) {
+		Data0 = _mm256_loadu_si256((__m256i *)(Buffer + i));
+		_mm256_storeu_si256((__m256i *)(Buffer + i),
+			_mm256_shuffle_epi8(Data0, Mask));
+	}
+	SwapScalar(Buffer + i, (Bytes - i) / nByte, nByte);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines apply and reverse the prefilter of a chunk of    */
+/*           nWord 16 bit pixels (see FilterChunk).  PREFILTER_DELTA keeps   */
+/*           the difference of each pixel from the one before it, the first  */
+/*           from 0, folded so that small differences of either sign have a  */
+/*           zero high byte (0, -1, 1, -2 become 0, 1, 2, 3).                */
+/*           PREFILTER_SHUFFLE then stores the first byte of every word,     */
+/*           followed by the second byte of every word.  Swapped says the    */
+/*           words are in the other byte order; the differences are still    */
+/*           taken of their values.  The range routines only do words First  */
+/*           to Last-1.  The AVX2 versions work on 16 words at a time.       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef void (*FILTERFUNC)(const char *In, char *Out, IMINDEX nWord,
+	int Filter);
+
+static void EncodeRange(const char *In, char *Out, IMINDEX First,
+	IMINDEX Last, IMINDEX nWord, int Filter, int Swapped)
+{
+	unsigned short Prev = 0;
+	unsigned short Word;
+	unsigned short Diff;
+	IMINDEX i;
+
+	if (First > 0)
+	{
+		memcpy(&Prev, In + 2 * (First - 1), 2);
+		if (Swapped) Prev = (unsigned short)((Prev << 8) | (Prev >> 8));
+	}
+	for (i = First; i < Last; i++) {
+		memcpy(&Word, In + 2 * i, 2);
+		if (Swapped) Word = (unsigned short)((Word << 8) | (Word >> 8));
+		Diff = Word;
+		if (Filter & PREFILTER_DELTA) {
+			Diff = (unsigned short)(Word - Prev);
+			Diff = (unsigned short)((Diff << 1) ^ ((Diff & 0x8000) ? 0xffff : 0));
+		}
+		Prev = Word;
+		if (Swapped) Diff = (unsigned short)((Diff << 8) | (Diff >> 8));
+		if (Filter & PREFILTER_SHUFFLE) {
+			Out[i] = ((char *)&Diff)[0];
+			Out[nWord + i] = ((char *)&Diff)[1];
+		}
+		else
+			memcpy(Out + 2 * i, &Diff, 2);
+	}
+}
+
+static void DecodeRange(const char *In, char *Out, IMINDEX First,
+	IMINDEX Last, IMINDEX nWord, int Filter, int Swapped)
+{
+	unsigned short Prev = 0;
+	unsigned short Word;
+	unsigned short Diff;
+	IMINDEX i;
+
+	if (First > 0)
+	{
+		memcpy(&Prev, Out + 2 * (First - 1), 2);
+		if (Swapped) Prev = (unsigned short)((Prev << 8) | (Prev >> 8));
+	}
+	for (i = First; i < Last; i++) {
+		if (Filter & PREFILTER_SHUFFLE) {
+			((char *)&Diff)[0] = In[i];
+			((char *)&Diff)[1] = In[nWord + i];
+		}
+		else
+			memcpy(&Diff, In + 2 * i, 2);
+		if (Swapped) Diff = (unsigned short)((Diff << 8) | (Diff >> 8));
+		Word = Diff;
+		if (Filter & PREFILTER_DELTA)
+			Word = (unsigned short)(Prev + ((Diff >> 1) ^ ((Diff & 1) ? 0xffff : 0)));
+		Prev = Word;
+		if (Swapped) Word = (unsigned short)((Word << 8) | (Word >> 8));
+		memcpy(Out + 2 * i, &Word, 2);
+	}
+}
+
+static void EncodeScalar(const char *In, char *Out, IMINDEX nWord, int Filter)
+{
+	EncodeRange(In, Out, 0, nWord, nWord, Filter, FALSE);
+}
+
+static void DecodeScalar(const char *In, char *Out, IMINDEX nWord, int Filter)
+{
+	DecodeRange(In, Out, 0, nWord, nWord, Filter, FALSE);
+}
+
+#ifdef HAVE_SIMD_SWAP
+/* Shuffle control that gathers the low then the high bytes of 8 words */
+static const char _imsplitmask[16] =
+   { 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15 };
+
+__attribute__((target("avx2")))
+static void EncodeAvx2(const char *In, char *Out, IMINDEX nWord, int Filter)
+{
+	__m256i Mask;
+	__m256i Data;
+	IMINDEX i;
+
+	if (nWord < 1) return;
+	Mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+		_imsplitmask));
+	EncodeRange(In, Out, 0, 1, nWord, Filter, FALSE);
+	for (i = 1; i + 16 <= nWord; i += 16) {
+		Data = _mm256_loadu_si256((const __m256i *)(In + 2 * i));
+		if (Filter & PREFILTER_DELTA) {
+			Data = _mm256_sub_epi16(Data,
+				_mm256_loadu_si256((const __m256i *)(In + 2 * i - 2)));
+			Data = _mm256_xor_si256(_mm256_slli_epi16(Data, 1),
+				_mm256_srai_epi16(Data, 15));
+		}
+		if (Filter & PREFILTER_SHUFFLE) {
+			Data = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(Data, Mask),
+				0xd8);
+			_mm_storeu_si128((__m128i *)(Out + i),
+				_mm256_castsi256_si128(Data));
+			_mm_storeu_si128((__m128i *)(Out + nWord + i),
+				_mm256_extracti128_si256(Data, 1));
+		}
+		else
+			_mm256_storeu_si256((__m256i *)(Out + 2 * i), Data);
+	}
+	EncodeRange(In, Out, i, nWord, nWord, Filter, FALSE);
+}
+
+/* Running sum of the 8 folded differences of Data, plus the sum carried */
+/* in Carry */
+__attribute__((target("avx2")))
+static __m128i PrefixSum16(__m128i Data, __m128i *Carry, __m128i Last)
+{
+	Data = _mm_xor_si128(_mm_srli_epi16(Data, 1),
+		_mm_sub_epi16(_mm_setzero_si128(),
+		_mm_and_si128(Data, _mm_set1_epi16(1))));
+	Data = _mm_add_epi16(Data, _mm_slli_si128(Data, 2));
+	Data = _mm_add_epi16(Data, _mm_slli_si128(Data, 4));
+	Data = _mm_add_epi16(Data, _mm_slli_si128(Data, 8));
+	Data = _mm_add_epi16(Data, *Carry);
+	*Carry = _mm_shuffle_epi8(Data, Last);
+	return(Data);
+}
+
+__attribute__((target("avx2")))
+static void DecodeAvx2(const char *In, char *Out, IMINDEX nWord, int Filter)
+{
+	__m128i Last;
+	__m128i Carry;
+	__m128i Low;
+	__m128i High;
+	__m128i Data0;
+	__m128i Data1;
+	IMINDEX i;
+
+	Last = _mm_set1_epi16(0x0f0e);
+	Carry = _mm_setzero_si128();
+	for (i = 0; i + 16 <= nWord; i += 16) {
+		if (Filter & PREFILTER_SHUFFLE) {
+			Low = _mm_loadu_si128((const __m128i *)(In + i));
+			High = _mm_loadu_si128((const __m128i *)(In + nWord + i));
+			Data0 = _mm_unpacklo_epi8(Low, High);
+			Data1 = _mm_unpackhi_epi8(Low, High);
+		}
+		else {
+			Data0 = _mm_loadu_si128((const __m128i *)(In + 2 * i));
+			Data1 = _mm_loadu_si128((const __m128i *)(In + 2 * i + 16));
+		}
+		if (Filter & PREFILTER_DELTA) {
+			Data0 = PrefixSum16(Data0, &Carry, Last);
+			Data1 = PrefixSum16(Data1, &Carry, Last);
+		}
+		_mm_storeu_si128((__m128i *)(Out + 2 * i), Data0);
+		_mm_storeu_si128((__m128i *)(Out + 2 * i + 16), Data1);
+	}
+	DecodeRange(In, Out, i, nWord, nWord, Filter, FALSE);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines convert Cnt raw pixels of the given Format to    */
+/*           Slope * pixel + Intercept in a buffer of Type (AS_FLOAT,        */
+/*           AS_DOUBLE, AS_INT32 or AS_UINT16).  Integer results are         */
+/*           rounded half away from zero and clamped to the range of the     */
+/*           type.  AS_FLOAT and AS_UINT16 are computed in single precision, */
+/*           AS_DOUBLE and AS_INT32 in double.  ConvertAvx2 does 8 or 4      */
+/*           pixels per step and leaves LONG pixels and the tail to          */
+/*           ConvertGeneric.                                                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef void (*CONVFUNC)(char *Src, int Format, void *Dst, int Type,
+   IMINDEX Cnt, double Slope, double Intercept);
+
+#define CONVREAL(SrcType, DstType, WorkType, Lo, Hi)\
+   {\
+   const SrcType *S = (const SrcType *)Src;\
+   DstType *D = (DstType *)Dst;\
+   WorkType M = (WorkType)Slope;\
+   WorkType B = (WorkType)Intercept;\
+   for (i = 0; i < Cnt; i++)\
+      D[i] = (DstType)((WorkType)S[i] * M + B);\
+   }
+
+#define CONVINT(SrcType, DstType, WorkType, Lo, Hi)\
+   {\
+   const SrcType *S = (const SrcType *)Src;\
+   DstType *D = (DstType *)Dst;\
+   WorkType M = (WorkType)Slope;\
+   WorkType B = (WorkType)Intercept;\
+   WorkType V;\
+   for (i = 0; i < Cnt; i++)\
+      {\
+      V = (WorkType)S[i] * M + B;\
+      V = V > (WorkType)(Lo) ? V : (WorkType)(Lo);\
+      V = V < (WorkType)(Hi) ? V : (WorkType)(Hi);\
+      D[i] = (DstType)(V < 0 ? V - (WorkType)0.5 : V + (WorkType)0.5);\
+      }\
+   }
+
+#define CONVFORMAT(CONV, DstType, WorkType, Lo, Hi)\
+   switch (Format) {\
+      case BYTE        : CONV(BYTETYPE, DstType, WorkType, Lo, Hi); break;\
+      case GREY        :\
+      case COLOR       :\
+      case SHORT       : CONV(SHORTTYPE, DstType, WorkType, Lo, Hi); break;\
+      case USERPACKED  : CONV(USERTYPE, DstType, WorkType, Lo, Hi); break;\
+      case LONG        : CONV(LONGTYPE, DstType, WorkType, Lo, Hi); break;\
+      case REAL        : CONV(REALTYPE, DstType, WorkType, Lo, Hi); break;\
+      }
+
+static void ConvertGeneric(char *Src, int Format, void *Dst, int Type,
+	IMINDEX Cnt, double Slope, double Intercept)
+{
+	IMINDEX i;
+
+	switch (Type) {
+		case AS_FLOAT  : CONVFORMAT(CONVREAL, float, float, 0, 0); break;
+		case AS_DOUBLE : CONVFORMAT(CONVREAL, double, double, 0, 0); break;
+		case AS_INT32  : CONVFORMAT(CONVINT, int, double, INT_MIN, INT_MAX); break;
+		case AS_UINT16 : CONVFORMAT(CONVINT, unsigned short, float, 0, USHRT_MAX); break;
+	}
+}
+
+#ifdef HAVE_SIMD_SWAP
+/* Loads 8 pixels as floats */
+__attribute__((target("avx2")))
+static __m256 LoadPs(char *Src, int Format)
+{
+	switch (Format) {
+		case BYTE        : return(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((__m128i *)Src))));
+		case USERPACKED  : return(_mm256_cvtepi32_ps(
+				_mm256_loadu_si256((__m256i *)Src)));
+		case REAL        : return(_mm256_loadu_ps((float *)Src));
+		default          : return(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+				_mm_loadu_si128((__m128i *)Src))));
+	}
+}
+
+/* Loads 4 pixels as doubles */
+__attribute__((target("avx2")))
+static __m256d LoadPd(char *Src, int Format)
+{
+	int Bytes;
+
+	switch (Format) {
+		case BYTE        : memcpy(&Bytes, Src, sizeof(Bytes));
+			return(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(
+				_mm_cvtsi32_si128(Bytes))));
+		case USERPACKED  : return(_mm256_cvtepi32_pd(
+				_mm_loadu_si128((__m128i *)Src)));
+		case REAL        : return(_mm256_cvtps_pd(_mm_loadu_ps((float *)Src)));
+		default          : return(_mm256_cvtepi32_pd(_mm_cvtepi16_epi32(
+				_mm_loadl_epi64((__m128i *)Src))));
+	}
+}
+
+__attribute__((target("avx2")))
+static void ConvertAvx2(char *Src, int Format, void *Dst, int Type,
+	IMINDEX Cnt, double Slope, double Intercept)
+{
+	__m256 Xs, Ms, Bs;
+	__m256d Xd, Md, Bd, Sign;
+	__m256i Round;
+	int PixelSize;
+	int TypeSize;
+	IMINDEX i;
+
+	switch (Format) {
+		case BYTE        : PixelSize = sizeof(BYTETYPE); break;
+		case GREY        :
+		case COLOR       :
+		case SHORT       : PixelSize = sizeof(SHORTTYPE); break;
+		case USERPACKED  : PixelSize = sizeof(USERTYPE); break;
+		case REAL        : PixelSize = sizeof(REALTYPE); break;
+		default          : PixelSize = 0; break;
+	}
+
+	i = 0;
+	if (PixelSize == 0)
+		TypeSize = 0;
+	else if (Type == AS_FLOAT || Type == AS_UINT16)
+	{
+		Ms = _mm256_set1_ps((float)Slope);
+		Bs = _mm256_set1_ps((float)Intercept);
+		for (; i + 8 <= Cnt; i += 8)
+		{
+			Xs = _mm256_add_ps(_mm256_mul_ps(LoadPs(Src + i * PixelSize,
+				Format), Ms), Bs);
+			if (Type == AS_FLOAT)
+				_mm256_storeu_ps((float *)Dst + i, Xs);
+			else
+			{
+				Xs = _mm256_min_ps(_mm256_max_ps(Xs, _mm256_setzero_ps()),
+					_mm256_set1_ps((float)USHRT_MAX));
+				Round = _mm256_cvttps_epi32(_mm256_add_ps(Xs,
+					_mm256_set1_ps(0.5f)));
+				_mm_storeu_si128((__m128i *)((unsigned short *)Dst + i),
+					_mm_packus_epi32(_mm256_castsi256_si128(Round),
+					_mm256_extracti128_si256(Round, 1)));
+			}
+		}
+		TypeSize = Type == AS_FLOAT ? sizeof(float) : sizeof(unsigned short);
+	}
+	else
+	{
+		Md = _mm256_set1_pd(Slope);
+		Bd = _mm256_set1_pd(Intercept);
+		Sign = _mm256_set1_pd(-0.0);
+		for (; i + 4 <= Cnt; i += 4)
+		{
+			Xd = _mm256_add_pd(_mm256_mul_pd(LoadPd(Src + i * PixelSize,
+				Format), Md), Bd);
+			if (Type == AS_DOUBLE)
+				_mm256_storeu_pd((double *)Dst + i, Xd);
+			else
+			{
+				Xd = _mm256_min_pd(_mm256_max_pd(Xd,
+					_mm256_set1_pd((double)INT_MIN)),
+					_mm256_set1_pd((double)INT_MAX));
+				Xd = _mm256_add_pd(Xd, _mm256_or_pd(_mm256_and_pd(Xd, Sign),
+					_mm256_set1_pd(0.5)));
+				_mm_storeu_si128((__m128i *)((int *)Dst + i),
+					_mm256_cvttpd_epi32(Xd));
+			}
+		}
+		TypeSize = Type == AS_DOUBLE ? sizeof(double) : sizeof(int);
+	}
+
+	ConvertGeneric(Src + i * PixelSize, Format, (char *)Dst + i * TypeSize,
+		Type, Cnt - i, Slope, Intercept);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines widen the range [*Min, *Max] to take in Cnt      */
+/*           GREY pixels.  MinMaxAvx2 compares 16 pixels per step.           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef void (*MINMAXFUNC)(const GREYTYPE *Pixels, IMINDEX Cnt, int *Min,
+   int *Max);
+
+static void MinMaxGeneric(const GREYTYPE *Pixels, IMINDEX Cnt, int *Min,
+	int *Max)
+{
+	int TempMin = *Min;
+	int TempMax = *Max;
+	IMINDEX i;
+
+	for (i=0; i<Cnt; i++)
+	{
+		if (Pixels[i] < TempMin) TempMin = Pixels[i];
+		if (Pixels[i] > TempMax) TempMax = Pixels[i];
+	}
+	*Min = TempMin;
+	*Max = TempMax;
+}
+
+#ifdef HAVE_SIMD_SWAP
+__attribute__((target("avx2")))
+static void MinMaxAvx2(const GREYTYPE *Pixels, IMINDEX Cnt, int *Min,
+	int *Max)
+{
+	GREYTYPE Lanes[2][16];
+	__m256i Lo, Hi, Data;
+	IMINDEX i;
+	int k;
+
+	if (Cnt < 16)
+	{
+		MinMaxGeneric(Pixels, Cnt, Min, Max);
+		return;
+	}
+
+	Lo = Hi = _mm256_loadu_si256((const __m256i *)Pixels);
+	for (i = 16; i + 16 <= Cnt; i += 16)
+	{
+		Data = _mm256_loadu_si256((const __m256i *)(Pixels + i));
+		Lo = _mm256_min_epi16(Lo, Data);
+		Hi = _mm256_max_epi16(Hi, Data);
+	}
+	_mm256_storeu_si256((__m256i *)Lanes[0], Lo);
+	_mm256_storeu_si256((__m256i *)Lanes[1], Hi);
+	for (k = 0; k < 16; k++)
+	{
+		if (Lanes[0][k] < *Min) *Min = Lanes[0][k];
+		if (Lanes[1][k] > *Max) *Max = Lanes[1][k];
+	}
+	MinMaxGeneric(Pixels + i, Cnt - i, Min, Max);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines add Cnt pixels of a numeric format to the        */
+/*           running statistics in Acc.  NaN pixels are counted and left     */
+/*           out of the range and sums.  Sums are kept in double in four     */
+/*           lanes, pixel i going to lane i & 3, so StatsAvx2 (8 pixels per  */
+/*           step, USERPACKED and REAL only) and StatsGeneric give identical */
+/*           results.  Callers must start each call on a multiple of 4       */
+/*           pixels.                                                         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef struct {
+   double Min;
+   double Max;
+   double Sum[4];
+   double SumSq[4];
+   IMINDEX NaNCount;
+   } STATSACC;
+
+typedef void (*STATSFUNC)(const char *Pixels, int Format, IMINDEX Cnt,
+   STATSACC *Acc);
+
+#define STATSWIDE(Type)\
+   {\
+   const Type *P = (const Type *)Pixels;\
+   for (i = 0; i < Cnt; i++)\
+      {\
+      V = (double)P[i];\
+      if (V != V)\
+         {\
+         Acc->NaNCount++;\
+         V = 0;\
+         }\
+      else\
+         {\
+         if (V < Acc->Min) Acc->Min = V;\
+         if (V > Acc->Max) Acc->Max = V;\
+         }\
+      Acc->Sum[i & 3] += V;\
+      Acc->SumSq[i & 3] += V * V;\
+      }\
+   }
+
+static void StatsGeneric(const char *Pixels, int Format, IMINDEX Cnt,
+	STATSACC *Acc)
+{
+	IMINDEX i;
+	double V;
+
+	switch (Format) {
+		case BYTE        : STATSWIDE(BYTETYPE); break;
+		case GREY        :
+		case COLOR       :
+		case SHORT       : STATSWIDE(SHORTTYPE); break;
+		case USERPACKED  : STATSWIDE(USERTYPE); break;
+		case LONG        : STATSWIDE(LONGTYPE); break;
+		case REAL        : STATSWIDE(REALTYPE); break;
+	}
+}
+
+#ifdef HAVE_SIMD_SWAP
+__attribute__((target("avx2")))
+static void StatsAvx2(const char *Pixels, int Format, IMINDEX Cnt,
+	STATSACC *Acc)
+{
+	float Lanes[2][8];
+	int LanesI[2][8];
+	__m256 X, Ord, Lo, Hi;
+	__m256i Xi, Loi, Hii;
+	__m256d Sum, SumSq, D;
+	IMINDEX NaNs;
+	IMINDEX i;
+	int k;
+
+	if ((Format != REAL && Format != USERPACKED) || Cnt < 8)
+	{
+		StatsGeneric(Pixels, Format, Cnt, Acc);
+		return;
+	}
+
+	Sum = _mm256_loadu_pd(Acc->Sum);
+	SumSq = _mm256_loadu_pd(Acc->SumSq);
+	NaNs = 0;
+	if (Format == REAL)
+	{
+		Lo = _mm256_set1_ps(HUGE_VALF);
+		Hi = _mm256_set1_ps(-HUGE_VALF);
+		for (i = 0; i + 8 <= Cnt; i += 8)
+		{
+			/* NaN lanes become 0 for the sums and +-inf for the range */
+			X = _mm256_loadu_ps((const float *)Pixels + i);
+			Ord = _mm256_cmp_ps(X, X, _CMP_ORD_Q);
+			NaNs += 8 - __builtin_popcount(_mm256_movemask_ps(Ord));
+			X = _mm256_and_ps(X, Ord);
+			Lo = _mm256_min_ps(Lo, _mm256_blendv_ps(
+				_mm256_set1_ps(HUGE_VALF), X, Ord));
+			Hi = _mm256_max_ps(Hi, _mm256_blendv_ps(
+				_mm256_set1_ps(-HUGE_VALF), X, Ord));
+			D = _mm256_cvtps_pd(_mm256_castps256_ps128(X));
+			Sum = _mm256_add_pd(Sum, D);
+			SumSq = _mm256_add_pd(SumSq, _mm256_mul_pd(D, D));
+			D = _mm256_cvtps_pd(_mm256_extractf128_ps(X, 1));
+			Sum = _mm256_add_pd(Sum, D);
+			SumSq = _mm256_add_pd(SumSq, _mm256_mul_pd(D, D));
+		}
+		_mm256_storeu_ps(Lanes[0], Lo);
+		_mm256_storeu_ps(Lanes[1], Hi);
+		for (k = 0; k < 8; k++)
+		{
+			if (Lanes[0][k] < Acc->Min) Acc->Min = Lanes[0][k];
+			if (Lanes[1][k] > Acc->Max) Acc->Max = Lanes[1][k];
+		}
+	}
+	else
+	{
+		Loi = _mm256_set1_epi32(INT_MAX);
+		Hii = _mm256_set1_epi32(INT_MIN);
+		for (i = 0; i + 8 <= Cnt; i += 8)
+		{
+			Xi = _mm256_loadu_si256((const __m256i *)Pixels + i / 8);
+			Loi = _mm256_min_epi32(Loi, Xi);
+			Hii = _mm256_max_epi32(Hii, Xi);
+			D = _mm256_cvtepi32_pd(_mm256_castsi256_si128(Xi));
+			Sum = _mm256_add_pd(Sum, D);
+			SumSq = _mm256_add_pd(SumSq, _mm256_mul_pd(D, D));
+			D = _mm256_cvtepi32_pd(_mm256_extracti128_si256(Xi, 1));
+			Sum = _mm256_add_pd(Sum, D);
+			SumSq = _mm256_add_pd(SumSq, _mm256_mul_pd(D, D));
+		}
+		_mm256_storeu_si256((__m256i *)LanesI[0], Loi);
+		_mm256_storeu_si256((__m256i *)LanesI[1], Hii);
+		for (k = 0; k < 8; k++)
+		{
+			if (LanesI[0][k] < Acc->Min) Acc->Min = LanesI[0][k];
+			if (LanesI[1][k] > Acc->Max) Acc->Max = LanesI[1][k];
+		}
+	}
+	_mm256_storeu_pd(Acc->Sum, Sum);
+	_mm256_storeu_pd(Acc->SumSq, SumSq);
+	Acc->NaNCount += NaNs;
+	StatsGeneric(Pixels + i * (Format == REAL ? sizeof(REALTYPE) :
+		sizeof(USERTYPE)), Format, Cnt - i, Acc);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines bin Cnt USERPACKED, LONG or REAL pixels into     */
+/*           the histogram of Stats, Bins buckets spanning [Low..High] with  */
+/*           Scale = Bins / (High - Low).  Pixels out of range go in the end */
+/*           buckets and NaN pixels are left out.  BinOf takes the pixel's   */
+/*           offset from Low in bucket widths.  BinAvx2 computes 8 bucket    */
+/*           numbers per step, in double like BinGeneric.                    */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+typedef void (*BINFUNC)(const char *Pixels, int Format, IMINDEX Cnt,
+   IMSTATS *Stats, double Scale);
+
+static int BinOf(double V, int Bins)
+{
+	if (V >= Bins) return(Bins - 1);
+	if (V >= 1) return((int)V);
+	return(0);
+}
+
+#define BINWIDE(Type)\
+   {\
+   const Type *P = (const Type *)Pixels;\
+   for (i = 0; i < Cnt; i++)\
+      if (P[i] == P[i])\
+         Stats->Histogram[BinOf(((double)P[i] - Stats->Low) * Scale,\
+            Stats->Bins)]++;\
+   }
+
+static void BinGeneric(const char *Pixels, int Format, IMINDEX Cnt,
+	IMSTATS *Stats, double Scale)
+{
+	IMINDEX i;
+
+	switch (Format) {
+		case USERPACKED  : BINWIDE(USERTYPE); break;
+		case LONG        : BINWIDE(LONGTYPE); break;
+		case REAL        : BINWIDE(REALTYPE); break;
+	}
+}
+
+#ifdef HAVE_SIMD_SWAP
+__attribute__((target("avx2")))
+static void BinAvx2(const char *Pixels, int Format, IMINDEX Cnt,
+	IMSTATS *Stats, double Scale)
+{
+	int Bucket[8];
+	__m256d Low, Mul, Zero, Top, D;
+	__m256 X;
+	__m128i Lo, Hi;
+	int Ord;
+	IMINDEX i;
+	int k;
+
+	if (Format != REAL && Format != USERPACKED)
+	{
+		BinGeneric(Pixels, Format, Cnt, Stats, Scale);
+		return;
+	}
+
+	/* max_pd(NaN, 0) is 0, as BinOf gives for 0 * inf */
+	Low = _mm256_set1_pd(Stats->Low);
+	Mul = _mm256_set1_pd(Scale);
+	Zero = _mm256_setzero_pd();
+	Top = _mm256_set1_pd(Stats->Bins - 1);
+	for (i = 0; i + 8 <= Cnt; i += 8)
+	{
+		if (Format == REAL)
+		{
+			X = _mm256_loadu_ps((const float *)Pixels + i);
+			Ord = _mm256_movemask_ps(_mm256_cmp_ps(X, X, _CMP_ORD_Q));
+			D = _mm256_cvtps_pd(_mm256_castps256_ps128(X));
+		}
+		else
+		{
+			Ord = 0xff;
+			D = _mm256_cvtepi32_pd(_mm_loadu_si128(
+				(const __m128i *)Pixels + i / 4));
+		}
+		D = _mm256_mul_pd(_mm256_sub_pd(D, Low), Mul);
+		Lo = _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_max_pd(D, Zero), Top));
+		if (Format == REAL)
+			D = _mm256_cvtps_pd(_mm256_extractf128_ps(X, 1));
+		else
+			D = _mm256_cvtepi32_pd(_mm_loadu_si128(
+				(const __m128i *)Pixels + i / 4 + 1));
+		D = _mm256_mul_pd(_mm256_sub_pd(D, Low), Mul);
+		Hi = _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_max_pd(D, Zero), Top));
+		_mm_storeu_si128((__m128i *)Bucket, Lo);
+		_mm_storeu_si128((__m128i *)Bucket + 1, Hi);
+		for (k = 0; k < 8; k++)
+			if (Ord & (1 << k)) Stats->Histogram[Bucket[k]]++;
+	}
+	BinGeneric(Pixels + i * (Format == REAL ? sizeof(REALTYPE) :
+		sizeof(USERTYPE)), Format, Cnt - i, Stats, Scale);
+}
+#endif
+
+/* Bytes per converted pixel, or 0 if Format can not be converted to Type */
+static int ConvertSize(int Format, int Type)
+{
+	switch (Format) {
+		case BYTE        :
+		case GREY        :
+		case COLOR       :
+		case SHORT       :
+		case USERPACKED  :
+		case LONG        :
+		case REAL        : break;
+		default          : return(0);
+	}
+
+	switch (Type) {
+		case AS_FLOAT    : return(sizeof(float));
+		case AS_DOUBLE   : return(sizeof(double));
+		case AS_INT32    : return(sizeof(int));
+		case AS_UINT16   : return(sizeof(unsigned short));
+		default          : return(0);
+	}
+}
+
+static SWAPFUNC _imswapfunc = SwapScalar;
+static CONVFUNC _imconvfunc = ConvertGeneric;
+static MINMAXFUNC _imminmaxfunc = MinMaxGeneric;
+static STATSFUNC _imstatsfunc = StatsGeneric;
+static BINFUNC _imbinfunc = BinGeneric;
+static FILTERFUNC _imencodefunc = EncodeScalar;
+static FILTERFUNC _imdecodefunc = DecodeScalar;
+
+#ifdef HAVE_SIMD_SWAP
+__attribute__((constructor))
+static void SelectSimd(void)
+{
+	if (getenv("IMAGE_NOSIMD") != NULL) return;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		_imswapfunc = SwapAvx2;
+		_imconvfunc = ConvertAvx2;
+		_imminmaxfunc = MinMaxAvx2;
+		_imstatsfunc = StatsAvx2;
+		_imbinfunc = BinAvx2;
+		_imencodefunc = EncodeAvx2;
+		_imdecodefunc = DecodeAvx2;
+	}
+	else if (__builtin_cpu_supports("ssse3"))
+		_imswapfunc = SwapSsse3;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine swaps the byte order of each word in a buffer.     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int Swap (char *Buffer, IMINDEX Length, int Type)
+{
+	int nByte;
+
+	switch (Type) {
+		case GREY        : nByte = sizeof(GREYTYPE);  break;
+		case COLOR       : nByte = sizeof(COLORTYPE); break;
+		case SHORT       : nByte = sizeof(SHORTTYPE); break;
+		case LONG        : nByte = sizeof(LONGTYPE);  break;
+		case INT         : nByte = sizeof(int);       break;
+		case INT64       : nByte = sizeof(IMINDEX);   break;
+		case USERPACKED  : nByte = sizeof(USERTYPE);  break;
+		case REAL        : 
+		case COMPLEX     : nByte = sizeof(REALTYPE);  break;
+		default          : nByte = 1;                 break;
+	}
+
+	if (nByte > 1)
+		_imswapfunc(Buffer, Length / nByte, nByte);
+	return 0;
+} 
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine swaps the byte order of header fields of an image. */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int 
+Swapheader (IMAGE *Image)
+{
+	Swap((char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin), INT);
+	Swap((char *)&Image->MaxMin[0], sizeof(Image->MaxMin), INT);
+	Swap((char *)&Image->ValidHistogram, sizeof(Image->ValidHistogram), INT);
+	Swap((char *)&Image->Histogram[0], sizeof(Image->Histogram), INT);
+	Swap((char *)&Image->PixelFormat, sizeof(Image->PixelFormat), INT);
+	Swap((char *)&Image->Dimc, sizeof(Image->Dimc), INT);
+	Swap((char *)&Image->Dimv[0], sizeof(Image->Dimv), INT);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Reads in the compression types.  Returns 0 with the error set  */
+/*           if the config file is missing or holds no methods.              */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+
+#ifdef COMPRESSION_TYPE_FILE
+int readCompressionConfigFile (void)
+{
+  FILE *configFile;
+  char lineread[241];
+  int tempChar;
+  int offset;
+  int numCompMethods;
+  int i;
+
+  if((configFile = fopen(COMPRESSION_TYPE_FILE, "r")) == NULL)
+    Error("Could not open the compression config file");
+
+  numCompMethods = 0;
+  while(fgets(lineread, 240, configFile))
+  {
+    if(numCompMethods == MAX_NUM_COMP_METHODS) break;
+
+    /*   ignore lines beginning with '#'   */
+    if(lineread[0] != '#')
+    {
+      tempChar = 0;
+
+      /* read the compression method name (up to the ':') */
+      while(lineread[tempChar] != ':')
+      {
+        compressionMethods[numCompMethods].methodName[tempChar]
+					= lineread[tempChar];
+				tempChar++;
+      }
+
+      /* read the compression command (up to the ':') */
+      tempChar++; offset = tempChar;
+      while(lineread[tempChar] != ':')
+      {
+        compressionMethods[numCompMethods].compressionCommand[tempChar-offset]
+					= lineread[tempChar];
+				tempChar++;
+      }
+
+      /* read the decompression command (up to the EOL) */
+      tempChar++; offset = tempChar;
+      while(lineread[tempChar] != '\n')
+      {
+        compressionMethods[numCompMethods].decompressionCommand[tempChar-offset]
+					= lineread[tempChar];
+				tempChar++;
+      }
+
+      numCompMethods++;
+    }
+  }
+  haveNotReadCompressionConfigFile = FALSE;
+  fclose(configFile);
+
+  if(numCompMethods == 0)
+    Error("Could not read any compression methods");
+
+  NumberOfCompressionMethods = numCompMethods;
+  return 1;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  takes parameters and generates a specific command string to     */
+/*           either compress or decompress pixel data                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int fillInCompressionCommand (char *specific, char *generic, char *infile,
+	char *outfile, IMAGE *Image)
+{
+  int gPosition = 0;
+  int sPosition = 0;
+  int i;
+  char tempstring[256];
+
+  while(generic[gPosition] != '\0')
+  {
+    if(generic[gPosition] != '%')
+    {
+      specific[sPosition] = generic[gPosition];
+      gPosition++;  sPosition++;
+    }
+    else
+    {
+      gPosition++;
+      switch(generic[gPosition])
+      {
+				/* print the dimensions */
+				case 'd':	sprintf(tempstring, "-d %d ", Image->Dimc);
+					for(i = 0; i < Image->Dimc; i++)
+					{
+						char numString[10];
+						sprintf(numString, "%d ", Image->Dimv[i]);
+						strcat(tempstring, numString);
+					}
+					break;
+					/* print the image type */
+				case 't':	sprintf(tempstring, "-t %d ", Image->PixelFormat);
+					break;
+					/* print the input file name */
+				case 'i':	strcpy(tempstring, infile);
+					break;
+					/* print the output file name */
+				case 'o':	strcpy(tempstring, outfile);
+					break;
+        default:	break;
+      }
+      for(i = 0; i < (int) strlen(tempstring); i++)
+      {
+        specific[sPosition] = tempstring[i];
+        sPosition++;
+      }
+      gPosition++;
+    }
+  }
+  specific[sPosition] = '\0';
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Opens a new temporary file in IMAGE_TEMPDIR (/usr/tmp by        */
+/*           default) and puts its name in FileName.  Returns the file       */
+/*           descriptor, or -1 if the file could not be created.             */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int OpenTemp(char *FileName)
+{
+	if ((tempDir = getenv("IMAGE_TEMPDIR")) == NULL)
+		tempDir = "/usr/tmp";
+	sprintf(FileName, "%.200s/tempimXXXXXX", tempDir);
+	return(mkstemp(FileName));
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  UCOpen sets up zeroed room for the decompressed pixels of an    */
+/*           image.  Images of up to UCMemory bytes are held in anonymous    */
+/*           memory, larger ones spill to a temporary file.  Where the       */
+/*           system allows, the file is unlinked at once so it goes away     */
+/*           with the process.  UCClose releases either one.                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int UCOpen(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+
+	Image->UCPixels = NULL;
+	Image->UCPixelsFd = -1;
+	Image->UCPixelsFileName[0] = '\0';
+
+	/* Pages of anonymous memory are only backed once they are touched */
+	if (Length <= Image->UCMemory)
+	{
+#if defined(WIN32) || !defined(MAP_ANONYMOUS)
+		Image->UCPixels = (char *)calloc((size_t)(Length > 0 ? Length : 1), 1);
+#else
+		Image->UCPixels = (char *)mmap(NULL, (size_t)(Length > 0 ? Length : 1),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (Image->UCPixels == (char *)MAP_FAILED) Image->UCPixels = NULL;
+#endif
+		if (Image->UCPixels != NULL) return(VALID);
+	}
+
+	/* Otherwise spill to a sparse temporary file */
+	if ((Image->UCPixelsFd = OpenTemp(Image->UCPixelsFileName)) == -1)
+	{
+		Image->UCPixelsFileName[0] = '\0';
+		Error("Could not open temp file");
+	}
+#ifndef WIN32
+	unlink(Image->UCPixelsFileName);
+	Image->UCPixelsFileName[0] = '\0';
+#endif
+	if (ftruncate(Image->UCPixelsFd, Length) != 0)
+	{
+		UCClose(Image);
+		Error("Could not open temp file");
+	}
+	return(VALID);
+}
+
+static void UCClose(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+
+	if (Image->UCPixels != NULL)
+	{
+#if defined(WIN32) || !defined(MAP_ANONYMOUS)
+		free(Image->UCPixels);
+#else
+		munmap(Image->UCPixels, (size_t)(Length > 0 ? Length : 1));
+#endif
+		Image->UCPixels = NULL;
+	}
+	if (Image->UCPixelsFd != -1)
+	{
+		close(Image->UCPixelsFd);
+		Image->UCPixelsFd = -1;
+	}
+	if (Image->UCPixelsFileName[0] != '\0')
+	{
+		unlink(Image->UCPixelsFileName);
+		Image->UCPixelsFileName[0] = '\0';
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  UCLoad copies the pixels of an uncompressed image file into     */
+/*           the room UCOpen set up, and UCSave copies them back.  Pixels    */
+/*           held in memory move in one call, spilled ones a scratch block   */
+/*           at a time.                                                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int UCLoad(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+	IMINDEX Offset;
+	IMINDEX Want;
+	char *Block;
+
+	if (Image->UCPixels != NULL)
+	{
+		if (ReadAt(Image->Fd, Image->UCPixels, Length,
+			(IMINDEX)Image->Address[aPIXELS]) != Length)
+			Error("Uncompressed pixel read failed");
+		return(VALID);
+	}
+
+	if ((Block = GetBlock()) == NULL) Error("Allocation error");
+	for (Offset=0; Offset<Length; Offset+=Want)
+	{
+		Want = Length - Offset;
+		if (Want > BLOCKBYTES) Want = BLOCKBYTES;
+		if (ReadAt(Image->Fd, Block, Want,
+			(IMINDEX)Image->Address[aPIXELS] + Offset) != Want)
+		{
+			PutBlock(Block);
+			Error("Uncompressed pixel read failed");
+		}
+		if (UCWrite(Image, Block, Want, Offset) != Want)
+		{
+			PutBlock(Block);
+			Error("Uncompressed Image pixel write failed");
+		}
+	}
+	PutBlock(Block);
+	return(VALID);
+}
+
+static int UCSave(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+	IMINDEX Offset;
+	IMINDEX Want;
+	char *Block;
+
+	if (Image->UCPixels != NULL)
+	{
+		if (WriteAt(Image->Fd, Image->UCPixels, Length,
+			(IMINDEX)Image->Address[aPIXELS]) != Length)
+			Error("Uncompressed Image pixel write failed");
+		return(VALID);
+	}
+
+	if ((Block = GetBlock()) == NULL) Error("Allocation error");
+	for (Offset=0; Offset<Length; Offset+=Want)
+	{
+		Want = Length - Offset;
+		if (Want > BLOCKBYTES) Want = BLOCKBYTES;
+		if (UCRead(Image, Block, Want, Offset) != Want)
+		{
+			PutBlock(Block);
+			Error("Uncompressed pixel read failed");
+		}
+		if (WriteAt(Image->Fd, Block, Want,
+			(IMINDEX)Image->Address[aPIXELS] + Offset) != Want)
+		{
+			PutBlock(Block);
+			Error("Uncompressed Image pixel write failed");
+		}
+	}
+	PutBlock(Block);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These are the codecs built into the library.  Each one is only  */
+/*           present when the library is compiled with HAVE_ZLIB, HAVE_ZSTD  */
+/*           or HAVE_LZ4 and linked with the matching library.  They work    */
+/*           in memory, so no process or temporary file is involved.         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+#ifdef HAVE_ZLIB
+static IMINDEX ZlibBound(IMINDEX Length)
+{
+	return((IMINDEX)compressBound((uLong)Length));
+}
+
+static IMINDEX ZlibCompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	uLongf Cnt = (uLongf)OutLen;
+
+	(void)Image;
+
+	/* uLong is only 32 bits on some systems */
+	if ((IMINDEX)(uLong)InLen != InLen || (IMINDEX)Cnt != OutLen)
+		return(-1);
+	if (compress2((Bytef *)Out, &Cnt, (const Bytef *)In, (uLong)InLen,
+		Z_DEFAULT_COMPRESSION) != Z_OK) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMINDEX ZlibDecompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	uLongf Cnt = (uLongf)OutLen;
+
+	(void)Image;
+	if ((IMINDEX)(uLong)InLen != InLen || (IMINDEX)Cnt != OutLen)
+		return(-1);
+	if (uncompress((Bytef *)Out, &Cnt, (const Bytef *)In, (uLong)InLen)
+		!= Z_OK) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMCODEC ZlibCodec = { "zlib", ZlibBound, ZlibCompress, ZlibDecompress };
+
+/* These stream the pixels of an image whose decompressed pixels spilled */
+/* to a file, a scratch block at a time.  ZlibDeflateFile returns the    */
+/* compressed length or -1, ZlibInflateFile VALID or INVALID.            */
+static IMINDEX ZlibDeflateFile(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+	IMINDEX Offset = 0;
+	IMINDEX Used = 0;
+	IMINDEX Want;
+	IMINDEX Cnt;
+	z_stream Stream;
+	char *In;
+	char *Out;
+	int Flush;
+	int Status = Z_OK;
+
+	In = GetBlock();
+	Out = GetBlock();
+	memset(&Stream, 0, sizeof(Stream));
+	if (In == NULL || Out == NULL ||
+		deflateInit(&Stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+		if (In != NULL) PutBlock(In);
+		if (Out != NULL) PutBlock(Out);
+		return(-1);
+	}
+	do
+	{
+		Want = Length - Offset;
+		if (Want > BLOCKBYTES) Want = BLOCKBYTES;
+		if (UCRead(Image, In, Want, Offset) != Want) Status = Z_ERRNO;
+		Offset += Want;
+		Flush = (Offset == Length) ? Z_FINISH : Z_NO_FLUSH;
+		Stream.next_in = (Bytef *)In;
+		Stream.avail_in = (uInt)Want;
+
+		/* the output block is drained until deflate leaves room in it */
+		while (Status != Z_ERRNO && Status != Z_STREAM_END)
+		{
+			Stream.next_out = (Bytef *)Out;
+			Stream.avail_out = BLOCKBYTES;
+			Status = deflate(&Stream, Flush);
+			if (Status == Z_STREAM_ERROR) Status = Z_ERRNO;
+			Cnt = BLOCKBYTES - Stream.avail_out;
+			if (Status != Z_ERRNO && WriteAt(Image->Fd, Out, Cnt,
+				(IMINDEX)Image->Address[aPIXELS] + Used) != Cnt) Status = Z_ERRNO;
+			Used += Cnt;
+			if (Stream.avail_out != 0) break;
+		}
+	} while (Status != Z_ERRNO && Status != Z_STREAM_END);
+	deflateEnd(&Stream);
+	PutBlock(In);
+	PutBlock(Out);
+	return(Status == Z_STREAM_END ? Used : -1);
+}
+
+static int ZlibInflateFile(IMAGE *Image)
+{
+	IMINDEX Length = Image->PixelCnt * Image->PixelSize;
+	IMINDEX Packed = Image->Address[aINFO] - Image->Address[aPIXELS];
+	IMINDEX Offset = 0;
+	IMINDEX Used = 0;
+	IMINDEX Want;
+	IMINDEX Cnt;
+	z_stream Stream;
+	char *In;
+	char *Out;
+	int Status = Z_OK;
+
+	In = GetBlock();
+	Out = GetBlock();
+	memset(&Stream, 0, sizeof(Stream));
+	if (In == NULL || Out == NULL || inflateInit(&Stream) != Z_OK)
+	{
+		if (In != NULL) PutBlock(In);
+		if (Out != NULL) PutBlock(Out);
+		return(INVALID);
+	}
+	while (Status == Z_OK)
+	{
+		/* refill the input block once inflate has taken all of it */
+		if (Stream.avail_in == 0)
+		{
+			Want = Packed - Used;
+			if (Want > BLOCKBYTES) Want = BLOCKBYTES;
+			if (Want <= 0 || ReadAt(Image->Fd, In, Want,
+				(IMINDEX)Image->Address[aPIXELS] + Used) != Want) break;
+			Used += Want;
+			Stream.next_in = (Bytef *)In;
+			Stream.avail_in = (uInt)Want;
+		}
+		Stream.next_out = (Bytef *)Out;
+		Stream.avail_out = BLOCKBYTES;
+		Status = inflate(&Stream, Z_NO_FLUSH);
+		if (Status != Z_OK && Status != Z_STREAM_END) break;
+		Cnt = BLOCKBYTES - Stream.avail_out;
+		if (Cnt > Length - Offset ||
+			UCWrite(Image, Out, Cnt, Offset) != Cnt) Status = Z_ERRNO;
+		Offset += Cnt;
+	}
+	inflateEnd(&Stream);
+	PutBlock(In);
+	PutBlock(Out);
+	return(Status == Z_STREAM_END && Offset == Length ? VALID : INVALID);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+#define ZSTDLEVEL	3
+
+static IMINDEX ZstdBound(IMINDEX Length)
+{
+	return((IMINDEX)ZSTD_compressBound((size_t)Length));
+}
+
+static IMINDEX ZstdCompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	size_t Cnt;
+
+	(void)Image;
+	Cnt = ZSTD_compress(Out, (size_t)OutLen, In, (size_t)InLen, ZSTDLEVEL);
+	if (ZSTD_isError(Cnt)) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMINDEX ZstdDecompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	size_t Cnt;
+
+	(void)Image;
+	Cnt = ZSTD_decompress(Out, (size_t)OutLen, In, (size_t)InLen);
+	if (ZSTD_isError(Cnt)) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMCODEC ZstdCodec = { "zstd", ZstdBound, ZstdCompress, ZstdDecompress };
+#endif
+
+#ifdef HAVE_LZ4
+static IMINDEX Lz4Bound(IMINDEX Length)
+{
+	/* LZ4 takes int lengths; a larger input fails to compress */
+	if (Length > LZ4_MAX_INPUT_SIZE) return(Length);
+	return((IMINDEX)LZ4_compressBound((int)Length));
+}
+
+static IMINDEX Lz4Compress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	int Cnt;
+
+	(void)Image;
+	if (InLen > LZ4_MAX_INPUT_SIZE) return(-1);
+	if (OutLen > INT_MAX) OutLen = INT_MAX;
+	Cnt = LZ4_compress_default(In, Out, (int)InLen, (int)OutLen);
+	if (Cnt <= 0) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMINDEX Lz4Decompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	int Cnt;
+
+	(void)Image;
+	if (InLen > INT_MAX) return(-1);
+	if (OutLen > INT_MAX) OutLen = INT_MAX;
+	Cnt = LZ4_decompress_safe(In, Out, (int)InLen, (int)OutLen);
+	if (Cnt < 0) return(-1);
+	return((IMINDEX)Cnt);
+}
+
+static IMCODEC Lz4Codec = { "lz4", Lz4Bound, Lz4Compress, Lz4Decompress };
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This is the legacy codec.  It runs the commands of the          */
+/*           compression config file through popen, passing the pixels in a  */
+/*           temporary file.  Output that would not fit is an error rather   */
+/*           than being cut short.                                           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+#ifdef COMPRESSION_TYPE_FILE
+static IMINDEX LegacyBound(IMINDEX Length)
+{
+	return(Length + Length / 8 + 4096);
+}
+
+static IMINDEX LegacyCompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	char commandString[256];
+	char FileName[256];
+	FILE *pfp;
+	IMINDEX Cnt;
+	int Fd;
+
+	/* the command reads the pixels from a file */
+	if ((Fd = OpenTemp(FileName)) == -1) return(-1);
+	Cnt = WriteAt(Fd, In, InLen, (IMINDEX)0);
+	close(Fd);
+	if (Cnt != InLen)
+	{
+		unlink(FileName);
+		return(-1);
+	}
+
+	/* read the compressed data from the pipe to the compression program */
+	fillInCompressionCommand(commandString,
+		compressionMethods[Image->CompressionMethod].compressionCommand,
+		FileName, "", Image);
+	if ((pfp = popen(commandString, "r")) == NULL)
+	{
+		unlink(FileName);
+		return(-1);
+	}
+	Cnt = (IMINDEX)fread(Out, sizeof(char), (size_t)OutLen, pfp);
+	if (Cnt == OutLen && fgetc(pfp) != EOF) Cnt = -1;
+	pclose(pfp);
+	unlink(FileName);
+	return(Cnt);
+}
+
+static IMINDEX LegacyDecompress(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen)
+{
+	char commandString[256];
+	char FileName[256];
+	FILE *pfp;
+	IMINDEX Cnt;
+	int Fd;
+
+	/* the command writes the pixels to a file */
+	if ((Fd = OpenTemp(FileName)) == -1) return(-1);
+	fillInCompressionCommand(commandString,
+		compressionMethods[Image->CompressionMethod].decompressionCommand,
+		"", FileName, Image);
+	if ((pfp = popen(commandString, "w")) == NULL)
+		Cnt = -1;
+	else
+	{
+		Cnt = (IMINDEX)fwrite(In, sizeof(char), (size_t)InLen, pfp);
+		pclose(pfp);
+		if (Cnt != InLen || lseek(Fd, (IMINDEX)0, FROMEND) > OutLen)
+			Cnt = -1;
+		else
+			Cnt = ReadAt(Fd, Out, OutLen, (IMINDEX)0);
+	}
+	close(Fd);
+	unlink(FileName);
+	return(Cnt);
+}
+
+static IMCODEC LegacyCodecs[MAX_NUM_COMP_METHODS];
+#ifndef WIN32
+static pthread_once_t LegacyReady = PTHREAD_ONCE_INIT;
+#else
+static int LegacyReady = FALSE;
+#endif
+
+static void RegisterLegacy(void)
+{
+	int Method;
+
+	if (haveNotReadCompressionConfigFile &&
+		readCompressionConfigFile() == INVALID) return;
+	for (Method=0; Method<NumberOfCompressionMethods; Method++)
+	{
+		LegacyCodecs[Method].Name = compressionMethods[Method].methodName;
+		LegacyCodecs[Method].Bound = LegacyBound;
+		LegacyCodecs[Method].Compress = LegacyCompress;
+		LegacyCodecs[Method].Decompress = LegacyDecompress;
+	}
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This is the codec registry, indexed by the compression method   */
+/*           stored in the image header.  GetCodec returns the codec of a    */
+/*           method, or NULL if none is available.  A registered codec       */
+/*           takes precedence over a command of the compression config file. */
+/*           The built in codecs are registered once, by the first caller,   */
+/*           which may be any of the pool workers, and the config file is    */
+/*           read once, the first time a method is not registered.           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMCODEC *Codecs[MAX_NUM_CODECS];
+#ifndef WIN32
+static pthread_once_t CodecsReady = PTHREAD_ONCE_INIT;
+#else
+static int CodecsReady = FALSE;
+#endif
+
+static void RegisterCodecs(void)
+{
+#ifdef HAVE_ZLIB
+	if (Codecs[CODEC_ZLIB] == NULL) Codecs[CODEC_ZLIB] = &ZlibCodec;
+#endif
+#ifdef HAVE_ZSTD
+	if (Codecs[CODEC_ZSTD] == NULL) Codecs[CODEC_ZSTD] = &ZstdCodec;
+#endif
+#ifdef HAVE_LZ4
+	if (Codecs[CODEC_LZ4] == NULL) Codecs[CODEC_LZ4] = &Lz4Codec;
+#endif
+}
+
+static void ReadyCodecs(void)
+{
+#ifndef WIN32
+	pthread_once(&CodecsReady, RegisterCodecs);
+#else
+	if (!CodecsReady)
+	{
+		RegisterCodecs();
+		CodecsReady = TRUE;
+	}
+#endif
+}
+
+static IMCODEC *GetCodec(int Method)
+{
+	if ((Method < 0) || (Method >= MAX_NUM_CODECS)) return(NULL);
+
+	/* Register the built in codecs the first time */
+	ReadyCodecs();
+	if (Codecs[Method] != NULL) return(Codecs[Method]);
+
+#ifdef COMPRESSION_TYPE_FILE
+	/* Fall back on the commands of the config file */
+	if (Method < MAX_NUM_COMP_METHODS)
+	{
+#ifndef WIN32
+		pthread_once(&LegacyReady, RegisterLegacy);
+#else
+		if (!LegacyReady)
+		{
+			RegisterLegacy();
+			LegacyReady = TRUE;
+		}
+#endif
+		if (LegacyCodecs[Method].Name != NULL) return(&LegacyCodecs[Method]);
+	}
+#endif
+	return(NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine registers Codec as compression method Method, or   */
+/*           removes the codec of that method if Codec is NULL.  Methods     */
+/*           CODEC_ZLIB, CODEC_ZSTD and CODEC_LZ4 are registered by default  */
+/*           when the library is built with them.  Images compressed with a  */
+/*           method can only be read where the same codec is registered.     */
+/*           Chunked images call a codec from several threads at once, so    */
+/*           its routines must not share state between calls.                */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imsetcodec(int Method, IMCODEC *Codec)
+{
+	/* Check parameters */
+	if ((Method < 0) || (Method >= MAX_NUM_CODECS))
+		Error("Invalid compression method");
+	if ((Codec != NULL) && ((Codec->Name == NULL) || (Codec->Bound == NULL) ||
+		(Codec->Compress == NULL) || (Codec->Decompress == NULL)))
+		Error("Incomplete codec");
+
+	/* Settle the built in codecs first so they do not replace this one */
+	ReadyCodecs();
+	Codecs[Method] = Codec;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Sets the compression method of an image from Setting, the       */
+/*           value of IMAGE_COMPRESS.  This is a method number or a codec    */
+/*           name, such as "zlib".  If the method is not available, method   */
+/*           0 is used instead.  Returns INVALID if neither is available.    */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int PickCodec(IMAGE *Image, char *Setting)
+{
+	IMCODEC *Codec;
+	char message[256];
+	int Method;
+
+	if (sscanf(Setting, "%d", &Method) != 1)
+	{
+		/* Look the codec up by name, registered ones first, so that */
+		/* the config file is only read for its own methods           */
+		ReadyCodecs();
+		for (Method=0; Method<MAX_NUM_CODECS; Method++)
+			if (Codecs[Method] != NULL &&
+				strcasecmp(Codecs[Method]->Name, Setting) == 0) break;
+		if (Method == MAX_NUM_CODECS)
+		{
+			for (Method=0; Method<MAX_NUM_COMP_METHODS; Method++)
+				if ((Codec = GetCodec(Method)) != NULL &&
+					strcasecmp(Codec->Name, Setting) == 0) break;
+			if (Method == MAX_NUM_COMP_METHODS) Method = -1;
+		}
+	}
+	if (GetCodec(Method) == NULL)
+	{
+		sprintf(message, "Compression method %.64s not available, defaulting to method 0",
+			Setting);
+		Warn(message);
+		Method = 0;
+		if (GetCodec(Method) == NULL) return(INVALID);
+	}
+	Image->CompressionMethod = Method;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Returns the name of a compression method for the "Pixel         */
+/*           Compression Method" info field.                                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static char *CodecName(int Method)
+{
+	IMCODEC *Codec;
+
+	if ((Codec = GetCodec(Method)) == NULL) return("unknown");
+	return(Codec->Name);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines handle the chunked layout of compressed pixels.  */
+/*           Each slice of the last two dimensions (the whole image for 1D)  */
+/*           is split into chunks of whole rows, about CHUNKBYTES each, that */
+/*           are compressed independently.  The pixel field starts with a    */
+/*           table of IMINDEX values: the slice and chunk sizes, the chunk   */
+/*           count and the ChunkCnt+1 chunk offsets from the first of them.  */
+/*           Chunks are decompressed (see UCOpen) as they are first          */
+/*           touched, and only changed chunks are compressed again.          */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void ChunkSpan(IMAGE *Image, IMINDEX Chunk, IMINDEX *Start,
+	IMINDEX *Length)
+{
+	IMINDEX Parts;
+	IMINDEX Part;
+
+	Parts = (Image->ChunkSlice + Image->ChunkBytes - 1) / Image->ChunkBytes;
+	Part = Chunk % Parts;
+	*Start = (Chunk / Parts) * Image->ChunkSlice + Part * Image->ChunkBytes;
+	*Length = Image->ChunkSlice - Part * Image->ChunkBytes;
+	if (*Length > Image->ChunkBytes) *Length = Image->ChunkBytes;
+}
+
+static IMINDEX ChunkOf(IMAGE *Image, IMINDEX Offset)
+{
+	IMINDEX Parts;
+
+	Parts = (Image->ChunkSlice + Image->ChunkBytes - 1) / Image->ChunkBytes;
+	return((Offset / Image->ChunkSlice) * Parts +
+		(Offset % Image->ChunkSlice) / Image->ChunkBytes);
+}
+
+static void FreeChunks(IMAGE *Image)
+{
+	if (!Image->Compressed || !Image->Chunked) return;
+	if (Image->ChunkTable != NULL) free(Image->ChunkTable);
+	if (Image->ChunkState != NULL) free(Image->ChunkState);
+	Image->ChunkTable = NULL;
+	Image->ChunkState = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Returns the prefilter for the chunks of an image about to be    */
+/*           compressed.  IMAGE_PREFILTER holds the PREFILTER_ flags as a    */
+/*           number, or the names "delta" and "shuffle" (for example         */
+/*           "delta+shuffle").  Only GREY and SHORT pixels are filtered.     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int PickPrefilter(IMAGE *Image)
+{
+	char *envVar;
+	int Filter = 0;
+
+	if ((envVar = getenv("IMAGE_PREFILTER")) == NULL) return(0);
+	if (Image->PixelFormat != GREY && Image->PixelFormat != SHORT) return(0);
+	if (sscanf(envVar, "%d", &Filter) != 1)
+	{
+		Filter = 0;
+		if (strstr(envVar, "delta") != NULL) Filter |= PREFILTER_DELTA;
+		if (strstr(envVar, "shuffle") != NULL) Filter |= PREFILTER_SHUFFLE;
+	}
+	return(Filter & (PREFILTER_DELTA | PREFILTER_SHUFFLE));
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Applies (Undo FALSE) or reverses (Undo TRUE) the prefilter of   */
+/*           Bytes of a chunk, from In to Out.                               */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void FilterChunk(IMAGE *Image, const char *In, char *Out,
+	IMINDEX Bytes, int Undo)
+{
+	IMINDEX nWord = Bytes / 2;
+
+	if (Image->SwapNeeded && Undo)
+		DecodeRange(In, Out, 0, nWord, nWord, Image->Prefilter, TRUE);
+	else if (Image->SwapNeeded)
+		EncodeRange(In, Out, 0, nWord, nWord, Image->Prefilter, TRUE);
+	else if (Undo)
+		(*_imdecodefunc)(In, Out, nWord, Image->Prefilter);
+	else
+		(*_imencodefunc)(In, Out, nWord, Image->Prefilter);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Lays out the chunks of an image that is about to be compressed  */
+/*           from its uncompressed pixels, and picks their prefilter.  Every */
+/*           chunk counts as decompressed and changed.  Config file methods  */
+/*           keep the single stream layout, since each chunk would cost them */
+/*           a process.                                                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int NewChunks(IMAGE *Image)
+{
+	IMCODEC *Codec;
+	IMINDEX RowBytes;
+	IMINDEX SliceRows;
+	IMINDEX Rows;
+	IMINDEX Parts;
+
+	Image->Chunked = FALSE;
+	Image->Prefilter = 0;
+	Image->ChunkTable = NULL;
+	Image->ChunkState = NULL;
+	if ((Codec = GetCodec(Image->CompressionMethod)) == NULL) return(INVALID);
+#ifdef COMPRESSION_TYPE_FILE
+	if (Codec->Compress == LegacyCompress) return(VALID);
+#endif
+
+	/* Split each slice into about equal runs of rows */
+	if (Image->Dimc >= 2)
+	{
+		RowBytes = (IMINDEX)Image->Dimv[Image->Dimc-1] * Image->PixelSize;
+		SliceRows = Image->Dimv[Image->Dimc-2];
+	}
+	else
+	{
+		RowBytes = Image->PixelSize;
+		SliceRows = Image->PixelCnt;
+	}
+	Rows = CHUNKBYTES / RowBytes;
+	if (Rows < 1) Rows = 1;
+	if (Rows > SliceRows) Rows = SliceRows;
+	Parts = (SliceRows + Rows - 1) / Rows;
+	Rows = (SliceRows + Parts - 1) / Parts;
+	Image->ChunkSlice = RowBytes * SliceRows;
+	Image->ChunkBytes = RowBytes * Rows;
+	Image->ChunkCnt = Image->PixelCnt * Image->PixelSize / Image->ChunkSlice
+		* Parts;
+
+	Image->ChunkState = (char *)malloc((size_t)Image->ChunkCnt);
+	if (Image->ChunkState == NULL) Error("Allocation error");
+	memset(Image->ChunkState, CHUNKLOADED | CHUNKDIRTY, (size_t)Image->ChunkCnt);
+	Image->Chunked = TRUE;
+	Image->Prefilter = PickPrefilter(Image);
+	Image->Address[aVERNO] |= CHUNKED | Image->Prefilter * PREFILTERED;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Reads the chunk table of a chunked image and checks it.  No     */
+/*           chunk is decompressed yet.                                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int LoadChunkTable(IMAGE *Image)
+{
+	IMINDEX Head[3];
+	IMINDEX Total;
+	IMINDEX Parts;
+	IMINDEX Length;
+	IMINDEX i;
+
+	if (ReadAt(Image->Fd, (char *)Head, sizeof(Head),
+		(IMINDEX)Image->Address[aPIXELS]) != sizeof(Head))
+		Error("Compressed pixel read failed");
+	if (Image->SwapNeeded) Swap((char *)Head, sizeof(Head), INT64);
+
+	/* The sizes must describe this image */
+	Total = Image->PixelCnt * Image->PixelSize;
+	if (Head[0] <= 0 || Head[1] <= 0 || Head[1] > Head[0] ||
+		Total % Head[0] != 0) Error("Invalid chunk table");
+	Parts = (Head[0] + Head[1] - 1) / Head[1];
+	if (Head[2] != Total / Head[0] * Parts) Error("Invalid chunk table");
+	Image->ChunkSlice = Head[0];
+	Image->ChunkBytes = Head[1];
+	Image->ChunkCnt = Head[2];
+
+	/* Read the offsets, which must climb within the pixel field */
+	Length = (Image->ChunkCnt + 1) * sizeof(IMINDEX);
+	Image->ChunkTable = (IMINDEX *)malloc((size_t)Length);
+	Image->ChunkState = (char *)calloc((size_t)Image->ChunkCnt, 1);
+	if (Image->ChunkTable == NULL || Image->ChunkState == NULL)
+	{
+		FreeChunks(Image);
+		Error("Allocation error");
+	}
+	if (ReadAt(Image->Fd, (char *)Image->ChunkTable, Length,
+		(IMINDEX)Image->Address[aPIXELS] + sizeof(Head)) != Length)
+	{
+		FreeChunks(Image);
+		Error("Compressed pixel read failed");
+	}
+	if (Image->SwapNeeded) Swap((char *)Image->ChunkTable, Length, INT64);
+	for (i=0; i<Image->ChunkCnt; i++)
+		if (Image->ChunkTable[i] < 0 ||
+			Image->ChunkTable[i] > Image->ChunkTable[i+1]) break;
+	if (i < Image->ChunkCnt ||
+		Image->ChunkTable[0] < Length + (IMINDEX)sizeof(Head) ||
+		Image->ChunkTable[Image->ChunkCnt] >
+		Image->Address[aINFO] - Image->Address[aPIXELS])
+	{
+		FreeChunks(Image);
+		Error("Invalid chunk table");
+	}
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Decompresses one chunk into the uncompressed pixels.  Pixels    */
+/*           held in memory are decompressed in place, otherwise Buffer      */
+/*           takes them on the way to the temp file.  A prefiltered chunk    */
+/*           is decompressed into the second half of Buffer first, which     */
+/*           then holds 2 ChunkBytes.                                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int ReadChunk(IMAGE *Image, IMCODEC *Codec, IMINDEX Chunk,
+	char *Buffer)
+{
+	char *Packed;
+	char *Target;
+	char *Raw;
+	IMINDEX Start;
+	IMINDEX Bytes;
+	IMINDEX Cnt;
+
+	/* Read the compressed chunk */
+	Cnt = Image->ChunkTable[Chunk+1] - Image->ChunkTable[Chunk];
+	if ((Packed = (char *)malloc((size_t)(Cnt > 0 ? Cnt : 1))) == NULL)
+		Error("Allocation error");
+	if (ReadAt(Image->Fd, Packed, Cnt, (IMINDEX)Image->Address[aPIXELS]
+		+ Image->ChunkTable[Chunk]) != Cnt)
+	{
+		free(Packed);
+		Error("Compressed pixel read failed");
+	}
+
+	/* Decompress it into place */
+	ChunkSpan(Image, Chunk, &Start, &Bytes);
+	Target = (Image->UCPixels != NULL) ? Image->UCPixels + Start : Buffer;
+	Raw = Image->Prefilter ? Buffer + Image->ChunkBytes : Target;
+	if (Codec->Decompress(Image, Packed, Cnt, Raw, Bytes) != Bytes)
+	{
+		free(Packed);
+		Error("Image decompression failed");
+	}
+	free(Packed);
+	if (Raw != Target) FilterChunk(Image, Raw, Target, Bytes, TRUE);
+	if (Target == Buffer && UCWrite(Image, Buffer, Bytes, Start) != Bytes)
+		Error("Uncompressed Image pixel write failed");
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Makes sure the chunks holding Length pixel bytes from Offset    */
+/*           are decompressed.  When Write is set they are marked changed,   */
+/*           and a chunk that is wholly overwritten is not decompressed      */
+/*           first.  Several threads may load chunks at once; a chunk being  */
+/*           decompressed by one is waited for by the others.                */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int LoadChunks(IMAGE *Image, IMINDEX Offset, IMINDEX Length, int Write)
+{
+	IMCODEC *Codec;
+	char *Buffer = NULL;
+	IMINDEX Chunk;
+	IMINDEX Last;
+	IMINDEX Start;
+	IMINDEX Bytes;
+	int Status = VALID;
+
+	if (Length <= 0) return(VALID);
+	if (Image->ChunkState == NULL) Error("Compressed pixels not loaded");
+	if ((Codec = GetCodec(Image->CompressionMethod)) == NULL)
+		Error("Compression method not available");
+
+	Last = ChunkOf(Image, Offset + Length - 1);
+#ifndef WIN32
+	pthread_mutex_lock(&_imchunklock);
+#endif
+	for (Chunk=ChunkOf(Image, Offset); Chunk<=Last && Status==VALID; Chunk++)
+	{
+#ifndef WIN32
+		while (Image->ChunkState[Chunk] & CHUNKBUSY)
+			pthread_cond_wait(&_imchunkdone, &_imchunklock);
+#endif
+		if (!(Image->ChunkState[Chunk] & CHUNKLOADED))
+		{
+			ChunkSpan(Image, Chunk, &Start, &Bytes);
+			if (!Write || Start < Offset || Start + Bytes > Offset + Length)
+			{
+				if (Buffer == NULL &&
+					(Image->UCPixels == NULL || Image->Prefilter) &&
+					(Buffer = (char *)malloc((size_t)Image->ChunkBytes
+					* (Image->Prefilter ? 2 : 1))) == NULL)
+				{
+					strcpy(_imerrbuf, "Allocation error");
+					Status = INVALID;
+					break;
+				}
+
+				/* Decompress without holding up other chunks */
+				Image->ChunkState[Chunk] |= CHUNKBUSY;
+#ifndef WIN32
+				pthread_mutex_unlock(&_imchunklock);
+#endif
+				Status = ReadChunk(Image, Codec, Chunk, Buffer);
+#ifndef WIN32
+				pthread_mutex_lock(&_imchunklock);
+				pthread_cond_broadcast(&_imchunkdone);
+#endif
+				Image->ChunkState[Chunk] &= ~CHUNKBUSY;
+			}
+			if (Status == VALID) Image->ChunkState[Chunk] |= CHUNKLOADED;
+		}
+		if (Status == VALID && Write) Image->ChunkState[Chunk] |= CHUNKDIRTY;
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&_imchunklock);
+#endif
+	if (Buffer != NULL) free(Buffer);
+	return(Status);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These are the worker pool jobs of the chunk codecs.  LoadTask   */
+/*           decompresses chunks [First, Last) and CompressTask compresses   */
+/*           the changed ones among them into its own buffer, copying the    */
+/*           others, and records each chunk's length.                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void CodecTaskDone(CODECTASK *Task)
+{
+#ifndef WIN32
+	pthread_mutex_lock(Task->Lock);
+	if (--*Task->Pending == 0) pthread_cond_signal(Task->Finished);
+	pthread_mutex_unlock(Task->Lock);
+#endif
+}
+
+static void LoadTask(void *Arg)
+{
+	CODECTASK *Task = (CODECTASK *)Arg;
+	IMINDEX Start;
+	IMINDEX End;
+	IMINDEX Bytes;
+
+	/* The last chunk of a slice may be shorter than the first */
+	ChunkSpan(Task->Image, Task->First, &Start, &Bytes);
+	ChunkSpan(Task->Image, Task->Last - 1, &End, &Bytes);
+	Task->Status = LoadChunks(Task->Image, Start, End + Bytes - Start, FALSE);
+	CodecTaskDone(Task);
+}
+
+static void CompressTask(void *Arg)
+{
+	CODECTASK *Task = (CODECTASK *)Arg;
+	IMAGE *Image = Task->Image;
+	char *Buffer;
+	char *Source;
+	char *Grown;
+	IMINDEX Size = 0;
+	IMINDEX Need;
+	IMINDEX Chunk;
+	IMINDEX Start;
+	IMINDEX Bytes;
+	IMINDEX Cnt = -1;
+
+	Task->Status = INVALID;
+	Task->Used = 0;
+	Buffer = (char *)malloc((size_t)Image->ChunkBytes *
+		(Image->Prefilter ? 2 : 1));
+	for (Chunk=Task->First; Chunk<Task->Last && Buffer!=NULL; Chunk++)
+	{
+		/* Make room for the worst case */
+		ChunkSpan(Image, Chunk, &Start, &Bytes);
+		Need = Task->Codec->Bound(Bytes);
+		if (!(Image->ChunkState[Chunk] & CHUNKDIRTY) &&
+			Image->ChunkTable[Chunk+1] - Image->ChunkTable[Chunk] > Need)
+			Need = Image->ChunkTable[Chunk+1] - Image->ChunkTable[Chunk];
+		if (Task->Used + Need > Size)
+		{
+			Size = 2 * Size > Task->Used + Need ? 2 * Size : Task->Used + Need;
+			if ((Grown = (char *)realloc(Task->Packed, (size_t)Size)) == NULL)
+				break;
+			Task->Packed = Grown;
+		}
+
+		/* Compress a changed chunk, prefiltered into the second half of */
+		/* Buffer if need be, and copy the others */
+		if (Image->ChunkState[Chunk] & CHUNKDIRTY)
+		{
+			Source = (Image->UCPixels != NULL) ? Image->UCPixels + Start : Buffer;
+			if (Source == Buffer && UCRead(Image, Buffer, Bytes, Start) != Bytes)
+				break;
+			if (Image->Prefilter)
+			{
+				FilterChunk(Image, Source, Buffer + Image->ChunkBytes, Bytes, FALSE);
+				Source = Buffer + Image->ChunkBytes;
+			}
+			Cnt = Task->Codec->Compress(Image, Source, Bytes,
+				Task->Packed + Task->Used, Size - Task->Used);
+		}
+		else
+		{
+			Cnt = Image->ChunkTable[Chunk+1] - Image->ChunkTable[Chunk];
+			if (ReadAt(Image->Fd, Task->Packed + Task->Used, Cnt,
+				(IMINDEX)Image->Address[aPIXELS] + Image->ChunkTable[Chunk])
+				!= Cnt) break;
+		}
+		if (Cnt < 0) break;
+		Task->Lengths[Chunk] = Cnt;
+		Task->Used += Cnt;
+	}
+	if (Chunk == Task->Last) Task->Status = VALID;
+	if (Buffer != NULL) free(Buffer);
+	CodecTaskDone(Task);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Splits ChunkCnt chunks from First into tasks and runs Func on   */
+/*           each, on the worker pool where there is one.  Lengths is where  */
+/*           CompressTask records the chunk lengths.  The tasks are returned */
+/*           for their results, or NULL if memory ran out.                   */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static CODECTASK *RunCodecTasks(IMAGE *Image, IMCODEC *Codec, IMINDEX First,
+	IMINDEX ChunkCnt, IMINDEX *Lengths, void (*Func)(void *), int *TaskCnt)
+{
+	CODECTASK *Tasks;
+	int i;
+#ifndef WIN32
+	pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t Finished = PTHREAD_COND_INITIALIZER;
+	int Pending;
+
+	/* A few tasks per worker even out chunks that compress unevenly */
+	*TaskCnt = 4 * PoolSize();
+#else
+	*TaskCnt = 1;
+#endif
+	if (*TaskCnt < 1) *TaskCnt = 1;
+	if (*TaskCnt > ChunkCnt) *TaskCnt = (int)ChunkCnt;
+	Tasks = (CODECTASK *)calloc(*TaskCnt, sizeof(CODECTASK));
+	if (Tasks == NULL) return(NULL);
+	for (i=0; i<*TaskCnt; i++)
+	{
+		Tasks[i].Image = Image;
+		Tasks[i].Codec = Codec;
+		Tasks[i].Lengths = Lengths;
+		Tasks[i].First = First + ChunkCnt * i / *TaskCnt;
+		Tasks[i].Last = First + ChunkCnt * (i+1) / *TaskCnt;
+	}
+
+#ifndef WIN32
+	Pending = *TaskCnt;
+	for (i=0; i<*TaskCnt; i++)
+	{
+		Tasks[i].Pending = &Pending;
+		Tasks[i].Lock = &Lock;
+		Tasks[i].Finished = &Finished;
+		Tasks[i].Job.Func = Func;
+		Tasks[i].Job.Arg = &Tasks[i];
+	}
+	for (i=0; i<*TaskCnt; i++)
+		if (*TaskCnt == 1 || PoolSubmit(&Tasks[i].Job) == INVALID)
+			Func(&Tasks[i]);
+	pthread_mutex_lock(&Lock);
+	while (Pending > 0)
+		pthread_cond_wait(&Finished, &Lock);
+	pthread_mutex_unlock(&Lock);
+#else
+	Func(&Tasks[0]);
+#endif
+	return(Tasks);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Decompresses the chunks holding Length pixel bytes from Offset  */
+/*           in parallel, for a large read.  Called from a worker pool job,  */
+/*           it decompresses them serially (see PoolSize).                   */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int LoadChunksParallel(IMAGE *Image, IMINDEX Offset, IMINDEX Length)
+{
+	CODECTASK *Tasks;
+	IMINDEX First;
+	IMINDEX Last;
+	int TaskCnt;
+	int Status;
+	int i;
+
+	if (Length <= 0) return(VALID);
+	if (Image->ChunkState == NULL) Error("Compressed pixels not loaded");
+	First = ChunkOf(Image, Offset);
+	Last = ChunkOf(Image, Offset + Length - 1);
+	if (Last == First) return(LoadChunks(Image, Offset, Length, FALSE));
+
+	Tasks = RunCodecTasks(Image, NULL, First, Last - First + 1, NULL,
+		LoadTask, &TaskCnt);
+	if (Tasks == NULL) Error("Allocation error");
+	Status = VALID;
+	for (i=0; i<TaskCnt; i++)
+		if (Tasks[i].Status == INVALID) Status = INVALID;
+	free(Tasks);
+	return(Status);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Compresses the changed chunks of a chunked image and writes the */
+/*           pixel field again.  The chunks are shared out over the worker   */
+/*           pool; the others are copied as they are.                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int CompressChunks(IMAGE *Image, IMCODEC *Codec)
+{
+	CODECTASK *Tasks;
+	IMINDEX Head[3];
+	IMINDEX *Table;
+	char *Packed;
+	IMINDEX HeadLen;
+	IMINDEX Used;
+	IMINDEX Chunk;
+	IMINDEX Cnt;
+	int Status;
+	int TaskCnt;
+	int i;
+
+	/* The table holds the chunk lengths until it is filled in */
+	HeadLen = sizeof(Head) + (Image->ChunkCnt + 1) * sizeof(IMINDEX);
+	Packed = (char *)malloc((size_t)HeadLen);
+	Table = (IMINDEX *)malloc((size_t)(Image->ChunkCnt + 1) * sizeof(IMINDEX));
+	if (Packed == NULL || Table == NULL)
+	{
+		if (Packed != NULL) free(Packed);
+		if (Table != NULL) free(Table);
+		Error("Allocation error");
+	}
+	Tasks = RunCodecTasks(Image, Codec, 0, Image->ChunkCnt, Table,
+		CompressTask, &TaskCnt);
+	if (Tasks == NULL)
+	{
+		free(Packed);
+		free(Table);
+		Error("Allocation error");
+	}
+	Status = VALID;
+	for (i=0; i<TaskCnt; i++)
+		if (Tasks[i].Status == INVALID) Status = INVALID;
+
+	/* Turn the lengths into offsets */
+	Used = HeadLen;
+	for (Chunk=0; Chunk<Image->ChunkCnt && Status==VALID; Chunk++)
+	{
+		Cnt = Table[Chunk];
+		Table[Chunk] = Used;
+		Used += Cnt;
+	}
+	Table[Image->ChunkCnt] = Used;
+
+	/* Write the table in file byte order, then each task's chunks */
+	if (Status == VALID)
+	{
+		Head[0] = Image->ChunkSlice;
+		Head[1] = Image->ChunkBytes;
+		Head[2] = Image->ChunkCnt;
+		memcpy(Packed, Head, sizeof(Head));
+		memcpy(Packed + sizeof(Head), Table,
+			(size_t)(Image->ChunkCnt + 1) * sizeof(IMINDEX));
+		if (Image->SwapNeeded) Swap(Packed, HeadLen, INT64);
+		Used = (IMINDEX)Image->Address[aPIXELS];
+		if (WriteAt(Image->Fd, Packed, HeadLen, Used) != HeadLen)
+			Status = INVALID;
+		Used += HeadLen;
+		for (i=0; i<TaskCnt && Status==VALID; i++)
+		{
+			if (WriteAt(Image->Fd, Tasks[i].Packed, Tasks[i].Used, Used)
+				!= Tasks[i].Used) Status = INVALID;
+			Used += Tasks[i].Used;
+		}
+	}
+	for (i=0; i<TaskCnt; i++)
+		if (Tasks[i].Packed != NULL) free(Tasks[i].Packed);
+	free(Tasks);
+	free(Packed);
+	if (Status == INVALID)
+	{
+		free(Table);
+		Error("Image compression failed");
+	}
+
+	/* The new table becomes current */
+	if (Image->ChunkTable != NULL) free(Image->ChunkTable);
+	Image->ChunkTable = Table;
+	for (Chunk=0; Chunk<Image->ChunkCnt; Chunk++)
+		Image->ChunkState[Chunk] &= ~CHUNKDIRTY;
+	Image->Address[aINFO] = Used;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Compresses the pixel data and updates the addresses.            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int compressImage (IMAGE *Image)
+{
+  IMCODEC *Codec;
+  char *Buffer;
+  char *Packed;
+  IMINDEX Length;
+  IMINDEX compressedLength;
+  IMINDEX Cnt;
+
+  if ((Codec = GetCodec(Image->CompressionMethod)) == NULL)
+    Error("Compression method not available");
+  if (Image->Chunked) return(CompressChunks(Image, Codec));
+
+  /* read the uncompressed pixels, unless they are in memory already */
+  Length = Image->PixelCnt * Image->PixelSize;
+#ifdef HAVE_ZLIB
+  if (Image->UCPixels == NULL && Codec == &ZlibCodec)
+  {
+    /* zlib streams spilled pixels straight into the image file */
+    if ((compressedLength = ZlibDeflateFile(Image)) < 0)
+      Error("Image compression failed");
+    Image->Address[aINFO] = Image->Address[aPIXELS] + compressedLength;
+    return 0;
+  }
+#endif
+  if ((Buffer = Image->UCPixels) == NULL)
+  {
+    Buffer = (char*)malloc((size_t)Length);
+    if (Buffer == NULL) Error("Allocation error");
+    Cnt = UCRead(Image, Buffer, Length, (IMINDEX)0);
+    if (Cnt != Length)
+    {
+      free(Buffer);
+      Error("Uncompressed pixel read failed");
+    }
+  }
+
+  /* compress them in memory */
+  Packed = (char*)malloc((size_t)Codec->Bound(Length));
+  if (Packed == NULL)
+  {
+    if (Buffer != Image->UCPixels) free(Buffer);
+    Error("Allocation error");
+  }
+  compressedLength = Codec->Compress(Image, Buffer, Length, Packed,
+    Codec->Bound(Length));
+  if (Buffer != Image->UCPixels) free(Buffer);
+  if (compressedLength < 0)
+  {
+    free(Packed);
+    Error("Image compression failed");
+  }
+
+  /* Write compressed pixels into image file */
+  Cnt = WriteAt(Image->Fd, Packed, compressedLength,
+    (IMINDEX)Image->Address[aPIXELS]);
+  free(Packed);
+  if (Cnt != compressedLength) Error("Image pixel write failed");
+
+  /* update the pointers (offsets) */
+  Image->Address[aINFO] = Image->Address[aPIXELS] + compressedLength;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Uncompresses the pixel data                                     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int decompressImage (IMAGE *Image)
+{
+  IMCODEC *Codec;
+  char *Buffer;
+  char *Packed;
+  IMINDEX Length;
+  IMINDEX compressedLength;
+  IMINDEX Cnt;
+
+  if(Image->PixelsAccessed == TRUE)
+    return (VALID);
+
+  if ((Codec = GetCodec(Image->CompressionMethod)) == NULL)
+    Error("Compression method not available");
+
+  /* chunks are decompressed as they are touched (see LoadChunks) */
+  Length = Image->PixelCnt * Image->PixelSize;
+  if (Image->Chunked)
+  {
+    if (LoadChunkTable(Image) == INVALID) return(INVALID);
+    if (UCOpen(Image) == INVALID)
+    {
+      FreeChunks(Image);
+      return(INVALID);
+    }
+    Image->PixelsAccessed = TRUE;
+    return (VALID);
+  }
+
+  if (UCOpen(Image) == INVALID) return(INVALID);
+#ifdef HAVE_ZLIB
+  if (Image->UCPixels == NULL && Codec == &ZlibCodec)
+  {
+    /* zlib streams the compressed data straight into the spilled pixels */
+    if (ZlibInflateFile(Image) == INVALID)
+    {
+      UCClose(Image);
+      Error("Image decompression failed");
+    }
+    Image->PixelsAccessed = TRUE;
+    return (VALID);
+  }
+#endif
+
+  /* read the compressed data from the image file */
+  compressedLength = (Image->Address[aINFO] - Image->Address[aPIXELS]);
+  Packed = (char*)malloc((size_t)compressedLength);
+  if (Packed == NULL)
+  {
+    UCClose(Image);
+    Error("Allocation error");
+  }
+  Cnt = ReadAt(Image->Fd, Packed, compressedLength,
+    (IMINDEX)Image->Address[aPIXELS]);
+  if (Cnt != compressedLength)
+  {
+    free(Packed);
+    UCClose(Image);
+    Error("Compressed pixel read failed");
+  }
+
+  /* decompress it straight into the uncompressed pixels when they are */
+  /* held in memory, through a buffer when they spill to a file */
+  if ((Buffer = Image->UCPixels) == NULL &&
+    (Buffer = (char*)malloc((size_t)Length)) == NULL)
+  {
+    free(Packed);
+    UCClose(Image);
+    Error("Allocation error");
+  }
+  Cnt = Codec->Decompress(Image, Packed, compressedLength, Buffer, Length);
+  free(Packed);
+  if (Cnt == Length && Buffer != Image->UCPixels)
+    Cnt = UCWrite(Image, Buffer, Length, (IMINDEX)0);
+  if (Buffer != Image->UCPixels) free(Buffer);
+  if (Cnt != Length)
+  {
+    UCClose(Image);
+    Error("Image decompression failed");
+  }
+
+  Image->PixelsAccessed = TRUE;
+	return (VALID);
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads pixel data from an image.  imread64 takes    */
+/*           64 bit pixel indices for images of more than 2^31 pixels.       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imread(IMAGE *Image, int LoIndex, int HiIndex, GREYTYPE *Buffer)
+{
+	return(imread64(Image, (IMINDEX)LoIndex, (IMINDEX)HiIndex, Buffer));
+}
+
+int imread64(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex, GREYTYPE *Buffer)
+{
+	IMINDEX Cnt;
+	IMINDEX Length;
+	IMINDEX Offset;   
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Buffer == NULL) Error("Null read buffer");
+	if ((LoIndex < 0) || (HiIndex > Image->PixelCnt) ||
+		(LoIndex > HiIndex)) Error("Invalid pixel index");
+
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	/* Determine number of bytes to read and the pixel offset */
+	Length = (HiIndex - LoIndex +1) * Image->PixelSize;
+	Offset = LoIndex * Image->PixelSize;
+
+	/* if pixels have not been accessed since opening the image, then */
+	/* the pixel data needs to be decompressed */
+	if(Image->Compressed && Image->PixelsAccessed == FALSE &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* decompress the chunks of a large read side by side */
+	if (Image->Compressed && Image->Chunked &&
+		LoadChunksParallel(Image, Offset, Length) == INVALID)
+		return(INVALID);
+
+	/* Read pixels into buffer, bypassing the page cache for bulk loads */
+#if !defined(WIN32) && defined(O_DIRECT)
+	if (Image->DirectIO && !Image->Compressed && Length >= DIRECTMIN)
+		Cnt = DirectRead(Image, Offset, (char *)Buffer, Length);
+	else
+#endif
+	Cnt = PixelRead(Image, Offset, (char *)Buffer, Length);
+	if (Cnt != Length) Error("Image pixel read failed");
+	AccessHint(Image, Offset, Offset + Length);
+
+	/* Swap the byte order of pixels in buffer if needed */
+	if (Image->SwapNeeded) Swap((char *)Buffer, Length, Image->PixelFormat);
+
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads pixel data from an image into a buffer of    */
+/*           Type (AS_FLOAT, AS_DOUBLE, AS_INT32 or AS_UINT16), storing      */
+/*           Slope * pixel + Intercept.  Pixels are read, swapped and        */
+/*           converted CONVBYTES at a time, so no raw copy of the whole      */
+/*           range is made.                                                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imread_as(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex, void *Buffer,
+	int Type, double Slope, double Intercept)
+{
+	char *Scratch;
+	char *Dst;
+	IMINDEX Chunk;
+	IMINDEX Cnt;
+	int TypeSize;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Buffer == NULL) Error("Null read buffer");
+	if ((LoIndex < 0) || (HiIndex > Image->PixelCnt) ||
+		(LoIndex > HiIndex)) Error("Invalid pixel index");
+	if ((TypeSize = ConvertSize(Image->PixelFormat, Type)) == 0)
+		Error("Can not convert this pixel format");
+
+	/* Pixels that are already of the requested type are read in place */
+	if (Slope == 1.0 && Intercept == 0.0 &&
+		((Image->PixelFormat == REAL && Type == AS_FLOAT) ||
+		 (Image->PixelFormat == USERPACKED && Type == AS_INT32)))
+		return(imread64(Image, LoIndex, HiIndex, (GREYTYPE *)Buffer));
+
+	/* Direct reads want large blocks; otherwise stay cache sized */
+	Chunk = (Image->DirectIO ? BLOCKBYTES : CONVBYTES) / Image->PixelSize;
+	if (Chunk > HiIndex - LoIndex + 1) Chunk = HiIndex - LoIndex + 1;
+	Scratch = (char *)malloc((size_t)(Chunk * Image->PixelSize));
+	if (Scratch == NULL) Error("Allocation error");
+
+	Dst = (char *)Buffer;
+	for (; LoIndex <= HiIndex; LoIndex += Cnt)
+	{
+		Cnt = HiIndex - LoIndex + 1;
+		if (Cnt > Chunk) Cnt = Chunk;
+		if (imread64(Image, LoIndex, LoIndex + Cnt - 1,
+			(GREYTYPE *)Scratch) == INVALID)
+		{
+			free(Scratch);
+			return(INVALID);
+		}
+		_imconvfunc(Scratch, Image->PixelFormat, Dst, Type, Cnt, Slope,
+			Intercept);
+		Dst += Cnt * TypeSize;
+	}
+
+	free(Scratch);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine writes pixel data to an image.  For GREY images,   */
+/*           the maximum and minimum values are also updated, but the        */
+/*           histogram is NOT updated.  The algorithm used to update the     */
+/*           maximum and minimum values generates a bound on the image       */
+/*           intensities, but not always the tightest bound.  This is the    */
+/*           best we can do by looking at pixels as they are written.  To    */
+/*           compute the tightest upper bound requires that we look at all   */
+/*           pixels in the image.  This is what imgetdesc does.  imwrite64   */
+/*           takes 64 bit pixel indices.  The buffer is not modified, even   */
+/*           when the image has the other byte order.                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imwrite(IMAGE *Image, int LoIndex, int HiIndex, const GREYTYPE *Buffer)
+{
+	return(imwrite64(Image, (IMINDEX)LoIndex, (IMINDEX)HiIndex, Buffer));
+}
+
+int imwrite64(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex,
+	const GREYTYPE *Buffer)
+{
+	IMINDEX Cnt;
+	IMINDEX Length;
+	IMINDEX Offset;   
+	int TempMin;
+	int TempMax;
+	IMINDEX PixelCnt;
+	IMINDEX i;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Buffer == NULL) Error("Null read buffer");
+	if ((LoIndex < 0) || (HiIndex > Image->PixelCnt) ||
+		(LoIndex > HiIndex)) Error("Invalid pixel index");
+
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	if (Image->nImgFormat != 0) Error("Can not write this format image file");
+
+	/* Determine number of bytes to write and the pixel offset */
+	Length = (HiIndex - LoIndex +1) * Image->PixelSize;
+	Offset = LoIndex * Image->PixelSize;
+
+	/* decompress the pixels so we have a file to write to */
+	if (Image->Compressed && Image->PixelsAccessed == FALSE &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* Write pixels into image file, swapping a copy if needed */
+	Cnt = SwapWrite(Image, Offset, (const char *)Buffer, Length);
+	if (Cnt != Length) Error("Image pixel write failed");
+
+	Image->PixelsModified = TRUE;
+
+	/* Invalidate the MaxMin and Histogram fields */
+	if (Image->ValidMaxMin) DropStats(Image);
+	Image->ValidMaxMin = FALSE;
+	Image->ValidHistogram = FALSE;
+
+	/* Compute new Maximum and Minimum for GREY images */
+	if (Image->PixelFormat == GREY)
+	{
+		TempMax = Image->MaxMin[1];
+		TempMin = Image->MaxMin[0];
+		PixelCnt = HiIndex - LoIndex + 1;
+		for (i=0; i<PixelCnt; i++)
+		{
+			if (Buffer[i] > TempMax) TempMax = Buffer[i];
+			if (Buffer[i] < TempMin) TempMin = Buffer[i];
+		}
+		Image->MaxMin[1] = TempMax;
+		Image->MaxMin[0] = TempMin;
+	}
+
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads an arbitrary subwindow of an image.  It      */
+/*           does optimal I/O for 1D, 2D and 3D images.  More general I/O    */
+/*           is used for higher dimension images.                            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imgetpix(IMAGE *Image, int Endpts[][2], int *Coarseness, GREYTYPE
+	*Pixels)
+{
+	IMINDEX SliceSize;
+	IMINDEX Start;
+	IMINDEX End;
+	int Coarse;
+	int Status;
+	int i;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Pixels == NULL) Error("Null pixel buffer");
+   
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	/* Check endpoints */
+	Coarse = FALSE;
+	for (i=0; i<Image->Dimc; i++)
+	{
+		if (Coarseness[i] < 1) Error("Bad coarseness");
+		if (Endpts[i][0] < 0) Error("Bad endpoints range");
+		if (Endpts[i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
+		if (Endpts[i][1] < Endpts[i][0]) Error("Bad endpoints order");
+		if (Coarseness[i] != 1) Coarse = TRUE;
+	}
+
+	/* A direct bulk load of the whole image is one imread */
+	if (Image->DirectIO && !Coarse)
+	{
+		for (i=0; i<Image->Dimc; i++)
+			if (Endpts[i][0] != 0 || Endpts[i][1] != Image->Dimv[i]-1) break;
+		if (i == Image->Dimc)
+			return(imread64(Image, 0, Image->PixelCnt-1, Pixels));
+	}
+
+	/* Subsampled windows are read run by run, others by dimension */
+	if (Coarse)
+		Status = GetPutCoarse(Image, Endpts, Coarseness, Pixels, READMODE);
+	else switch (Image->Dimc) {
+
+		/* Handle 1D images */
+		case 1: 
+			return(imread64(Image, Endpts[0][0], Endpts[0][1], Pixels));
+			break;
+
+      /* Handle 2D images */
+		case 2:
+			Status = GetPut2D(Image, Endpts, Pixels, READMODE);
+			break;
+
+      /* Handle 3D images */
+		case 3:
+			Status = GetPut3D(Image, Endpts, Pixels, READMODE);
+			break;
+
+      /* Handle higher dimension images */
+		default:
+			Status = GetPutND(Image, Endpts, Pixels, READMODE);
+			break;
+	}
+
+	/* Hint the kernel about the next window from the span of this one */
+	if (Status == VALID)
+	{
+		SliceSize = Image->PixelSize;
+		Start = 0;
+		End = Image->PixelSize;
+		for (i=Image->Dimc-1; i>=0; i--)
+		{
+			Start = Start + Endpts[i][0] * SliceSize;
+			End = End + Endpts[i][1] * SliceSize;
+			SliceSize = SliceSize * Image->Dimv[i];
+		}
+		AccessHint(Image, Start, End);
+	}
+
+	return(Status);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads many subwindows of an image in one sweep.    */
+/*           Region r has endpoints Endpts[r] and goes to Buffers[r], as     */
+/*           for imgetpix.  The runs of all regions are sorted by file       */
+/*           offset and read together, so overlapping and neighbouring       */
+/*           regions share reads (see ReadRuns and OPT_COALESCE).  Gaps      */
+/*           wider than the largest region are not read through.             */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imgetpix_batch(IMAGE *Image, int nRegions, int (*Endpts[])[2],
+	GREYTYPE *Buffers[])
+{
+	PIXRUN *Runs = NULL;
+	PIXRUN *Region;
+	PIXRUN *More;
+	IMINDEX Bytes;
+	IMINDEX MaxGap;
+	int RunCnt;
+	int Cnt;
+	int r;
+	int i;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (nRegions < 0) Error("Invalid region count");
+	if (nRegions > 0 && (Endpts == NULL || Buffers == NULL))
+		Error("Null region list");
+
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	/* Check endpoints */
+	for (r=0; r<nRegions; r++)
+	{
+		if (Endpts[r] == NULL) Error("Null endpoints");
+		if (Buffers[r] == NULL) Error("Null pixel buffer");
+		for (i=0; i<Image->Dimc; i++)
+		{
+			if (Endpts[r][i][0] < 0) Error("Bad endpoints range");
+			if (Endpts[r][i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
+			if (Endpts[r][i][1] < Endpts[r][i][0]) Error("Bad endpoints order");
+		}
+	}
+
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* Collect the runs of every region.  A gap wider than the largest */
+	/* region costs more to read through than to skip, so runs of      */
+	/* scattered regions are not merged across it.                      */
+	RunCnt = 0;
+	MaxGap = 0;
+	for (r=0; r<nRegions; r++)
+	{
+		Bytes = Image->PixelSize;
+		for (i=0; i<Image->Dimc; i++)
+			Bytes = Bytes * (Endpts[r][i][1] - Endpts[r][i][0] + 1);
+		if (Bytes > MaxGap) MaxGap = Bytes;
+		Cnt = PlanRuns(Image, Endpts[r], NULL, (char *)Buffers[r], &Region);
+		if (Cnt < 0) break;
+		More = (PIXRUN *)realloc(Runs, (size_t)(RunCnt + Cnt) * sizeof(PIXRUN));
+		if (More == NULL)
+		{
+			free(Region);
+			break;
+		}
+		Runs = More;
+		memcpy(Runs + RunCnt, Region, (size_t)Cnt * sizeof(PIXRUN));
+		RunCnt += Cnt;
+		free(Region);
+	}
+	if (r < nRegions)
+	{
+		if (Runs != NULL) free(Runs);
+		Error("Allocation error");
+	}
+
+	/* Read everything in file order */
+	qsort(Runs, (size_t)RunCnt, sizeof(PIXRUN), CompareRuns);
+	if (MaxGap > Image->Coalesce) MaxGap = Image->Coalesce;
+	Cnt = ReadRuns(Image, Runs, RunCnt, MaxGap);
+	if (Runs != NULL) free(Runs);
+	if (Cnt == INVALID) Error("Pixel read failed");
+
+	/* Swap the byte order of pixels read in if Needed */
+	if (Image->SwapNeeded)
+		for (r=0; r<nRegions; r++)
+		{
+			Bytes = Image->PixelSize;
+			for (i=0; i<Image->Dimc; i++)
+				Bytes = Bytes * (Endpts[r][i][1] - Endpts[r][i][0] + 1);
+			Swap((char *)Buffers[r], Bytes, Image->PixelFormat);
+		}
+
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads an arbitrary subwindow of an image into a    */
+/*           buffer of Type, storing Slope * pixel + Intercept as for        */
+/*           imread_as.  The window is cut along its outer dimensions into   */
+/*           pieces of about CONVBYTES that are read with imgetpix and       */
+/*           converted while they are still in cache.                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imgetpix_as(IMAGE *Image, int Endpts[][2], int *Coarseness, void *Pixels,
+	int Type, double Slope, double Intercept)
+{
+	int Sub[nDIMV][2];
+	int Index[nDIMV];
+	int Extent[nDIMV];
+	IMINDEX Inner;
+	IMINDEX Cnt;
+	char *Scratch;
+	char *Dst;
+	int TypeSize;
+	int Planes;
+	int Outer;
+	int i;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Pixels == NULL) Error("Null pixel buffer");
+	if (Coarseness == NULL) Error("Bad coarseness");
+	if ((TypeSize = ConvertSize(Image->PixelFormat, Type)) == 0)
+		Error("Can not convert this pixel format");
+
+	/* Check endpoints and find the sampled extent of each dimension */
+	for (i=0; i<Image->Dimc; i++)
+	{
+		if (Coarseness[i] < 1) Error("Bad coarseness");
+		if (Endpts[i][0] < 0) Error("Bad endpoints range");
+		if (Endpts[i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
+		if (Endpts[i][1] < Endpts[i][0]) Error("Bad endpoints order");
+		Extent[i] = (Endpts[i][1] - Endpts[i][0]) / Coarseness[i] + 1;
+	}
+
+	/* Pixels that are already of the requested type are read in place */
+	if (Slope == 1.0 && Intercept == 0.0 &&
+		((Image->PixelFormat == REAL && Type == AS_FLOAT) ||
+		 (Image->PixelFormat == USERPACKED && Type == AS_INT32)))
+		return(imgetpix(Image, Endpts, Coarseness, (GREYTYPE *)Pixels));
+
+	/* Pieces span dimension Outer in blocks of Planes and all of the */
+	/* dimensions after it; the dimensions before it are stepped one  */
+	/* index at a time                                                */
+	Inner = Image->PixelSize;
+	for (Outer=Image->Dimc-1; Outer>0; Outer--)
+	{
+		if (Inner * Extent[Outer] > CONVBYTES) break;
+		Inner = Inner * Extent[Outer];
+	}
+	Planes = (int)(CONVBYTES / Inner);
+	if (Planes < 1) Planes = 1;
+	if (Planes > Extent[Outer]) Planes = Extent[Outer];
+
+	Scratch = (char *)malloc((size_t)(Inner * Planes));
+	if (Scratch == NULL) Error("Allocation error");
+
+	for (i=0; i<Image->Dimc; i++)
+	{
+		Sub[i][0] = Endpts[i][0];
+		Sub[i][1] = Endpts[i][1];
+		Index[i] = 0;
+	}
+
+	Dst = (char *)Pixels;
+	while (TRUE)
+	{
+		/* Cut out the next piece */
+		for (i=0; i<Outer; i++)
+			Sub[i][0] = Sub[i][1] = Endpts[i][0] + Index[i] * Coarseness[i];
+		Cnt = Extent[Outer] - Index[Outer];
+		if (Cnt > Planes) Cnt = Planes;
+		Sub[Outer][0] = Endpts[Outer][0] + Index[Outer] * Coarseness[Outer];
+		Sub[Outer][1] = Sub[Outer][0] + ((int)Cnt - 1) * Coarseness[Outer];
+
+		if (imgetpix(Image, Sub, Coarseness, (GREYTYPE *)Scratch) == INVALID)
+		{
+			free(Scratch);
+			return(INVALID);
+		}
+		Cnt = Cnt * (Inner / Image->PixelSize);
+		_imconvfunc(Scratch, Image->PixelFormat, Dst, Type, Cnt, Slope,
+			Intercept);
+		Dst += Cnt * TypeSize;
+
+		/* Advance to the next piece, last dimension first */
+		Index[Outer] += Planes;
+		if (Index[Outer] < Extent[Outer]) continue;
+		Index[Outer] = 0;
+		for (i=Outer-1; i>=0; i--)
+		{
+			if (++Index[i] < Extent[i]) break;
+			Index[i] = 0;
+		}
+		if (i < 0) break;
+	}
+
+	free(Scratch);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine writes an arbitrary subwindow of an image.  It     */
+/*           does optimal I/O for 1D, 2D and 3D images.  More general I/O    */
+/*           is used for higher dimension images.                            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imputpix(IMAGE *Image, int Endpts[][2], int *Coarseness,
+	const GREYTYPE *Pixels)
+{
+	GREYTYPE *Buffer;
+	IMINDEX i;
+	IMINDEX PixelCnt;
+	int TempMax;
+	int TempMin;
+	int Coarse;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Pixels == NULL) Error("Null pixel buffer");
+   
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	if (Image->nImgFormat != 0) Error("Can not write this format image file");
+
+	/* Check endpoints */
+	PixelCnt = 1;
+	Coarse = FALSE;
+	for (i=0; i<Image->Dimc; i++)
+	{
+		if (Coarseness[i] < 1) Error("Bad coarseness");
+		if (Endpts[i][0] < 0) Error("Bad endpoints range");
+		if (Endpts[i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
+		if (Endpts[i][1] < Endpts[i][0]) Error("Bad endpoints order");
+		if (Coarseness[i] != 1) Coarse = TRUE;
+		PixelCnt = PixelCnt *
+			((Endpts[i][1] - Endpts[i][0]) / Coarseness[i] + 1);
+	}
+
+	/* Invalidate the MaxMin and Histogram fields */
+	if (Image->ValidMaxMin) DropStats(Image);
+	Image->ValidMaxMin = FALSE;
+	Image->ValidHistogram = FALSE;
+
+	/* Compute new Maximum and Minimum for GREY images */
+	if (Image->PixelFormat == GREY)
+	{
+		TempMax = Image->MaxMin[1];
+		TempMin = Image->MaxMin[0];
+		for (i=0; i<PixelCnt; i++)
+		{
+			if (Pixels[i] > TempMax) TempMax = Pixels[i];
+			if (Pixels[i] < TempMin) TempMin = Pixels[i];
+		}
+		Image->MaxMin[1] = TempMax;
+		Image->MaxMin[0] = TempMin;
+	}
+
+	/* The GetPut routines only read from the buffer in WRITEMODE */
+	Buffer = (GREYTYPE *)Pixels;
+
+	/* Subsampled windows are written run by run */
+	if (Coarse)
+		return(GetPutCoarse(Image, Endpts, Coarseness, Buffer, WRITEMODE));
+
+	/* Check for image dimensions */
+	switch (Image->Dimc) {
+
+		/* Handle 1D images */
+		case 1: 
+			return(imwrite64(Image, Endpts[0][0], Endpts[0][1], Pixels));
+			break;
+
+      /* Handle 2D images */
+		case 2:
+			return(GetPut2D(Image, Endpts, Buffer, WRITEMODE));
+			break;
+
+      /* Handle 3D images */
+		case 3:
+			return(GetPut3D(Image, Endpts, Buffer, WRITEMODE));
+			break;
+
+      /* Handle higher dimension images */
+		default:
+			return(GetPutND(Image, Endpts, Buffer, WRITEMODE));
+			break;
+	}
+
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads and writes pixels to 2D images.  The         */
+/*           minimum number of I/O calls are used.                           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int GetPut2D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+{
+	int Xdim;
+	int Ydim;
+	int Xlength;
+	int Ylength;
+	IMINDEX ReadBytes;
+	int Yloop;
+	int Yskipcnt;
+	IMINDEX FirstPixel;
+	IMINDEX Offset;
+	IMINDEX Cnt;
+	int i;
+	char *PixelPtr;
+	READBATCH Batch;
+
+	if (Mode != READMODE && Image->nImgFormat != 0) 
+		Error("Can not write this format image file");
+
+	/* The 0th dimension is y; the 1st is x */
+	Ydim = 0;
+	Xdim = 1;
+	    
+	/* Determine how many pixels to READ/WRITE in each dimension */
+	Ylength = (Endpts[Ydim][1] - Endpts[Ydim][0]) + 1;
+	Xlength = (Endpts[Xdim][1] - Endpts[Xdim][0]) + 1;
+	    
+	/* Determine how many pixels to SKIP in each dimension */
+	Yskipcnt = (Image->Dimv[Xdim]-Xlength) * Image->PixelSize;
+
+	/* Determine the maximum number of consecutive pixels that can */
+	/* be read in at one time and the number of non-contiguous     */
+	/* sections that span the y dimension                          */
+	if (Xlength != Image->Dimv[Xdim])
+	{
+		ReadBytes = Xlength * Image->PixelSize;
+		Yloop = Ylength;
+	}
+	else 
+	{
+		ReadBytes = (IMINDEX)Ylength * Xlength * Image->PixelSize;
+		Yloop = 1;
+	}
+ 
+	/* Calculate position of first pixel */
+	FirstPixel = ((IMINDEX)Endpts[Ydim][0] * Image->Dimv[Xdim]
+		+ Endpts[Xdim][0]) * Image->PixelSize;
+
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* Loop reading/writing pixel data in sections */
+	PixelPtr = (char *) Pixels;
+	Offset = FirstPixel;
+	Batch.Image = Image;
+	Batch.Count = 0;
+	Batch.Sink = NULL;
+	for (i=0; i<Yloop; i++)
+	{
+		/* queue read of data into buffer */
+		if (Mode == READMODE)
+		{
+			if (BatchRead(&Batch, Offset, PixelPtr, ReadBytes) == INVALID)
+				Error("Pixel read failed");
+		}
+
+		/* write data from buffer */
+		else
+		{
+			/* Swap a copy of the pixels written out if Needed */
+			Cnt = SwapWrite(Image, Offset, PixelPtr, ReadBytes);
+			if (Cnt != ReadBytes) Error("Pixel write failed");
+		}
+
+		/* Advance buffer pointer */
+		PixelPtr += ReadBytes;
+
+		/* Advance to next line of pixels to read/write */
+		Offset += ReadBytes + Yskipcnt;
+	}
+
+	if (Mode == READMODE)
+	{
+		/* Finish the last read */
+		if (FlushBatch(&Batch) == INVALID) Error("Pixel read failed");
+
+		/* Swap the byte order of pixels read in if Needed */
+		if (Image->SwapNeeded)
+			Swap((char *)Pixels, (IMINDEX)(PixelPtr - (char *)Pixels),
+				Image->PixelFormat);
+	}
+
+	Image->PixelsModified = TRUE;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads and writes pixels to 3D images.  The         */
+/*           minimum number of I/O calls are used.                           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int GetPut3D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+{
+	int Xdim;
+	int Ydim;
+	int Zdim;
+	int Xlength;
+	int Ylength;
+	int Zlength;
+	IMINDEX ReadBytes;
+	int Yloop;
+	int Zloop;
+	int Yskipcnt;
+	IMINDEX Zskipcnt;
+	IMINDEX FirstPixel;
+	IMINDEX Offset;
+	IMINDEX Cnt;
+	int i;
+	int j;
+	char *PixelPtr;
+	READBATCH Batch;
+
+	if (Mode != READMODE && Image->nImgFormat != 0) 
+		Error("Can not write this format image file");
+
+	/* 0th dimension is z; 1st is y; 2nd is x */
+	Zdim = 0;
+	Ydim = 1;
+	Xdim = 2;
+
+	/* Determine how many pixels to READ/WRITE in each dimension*/
+	Zlength = (Endpts[Zdim][1] - Endpts[Zdim][0]) + 1;
+	Ylength = (Endpts[Ydim][1] - Endpts[Ydim][0]) + 1;
+	Xlength = (Endpts[Xdim][1] - Endpts[Xdim][0]) + 1;
+
+	/* Determine how many pixels to SKIP in each dimension*/
+	Yskipcnt = (Image->Dimv[Xdim]-Xlength) * Image->PixelSize;
+	Zskipcnt = (IMINDEX)(Image->Dimv[Ydim]-Ylength) 
+		* Image->Dimv[Xdim] * Image->PixelSize;
+
+	/* Determine the maximum number of consecutive pixels that can */
+	/* be read in at one time and the number of non-contiguous     */
+	/* sections that span the y and z dimensions                   */
+	if (Xlength != Image->Dimv[Xdim])
+	{
+		ReadBytes = Xlength * Image->PixelSize;
+		Yloop = Ylength;
+		Zloop = Zlength;
+	}
+	else if (Ylength != Image->Dimv[Ydim]) 
+	{
+		ReadBytes = (IMINDEX)Ylength * Xlength * Image->PixelSize;
+		Yloop = 1;
+		Zloop = Zlength;
+	}
+	else 
+	{
+		ReadBytes = (IMINDEX)Zlength * Ylength * Xlength * Image->PixelSize;
+		Yloop = 1;
+		Zloop = 1;
+	}
+	    
+	/* Calculate position of first pixel in image */
+	FirstPixel = ((IMINDEX)Endpts[Zdim][0] * Image->Dimv[Xdim] * Image->Dimv[Ydim]
+		+ (IMINDEX)Endpts[Ydim][0] * Image->Dimv[Xdim]
+		+  Endpts[Xdim][0]) * Image->PixelSize;
+
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* Loop reading/writing pixel data in sections */
+	PixelPtr = (char *) Pixels;
+	Offset = FirstPixel;
+	Batch.Image = Image;
+	Batch.Count = 0;
+	Batch.Sink = NULL;
+	for (i=0; i<Zloop; i++)
+	{
+		for (j=0; j<Yloop; j++)
+		{
+
+			/* Queue read of data from file into buffer */
+			if (Mode == READMODE)
+			{
+				if (BatchRead(&Batch, Offset, PixelPtr, ReadBytes) == INVALID)
+					Error("Pixel read failed");
+			}
+
+			/* write to file from buffer */
+			else
+			{
+				/* Swap a copy of the pixels written out if Needed */
+				Cnt = SwapWrite(Image, Offset, PixelPtr, ReadBytes);
+				if (Cnt != ReadBytes) Error("Pixel write failed");
+			}
+   
+			/* Advance buffer pointer */
+			PixelPtr += ReadBytes;
+   
+			/* Advance to next line of pixels to read/write */
+			Offset += ReadBytes + Yskipcnt;
+		}
+
+		/* Advance to next slice of pixels to read/write */
+		Offset += Zskipcnt;
+	}
+
+	if (Mode == READMODE)
+	{
+		/* Finish the last read */
+		if (FlushBatch(&Batch) == INVALID) Error("Pixel read failed");
+
+		/* Swap the byte order of pixels read in if Needed */
+		if (Image->SwapNeeded)
+			Swap((char *)Pixels, (IMINDEX)(PixelPtr - (char *)Pixels),
+				Image->PixelFormat);
+	}
+
+	Image->PixelsModified = TRUE;
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads and writes pixels to N dimensional images.   */
+/*           The minimum number of I/O calls are used.                       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int GetPutND(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+{
+	IMINDEX SliceSize[nDIMV];
+	int ReadCnt[nDIMV] = { 0 };
+	int SkipCnt[nDIMV];
+	int Index[nDIMV];
+	int Dimc;
+	IMINDEX ReadBytes;
+	IMINDEX NextPixel;
+	IMINDEX Offset;
+	int i;
+	IMINDEX Cnt;
+	char *PixelPtr;
+	PIXRUN *Runs;
+	int RunCnt;
+
+	if (Mode != READMODE && Image->nImgFormat != 0) Error("Can not write this format image file");
+
+	/* Determine size of one "slice" in each dimension */
+	Dimc = Image->Dimc;
+	SliceSize[Dimc-1] = Image->PixelSize;
+	for (i=Dimc-2; i>=0; i--)
+		SliceSize[i] = SliceSize[i+1] * Image->Dimv[i+1];
+
+	/* Determine number of "slices" to read and skip in each dimension */
+	for (i=0; i<Dimc; i++)
+	{
+		ReadCnt[i] = Endpts[i][1] - Endpts[i][0] + 1;
+		SkipCnt[i] = Image->Dimv[i] - ReadCnt[i];
+	}
+	ReadBytes = ReadCnt[Dimc-1] * SliceSize[Dimc-1];
+    
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(INVALID);
+
+	/* Read all runs at once, merging runs separated by short gaps */
+	if (Mode == READMODE)
+	{
+		RunCnt = PlanRuns(Image, Endpts, NULL, (char *)Pixels, &Runs);
+		if (RunCnt < 0) Error("Allocation error");
+		i = ReadRuns(Image, Runs, RunCnt, Image->Coalesce);
+		Cnt = (IMINDEX)(Runs[RunCnt-1].Buffer + Runs[RunCnt-1].Length
+			- (char *)Pixels);
+		free(Runs);
+		if (i == INVALID) Error("Pixel read failed");
+
+		/* Swap the byte order of pixels read in if Needed */
+		if (Image->SwapNeeded) Swap((char *)Pixels, Cnt, Image->PixelFormat);
+
+		Image->PixelsModified = TRUE;
+		return(VALID);
+	}
+
+	/* Find offset to first pixel */
+	NextPixel = 0;
+	for (i=0; i<Dimc; i++)
+	{
+		NextPixel = NextPixel + SliceSize[i]*Endpts[i][0];
+		Index[i] = Endpts[i][0];
+	}
+
+	/* Loop reading and skipping pixels */
+	PixelPtr = (char *) Pixels;
+	Offset = 0;
+	while (Index[0] <= Endpts[0][1])
+	{
+		/* Advance to next line of pixels to write */
+		Offset += NextPixel;
+
+		/* write data from buffer to file, swapping a copy if Needed */
+		Cnt = SwapWrite(Image, Offset, PixelPtr, ReadBytes);
+		if (Cnt != ReadBytes) Error("Pixel write failed");
+  
+		/* Advance buffer pointer */
+		PixelPtr += ReadBytes;
+		Offset += ReadBytes;
+		Index[Dimc-1] = Endpts[Dimc-1][1] + 1;
+ 
+		/* Find offset to next pixel */
+		NextPixel = 0;
+		for (i=Dimc-1; i>=0; i--)
+		{
+			if (Index[i] > Endpts[i][1])
+			{
+				NextPixel = NextPixel + SkipCnt[i] * SliceSize[i];
+				if (i > 0) 
+				{
+					Index[i] = Endpts[i][0];
+					Index[i-1]++;
+				}
+			}
+		}
+	}
 
-	/* Determine number of pixels in image */
-	Image->PixelCnt = 1;
-	for (i=0; i<Image->Dimc; i++)
-		Image->PixelCnt = Image->PixelCnt * Image->Dimv[i];
+	Image->PixelsModified = TRUE;
+	return(VALID);
+}
 
-	/* Determine length of information field */
-	Cnt = (int)lseek(Fd, (long)0, FROMEND);
-	if (Cnt == -1) ErrorNull("Seek EOF failed");
-	Length = Cnt - Image->Address[aINFO];
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads and writes subsampled pixels of an image of  */
+/*           any dimension.  Every Coarseness[i]-th pixel from Endpts[i][0]  */
+/*           up to Endpts[i][1] is used.  Rows of the last dimension with a  */
+/*           small step are read whole and decimated in memory (written by   */
+/*           read-modify-write); with a large step only the wanted pixels    */
+/*           are read or written (see PlanRuns).                             */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int GetPutCoarse(IMAGE *Image, int Endpts[][2], int *Coarseness,
+	GREYTYPE *Pixels, int Mode)
+{
+	PIXRUN *Runs;
+	IMINDEX Bytes;
+	int RunCnt;
+	int Status;
 
-	/* Allocate buffer for information field */
-	if (Length < 1) ErrorNull("Invalid information field");
-	Buffer = (char *)malloc((unsigned)Length);
-	if (Buffer == NULL) ErrorNull("Allocation error");
+	if (Mode != READMODE && Image->nImgFormat != 0) Error("Can not write this format image file");
 
-	/* Read whole information field into a buffer */
-	Cnt = (int)lseek(Fd, (long)Image->Address[aINFO], FROMBEG);
-	Cnt = read(Fd, (char *)Buffer, Length);
-	if (Cnt != Length) ErrorNull("Image read failed");
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(INVALID);
 
-	/* Prepare to loop through all fields */
-	StrPtr = Buffer;
-	Length = (int) strlen(StrPtr) + 1;
-	Image->InfoCnt = 0;
+	RunCnt = PlanRuns(Image, Endpts, Coarseness, (char *)Pixels, &Runs);
+	if (RunCnt < 0) Error("Allocation error");
+	Bytes = (IMINDEX)(Runs[RunCnt-1].Buffer + Runs[RunCnt-1].Length
+		- (char *)Pixels);
 
-	/* Loop through all fields */
-	while ((Length > 1) && (Image->InfoCnt < nINFO))
+	if (Mode == READMODE)
 	{
-		/* Reading field name from buffer */
-		Name = (char *)malloc((unsigned)Length);
-		if (Name == NULL) ErrorNull("Allocation error");
-		strcpy(Name, StrPtr);
-		StrPtr = StrPtr + Length;
-		Length = (int) strlen(StrPtr) + 1;
-
-		/* Reading field data from buffer */
-		Data = (char *)malloc((unsigned)Length);
-		if (Data == NULL) ErrorNull("Allocation error");
-		strcpy(Data, StrPtr);
-		StrPtr = StrPtr + Length;
-		Length = (int) strlen(StrPtr) + 1;
+		Status = ReadRuns(Image, Runs, RunCnt, Image->Coalesce);
+		free(Runs);
+		if (Status == INVALID) Error("Pixel read failed");
 
-		/* Saving name and data in image header */
-		Image->InfoName[Image->InfoCnt] = Name;
-		Image->InfoData[Image->InfoCnt] = Data;
-		Image->InfoCnt ++;
+		/* Swap the byte order of pixels read in if Needed */
+		if (Image->SwapNeeded) Swap((char *)Pixels, Bytes, Image->PixelFormat);
 	}
-
-	/* Free buffer used for information string */
-	free(Buffer);
-
-	/* Save file pointer */
-	Image->Fd = Fd;
-
-	/* Determine size of each pixel */
-	switch (Image->PixelFormat) {
-		case GREY         : Image->PixelSize = sizeof (GREYTYPE); break;
-		case COLOR        : Image->PixelSize = sizeof (COLORTYPE); break;
-		case COLORPACKED  : Image->PixelSize = sizeof (CPACKEDTYPE); break;
-		case BYTE         : Image->PixelSize = sizeof (BYTETYPE); break;
-		case SHORT        : Image->PixelSize = sizeof (SHORTTYPE); break;
-		case LONG         : Image->PixelSize = sizeof (LONGTYPE); break;
-		case REAL         : Image->PixelSize = sizeof (REALTYPE); break;
-		case COMPLEX      : Image->PixelSize = sizeof (COMPLEXTYPE); break;
-		case USERPACKED   : Image->PixelSize = sizeof (USERTYPE); break;
+	else
+	{
+		/* WriteRuns swaps a copy of the pixels if Needed */
+		Status = WriteRuns(Image, Runs, RunCnt);
+		free(Runs);
+		if (Status == INVALID) Error("Pixel write failed");
 	}
 
-	/* set flag indicating this is .im format */
-	Image->nImgFormat=0;
-	return(Image);
+	Image->PixelsModified = TRUE;
+	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine closes an image.  The image parameters are         */
-/*           written to the file from the image record.                      */
+/* Purpose:  This routine maps the pixels of an image into memory.  On       */
+/*           return Pixels points at the first pixel, which has the type     */
+/*           given by the pixel format, and Strides[i] holds the distance    */
+/*           in pixels between neighbours along dimension i.  The mapping    */
+/*           is writable when the image was opened for UPDATE.  Only         */
+/*           uncompressed images in native byte order can be mapped; for     */
+/*           the others use imread or imgetpix.                              */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imclose (IMAGE *Image)
+int immap(IMAGE *Image, void **Pixels, int *Strides)
 {
-	int Fd;
-	int Cnt;
-	int Length;
-	int InfoLength;
-	char Null = '\0';
+#ifdef WIN32
+	Error("Memory mapping not supported");
+#else
+	struct stat Status;
+	IMINDEX Start;
+	IMINDEX End;
+	IMINDEX PageStart;
+	int Prot;
 	int i;
-#ifndef NO_COMPRESSION
-	char* Buffer;
-	char* envVar;
-#endif
+
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
+	if (Pixels == NULL) Error("Null pixel pointer");
 
 	/* Check that file is open */
-	Fd = Image->Fd;
-	if (Fd == EOF) Error("Image not open");
+	if (Image->Fd == EOF) Error("Image not open");
 
-	if (Image->nImgFormat == 0)
+	/* Only raw pixels in our byte order can be used in place */
+	if (Image->Compressed) Error("Can not map compressed image");
+	if (Image->SwapNeeded) Error("Can not map byte swapped image");
+
+	/* Map the pixel region once, starting at a page boundary */
+	if (Image->MapBase == NULL)
 	{
-#ifndef NO_COMPRESSION
-		/* if the image was opened as an uncompressed file, but the FORCE_COMPRESS
-			 environment variable was set, then close it as a compressed file */
-		if(!Image->Compressed && getenv("IMAGE_FORCE_COMPRESS"))
-		{
-			if((tempDir = getenv("IMAGE_TEMPDIR")) == NULL)
-				tempDir = "/usr/tmp";
-			sprintf(Image->UCPixelsFileName, "%s/tempimXXXXXX", tempDir);
-			mkstemp(Image->UCPixelsFileName);
-			if((Image->UCPixelsFd = open(Image->UCPixelsFileName,
-						O_RDWR | O_CREAT | O_TRUNC,
-						DEFAULT)) == -1) Error("Could not open temp file");
-
-			Buffer = (char*)malloc(Image->PixelCnt * Image->PixelSize);
-
-			/* read pixel data from image file */
-			Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-			Cnt = read(Image->Fd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt*Image->PixelSize)
-				Error("Uncompressed pixel read failed");
-
-			/* write pixel data to temp file */
-			Cnt = write(Image->UCPixelsFd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt * Image->PixelSize)
-				Error("Uncompressed Image pixel write failed");
-
-			free(Buffer);
-			ftruncate(Image->UCPixelsFd, (off_t)(Image->PixelCnt*Image->PixelSize+1));
-			Image->Compressed = TRUE;
-			Image->PixelsAccessed = TRUE;
+		Start = (IMINDEX)Image->Address[aPIXELS];
+		End = Start + (IMINDEX)Image->PixelCnt * Image->PixelSize;
+		if (fstat(Image->Fd, &Status) == -1) Error("Image stat failed");
+		if (Status.st_size < End) Error("Image file too short");
+
+		PageStart = Start - Start % (IMINDEX)sysconf(_SC_PAGESIZE);
+		Prot = PROT_READ;
+		if (Image->nImgFormat == 0 &&
+			(fcntl(Image->Fd, F_GETFL) & O_ACCMODE) == O_RDWR)
+			Prot |= PROT_WRITE;
+
+		Image->MapLength = (size_t)(End - PageStart);
+		Image->MapBase = (char *)mmap(NULL, Image->MapLength, Prot,
+			MAP_SHARED, Image->Fd, PageStart);
+		if (Image->MapBase == (char *)MAP_FAILED)
+		{
+			Image->MapBase = NULL;
+			Error("Image map failed");
+		}
+		Image->MapPixels = Image->MapBase + (Start - PageStart);
+		Image->MapWritable = (Prot & PROT_WRITE) != 0;
+		if (Image->MapWritable)
+		{
+			StopTracking(Image);
+			StopZones(Image);
+		}
+	}
 
-			Image->CompressionMethod = 0;
-			if((envVar = getenv("IMAGE_COMPRESS")) != NULL)
-			{
-				Image->Compressed = TRUE;
-				/* find the specified compression method; if it can't be determined,
-					 it defaults to 0 */
-				if(sscanf(envVar,"%d", &(Image->CompressionMethod)) != 1)
-					Image->CompressionMethod = 0;
-
-				/* this step assumes that NumberOfCompressionMethods > 0 */
-				if(Image->CompressionMethod >= NumberOfCompressionMethods)
-				{
-					char message[256];
-					sprintf(message, "Compression method %d out of bounds (only %d methods defined).\nDefaulting to method 0",
-						Image->CompressionMethod, NumberOfCompressionMethods);
-					Warn(message);
-					Image->CompressionMethod = 0;
-				}
-			}
-			Image->Address[aVERNO] =
-				Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
+	/* Return first pixel and the stride of each dimension */
+	*Pixels = (void *)Image->MapPixels;
+	if (Strides != NULL)
+	{
+		Strides[Image->Dimc-1] = 1;
+		for (i=Image->Dimc-2; i>=0; i--)
+			Strides[i] = Strides[i+1] * Image->Dimv[i+1];
+	}
 
-			compressImage(Image);
-			Image->PixelsAccessed = FALSE;
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
+	return(VALID);
+#endif
+}
 
-			/* save the compression type as an info field */
-			if(Image->Compressed)
-				imputinfo(Image, "Pixel Compression Method", 
-					compressionMethods[Image->CompressionMethod].methodName);
-		}
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine releases the pixel mapping made by immap.  If the  */
+/*           mapping was writable, the MaxMin and Histogram fields are       */
+/*           invalidated since the pixels may have changed.                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imunmap(IMAGE *Image)
+{
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Image->MapBase == NULL) Error("Image not mapped");
 
-		/* if the image was opened as a compressed file, but the
-			 IMAGE_FORCE_UNCOMPRESS environment variable was set, then close it as
-			 an uncompressed file */
-		if(Image->Compressed && getenv("IMAGE_FORCE_UNCOMPRESS"))
-		{
-			decompressImage(Image);
+#ifndef WIN32
+	if (munmap(Image->MapBase, Image->MapLength) == -1)
+		Error("Image unmap failed");
+#endif
+	if (Image->MapWritable)
+	{
+		if (Image->ValidMaxMin) DropStats(Image);
+		Image->ValidMaxMin = FALSE;
+		Image->ValidHistogram = FALSE;
+		Image->PixelsModified = TRUE;
+	}
+	Image->MapBase = NULL;
+	Image->MapPixels = NULL;
 
-			/*
-				Buffer = (char*)malloc(Image->PixelCnt * Image->PixelSize);
-			*/
-			lseek(Image->UCPixelsFd, 0, FROMBEG);
-			Cnt = read(Image->UCPixelsFd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt*Image->PixelSize)
-				Error("Uncompressed pixel read failed");
+	return(VALID);
+}
 
-			/* Write pixels into image file */
-			Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-			Cnt = write(Image->Fd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt * Image->PixelSize)
-				Error("Uncompressed Image pixel write failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines complete an asynchronous read.  AsyncFinish      */
+/*           fixes the byte order, runs the callback and wakes any waiter.   */
+/*           AsyncTask is one worker pool job reading a range of runs; like  */
+/*           GetPutND it reads nearby runs with one preadv (see BatchRead).  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void AsyncFinish(IMASYNC *Handle)
+{
+	IMAGE *Image = Handle->Image;
 
-			free(Buffer);
-			/* set a few things straight */
-			Image->Compressed = FALSE;
-			Image->Address[aVERNO] = Image->Address[aVERNO] - COMPRESSED - Image->CompressionMethod * 4096;
-			Image->Address[aINFO] =
-				Image->Address[aPIXELS] + Image->PixelCnt*Image->PixelSize;
+	if ((Handle->Status == VALID) && Image->SwapNeeded)
+		Swap((char *)Handle->Pixels, Handle->Bytes, Image->PixelFormat);
 
-			imputinfo(Image, "Pixel Compression Method", NULL);
+	if (Handle->Callback != NULL)
+		Handle->Callback(Handle, Handle->Status, Handle->Data);
 
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
-		}
+#ifndef WIN32
+	pthread_mutex_lock(&Handle->Lock);
+	Handle->Done = TRUE;
+	pthread_cond_broadcast(&Handle->Finished);
+	pthread_mutex_unlock(&Handle->Lock);
+#else
+	Handle->Done = TRUE;
+#endif
+}
 
-		/* if the image has been compressed, and we have modified the pixels,
-			 we must compress the pixels back into the image file and remove
-			 the temp file */
-		if(Image->Compressed && Image->PixelsModified)
-		{
-			compressImage(Image);
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
-			/* save the compression type as an info field */
-			if(Image->Compressed)
-				imputinfo(Image, "Pixel Compression Method", 
-					compressionMethods[Image->CompressionMethod].methodName);
-		}
-		else if(Image->Compressed && Image->PixelsAccessed)
-		{
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
-		}
+#ifndef WIN32
+static void AsyncTask(void *Arg)
+{
+	ASYNCTASK *Task = (ASYNCTASK *)Arg;
+	IMASYNC *Handle = Task->Handle;
+	READBATCH Batch;
+	PIXRUN *Run;
+	int Status = VALID;
+	int Last;
+	int i;
+
+	Batch.Image = Handle->Image;
+	Batch.Count = 0;
+	Batch.Sink = NULL;
+	for (i=Task->First; i<Task->Last && Status==VALID; i++)
+	{
+		Run = &Handle->Runs[i];
+		if (Run->Step == 0)
+			Status = BatchRead(&Batch, Run->Offset, Run->Buffer, Run->Length);
+		else if (FlushBatch(&Batch) == INVALID || ReadRuns(Handle->Image,
+			Run, 1, Handle->Image->Coalesce) == INVALID)
+			Status = INVALID;
+	}
+	if (FlushBatch(&Batch) == INVALID) Status = INVALID;
+
+	pthread_mutex_lock(&Handle->Lock);
+	if (Status == INVALID) Handle->Status = INVALID;
+	Last = (--Handle->Pending == 0);
+	pthread_mutex_unlock(&Handle->Lock);
+
+	if (Last) AsyncFinish(Handle);
+}
 #endif
 
-		/* Swap the byte order of header fields except the title and address */
-		if (Image->SwapNeeded) Swapheader(Image); 
- 
-		/* Write Title field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aTITLE], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
-		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
+#ifdef HAVE_IO_URING
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines drive a private io_uring for one asynchronous    */
+/*           read, using the raw system calls.  RingPlan groups runs whose   */
+/*           gap is at most Image->Coalesce bytes into one READV request,    */
+/*           the gaps going to a sink, as BatchRead does for preadv.  Short  */
+/*           reads are resubmitted for the remainder.  A ring is only handed */
+/*           back once nothing is in flight on it, so RingClose keeps a few  */
+/*           for RingOpen to reuse rather than setting up a new one.         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int RingOpen(URING *Ring, unsigned Entries)
+{
+	struct io_uring_params Params;
+	char *Sq;
+	char *Cq;
 
-		/* Write MaxMin field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aMAXMIN], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
-		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
-		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
+	pthread_mutex_lock(&_imringlock);
+	if (_imringcnt > 0)
+	{
+		*Ring = _imringpool[--_imringcnt];
+		pthread_mutex_unlock(&_imringlock);
+		return(VALID);
+	}
+	pthread_mutex_unlock(&_imringlock);
+
+	memset(&Params, 0, sizeof(Params));
+	Ring->Fd = (int)syscall(__NR_io_uring_setup, Entries, &Params);
+	if (Ring->Fd < 0) return(INVALID);
+
+	Ring->SqMapLength = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+	Ring->CqMapLength = Params.cq_off.cqes +
+		Params.cq_entries * sizeof(struct io_uring_cqe);
+	Ring->SqesLength = Params.sq_entries * sizeof(struct io_uring_sqe);
+	Ring->SingleMap = FALSE;
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		Ring->SingleMap = TRUE;
+		if (Ring->CqMapLength > Ring->SqMapLength)
+			Ring->SqMapLength = Ring->CqMapLength;
+	}
+#endif
 
-		/* Write Histogram field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aHISTO], FROMBEG);
-		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
-		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
-		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
+	Ring->SqMap = mmap(NULL, Ring->SqMapLength, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQ_RING);
+	Ring->CqMap = Ring->SingleMap ? Ring->SqMap :
+		mmap(NULL, Ring->CqMapLength, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_CQ_RING);
+	Ring->Sqes = (struct io_uring_sqe *)mmap(NULL, Ring->SqesLength,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd,
+		IORING_OFF_SQES);
+	if ((Ring->SqMap == MAP_FAILED) || (Ring->CqMap == MAP_FAILED) ||
+		(Ring->Sqes == (struct io_uring_sqe *)MAP_FAILED))
+	{
+		if (Ring->SqMap != MAP_FAILED) munmap(Ring->SqMap, Ring->SqMapLength);
+		if (!Ring->SingleMap && (Ring->CqMap != MAP_FAILED))
+			munmap(Ring->CqMap, Ring->CqMapLength);
+		if (Ring->Sqes != (struct io_uring_sqe *)MAP_FAILED)
+			munmap(Ring->Sqes, Ring->SqesLength);
+		close(Ring->Fd);
+		return(INVALID);
+	}
 
-		/* Write PixelFormat field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aPIXFORM], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
-		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
+	Sq = (char *)Ring->SqMap;
+	Cq = (char *)Ring->CqMap;
+	Ring->SqTail = (unsigned *)(Sq + Params.sq_off.tail);
+	Ring->SqMask = (unsigned *)(Sq + Params.sq_off.ring_mask);
+	Ring->SqArray = (unsigned *)(Sq + Params.sq_off.array);
+	Ring->CqHead = (unsigned *)(Cq + Params.cq_off.head);
+	Ring->CqTail = (unsigned *)(Cq + Params.cq_off.tail);
+	Ring->CqMask = (unsigned *)(Cq + Params.cq_off.ring_mask);
+	Ring->Cqes = (struct io_uring_cqe *)(Cq + Params.cq_off.cqes);
+	Ring->Entries = Params.sq_entries;
+	return(VALID);
+}
 
-		/* Write DimC field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMC], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
-		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+static void RingClose(URING *Ring)
+{
+	pthread_mutex_lock(&_imringlock);
+	if (_imringcnt < RINGPOOL)
+	{
+		_imringpool[_imringcnt++] = *Ring;
+		pthread_mutex_unlock(&_imringlock);
+		return;
+	}
+	pthread_mutex_unlock(&_imringlock);
 
-		/* Write DimV field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMV], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
-		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+	munmap(Ring->Sqes, Ring->SqesLength);
+	if (!Ring->SingleMap) munmap(Ring->CqMap, Ring->CqMapLength);
+	munmap(Ring->SqMap, Ring->SqMapLength);
+	close(Ring->Fd);
+}
 
-		/* Write Info field */
-		InfoLength = 0;
-		Cnt = (int)lseek(Fd, (long)Image->Address[aINFO], FROMBEG);
-		for (i=0; i<Image->InfoCnt; i++)
-		{
-      /* Write name of field and free string */
-      Length = (int) strlen(Image->InfoName[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoName[i]);
-      InfoLength += Length;
+static void RingPlan(IMASYNC *Handle)
+{
+	PIXRUN *Runs = Handle->Runs;
+	URINGREQ *Req = NULL;
+	IMINDEX MaxGap;
+	IMINDEX Gap;
+	IMINDEX End = 0;
+	int n = 0;
+	int i;
 
-      /* Write field data and free string */
-      Length = (int) strlen(Image->InfoData[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoData[i]);
-      InfoLength += Length;
+	MaxGap = (Handle->Sink != NULL) ? Handle->Image->Coalesce : 0;
+	Handle->ReqCnt = 0;
+	for (i=0; i<Handle->RunCnt; i++)
+	{
+		/* Start a new request if this run does not fit the current one */
+		Gap = Runs[i].Offset - End;
+		if ((Req == NULL) || (Gap < 0) || (Gap > MaxGap) ||
+			(Req->Count + 2 > IOVBATCH) ||
+			(Runs[i].Offset + Runs[i].Length - Req->Offset > SPANBYTES))
+		{
+			Req = &Handle->Reqs[Handle->ReqCnt++];
+			Req->Offset = Runs[i].Offset;
+			Req->Iov = n;
+			Req->Count = 0;
 		}
-		Cnt = write(Fd, (char *)&Null, sizeof(Null));
-		InfoLength += 1;
+		else if (Gap > 0)
+		{
+			Handle->Iov[n].iov_base = Handle->Sink;
+			Handle->Iov[n].iov_len = (size_t)Gap;
+			n++;
+			Req->Count++;
+		}
+		Handle->Iov[n].iov_base = Runs[i].Buffer;
+		Handle->Iov[n].iov_len = (size_t)Runs[i].Length;
+		n++;
+		Req->Count++;
+		End = Runs[i].Offset + Runs[i].Length;
+	}
+}
 
-		/* change the length of the file */
-		ftruncate(Fd, (off_t)(Image->Address[aINFO] + InfoLength));
+static void RingQueue(IMASYNC *Handle, int Request)
+{
+	URING *Ring = &Handle->Ring;
+	URINGREQ *Req = &Handle->Reqs[Request];
+	struct io_uring_sqe *Sqe;
+	unsigned Tail;
+	unsigned Index;
+
+	Tail = *Ring->SqTail;
+	Index = Tail & *Ring->SqMask;
+	Sqe = &Ring->Sqes[Index];
+	memset(Sqe, 0, sizeof(*Sqe));
+	Sqe->opcode = IORING_OP_READV;
+	Sqe->fd = Handle->Fd;
+	Sqe->addr = (unsigned long)&Handle->Iov[Req->Iov];
+	Sqe->len = (unsigned)Req->Count;
+	Sqe->off = (unsigned long long)(Handle->Base + Req->Offset);
+	Sqe->user_data = (unsigned long long)Request;
+	Ring->SqArray[Index] = Index;
+	__atomic_store_n(Ring->SqTail, Tail + 1, __ATOMIC_RELEASE);
+	Handle->InFlight++;
+}
 
-		if (Image->SwapNeeded) /* Swap the byte order of each address */
-      Swap((char *)&Image->Address[0], sizeof(Image->Address), INT);
+static void RingProgress(IMASYNC *Handle, int Wait)
+{
+	URING *Ring = &Handle->Ring;
+	struct io_uring_cqe *Cqe;
+	struct iovec *Iov;
+	URINGREQ *Req;
+	unsigned Head;
+	unsigned Tail;
+	unsigned Queued;
+	int Request;
+	int Res;
+
+	/* Block for at least one completion if asked to */
+	if (Wait && (Handle->InFlight > 0))
+		while ((syscall(__NR_io_uring_enter, Ring->Fd, 0, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno == EINTR));
+
+	/* Reap completions, requeueing the rest of any short read */
+	Queued = 0;
+	Head = *Ring->CqHead;
+	Tail = __atomic_load_n(Ring->CqTail, __ATOMIC_ACQUIRE);
+	while (Head != Tail)
+	{
+		Cqe = &Ring->Cqes[Head & *Ring->CqMask];
+		Request = (int)Cqe->user_data;
+		Res = Cqe->res;
+		Head++;
+		Handle->InFlight--;
+		IOSTAT(Res);
+		if (Res <= 0)
+		{
+			Handle->Status = INVALID;
+			continue;
+		}
 
-		/* Write addresses of image header fields */
-		Cnt = (int)lseek(Fd, (long)0, FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Address[0], sizeof(Image->Address));
-		if (Cnt != sizeof(Image->Address)) Warn("Image write failed");
+		/* Skip the buffers that are full and trim a partial one */
+		Req = &Handle->Reqs[Request];
+		Req->Offset += Res;
+		Iov = &Handle->Iov[Req->Iov];
+		while ((Req->Count > 0) && ((size_t)Res >= Iov->iov_len))
+		{
+			Res -= (int)Iov->iov_len;
+			Iov++;
+			Req->Iov++;
+			Req->Count--;
+		}
+		if (Req->Count > 0)
+		{
+			Iov->iov_base = (char *)Iov->iov_base + Res;
+			Iov->iov_len -= Res;
+			RingQueue(Handle, Request);
+			Queued++;
+		}
 	}
+	__atomic_store_n(Ring->CqHead, Head, __ATOMIC_RELEASE);
 
-	/* Close file and free image record */
-	free((char *)Image);
-	close(Fd);
-	return(VALID);
+	/* Keep the ring full */
+	while ((Handle->Status == VALID) && (Handle->Next < Handle->ReqCnt) &&
+		(Handle->InFlight < (int)Ring->Entries))
+	{
+		RingQueue(Handle, Handle->Next++);
+		Queued++;
+	}
+	if (Queued > 0)
+		while ((syscall(__NR_io_uring_enter, Ring->Fd, Queued, 0, 0, NULL, 0)
+			< 0) && (errno == EINTR));
+
+	/* Finish once nothing is left in flight */
+	if ((Handle->InFlight == 0) &&
+		((Handle->Next == Handle->ReqCnt) || (Handle->Status == INVALID)))
+		AsyncFinish(Handle);
 }
+#endif
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine closes an image, forcing it to be compressed.      */
+/* Purpose:  This routine starts an asynchronous read of a subwindow.  The   */
+/*           arguments are those of imgetpix plus an optional callback that  */
+/*           is called once, with VALID or INVALID, when the pixels are in   */
+/*           place.  The returned handle is checked with imasync_poll and    */
+/*           released with imasync_wait.  Reads are queued on an io_uring    */
+/*           when the library is built with HAVE_IO_URING and the kernel     */
+/*           allows it; otherwise they run on the worker pool.  With the     */
+/*           io_uring the callback runs inside imasync_poll/imasync_wait,    */
+/*           so the handle must be polled from one thread; with the pool it  */
+/*           runs on a worker thread.  Compressed images are decompressed    */
+/*           before this routine returns.                                    */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-#ifndef NO_COMPRESSION
-int imcloseC (IMAGE *Image)
+IMASYNC *imgetpix_async(IMAGE *Image, int Endpts[][2], int *Coarseness,
+	GREYTYPE *Pixels, IMCALLBACK Callback, void *Data)
 {
-	int Fd;
-	int Cnt;
-	int Length;
-	int InfoLength;
-	char Null = '\0';
+	IMASYNC *Handle;
 	int i;
-	char* Buffer;
-	char* envVar;
-
-	if(haveNotReadCompressionConfigFile) readCompressionConfigFile();
+#ifndef WIN32
+	int TaskCnt;
+	int Size;
+#endif
 
 	/* Check parameters */
-	if (Image == NULL) Error("Null image pointer");
+	if (Image == NULL) ErrorNull("Null image pointer");
+	if (Pixels == NULL) ErrorNull("Null pixel buffer");
 
 	/* Check that file is open */
-	Fd = Image->Fd;
-	if (Fd == EOF) Error("Image not open");
+	if (Image->Fd == EOF) ErrorNull("Image not open");
 
-	if (Image->nImgFormat == 0)
+	/* Check endpoints */
+	for (i=0; i<Image->Dimc; i++)
 	{
-		/* if the image was opened as an uncompressed file, close it as a
-			 compressed file */
-		if(!Image->Compressed)
-		{
-			strcpy(Image->UCPixelsFileName, "/usr/tmp/tempimXXXXXX");
-			mkstemp(Image->UCPixelsFileName);
-			Image->UCPixelsFd = open(Image->UCPixelsFileName,
-				O_RDWR | O_CREAT | O_TRUNC,
-				DEFAULT);
-
-			Buffer = (char*)malloc(Image->PixelCnt * Image->PixelSize);
-
-			/* read pixel data from image file */
-			Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-			Cnt = read(Image->Fd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt*Image->PixelSize)
-				Error("Uncompressed pixel read failed");
-       
-			/* write pixel data to temp file */
-			Cnt = write(Image->UCPixelsFd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			free(Buffer);
-			if (Cnt != Image->PixelCnt * Image->PixelSize)
-				Error("Uncompressed Image pixel write failed");
-
-			ftruncate(Image->UCPixelsFd, (off_t)(Image->PixelCnt*Image->PixelSize+1));
-			Image->Compressed = TRUE;
-			Image->PixelsAccessed = TRUE;
-			Image->PixelsModified = TRUE;
+		if (Coarseness[i] < 1) ErrorNull("Bad coarseness");
+		if (Endpts[i][0] < 0) ErrorNull("Bad endpoints range");
+		if (Endpts[i][1] >= Image->Dimv[i]) ErrorNull("Bad endpoints range");
+		if (Endpts[i][1] < Endpts[i][0]) ErrorNull("Bad endpoints order");
+	}
 
-			Image->CompressionMethod = 0;
-			if((envVar = getenv("IMAGE_COMPRESS")) != NULL)
-			{
-				Image->Compressed = TRUE;
-				/* find the specified compression method; if it can't be determined,
-					 it defaults to 0 */
-				if(sscanf(envVar,"%d", &(Image->CompressionMethod)) != 1)
-					Image->CompressionMethod = 0;
-
-				/* this step assumes that NumberOfCompressionMethods > 0 */
-				if(Image->CompressionMethod >= NumberOfCompressionMethods)
-				{
-					char message[256];
-					sprintf(message, "Compression method %d out of bounds (only %d methods defined).\nDefaulting to method 0",
-						Image->CompressionMethod, NumberOfCompressionMethods);
-					Warn(message);
-					Image->CompressionMethod = 0;
-				}
-			}
-			Image->Address[aVERNO] =
-				Image->Address[aVERNO] | COMPRESSED | Image->CompressionMethod * 4096;
-		}
+	/* if the pixels have not been uncompressed, do so now */
+	if(Image->Compressed && !Image->PixelsAccessed &&
+		decompressImage(Image) == INVALID) return(NULL);
+
+	/* Allocate handle */
+	Handle = (IMASYNC *)calloc(1, sizeof(IMASYNC));
+	if (Handle == NULL) ErrorNull("Allocation error");
+	Handle->Image = Image;
+	Handle->Pixels = Pixels;
+	Handle->Callback = Callback;
+	Handle->Data = Data;
+	Handle->Status = VALID;
+	Handle->Done = FALSE;
 
-		if(Image->PixelsModified)
+#ifdef WIN32
+	/* No asynchronous I/O here; complete the read before returning */
+	Handle->Status = imgetpix(Image, Endpts, Coarseness, Pixels);
+	Handle->Bytes = 0;
+	AsyncFinish(Handle);
+	return(Handle);
+#else
+	/* Plan the runs to read */
+	Handle->RunCnt = PlanRuns(Image, Endpts, Coarseness, (char *)Pixels,
+		&Handle->Runs);
+	if (Handle->RunCnt < 0)
+	{
+		free(Handle);
+		ErrorNull("Allocation error");
+	}
+	Handle->Bytes = (IMINDEX)(Handle->Runs[Handle->RunCnt-1].Buffer
+		+ Handle->Runs[Handle->RunCnt-1].Length - (char *)Pixels);
+	pthread_mutex_init(&Handle->Lock, NULL);
+	pthread_cond_init(&Handle->Finished, NULL);
+
+#ifdef HAVE_IO_URING
+	/* Queue the runs on an io_uring if we can get one.  Decompressed */
+	/* pixels held in memory, and runs of pixels spread out by a     */
+	/* coarseness, are read by the worker pool instead.              */
+	for (i=0; i<Handle->RunCnt && Handle->Runs[i].Step == 0; i++);
+	Handle->Reqs = (URINGREQ *)malloc(Handle->RunCnt * sizeof(URINGREQ));
+	Handle->Iov = (struct iovec *)malloc(2 * Handle->RunCnt *
+		sizeof(struct iovec));
+	Handle->Sink = (Image->Coalesce > 0) ?
+		(char *)malloc((size_t)Image->Coalesce) : NULL;
+	if ((Handle->Reqs != NULL) && (Handle->Iov != NULL) &&
+		(Image->UCPixels == NULL) && (i == Handle->RunCnt) &&
+		(RingOpen(&Handle->Ring, URINGDEPTH) == VALID))
+	{
+		Handle->Backend = ASYNCURING;
+		if (Image->Compressed)
 		{
-			compressImage(Image);
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
+			Handle->Fd = Image->UCPixelsFd;
+			Handle->Base = 0;
+			for (i=0; i<Handle->RunCnt && Image->Chunked; i++)
+				LoadChunks(Image, Handle->Runs[i].Offset,
+					RUNEXTENT(&Handle->Runs[i], Image->PixelSize), FALSE);
 		}
-		else if(Image->PixelsAccessed)
+		else
 		{
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
+			Handle->Fd = Image->Fd;
+			Handle->Base = Image->Address[aPIXELS];
 		}
+		RingPlan(Handle);
+		RingProgress(Handle, FALSE);
+		return(Handle);
+	}
+	free(Handle->Reqs);
+	free(Handle->Iov);
+	free(Handle->Sink);
+	Handle->Reqs = NULL;
+	Handle->Iov = NULL;
+	Handle->Sink = NULL;
+#endif
 
-		/* save the compression type as an info field */
-		imputinfo(Image, "Pixel Compression Method", 
-			compressionMethods[Image->CompressionMethod].methodName);
-
-		/* Swap the byte order of header fields except the title and address */
-		if (Image->SwapNeeded) Swapheader(Image); 
- 
-		/* Write Title field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aTITLE], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
-		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
-
-		/* Write MaxMin field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aMAXMIN], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
-		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
-		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
-
-		/* Write Histogram field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aHISTO], FROMBEG);
-		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
-		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
-		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
-
-		/* Write PixelFormat field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aPIXFORM], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
-		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
-
-		/* Write DimC field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMC], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
-		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+	/* Otherwise spread the runs over the worker pool */
+	Handle->Backend = ASYNCTHREADS;
+	Size = PoolSize();
+	TaskCnt = 4 * (Size > 0 ? Size : 1);
+	if (TaskCnt > Handle->RunCnt) TaskCnt = Handle->RunCnt;
+	Handle->Tasks = (ASYNCTASK *)malloc(TaskCnt * sizeof(ASYNCTASK));
+	if (Handle->Tasks == NULL)
+	{
+		free(Handle->Runs);
+		free(Handle);
+		ErrorNull("Allocation error");
+	}
+	Handle->Pending = TaskCnt;
+	for (i=0; i<TaskCnt; i++)
+	{
+		Handle->Tasks[i].Handle = Handle;
+		Handle->Tasks[i].First = (int)((long)Handle->RunCnt * i / TaskCnt);
+		Handle->Tasks[i].Last = (int)((long)Handle->RunCnt * (i+1) / TaskCnt);
+		Handle->Tasks[i].Job.Func = AsyncTask;
+		Handle->Tasks[i].Job.Arg = &Handle->Tasks[i];
+	}
+	for (i=0; i<TaskCnt; i++)
+		if (PoolSubmit(&Handle->Tasks[i].Job) == INVALID)
+			AsyncTask(&Handle->Tasks[i]);
+	return(Handle);
+#endif
+}
 
-		/* Write DimV field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMV], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
-		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine returns TRUE if an asynchronous read has           */
+/*           finished and FALSE if it is still in progress.                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imasync_poll(IMASYNC *Handle)
+{
+	int Done;
 
-		/* Write Info field */
-		InfoLength = 0;
-		Cnt = (int)lseek(Fd, (long)Image->Address[aINFO], FROMBEG);
-		for (i=0; i<Image->InfoCnt; i++)
-		{
-      /* Write name of field and free string */
-      Length = (int) strlen(Image->InfoName[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoName[i]);
-      InfoLength += Length;
+	/* Check parameters */
+	if (Handle == NULL) Error("Null async handle");
 
-      /* Write field data and free string */
-      Length = (int) strlen(Image->InfoData[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoData[i]);
-      InfoLength += Length;
-		}
-		Cnt = write(Fd, (char *)&Null, sizeof(Null));
-		InfoLength += 1;
+#ifdef HAVE_IO_URING
+	if ((Handle->Backend == ASYNCURING) && !Handle->Done)
+		RingProgress(Handle, FALSE);
+#endif
+#ifndef WIN32
+	pthread_mutex_lock(&Handle->Lock);
+	Done = Handle->Done;
+	pthread_mutex_unlock(&Handle->Lock);
+#else
+	Done = Handle->Done;
+#endif
+	return(Done);
+}
 
-		/* change the length of the file */
-		ftruncate(Fd, (off_t)(Image->Address[aINFO] + InfoLength));
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine waits for an asynchronous read to finish, frees    */
+/*           the handle and returns the status of the read.                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imasync_wait(IMASYNC *Handle)
+{
+	int Status;
 
-		if (Image->SwapNeeded) /* Swap the byte order of each address */
-      Swap((char *)&Image->Address[0], sizeof(Image->Address), INT);
+	/* Check parameters */
+	if (Handle == NULL) Error("Null async handle");
 
-		/* Write addresses of image header fields */
-		Cnt = (int)lseek(Fd, (long)0, FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Address[0], sizeof(Image->Address));
-		if (Cnt != sizeof(Image->Address)) Warn("Image write failed");
-	}else{
-		fprintf(stderr,"can only compress .im format images\n");
+#ifndef WIN32
+#ifdef HAVE_IO_URING
+	if (Handle->Backend == ASYNCURING)
+	{
+		while (!Handle->Done)
+			RingProgress(Handle, TRUE);
+		RingClose(&Handle->Ring);
+		free(Handle->Reqs);
+		free(Handle->Iov);
+		free(Handle->Sink);
 	}
-	
-	/* Close file and free image record */
-	free((char *)Image);
-	close(Fd);
+#endif
+	pthread_mutex_lock(&Handle->Lock);
+	while (!Handle->Done)
+		pthread_cond_wait(&Handle->Finished, &Handle->Lock);
+	pthread_mutex_unlock(&Handle->Lock);
+	pthread_mutex_destroy(&Handle->Lock);
+	pthread_cond_destroy(&Handle->Finished);
+	free(Handle->Tasks);
+	free(Handle->Runs);
+#endif
+
+	Status = Handle->Status;
+	free(Handle);
+	if (Status == INVALID) Error("Pixel read failed");
 	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine closes an image, forcing it to be uncompressed.    */
+/* Purpose:  This routine reads all useful image information from the        */
+/*           image image header.  This routine can be used in place of       */
+/*           imdim, imbounds, and imgetdesc.                                 */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imcloseU (IMAGE *Image)
+int imheader (IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int
+	*Dimc, int *Dimv, int *MaxMin)
 {
-	int Fd;
-	int Cnt;
-	int Length;
-	int InfoLength;
-	char Null = '\0';
 	int i;
-	char* Buffer;
-	char* envVar;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
+	if (PixFormat == NULL) Error("Null pixformat pointer");
+	if (PixSize == NULL) Error("Null pixsize pointer");
+	if (PixCnt == NULL) Error("Null pixcnt pointer");
+	if (Dimc == NULL) Error("Null dimc pointer");
+	if (Dimv == NULL) Error("Null dimv pointer");
+	if (MaxMin == NULL) Error("Null maxmin pointer");
 
 	/* Check that file is open */
-	Fd = Image->Fd;
-	if (Fd == EOF) Error("Image not open");
-
-	if (Image->nImgFormat == 0)
-	{
-		/* if the image was opened as a compressed file, close it as an
-			 uncompressed file */
-		if(Image->Compressed)
-		{
-			decompressImage(Image);
-
-			Buffer = (char*)malloc(Image->PixelCnt * Image->PixelSize);
-			lseek(Image->UCPixelsFd, 0, FROMBEG);
-			Cnt = read(Image->UCPixelsFd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt*Image->PixelSize)
-				Error("Uncompressed pixel read failed");
-
-			/* Write pixels into image file */
-			Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-			Cnt = write(Image->Fd, (char *)Buffer, Image->PixelCnt*Image->PixelSize);
-			if (Cnt != Image->PixelCnt * Image->PixelSize)
-				Error("Uncompressed Image pixel write failed");
-			free(Buffer);
-
-			/* set a few things straight */
-			Image->Compressed = FALSE;
-			Image->Address[aVERNO] = Image->Address[aVERNO] - COMPRESSED - Image->CompressionMethod * 4096;
-			Image->Address[aINFO] =
-				Image->Address[aPIXELS] + Image->PixelCnt*Image->PixelSize;
-
-			imputinfo(Image, "Pixel Compression Method", NULL);
+	if (Image->Fd == EOF) Error("Image not open");
 
-			close(Image->UCPixelsFd);
-			unlink(Image->UCPixelsFileName);
-		}
+	/* The pixel count does not fit, the caller must use impixcnt */
+	if (Image->PixelCnt > INT_MAX) Error("Pixel count too large, use impixcnt");
 
-		/* Swap the byte order of header fields except the title and address */
-		if (Image->SwapNeeded) Swapheader(Image); 
- 
-		/* Write Title field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aTITLE], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Title[0], sizeof(Image->Title));
-		if (Cnt != sizeof(Image->Title)) Warn("Image write failed");
+	/* Copy data */
+	*PixFormat = Image->PixelFormat;
+	*PixSize = Image->PixelSize;
+	*PixCnt = (int)Image->PixelCnt;
+	*Dimc = Image->Dimc;
+	for (i=0; i<*Dimc; i++)
+		Dimv[i] = Image->Dimv[i];
 
-		/* Write MaxMin field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aMAXMIN], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin));
-		if (Cnt != sizeof(Image->ValidMaxMin)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->MaxMin[0], sizeof(Image->MaxMin));
-		if (Cnt != sizeof(Image->MaxMin)) Warn("Image write failed");
+	/* Get correct MINMAX field */
+	imgetdesc(Image, MINMAX, MaxMin);
+   
+	return(VALID);
+}
 
-		/* Write Histogram field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aHISTO], FROMBEG);
-		Cnt = write(Fd,(char *)&Image->ValidHistogram,sizeof(Image->ValidHistogram));
-		if (Cnt != sizeof(Image->ValidHistogram)) Warn("Image write failed");
-		Cnt = write(Fd, (char *)&Image->Histogram[0], sizeof(Image->Histogram));
-		if (Cnt != sizeof(Image->Histogram)) Warn("Image write failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine returns the number of pixels in an image as a      */
+/*           64 bit count.  Use it instead of imheader for images of more    */
+/*           than 2^31 pixels.                                               */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int impixcnt (IMAGE *Image, IMINDEX *PixCnt)
+{
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (PixCnt == NULL) Error("Null pixcnt pointer");
 
-		/* Write PixelFormat field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aPIXFORM], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->PixelFormat, sizeof(Image->PixelFormat));
-		if (Cnt != sizeof(Image->PixelFormat)) Warn("Image write failed");
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
 
-		/* Write DimC field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMC], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimc, sizeof(Image->Dimc));
-		if (Cnt != sizeof(Image->Dimc)) Warn("Image write failed");
+	*PixCnt = Image->PixelCnt;
+	return(VALID);
+}
 
-		/* Write DimV field */
-		Cnt = (int)lseek(Fd, (long)Image->Address[aDIMV], FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Dimv[0], sizeof(Image->Dimv));
-		if (Cnt != sizeof(Image->Dimv)) Warn("Image write failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads all useful image information from the        */
+/*           image image header.  This routine can be used in place of       */
+/*           imdim, imbounds, and imgetdesc.                                 */
+/*                                                                           */
+/*           This version also returns information about compression used    */
+/*           in the image (on/off, type, compression ratio)                  */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imheaderC (IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int
+	*Dimc, int *Dimv, int *MaxMin, int *Compressed, int *CompMethod, float
+	*CompRatio)
+{
+	int i;
+	
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (PixFormat == NULL) Error("Null pixformat pointer");
+	if (PixSize == NULL) Error("Null pixsize pointer");
+	if (PixCnt == NULL) Error("Null pixcnt pointer");
+	if (Dimc == NULL) Error("Null dimc pointer");
+	if (Dimv == NULL) Error("Null dimv pointer");
+	if (MaxMin == NULL) Error("Null maxmin pointer");
 
-		/* Write Info field */
-		InfoLength = 0;
-		Cnt = (int)lseek(Fd, (long)Image->Address[aINFO], FROMBEG);
-		for (i=0; i<Image->InfoCnt; i++)
-		{
-      /* Write name of field and free string */
-      Length = (int) strlen(Image->InfoName[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoName[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoName[i]);
-      InfoLength += Length;
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
 
-      /* Write field data and free string */
-      Length = (int) strlen(Image->InfoData[i]) + 1;
-      Cnt = write(Fd, (char *)Image->InfoData[i], Length);
-      if (Cnt != Length) Warn("Image write failed");
-      free(Image->InfoData[i]);
-      InfoLength += Length;
-		}
-		Cnt = write(Fd, (char *)&Null, sizeof(Null));
-		InfoLength += 1;
+	/* The pixel count does not fit, the caller must use impixcnt */
+	if (Image->PixelCnt > INT_MAX) Error("Pixel count too large, use impixcnt");
 
-		/* change the length of the file */
-		ftruncate(Fd, (off_t)(Image->Address[aINFO] + InfoLength));
+	/* Copy data */
+	*PixFormat = Image->PixelFormat;
+	*PixSize = Image->PixelSize;
+	*PixCnt = (int)Image->PixelCnt;
+	*Dimc = Image->Dimc;
+	for (i=0; i<*Dimc; i++)
+		Dimv[i] = Image->Dimv[i];
 
-		if (Image->SwapNeeded) /* Swap the byte order of each address */
-      Swap((char *)&Image->Address[0], sizeof(Image->Address), INT);
+	/* Get correct MINMAX field */
+	imgetdesc(Image, MINMAX, MaxMin);
+   
+	*Compressed = Image->Compressed;
+	*CompMethod = Image->CompressionMethod;
+	*CompRatio = (float)(Image->Address[aINFO] - Image->Address[aPIXELS]) / 
+		(float)(Image->PixelCnt * Image->PixelSize);
 
-		/* Write addresses of image header fields */
-		Cnt = (int)lseek(Fd, (long)0, FROMBEG);
-		Cnt = write(Fd, (char *)&Image->Address[0], sizeof(Image->Address));
-		if (Cnt != sizeof(Image->Address)) Warn("Image write failed");
-	}
-	/* Close file and free image record */
-	free((char *)Image);
-	close(Fd);
 	return(VALID);
 }
-#endif
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine swaps the byte order of each word in a buffer.     */
+/*	Purpose:  returns the compression information for the image          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int Swap (char *Buffer, int Length, int Type)
+int imgetcompinfo (IMAGE *Image, int *Compressed, int *CompMethod, float *CompRatio)
 {
-	int Word, nWord, Byte, nByte;
-	char temp;
+	*Compressed = Image->Compressed;
+	*CompMethod = Image->CompressionMethod;
+	*CompRatio = (float)(Image->Address[aINFO] - Image->Address[aPIXELS]) / 
+		(float)(Image->PixelCnt * Image->PixelSize);
+	return(VALID);
+}
 
-	switch (Type) {
-		case GREY        : nByte = sizeof(GREYTYPE);  break;
-		case COLOR       : nByte = sizeof(COLORTYPE); break;
-		case SHORT       : nByte = sizeof(SHORTTYPE); break;
-		case LONG        : nByte = sizeof(LONGTYPE);  break;
-		case INT         : nByte = sizeof(int);       break;
-		case USERPACKED  : nByte = sizeof(USERTYPE);  break;
-		case REAL        : 
-		case COMPLEX     : nByte = sizeof(REALTYPE);  break;
-		default          :                            break;
-	}
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine sets an access option of an open image.  The       */
+/*           options only tune how pixels are read and written:              */
+/*                                                                           */
+/*              OPT_COALESCE - GetPutND merges runs of a subwindow that are  */
+/*                             at most this many bytes apart into a single   */
+/*                             read.  0 merges touching runs only.           */
+/*              OPT_DIRECTIO - TRUE makes imread of 1 MB or more, and        */
+/*                             imgetpix of the whole image, read with        */
+/*                             O_DIRECT so the page cache is left alone.     */
+/*                             Ignored where direct I/O is not supported.    */
+/*              OPT_STREAMING - TRUE drops pixels from the page cache once   */
+/*                             imread or imgetpix has read them, for data    */
+/*                             that is read once.                            */
+/*              OPT_PARALLEL - TRUE lets imgetdesc scan an image of several  */
+/*                             blocks on the worker pool, one slab per       */
+/*                             worker.  The results are the same.            */
+/*              OPT_TRACKHISTO - TRUE counts GREY pixels as they are         */
+/*                             written.  If the image is written once front  */
+/*                             to back from now on, its MAXMIN and HISTO     */
+/*                             fields are valid at imclose without a scan.   */
+/*              OPT_SLICEINDEX - TRUE makes imclose of an image whose pixels */
+/*                             were written build the slice index (see       */
+/*                             imindex), so it is saved with the image.      */
+/*              OPT_ZONEMAP - TRUE keeps the zone map (see imgetabove) of    */
+/*                             pixels as they are written.  If the image is  */
+/*                             written once front to back from now on, the   */
+/*                             map is ready without a scan.                  */
+/*              OPT_UCMEMORY - megabytes up to which the decompressed pixels */
+/*                             of a compressed image are held in memory.     */
+/*                             Larger images use a temporary file in         */
+/*                             IMAGE_TEMPDIR.  0 always uses the file.  It   */
+/*                             applies when the pixels are next              */
+/*                             decompressed.                                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imsetopt (IMAGE *Image, int Option, int Value)
+{
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
 
-	nWord = Length / nByte;
-   
-	for (Word = 0; Word < nWord; Word ++) {
-		for (Byte = 0; Byte < nByte/2; Byte ++) {
-			temp = Buffer[Word * nByte + Byte];
-			Buffer[Word * nByte + Byte] = Buffer[Word * nByte + nByte - 1 - Byte];
-			Buffer[Word * nByte + nByte - 1 - Byte] = temp;
-		}
+	switch (Option) {
+		case OPT_COALESCE:
+			if (Value < 0) Error("Invalid option value");
+			Image->Coalesce = Value;
+			break;
+		case OPT_DIRECTIO:
+			Image->DirectIO = (Value != FALSE);
+			break;
+		case OPT_STREAMING:
+			Image->Streaming = (Value != FALSE);
+			break;
+		case OPT_PARALLEL:
+			Image->Parallel = (Value != FALSE);
+			break;
+		case OPT_TRACKHISTO:
+			StopTracking(Image);
+			Image->TrackHisto = (Value != FALSE);
+			Image->HistoNext = 0;
+			break;
+		case OPT_SLICEINDEX:
+			Image->SliceIndex = (Value != FALSE);
+			break;
+		case OPT_ZONEMAP:
+			StopZones(Image);
+			Image->TrackZones = (Value != FALSE);
+			Image->ZoneNext = 0;
+			break;
+		case OPT_UCMEMORY:
+			if (Value < 0) Error("Invalid option value");
+			Image->UCMemory = (IMINDEX)Value << 20;
+			break;
+		default:
+			Error("Invalid option");
 	}
-	return 0;
-} 
+	return(VALID);
+}
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine swaps the byte order of header fields of an image. */
+/* Purpose:  This routine returns the pixel format and dimension count.      */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int 
-Swapheader (IMAGE *Image)
+int imdim (IMAGE *Image, int *PixFormat, int *Dimc)
 {
-	Swap((char *)&Image->ValidMaxMin, sizeof(Image->ValidMaxMin), INT);
-	Swap((char *)&Image->MaxMin[0], sizeof(Image->MaxMin), INT);
-	Swap((char *)&Image->ValidHistogram, sizeof(Image->ValidHistogram), INT);
-	Swap((char *)&Image->Histogram[0], sizeof(Image->Histogram), INT);
-	Swap((char *)&Image->PixelFormat, sizeof(Image->PixelFormat), INT);
-	Swap((char *)&Image->Dimc, sizeof(Image->Dimc), INT);
-	Swap((char *)&Image->Dimv[0], sizeof(Image->Dimv), INT);
-	return 0;
+
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (PixFormat == NULL) Error("Null pixformat pointer");
+	if (Dimc == NULL) Error("Null dimc pointer");
+
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	/* Copy data */
+	*PixFormat = Image->PixelFormat;
+	*Dimc = Image->Dimc;
+
+	return(VALID);
 }
 
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  Reads in the compression types				     */
+/* Purpose:  This routine returns the image dimension vector.                */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-
-#ifndef NO_COMPRESSION
-int readCompressionConfigFile (void)
+int imbounds (IMAGE *Image, int *Dimv)
 {
-  FILE *configFile;
-  char lineread[241];
-  int tempChar;
-  int offset;
-  int numCompMethods;
-  int i;
-
-  if((configFile = fopen(COMPRESSION_TYPE_FILE, "r")) == NULL)
-  {
-    fprintf(stderr, "Error: could not open the compression config file.\n");
-    exit(1);
-  }
-
-  numCompMethods = 0;
-  while(fgets(lineread, 240, configFile))
-  {
-    if(numCompMethods == MAX_NUM_COMP_METHODS) break;
+	int i;
 
-    /*   ignore lines beginning with '#'   */
-    if(lineread[0] != '#')
-    {
-      tempChar = 0;
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Dimv == NULL) Error("Null dimv pointer");
 
-      /* read the compression method name (up to the ':') */
-      while(lineread[tempChar] != ':')
-      {
-        compressionMethods[numCompMethods].methodName[tempChar]
-					= lineread[tempChar];
-				tempChar++;
-      }
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
 
-      /* read the compression command (up to the ':') */
-      tempChar++; offset = tempChar;
-      while(lineread[tempChar] != ':')
-      {
-        compressionMethods[numCompMethods].compressionCommand[tempChar-offset]
-					= lineread[tempChar];
-				tempChar++;
-      }
+	/* Copy data */
+	for (i=0; i<Image->Dimc; i++)
+		Dimv[i] = Image->Dimv[i];
+   
+	return(VALID);
+}
 
-      /* read the decompression command (up to the EOL) */
-      tempChar++; offset = tempChar;
-      while(lineread[tempChar] != '\n')
-      {
-        compressionMethods[numCompMethods].decompressionCommand[tempChar-offset]
-					= lineread[tempChar];
-				tempChar++;
-      }
 
-      numCompMethods++;
-    }
-  }
-  haveNotReadCompressionConfigFile = FALSE;
-  fclose(configFile);
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine adds Cnt GREY pixels to a scan.  If Count is       */
+/*           given, Count[v - MINVAL] is incremented for each pixel of       */
+/*           value v; otherwise [*Min, *Max] is widened to take in the       */
+/*           pixels.  Runs of equal pixels, such as background, are counted  */
+/*           with one increment.                                             */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void ScanBlock(const GREYTYPE *Pixels, IMINDEX Cnt, int *Min,
+	int *Max, IMINDEX *Count)
+{
+	IMINDEX Run;
+	IMINDEX i;
+	int Last;
 
-  if(numCompMethods == 0)
-  {
-    fprintf(stderr, "Error: could not read any compression methods.\n");
-    exit(1);
-  }
+	if (Count == NULL)
+	{
+		_imminmaxfunc(Pixels, Cnt, Min, Max);
+		return;
+	}
 
-  NumberOfCompressionMethods = numCompMethods;
-  return 1;
+	Last = Pixels[0];
+	Run = 0;
+	for (i=0; i<Cnt; i++)
+	{
+		if (Pixels[i] == Last)
+			Run++;
+		else
+		{
+			Count[Last - MINVAL] += Run;
+			Last = Pixels[i];
+			Run = 1;
+		}
+	}
+	Count[Last - MINVAL] += Run;
 }
-#endif
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  takes parameters and generates a specific command string to     */
-/*           either compress or decompress pixel data                        */
+/* Purpose:  This routine reads every pixel of a GREY image a BLOCKBYTES     */
+/*           block at a time on the calling thread and adds it to a scan     */
+/*           (see ScanBlock).                                                */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int fillInCompressionCommand (char *specific, char *generic, char *infile,
-	char *outfile, IMAGE *Image)
+static int ScanSerial(IMAGE *Image, int *Min, int *Max, IMINDEX *Count)
 {
-  int gPosition = 0;
-  int sPosition = 0;
-  int i;
-  char tempstring[256];
+	GREYTYPE *Pixels;
+	IMINDEX Low, High;
 
-  while(generic[gPosition] != '\0')
-  {
-    if(generic[gPosition] != '%')
-    {
-      specific[sPosition] = generic[gPosition];
-      gPosition++;  sPosition++;
-    }
-    else
-    {
-      gPosition++;
-      switch(generic[gPosition])
-      {
-				/* print the dimensions */
-				case 'd':	sprintf(tempstring, "-d %d ", Image->Dimc);
-					for(i = 0; i < Image->Dimc; i++)
-					{
-						char numString[10];
-						sprintf(numString, "%d ", Image->Dimv[i]);
-						strcat(tempstring, numString);
-					}
-					break;
-					/* print the image type */
-				case 't':	sprintf(tempstring, "-t %d ", Image->PixelFormat);
-					break;
-					/* print the input file name */
-				case 'i':	strcpy(tempstring, infile);
-					break;
-					/* print the output file name */
-				case 'o':	strcpy(tempstring, outfile);
-					break;
-        default:	break;
-      }
-      for(i = 0; i < (int) strlen(tempstring); i++)
-      {
-        specific[sPosition] = tempstring[i];
-        sPosition++;
-      }
-      gPosition++;
-    }
-  }
-  specific[sPosition] = '\0';
-	return 0;
+	if ((Pixels = (GREYTYPE *)GetBlock()) == NULL) return(INVALID);
+
+	for (Low=0; Low<Image->PixelCnt; Low=High+1)
+	{
+		/* Compute read range */
+		High = Low + BLOCKBYTES / sizeof(GREYTYPE) - 1;
+		if (High >= Image->PixelCnt) High = Image->PixelCnt - 1;
+
+		/* Read pixels */
+		if (imread64(Image, Low, High, Pixels) == INVALID)
+		{
+			PutBlock((char *)Pixels);
+			return(INVALID);
+		}
+		ScanBlock(Pixels, High - Low + 1, Min, Max, Count);
+	}
+
+	PutBlock((char *)Pixels);
+	return(VALID);
 }
 
+#ifndef WIN32
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine is the worker pool job for one slab of a parallel  */
+/*           scan.  The slab is read with positioned reads into a pooled     */
+/*           block and added to the task's own accumulators.                 */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void ScanTask(void *Arg)
+{
+	SCANTASK *Task = (SCANTASK *)Arg;
+	IMAGE *Image = Task->Image;
+	GREYTYPE *Pixels;
+	IMINDEX Low, High;
+	IMINDEX Bytes;
+
+	Task->Status = INVALID;
+	if ((Pixels = (GREYTYPE *)GetBlock()) != NULL)
+	{
+		for (Low=Task->First; Low<=Task->Last; Low=High+1)
+		{
+			High = Low + BLOCKBYTES / sizeof(GREYTYPE) - 1;
+			if (High > Task->Last) High = Task->Last;
+			Bytes = (High - Low + 1) * sizeof(GREYTYPE);
+			if (PixelRead(Image, Low * sizeof(GREYTYPE), (char *)Pixels, Bytes)
+				!= Bytes) break;
+			if (Image->SwapNeeded) Swap((char *)Pixels, Bytes, GREY);
+			ScanBlock(Pixels, High - Low + 1, &Task->Min, &Task->Max,
+				Task->Count);
+		}
+		if (Low > Task->Last) Task->Status = VALID;
+		PutBlock((char *)Pixels);
+	}
+
+	pthread_mutex_lock(Task->Lock);
+	if (--*Task->Pending == 0) pthread_cond_signal(Task->Finished);
+	pthread_mutex_unlock(Task->Lock);
+}
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  Compresses the pixel data and updates the addresses.            */
+/* Purpose:  This routine scans a GREY image in SlabCnt slabs on the worker  */
+/*           pool and merges the slabs' accumulators into Min, Max and       */
+/*           Count.  Counts add exactly, so the result is the same as a      */
+/*           serial scan, which is done instead if memory runs out.          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int compressImage (IMAGE *Image)
+static int ScanParallel(IMAGE *Image, int SlabCnt, int *Min, int *Max,
+	IMINDEX *Count)
 {
-#ifndef NO_COMPRESSION
-  char commandString[256];
-  FILE *pfp;
-  char *Buffer;
-  int compressedLength;
-  int Cnt;
-
-  if(haveNotReadCompressionConfigFile) readCompressionConfigFile();
-
-  /* call the compression program, passing it the appropriate file names */
-  fillInCompressionCommand(commandString,
-		compressionMethods[Image->CompressionMethod].compressionCommand,
-		Image->UCPixelsFileName, "", Image);
-
-  pfp = popen(commandString, "r");
-
-  /* read the compressed data from the pipe to the compression program */
-  Buffer = (char*)malloc(Image->PixelSize * Image->PixelCnt);
-  compressedLength = (int)fread(Buffer, sizeof(char), Image->PixelCnt*Image->PixelSize, pfp);
+	pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t Finished = PTHREAD_COND_INITIALIZER;
+	SCANTASK *Tasks;
+	int Pending;
+	int Status;
+	int i;
+	int v;
 
-  pclose(pfp);
+	Tasks = (SCANTASK *)calloc(SlabCnt, sizeof(SCANTASK));
+	if (Tasks == NULL) return(ScanSerial(Image, Min, Max, Count));
+	for (i=0; i<SlabCnt; i++)
+	{
+		Tasks[i].Image = Image;
+		Tasks[i].First = Image->PixelCnt * i / SlabCnt;
+		Tasks[i].Last = Image->PixelCnt * (i+1) / SlabCnt - 1;
+		Tasks[i].Min = MAXVAL;
+		Tasks[i].Max = MINVAL;
+		Tasks[i].Pending = &Pending;
+		Tasks[i].Lock = &Lock;
+		Tasks[i].Finished = &Finished;
+		Tasks[i].Job.Func = ScanTask;
+		Tasks[i].Job.Arg = &Tasks[i];
+		if (Count != NULL && (Tasks[i].Count = (IMINDEX *)calloc(
+			MAXVAL - MINVAL + 1, sizeof(IMINDEX))) == NULL) break;
+	}
 
-  /* Write compressed pixels into image file */
-  Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-  Cnt = write(Image->Fd, (char *)Buffer, compressedLength);
-  if (Cnt != compressedLength) Error("Image pixel write failed");
+	/* Scan serially if memory ran out */
+	if (i < SlabCnt)
+	{
+		for (i=0; i<SlabCnt; i++)
+			if (Tasks[i].Count != NULL) free(Tasks[i].Count);
+		free(Tasks);
+		return(ScanSerial(Image, Min, Max, Count));
+	}
 
-  /* update the pointers (offsets) */
-  Image->Address[aINFO] = Image->Address[aPIXELS] + compressedLength;
-  free(Buffer);
-#endif
-	return 0;
+	/* Run the slabs */
+	Pending = SlabCnt;
+	for (i=0; i<SlabCnt; i++)
+		if (PoolSubmit(&Tasks[i].Job) == INVALID)
+			ScanTask(&Tasks[i]);
+	pthread_mutex_lock(&Lock);
+	while (Pending > 0)
+		pthread_cond_wait(&Finished, &Lock);
+	pthread_mutex_unlock(&Lock);
+
+	/* Merge the slabs */
+	Status = VALID;
+	for (i=0; i<SlabCnt; i++)
+	{
+		if (Status == VALID && Tasks[i].Status == VALID)
+		{
+			if (Count == NULL)
+			{
+				if (Tasks[i].Min < *Min) *Min = Tasks[i].Min;
+				if (Tasks[i].Max > *Max) *Max = Tasks[i].Max;
+			}
+			else
+				for (v=0; v<=MAXVAL-MINVAL; v++)
+					Count[v] += Tasks[i].Count[v];
+		}
+		else
+			Status = INVALID;
+		if (Tasks[i].Count != NULL) free(Tasks[i].Count);
+	}
+	free(Tasks);
+	return(Status);
 }
-
+#endif
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  Uncompresses the pixel data                                     */
+/* Purpose:  This routine adds every pixel of a GREY image to a scan (see    */
+/*           ScanBlock).  With OPT_PARALLEL set, large images are split into */
+/*           one slab per pool worker (see ScanParallel).                    */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int decompressImage (IMAGE *Image)
+static int ScanPixels(IMAGE *Image, int *Min, int *Max, IMINDEX *Count)
 {
-#ifndef NO_COMPRESSION
-  char commandString[256];
-  FILE *pfp;
-  char *Buffer;
-  int compressedLength;
-  int Cnt;
-
-  if(Image->PixelsAccessed == TRUE)
-    return (VALID);
-
-  strcpy(Image->UCPixelsFileName, "/usr/tmp/tempimXXXXXX");
-  mkstemp(Image->UCPixelsFileName);
+#ifndef WIN32
+	IMINDEX Blocks;
+	int SlabCnt;
 
-  if(haveNotReadCompressionConfigFile) readCompressionConfigFile();
+	if (Image->Parallel)
+	{
+		Blocks = Image->PixelCnt * sizeof(GREYTYPE) / BLOCKBYTES;
+		SlabCnt = PoolSize();
+		if (SlabCnt > Blocks) SlabCnt = (int)Blocks;
+		if (SlabCnt > 1)
+		{
+			if (Image->Compressed && Image->PixelsAccessed == FALSE &&
+				decompressImage(Image) == INVALID) return(INVALID);
+			return(ScanParallel(Image, SlabCnt, Min, Max, Count));
+		}
+	}
+#endif
 
-  /* call the compression program, passing it the appropriate file names */
-  fillInCompressionCommand(commandString,
-		compressionMethods[Image->CompressionMethod].decompressionCommand,
-		"", Image->UCPixelsFileName, Image);
-  pfp = popen(commandString, "w");
+	return(ScanSerial(Image, Min, Max, Count));
+}
 
-  /* read the compressed data from the image file */
-  compressedLength = (Image->Address[aINFO] - Image->Address[aPIXELS]);
-  Buffer = (char*)malloc(compressedLength);
-  Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-  Cnt = read(Image->Fd, (char *)Buffer, compressedLength);
-  if (Cnt != compressedLength) Error("Compressed pixel read failed");
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  These routines turn a count of every GREY value (see ScanBlock) */
+/*           into descriptor fields.  CountRange finds the smallest and      */
+/*           largest values present.  FoldCounts sets the MAXMIN field if    */
+/*           it is not valid and then the HISTO field, putting any pixels    */
+/*           out of range in the end buckets.                                */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void CountRange(IMINDEX *Count, int *Min, int *Max)
+{
+	int i;
 
-  /* write data to pipe */
-  Cnt = (int)fwrite(Buffer, sizeof(char), compressedLength, pfp);
-  if (Cnt != compressedLength) Error("Image decompression failed");
+	for (i=MINVAL; i<=MAXVAL; i++)
+		if (Count[i - MINVAL] != 0)
+		{
+			if (i < *Min) *Min = i;
+			*Max = i;
+		}
+}
 
-  pclose(pfp);
+static void FoldCounts(IMAGE *Image, IMINDEX *Count)
+{
+	int TempMin, TempMax;
+	int Index;
+	int i;
 
-  Image->PixelsAccessed = TRUE;
+	/* The MAX and MIN pixel values come from the counts JG1 */
+	if (Image->ValidMaxMin == FALSE)
+	{
+		TempMin = MAXVAL;
+		TempMax = MINVAL;
+		CountRange(Count, &TempMin, &TempMax);
+		Image->ValidMaxMin = TRUE;
+		Image->MaxMin[0] = TempMin;
+		Image->MaxMin[1] = TempMax;
+	}
+	TempMin = Image->MaxMin[0];
 
-  /* open the decompressed pixels file for reading or writing */
-  Image->UCPixelsFd = open(Image->UCPixelsFileName, O_RDWR, DEFAULT);
-  free(Buffer);
-#endif
-	return (VALID);
+	for (i=0; i<nHISTOGRAM; i++)
+		Image->Histogram[i] = 0;
+	for (i=MINVAL; i<=MAXVAL; i++)
+	{
+		if (Count[i - MINVAL] == 0) continue;
+
+		/* Determine index into histogram map JG1 */
+		Index = i - TempMin;
+		if (Index < 0)
+			Image->Histogram[ 0 ] += (int) Count[i - MINVAL];
+		else if (Index >= nHISTOGRAM)
+			Image->Histogram[ nHISTOGRAM-1 ] += (int) Count[i - MINVAL];
+		else
+			Image->Histogram[ Index ] += (int) Count[i - MINVAL];
+	}
+	Image->ValidHistogram = TRUE;
 }
 
-
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads pixel data from an image.                    */
+/* Purpose:  These routines keep a count of every GREY value written when    */
+/*           OPT_TRACKHISTO is set.  The count is only good for an image     */
+/*           written once from the first pixel to the last: HistoNext is     */
+/*           the next pixel a write must start at.  Any other write, a       */
+/*           strided write or a writable mapping stops tracking, and         */
+/*           imgetdesc falls back to reading the pixels.  TrackedCounts is   */
+/*           TRUE once every pixel has been counted; FinishTracking then     */
+/*           sets the MAXMIN and HISTO fields for imclose.                   */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imread(IMAGE *Image, int LoIndex, int HiIndex, GREYTYPE *Buffer)
+static void TrackWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+	IMINDEX Length)
 {
-	int Cnt;
-	int Length;
-	int Offset;   
-
-	/* Check parameters */
-	if (Image == NULL) Error("Null image pointer");
-	if (Buffer == NULL) Error("Null read buffer");
-	if ((LoIndex < 0) || (HiIndex > Image->PixelCnt) ||
-		(LoIndex > HiIndex)) Error("Invalid pixel index");
-
-	/* Check that file is open */
-	if (Image->Fd == EOF) Error("Image not open");
-
-	/* Determine number of bytes to read and the lseek offset */
-	Length = (HiIndex - LoIndex +1) * Image->PixelSize;
-	Offset = Image->Address[aPIXELS] + LoIndex * Image->PixelSize;
-
-	if(Image->Compressed)
+	if (Image->PixelFormat != GREY || Image->HistoNext < 0) return;
+	if (Offset != Image->HistoNext * Image->PixelSize ||
+		Image->HistoNext >= Image->PixelCnt || Length <= 0)
 	{
-		/* if pixels have not been accessed since opening the image, then */
-		/* the pixel data needs to be decompressed */
-		if(Image->PixelsAccessed == FALSE) {
-			decompressImage(Image);
-		}
-		/* Read pixels into buffer from decompressed pixels file */
-		Cnt = (int)lseek(Image->UCPixelsFd, (long)Offset - Image->Address[aPIXELS], FROMBEG);
-		Cnt = read(Image->UCPixelsFd, (char *)Buffer, Length);
-		if (Cnt != Length) Error("Uncompressed pixel read failed");
+		StopTracking(Image);
+		return;
 	}
-	else
+
+	if (Image->HistoCount == NULL &&
+		(Image->HistoCount = (IMINDEX *)calloc(MAXVAL - MINVAL + 1,
+		sizeof(IMINDEX))) == NULL)
 	{
-		/* Read pixels into buffer */
-		Cnt = (int)lseek(Image->Fd, (long)Offset, FROMBEG);
-		Cnt = read(Image->Fd, (char *)Buffer, Length);
-		if (Cnt != Length) Error("Image pixel read failed");
+		StopTracking(Image);
+		return;
 	}
+	ScanBlock((const GREYTYPE *)Buffer, Length / Image->PixelSize, NULL, NULL,
+		Image->HistoCount);
+	Image->HistoNext += Length / Image->PixelSize;
+}
 
-	/* Swap the byte order of pixels in buffer if needed */
-	if (Image->SwapNeeded) Swap((char *)Buffer, Length, Image->PixelFormat);
+static void StopTracking(IMAGE *Image)
+{
+	if (Image->HistoCount != NULL) free(Image->HistoCount);
+	Image->HistoCount = NULL;
+	Image->HistoNext = -1;
+}
 
-	/* unlink the file so that, when it is closed either by closing the
-	   file or the program terminating, its resources will be freed.
-		 Note that this relies on the fact that in Unix the resource
-		 releasing occurs only after the last open instance of the file
-		 is closed.
-	*/
-	unlink(Image->UCPixelsFileName);
+static int TrackedCounts(IMAGE *Image)
+{
+	return(Image->HistoCount != NULL && Image->HistoNext == Image->PixelCnt);
+}
 
-	return(VALID);
+static void FinishTracking(IMAGE *Image)
+{
+	if (TrackedCounts(Image)) FoldCounts(Image, Image->HistoCount);
+	StopTracking(Image);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine writes pixel data to an image.  For GREY images,   */
-/*           the maximum and minimum values are also updated, but the        */
-/*           histogram is NOT updated.  The algorithm used to update the     */
-/*           maximum and minimum values generates a bound on the image       */
-/*           intensities, but not always the tightest bound.  This is the    */
-/*           best we can do by looking at pixels as they are written.  To    */
-/*           compute the tightest upper bound requires that we look at all   */
-/*           pixels in the image.  This is what imgetdesc does.              */
+/* Purpose:  These routines keep the imgetstats results of an image in the   */
+/*           STATSINFO information field, so they are saved with the image.  */
+/*           The field, like SLICEINFO (see imindex), HISTOINFO (see         */
+/*           imgetpercentile) and ZONEINFO (see imgetabove), is only present */
+/*           while the MAXMIN field is valid: PutStats sets both, every      */
+/*           write that clears ValidMaxMin drops the fields, and imopen      */
+/*           drops them when an older library has written the pixels since.  */
+/*           An older library may also recompute MAXMIN after its writes, so */
+/*           each field starts with a fingerprint line holding MAXMIN and    */
+/*           PixelCnt, and a field whose fingerprint no longer matches the   */
+/*           header is ignored by StatsField and dropped by imopen.          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imwrite(IMAGE *Image, int LoIndex, int HiIndex, GREYTYPE *Buffer)
+static char *StatsField(IMAGE *Image, char *Name)
 {
-	int Cnt;
-	int Length;
-	int Offset;   
-	int TempMin;
-	int TempMax;
-	int PixelCnt;
+	char Print[100];
+	size_t Length;
 	int i;
 
-	/* Check parameters */
-	if (Image == NULL) Error("Null image pointer");
-	if (Buffer == NULL) Error("Null read buffer");
-	if ((LoIndex < 0) || (HiIndex > Image->PixelCnt) ||
-		(LoIndex > HiIndex)) Error("Invalid pixel index");
+	if (Image->ValidMaxMin == FALSE) return(NULL);
+	Length = sprintf(Print, "%d %d %lld\n", Image->MaxMin[0], Image->MaxMin[1],
+		(long long)Image->PixelCnt);
+	for (i=0; i<Image->InfoCnt; i++)
+		if (strcmp(Image->InfoName[i], Name) == 0)
+			return(strncmp(Image->InfoData[i], Print, Length) == 0 ?
+				Image->InfoData[i] + Length : NULL);
+	return(NULL);
+}
 
-	/* Check that file is open */
-	if (Image->Fd == EOF) Error("Image not open");
+static int PutStatsField(IMAGE *Image, char *Name, char *Data)
+{
+	char *Field;
+	size_t Length;
+	int Status;
+
+	if ((Field = (char *)malloc(100 + strlen(Data))) == NULL)
+		Error("Allocation error");
+	Length = sprintf(Field, "%d %d %lld\n", Image->MaxMin[0], Image->MaxMin[1],
+		(long long)Image->PixelCnt);
+	strcpy(Field + Length, Data);
+	Status = imputinfo(Image, Name, Field);
+	free(Field);
+	return(Status);
+}
 
-	if (Image->nImgFormat != 0) Error("Can not write this format image file");
+static int GetStats(IMAGE *Image, IMSTATS *Stats)
+{
+	char *Data;
 
-	/* Determine number of bytes to write and the lseek offset */
-	Length = (HiIndex - LoIndex +1) * Image->PixelSize;
-	Offset = Image->Address[aPIXELS] + LoIndex * Image->PixelSize;
+	if ((Data = StatsField(Image, STATSINFO)) == NULL) return(FALSE);
+	return(sscanf(Data, "%lf %lf %lf %lf %lld %lld",
+		&Stats->Min, &Stats->Max, &Stats->Sum, &Stats->SumSq,
+		&Stats->Count, &Stats->NaNCount) == 6);
+}
 
-	/* Swap the byte order of pixels in buffer if Needed */
-	if (Image->SwapNeeded) Swap((char *)Buffer, Length, Image->PixelFormat);
+static void PutMaxMin(IMAGE *Image, double Min, double Max)
+{
+	/* The MAXMIN field bounds the pixels with integers */
+	Image->ValidMaxMin = TRUE;
+	Image->MaxMin[0] = Min <= INT_MIN ? INT_MIN : (int)floor(Min);
+	Image->MaxMin[1] = Max >= INT_MAX ? INT_MAX : (int)ceil(Max);
+}
 
-	if (Image->Compressed) 
-	{
-		/* decompress the pixels so we have a file to write to */
-		if(Image->PixelsAccessed == FALSE)
-			decompressImage(Image);
+static void PutStats(IMAGE *Image, IMSTATS *Stats)
+{
+	char Data[200];
+
+	PutMaxMin(Image, Stats->Min, Stats->Max);
+	if (Image->nImgFormat != 0) return;
+	sprintf(Data, "%.17g %.17g %.17g %.17g %lld %lld", Stats->Min, Stats->Max,
+		Stats->Sum, Stats->SumSq, (long long)Stats->Count,
+		(long long)Stats->NaNCount);
+	PutStatsField(Image, STATSINFO, Data);
+}
 
-		/* Write pixels into decompressed pixel file */
-		Cnt = (int)lseek(Image->UCPixelsFd, (long)Offset - Image->Address[aPIXELS], FROMBEG);
-		Cnt = write(Image->UCPixelsFd, (char *)Buffer, Length);
-		if (Cnt != Length) Error("Image pixel write failed");
-	}
+static int IsStatsField(char *Name)
+{
+	return(strcmp(Name, STATSINFO) == 0 || strcmp(Name, SLICEINFO) == 0 ||
+		strcmp(Name, HISTOINFO) == 0 || strcmp(Name, ZONEINFO) == 0);
+}
 
-	else
+static void FreeStats(IMAGE *Image)
+{
+	if (Image->SliceStats != NULL) free(Image->SliceStats);
+	Image->SliceStats = NULL;
+	if (Image->PixelHisto != NULL)
 	{
-		/* Write pixels into image file */
-		Cnt = (int)lseek(Image->Fd, (long)Offset, FROMBEG);
-		Cnt = write(Image->Fd, (char *)Buffer, Length);
-		if (Cnt != Length) Error("Image pixel write failed");
+		free(Image->PixelHisto->Histogram);
+		free(Image->PixelHisto);
 	}
+	Image->PixelHisto = NULL;
+	if (Image->ZoneMap != NULL) free(Image->ZoneMap);
+	Image->ZoneMap = NULL;
+}
 
-	Image->PixelsModified = TRUE;
+static void DropStats(IMAGE *Image)
+{
+	FreeStats(Image);
+	if (Image->nImgFormat != 0) return;
+	imputinfo(Image, STATSINFO, NULL);
+	imputinfo(Image, SLICEINFO, NULL);
+	imputinfo(Image, HISTOINFO, NULL);
+	imputinfo(Image, ZONEINFO, NULL);
+}
 
-	/* Invalidate the MaxMin and Histogram fields */
-	Image->ValidMaxMin = FALSE;
-	Image->ValidHistogram = FALSE;
+static void DropStaleStats(IMAGE *Image)
+{
+	static char *Names[] = { STATSINFO, SLICEINFO, HISTOINFO, ZONEINFO };
+	int i, k;
 
-	/* Compute new Maximum and Minimum for GREY images */
-	if (Image->PixelFormat == GREY)
+	if (Image->ValidMaxMin == FALSE)
 	{
-		TempMax = Image->MaxMin[1];
-		TempMin = Image->MaxMin[0];
-		PixelCnt = HiIndex - LoIndex + 1;
-		for (i=0; i<PixelCnt; i++)
-		{
-			if (Buffer[i] > TempMax) TempMax = Buffer[i];
-			if (Buffer[i] < TempMin) TempMin = Buffer[i];
-		}
-		Image->MaxMin[1] = TempMax;
-		Image->MaxMin[0] = TempMin;
+		DropStats(Image);
+		return;
 	}
-
-	return(VALID);
+	for (k=0; k<4; k++)
+		for (i=0; i<Image->InfoCnt; i++)
+			if (strcmp(Image->InfoName[i], Names[k]) == 0 &&
+				StatsField(Image, Names[k]) == NULL)
+			{
+				imputinfo(Image, Names[k], NULL);
+				break;
+			}
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads an arbitrary subwindow of an image.  It      */
-/*           does optimal I/O for 1D, 2D and 3D images.  More general I/O    */
-/*           is used for higher dimension images.                            */
+/* Purpose:  These routines keep the histogram behind imgetpercentile in     */
+/*           Image->PixelHisto and the HISTOINFO information field.  The     */
+/*           field holds Bins, Low, High, Min, Max and Count (see IMSTATS)   */
+/*           and then a bucket number and count for each bucket that is not  */
+/*           empty.  8 and 16 bit pixels have one bucket per value, laid     */
+/*           out like the counts of ScanBlock, so imgetstats uses them too.  */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imgetpix(IMAGE *Image, int Endpts[][2], int *Coarseness, GREYTYPE
-	*Pixels)
+static int LoadHisto(IMAGE *Image)
 {
-	int i;
-
-	/* Check parameters */
-	if (Image == NULL) Error("Null image pointer");
-	if (Pixels == NULL) Error("Null pixel buffer");
-   
-	/* Check that file is open */
-	if (Image->Fd == EOF) Error("Image not open");
-
-	/* Check endpoints */
-	for (i=0; i<Image->Dimc; i++)
+	IMSTATS *Histo;
+	IMINDEX Bucket;
+	char *Data;
+	char *End;
+
+	if (Image->PixelHisto != NULL) return(VALID);
+	if ((Data = StatsField(Image, HISTOINFO)) == NULL) return(INVALID);
+
+	if ((Histo = (IMSTATS *)malloc(sizeof(IMSTATS))) == NULL)
+		return(INVALID);
+	Histo->Bins = (int)strtol(Data, &Data, 10);
+	Histo->Low = strtod(Data, &Data);
+	Histo->High = strtod(Data, &Data);
+	Histo->Min = strtod(Data, &Data);
+	Histo->Max = strtod(Data, &Data);
+	Histo->Count = strtoll(Data, &Data, 10);
+
+	/* 8 and 16 bit pixels are read back as counts by value, so any */
+	/* other layout is stale                                        */
+	if (Image->PixelSize <= (int) sizeof(GREYTYPE) &&
+		(Histo->Bins != MAXVAL - MINVAL + 1 || Histo->Low != MINVAL))
 	{
-		if (Coarseness[i] != 1) Error("Coarseness not implemented");
-		if (Endpts[i][0] < 0) Error("Bad endpoints range");
-		if (Endpts[i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
-		if (Endpts[i][1] < Endpts[i][0]) Error("Bad endpoints order");
+		free(Histo);
+		return(INVALID);
+	}
+	if (Histo->Bins <= 0 || Histo->Bins > MAXVAL - MINVAL + 1 ||
+		(Histo->Histogram = (IMINDEX *)calloc(Histo->Bins,
+		sizeof(IMINDEX))) == NULL)
+	{
+		free(Histo);
+		return(INVALID);
+	}
+	for (;;)
+	{
+		Bucket = strtoll(Data, &End, 10);
+		if (End == Data || Bucket < 0 || Bucket >= Histo->Bins) break;
+		Histo->Histogram[Bucket] = strtoll(End, &Data, 10);
 	}
+	Image->PixelHisto = Histo;
+	return(VALID);
+}
 
-	/* Check for image dimensions */
-	switch (Image->Dimc) {
+static int PutHisto(IMAGE *Image, IMSTATS *Histo)
+{
+	char *Data;
+	size_t Length;
+	int Status;
+	int i;
 
-		/* Handle 1D images */
-		case 1: 
-			return(imread(Image, Endpts[0][0], Endpts[0][1], Pixels));
-			break;
+	if (Image->nImgFormat != 0) return(VALID);
+	Length = 200;
+	for (i=0; i<Histo->Bins; i++)
+		if (Histo->Histogram[i] != 0) Length += 40;
+	if ((Data = (char *)malloc(Length)) == NULL) Error("Allocation error");
+	Length = sprintf(Data, "%d %.17g %.17g %.17g %.17g %lld", Histo->Bins,
+		Histo->Low, Histo->High, Histo->Min, Histo->Max,
+		(long long)Histo->Count);
+	for (i=0; i<Histo->Bins; i++)
+		if (Histo->Histogram[i] != 0)
+			Length += sprintf(Data + Length, "\n%d %lld", i,
+				(long long)Histo->Histogram[i]);
+	Status = PutStatsField(Image, HISTOINFO, Data);
+	free(Data);
+	return(Status);
+}
 
-      /* Handle 2D images */
-		case 2:
-			return(GetPut2D(Image, Endpts, Pixels, READMODE));
-			break;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine reads every pixel of a numeric image a BLOCKBYTES  */
+/*           block at a time.  8 and 16 bit pixels are counted by value      */
+/*           into Count (see ScanBlock), which gives their statistics and    */
+/*           any histogram exactly.  Wider pixels are either added to Acc    */
+/*           or, when Bin is given, binned into its histogram.               */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int StatsPixels(IMAGE *Image, STATSACC *Acc, IMINDEX *Count,
+	IMSTATS *Bin)
+{
+	const BYTETYPE *Bytes;
+	char *Pixels;
+	IMINDEX Low, High;
+	IMINDEX Cnt;
+	IMINDEX i;
+	double Scale;
+
+	if ((Pixels = GetBlock()) == NULL) return(INVALID);
+	Scale = 0;
+	if (Bin != NULL && Bin->High > Bin->Low)
+		Scale = Bin->Bins / (Bin->High - Bin->Low);
+
+	for (Low=0; Low<Image->PixelCnt; Low=High+1)
+	{
+		/* Compute read range */
+		High = Low + BLOCKBYTES / Image->PixelSize - 1;
+		if (High >= Image->PixelCnt) High = Image->PixelCnt - 1;
+		Cnt = High - Low + 1;
 
-      /* Handle 3D images */
-		case 3:
-			return(GetPut3D(Image, Endpts, Pixels, READMODE));
-			break;
+		/* Read pixels */
+		if (imread64(Image, Low, High, (GREYTYPE *)Pixels) == INVALID)
+		{
+			PutBlock(Pixels);
+			return(INVALID);
+		}
 
-      /* Handle higher dimension images */
-		default:
-			return(GetPutND(Image, Endpts, Pixels, READMODE));
-			break;
+		if (Count != NULL && Image->PixelFormat == BYTE)
+		{
+			Bytes = (const BYTETYPE *)Pixels;
+			for (i=0; i<Cnt; i++)
+				Count[Bytes[i] - MINVAL]++;
+		}
+		else if (Count != NULL)
+			ScanBlock((const GREYTYPE *)Pixels, Cnt, NULL, NULL, Count);
+		else if (Bin != NULL)
+			_imbinfunc(Pixels, Image->PixelFormat, Cnt, Bin, Scale);
+		else
+			_imstatsfunc(Pixels, Image->PixelFormat, Cnt, Acc);
 	}
 
+	PutBlock(Pixels);
 	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine writes an arbitrary subwindow of an image.  It     */
-/*           does optimal I/O for 1D, 2D and 3D images.  More general I/O    */
-/*           is used for higher dimension images.                            */
+/* Purpose:  This routine computes statistics of the pixels of a BYTE, GREY, */
+/*           COLOR, SHORT, USERPACKED, LONG or REAL image: the smallest and  */
+/*           largest value, the sum and sum of squares (in double), and the  */
+/*           number of NaN pixels, which are left out of everything else.    */
+/*           Count is the number of pixels that are not NaN.  If Bins is     */
+/*           positive, Histogram (supplied by the caller) also receives a    */
+/*           count of pixels in each of Bins equal buckets spanning          */
+/*           [Low..High], pixels out of range going in the end buckets.  If  */
+/*           Low >= High on entry, [Min..Max] is used and stored back.       */
+/*           Bins = 65536 over [-32768..32768] gives an exact count of every */
+/*           16 bit value.                                                   */
+/*                                                                           */
+/*           The statistics are saved in an information field and reused     */
+/*           until the pixels are written, so only the first call reads the  */
+/*           image.  A histogram of 8 or 16 bit pixels comes from one pass   */
+/*           counting every value; one of wider pixels takes a second pass   */
+/*           the first time.                                                 */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imputpix(IMAGE *Image, int Endpts[][2], int *Coarseness, GREYTYPE *Pixels)
+int imgetstats (IMAGE *Image, IMSTATS *Stats)
 {
+	STATSACC Acc;
+	IMINDEX *Count;
+	double Scale;
+	int TempMin, TempMax;
+	int Narrow;
+	int Cached;
 	int i;
-	int PixelCnt;
-	int TempMax;
-	int TempMin;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
-	if (Pixels == NULL) Error("Null pixel buffer");
-   
+	if (Stats == NULL) Error("Null statistics pointer");
+	if (ConvertSize(Image->PixelFormat, AS_DOUBLE) == 0)
+		Error("Image type is not numeric");
+	if (Stats->Bins < 0 || (Stats->Bins > 0 && Stats->Histogram == NULL))
+		Error("Invalid histogram request");
+
 	/* Check that file is open */
 	if (Image->Fd == EOF) Error("Image not open");
 
-	if (Image->nImgFormat != 0) Error("Can not write this format image file");
+	Narrow = Image->PixelSize <= (int) sizeof(GREYTYPE);
+	Cached = GetStats(Image, Stats);
 
-	/* Check endpoints */
-	PixelCnt = 1;
-	for (i=0; i<Image->Dimc; i++)
+	/* Count 8 and 16 bit pixels by value, unless the statistics are */
+	/* cached and no histogram is wanted                              */
+	Count = NULL;
+	if (Narrow && (Cached == FALSE || Stats->Bins > 0))
 	{
-		if (Coarseness[i] != 1) Error("Coarseness not implemented");
-		if (Endpts[i][0] < 0) Error("Bad endpoints range");
-		if (Endpts[i][1] >= Image->Dimv[i]) Error("Bad endpoints range");
-		if (Endpts[i][1] < Endpts[i][0]) Error("Bad endpoints order");
-		PixelCnt = PixelCnt * (Endpts[i][1] - Endpts[i][0] + 1);
+		if (TrackedCounts(Image))
+			Count = Image->HistoCount;
+		else if (LoadHisto(Image) == VALID)
+			Count = Image->PixelHisto->Histogram;
+		else
+		{
+			Count = (IMINDEX *)calloc(MAXVAL - MINVAL + 1, sizeof(IMINDEX));
+			if (Count == NULL) Error("Allocation error");
+			if (StatsPixels(Image, NULL, Count, NULL) == INVALID)
+			{
+				free(Count);
+				Error("Could not read pixels");
+			}
+		}
 	}
 
-	/* Invalidate the MaxMin and Histogram fields */
-	Image->ValidMaxMin = FALSE;
-	Image->ValidHistogram = FALSE;
-
-	/* Compute new Maximum and Minimum for GREY images */
-	if (Image->PixelFormat == GREY)
+	if (Cached == FALSE && Count != NULL)
 	{
-		TempMax = Image->MaxMin[1];
-		TempMin = Image->MaxMin[0];
-		for (i=0; i<PixelCnt; i++)
+		TempMin = MAXVAL;
+		TempMax = MINVAL;
+		CountRange(Count, &TempMin, &TempMax);
+		Stats->Min = TempMin;
+		Stats->Max = TempMax;
+		Stats->Sum = Stats->SumSq = 0;
+		for (i=MINVAL; i<=MAXVAL; i++)
 		{
-			if (Pixels[i] > TempMax) TempMax = Pixels[i];
-			if (Pixels[i] < TempMin) TempMin = Pixels[i];
+			Stats->Sum += (double) i * Count[i - MINVAL];
+			Stats->SumSq += (double) i * i * Count[i - MINVAL];
 		}
-		Image->MaxMin[1] = TempMax;
-		Image->MaxMin[0] = TempMin;
+		Stats->Count = Image->PixelCnt;
+		Stats->NaNCount = 0;
 	}
+	else if (Cached == FALSE)
+	{
+		Acc.Min = HUGE_VAL;
+		Acc.Max = -HUGE_VAL;
+		for (i=0; i<4; i++)
+			Acc.Sum[i] = Acc.SumSq[i] = 0;
+		Acc.NaNCount = 0;
+		if (StatsPixels(Image, &Acc, NULL, NULL) == INVALID)
+			Error("Could not read pixels");
+		Stats->Count = Image->PixelCnt - Acc.NaNCount;
+		Stats->NaNCount = Acc.NaNCount;
+		Stats->Min = Stats->Count > 0 ? Acc.Min : 0;
+		Stats->Max = Stats->Count > 0 ? Acc.Max : 0;
+		Stats->Sum = (Acc.Sum[0] + Acc.Sum[1]) + (Acc.Sum[2] + Acc.Sum[3]);
+		Stats->SumSq = (Acc.SumSq[0] + Acc.SumSq[1]) +
+			(Acc.SumSq[2] + Acc.SumSq[3]);
+	}
+	if (Cached == FALSE) PutStats(Image, Stats);
 
-	/* Check for image dimensions */
-	switch (Image->Dimc) {
+	/* Fill in the histogram */
+	if (Stats->Bins > 0)
+	{
+		if (Stats->Low >= Stats->High)
+		{
+			Stats->Low = Stats->Min;
+			Stats->High = Stats->Max;
+		}
+		Scale = 0;
+		if (Stats->High > Stats->Low)
+			Scale = Stats->Bins / (Stats->High - Stats->Low);
+		for (i=0; i<Stats->Bins; i++)
+			Stats->Histogram[i] = 0;
 
-		/* Handle 1D images */
-		case 1: 
-			return(imwrite(Image, Endpts[0][0], Endpts[0][1], Pixels));
-			break;
+		if (Count != NULL)
+		{
+			for (i=MINVAL; i<=MAXVAL; i++)
+				if (Count[i - MINVAL] != 0)
+					Stats->Histogram[BinOf((i - Stats->Low) * Scale,
+						Stats->Bins)] += Count[i - MINVAL];
+		}
+		else if (StatsPixels(Image, NULL, NULL, Stats) == INVALID)
+			Error("Could not read pixels");
+	}
 
-      /* Handle 2D images */
-		case 2:
-			return(GetPut2D(Image, Endpts, Pixels, WRITEMODE));
-			break;
+	if (Count != NULL && Count != Image->HistoCount &&
+		(Image->PixelHisto == NULL || Count != Image->PixelHisto->Histogram))
+		free(Count);
+	return(VALID);
+}
 
-      /* Handle 3D images */
-		case 3:
-			return(GetPut3D(Image, Endpts, Pixels, WRITEMODE));
-			break;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine sets the MAXMIN or HISTO field of an image that    */
+/*           is not GREY from imgetstats.  MAXMIN is the smallest and        */
+/*           largest pixel rounded out to integers, and HISTO has buckets    */
+/*           one unit wide from MaxMin[0], as for GREY images.               */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int StatsDesc(IMAGE *Image, int Type)
+{
+	IMSTATS Stats;
+	IMINDEX *Histogram;
+	int i;
 
-      /* Handle higher dimension images */
-		default:
-			return(GetPutND(Image, Endpts, Pixels, WRITEMODE));
-			break;
+	Stats.Bins = 0;
+	if (Image->ValidMaxMin == FALSE && imgetstats(Image, &Stats) == INVALID)
+		return(INVALID);
+	if (Type != HISTO || Image->ValidHistogram == TRUE) return(VALID);
+
+	Histogram = (IMINDEX *)malloc(nHISTOGRAM * sizeof(IMINDEX));
+	if (Histogram == NULL) Error("Allocation error");
+	Stats.Bins = nHISTOGRAM;
+	Stats.Low = Image->MaxMin[0];
+	Stats.High = Stats.Low + nHISTOGRAM;
+	Stats.Histogram = Histogram;
+	if (imgetstats(Image, &Stats) == INVALID)
+	{
+		free(Histogram);
+		return(INVALID);
 	}
-
+	for (i=0; i<nHISTOGRAM; i++)
+		Image->Histogram[i] = (int) Histogram[i];
+	Image->ValidHistogram = TRUE;
+	free(Histogram);
 	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads and writes pixels to 2D images.  The         */
-/*           minimum number of I/O calls are used.                           */
+/* Purpose:  These routines handle the zone map of an image: the smallest    */
+/*           and largest value of each ZONEPIXELS pixels, NaN left out, in   */
+/*           Image->ZoneMap and the ZONEINFO information field.  ZoneRange   */
+/*           widens a zone's range to take in Cnt pixels.  With OPT_ZONEMAP  */
+/*           set, ZoneWrite builds the map in Image->ZoneTrack as pixels are */
+/*           written, as TrackWrite does for the histogram: ZoneNext is the  */
+/*           next pixel a write must start at, and anything else stops the   */
+/*           tracking.  UseZones takes the map over once every pixel has     */
+/*           been written, and FinishZones saves it at imclose.  PutZones    */
+/*           also sets the MAXMIN field, so the map follows the STATSINFO    */
+/*           validity rule.                                                  */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int GetPut2D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+static void ZoneRange(const char *Pixels, int Format, IMINDEX Cnt,
+	double *Zone)
 {
-	int Xdim;
-	int Ydim;
-	int Xlength;
-	int Ylength;
-	int ReadBytes;
-	int Yloop;
-	int Yskipcnt;
-	int FirstPixel;
-	int Cnt;
+	STATSACC Acc;
 	int i;
-	char *PixelPtr;
 
-	if (Mode != READMODE && Image->nImgFormat != 0) 
-		Error("Can not write this format image file");
-
-	/* The 0th dimension is y; the 1st is x */
-	Ydim = 0;
-	Xdim = 1;
-	    
-	/* Determine how many pixels to READ/WRITE in each dimension */
-	Ylength = (Endpts[Ydim][1] - Endpts[Ydim][0]) + 1;
-	Xlength = (Endpts[Xdim][1] - Endpts[Xdim][0]) + 1;
-	    
-	/* Determine how many pixels to SKIP in each dimension */
-	Yskipcnt = (Image->Dimv[Xdim]-Xlength) * Image->PixelSize;
+	Acc.Min = Zone[0];
+	Acc.Max = Zone[1];
+	for (i=0; i<4; i++)
+		Acc.Sum[i] = Acc.SumSq[i] = 0;
+	Acc.NaNCount = 0;
+	_imstatsfunc(Pixels, Format, Cnt, &Acc);
+	Zone[0] = Acc.Min;
+	Zone[1] = Acc.Max;
+}
 
-	/* Determine the maximum number of consecutive pixels that can */
-	/* be read in at one time and the number of non-contiguous     */
-	/* sections that span the y dimension                          */
-	if (Xlength != Image->Dimv[Xdim])
-	{
-		ReadBytes = Xlength * Image->PixelSize;
-		Yloop = Ylength;
-	}
-	else 
+static double *NewZones(IMAGE *Image)
+{
+	IMINDEX ZoneCnt;
+	IMINDEX z;
+	double *Zones;
+
+	ZoneCnt = (Image->PixelCnt + ZONEPIXELS - 1) / ZONEPIXELS;
+	Zones = (double *)malloc((ZoneCnt > 0 ? ZoneCnt : 1) * 2 * sizeof(double));
+	if (Zones == NULL) return(NULL);
+	for (z=0; z<ZoneCnt; z++)
 	{
-		ReadBytes = Ylength * Xlength * Image->PixelSize;
-		Yloop = 1;
+		Zones[2*z] = HUGE_VAL;
+		Zones[2*z+1] = -HUGE_VAL;
 	}
- 
-	/* Calculate position of first pixel */
-	FirstPixel = ((Endpts[Ydim][0] * Image->Dimv[Xdim]) 
-		+ Endpts[Xdim][0]) * Image->PixelSize
-		+ Image->Address[aPIXELS];
+	return(Zones);
+}
 
-	/* if the pixels have not been uncompressed, do so now */
-	if(Image->Compressed && !Image->PixelsAccessed)
-		decompressImage(Image);
+static void ZoneWrite(IMAGE *Image, IMINDEX Offset, const char *Buffer,
+	IMINDEX Length)
+{
+	IMINDEX First, Last;
+	IMINDEX i, Next;
 
-	/* Seek to first pixel in image */
-	if(Image->Compressed)
+	if (Image->ZoneNext < 0) return;
+	if (ConvertSize(Image->PixelFormat, AS_DOUBLE) == 0 ||
+		Offset != Image->ZoneNext * Image->PixelSize ||
+		Image->ZoneNext >= Image->PixelCnt || Length <= 0)
 	{
-		Cnt = (int)lseek(Image->UCPixelsFd,
-			(long)FirstPixel - Image->Address[aPIXELS], FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		StopZones(Image);
+		return;
 	}
-	else
+
+	if (Image->ZoneTrack == NULL &&
+		(Image->ZoneTrack = NewZones(Image)) == NULL)
 	{
-		Cnt = (int)lseek(Image->Fd, (long)FirstPixel, FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		StopZones(Image);
+		return;
 	}
-	    
-	/* Loop reading/writing pixel data in sections */
-	PixelPtr = (char *) Pixels;
-	for (i=0; i<Yloop; i++)
+	First = Image->ZoneNext;
+	Last = First + Length / Image->PixelSize;
+	for (i=First; i<Last; i=Next)
 	{
-		/* read data into buffer */
-		if (Mode == READMODE)
-		{
-			if(Image->Compressed)
-			{
-				/* Read pixels into buffer from decompressed pixels file */
-				Cnt = read(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Compressed pixel read failed");
-			}
-			else
-			{
-				Cnt = read(Image->Fd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Pixel read failed");
-			}
+		Next = (i / ZONEPIXELS + 1) * ZONEPIXELS;
+		if (Next > Last) Next = Last;
+		ZoneRange(Buffer + (i - First) * Image->PixelSize,
+			Image->PixelFormat, Next - i,
+			Image->ZoneTrack + 2 * (i / ZONEPIXELS));
+	}
+	Image->ZoneNext = Last;
+}
 
-			/* Swap the byte order of pixels read in if Needed */
-			if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
-		}
+static void StopZones(IMAGE *Image)
+{
+	if (Image->ZoneTrack != NULL) free(Image->ZoneTrack);
+	Image->ZoneTrack = NULL;
+	Image->ZoneNext = -1;
+}
 
-		/* write data from buffer */
+static int PutZones(IMAGE *Image)
+{
+	IMINDEX ZoneCnt;
+	IMINDEX z;
+	double Min, Max;
+	double *Zone;
+	char *Data;
+	size_t Length;
+	int Status;
+
+	ZoneCnt = (Image->PixelCnt + ZONEPIXELS - 1) / ZONEPIXELS;
+	Min = HUGE_VAL;
+	Max = -HUGE_VAL;
+	for (z=0; z<ZoneCnt; z++)
+	{
+		if (Image->ZoneMap[2*z] < Min) Min = Image->ZoneMap[2*z];
+		if (Image->ZoneMap[2*z+1] > Max) Max = Image->ZoneMap[2*z+1];
+	}
+	if (Min > Max) Min = Max = 0;
+	PutMaxMin(Image, Min, Max);
+	if (Image->nImgFormat != 0) return(VALID);
+
+	/* Empty zones are written as 0 -inf, which reads back as empty */
+	Data = (char *)malloc(50 + (size_t)ZoneCnt * 50);
+	if (Data == NULL) Error("Allocation error");
+	Length = sprintf(Data, "%d %lld", ZONEPIXELS, (long long)ZoneCnt);
+	for (z=0; z<ZoneCnt; z++)
+	{
+		Zone = Image->ZoneMap + 2 * z;
+		if (Zone[0] > Zone[1])
+			Length += sprintf(Data + Length, "\n0 -inf");
 		else
-		{
-			/* Swap the byte order of pixels written out if Needed */
-			if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
+			Length += sprintf(Data + Length, "\n%.17g %.17g", Zone[0], Zone[1]);
+	}
+	Status = PutStatsField(Image, ZONEINFO, Data);
+	free(Data);
+	return(Status);
+}
 
-			if (Image->Compressed) 
-			{
-				/* Write pixels into decompressed pixel file */
-				Cnt = write(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Compressed pixel write failed");
-			}
-			else
-			{
-				Cnt = write(Image->Fd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Pixel write failed");
-			}
-		}
+static int UseZones(IMAGE *Image)
+{
+	IMINDEX ZoneCnt;
+	IMINDEX i;
+	char *Data;
+	char *End;
 
-		/* Advance buffer pointer */
-		PixelPtr += ReadBytes;
+	if (Image->ZoneMap != NULL) return(VALID);
 
-		/* Seek to next line of pixels to read/write */
-		if(Image->Compressed)
-		{
-			Cnt = (int)lseek(Image->UCPixelsFd, (long)Yskipcnt, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
-		}
-		else
-		{
-			Cnt = (int)lseek(Image->Fd, (long)Yskipcnt, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
-		}
+	/* Take over a map kept while writing */
+	if (Image->ZoneTrack != NULL && Image->ZoneNext == Image->PixelCnt)
+	{
+		Image->ZoneMap = Image->ZoneTrack;
+		Image->ZoneTrack = NULL;
+		Image->ZoneNext = -1;
+		PutZones(Image);
+		return(VALID);
 	}
 
-	Image->PixelsModified = TRUE;
+	/* Or load a saved one */
+	if ((Data = StatsField(Image, ZONEINFO)) == NULL) return(INVALID);
+	ZoneCnt = (Image->PixelCnt + ZONEPIXELS - 1) / ZONEPIXELS;
+	if (strtol(Data, &Data, 10) != ZONEPIXELS ||
+		strtoll(Data, &Data, 10) != ZoneCnt) return(INVALID);
+	if ((Image->ZoneMap = NewZones(Image)) == NULL) return(INVALID);
+	for (i=0; i<2*ZoneCnt; i++)
+	{
+		Image->ZoneMap[i] = strtod(Data, &End);
+		if (End == Data) break;
+		Data = End;
+	}
+	if (i < 2*ZoneCnt)
+	{
+		free(Image->ZoneMap);
+		Image->ZoneMap = NULL;
+		return(INVALID);
+	}
 	return(VALID);
 }
 
+static void FinishZones(IMAGE *Image)
+{
+	if (Image->ZoneTrack != NULL && Image->ZoneNext == Image->PixelCnt)
+		UseZones(Image);
+	StopZones(Image);
+}
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads and writes pixels to 3D images.  The         */
-/*           minimum number of I/O calls are used.                           */
+/* Purpose:  These routines handle the slice index of an image.  A slice is  */
+/*           the plane of pixels spanned by the last two dimensions, so a    */
+/*           3D image has Dimv[0] slices and a 4D image Dimv[0] frames of    */
+/*           Dimv[1] slices each.  SliceSize is the number of pixels in a    */
+/*           slice.  LoadIndex parses the SLICEINFO field, which holds the   */
+/*           slice count and size and then SLICEVALS values per slice, into  */
+/*           Image->SliceStats.  FinishIndex builds the index at imclose if  */
+/*           OPT_SLICEINDEX is set and frees the cached statistics.          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int GetPut3D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+static IMINDEX SliceSize(IMAGE *Image)
 {
-	int Xdim;
-	int Ydim;
-	int Zdim;
-	int Xlength;
-	int Ylength;
-	int Zlength;
-	int ReadBytes;
-	int Yloop;
-	int Zloop;
-	int Yskipcnt;
-	int Zskipcnt;
-	int FirstPixel;
-	int Cnt;
-	int i;
-	int j;
-	char *PixelPtr;
+	if (Image->Dimc < 2) return(Image->PixelCnt);
+	return((IMINDEX)Image->Dimv[Image->Dimc-2] * Image->Dimv[Image->Dimc-1]);
+}
 
-	if (Mode != READMODE && Image->nImgFormat != 0) 
-		Error("Can not write this format image file");
+static int LoadIndex(IMAGE *Image)
+{
+	IMINDEX SliceCnt;
+	IMINDEX i;
+	char *Data;
+	char *End;
+
+	if (Image->SliceStats != NULL) return(VALID);
+	Data = StatsField(Image, SLICEINFO);
+	if (Data == NULL || SliceSize(Image) <= 0) return(INVALID);
+
+	SliceCnt = Image->PixelCnt / SliceSize(Image);
+	if (strtoll(Data, &Data, 10) != SliceCnt ||
+		strtoll(Data, &Data, 10) != SliceSize(Image)) return(INVALID);
+	Image->SliceStats = (double *)malloc(SliceCnt * SLICEVALS * sizeof(double));
+	if (Image->SliceStats == NULL) return(INVALID);
+	for (i=0; i<SliceCnt * SLICEVALS; i++)
+	{
+		Image->SliceStats[i] = strtod(Data, &End);
+		if (End == Data) break;
+		Data = End;
+	}
+	if (i < SliceCnt * SLICEVALS)
+	{
+		free(Image->SliceStats);
+		Image->SliceStats = NULL;
+		return(INVALID);
+	}
+	return(VALID);
+}
 
-	/* 0th dimension is z; 1st is y; 2nd is x */
-	Zdim = 0;
-	Ydim = 1;
-	Xdim = 2;
+static void FinishIndex(IMAGE *Image)
+{
+	if (Image->SliceIndex && Image->PixelsModified &&
+		LoadIndex(Image) == INVALID) imindex(Image);
+	FreeStats(Image);
+}
 
-	/* Determine how many pixels to READ/WRITE in each dimension*/
-	Zlength = (Endpts[Zdim][1] - Endpts[Zdim][0]) + 1;
-	Ylength = (Endpts[Ydim][1] - Endpts[Ydim][0]) + 1;
-	Xlength = (Endpts[Xdim][1] - Endpts[Xdim][0]) + 1;
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine builds the slice index of a numeric image: the     */
+/*           smallest and largest value, sum, sum of squares and number of   */
+/*           pixels that are not NaN of every slice, in one pass over the    */
+/*           pixels.  The index is saved with the image in an information    */
+/*           field and also sets the MAXMIN field.  imgetslicestats then     */
+/*           answers queries on slices and frames from the index.  Writing   */
+/*           pixels drops the index.                                         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imindex (IMAGE *Image)
+{
+	STATSACC *Acc;
+	char *Pixels;
+	char *Data;
+	double *Slice;
+	double Min, Max;
+	IMINDEX Size, SliceCnt;
+	IMINDEX Low, High;
+	IMINDEX Next;
+	IMINDEX i;
+	size_t Length;
+	int Status;
 
-	/* Determine how many pixels to SKIP in each dimension*/
-	Yskipcnt = (Image->Dimv[Xdim]-Xlength) * Image->PixelSize;
-	Zskipcnt = (Image->Dimv[Ydim]-Ylength) 
-		* Image->Dimv[Xdim] * Image->PixelSize;
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (ConvertSize(Image->PixelFormat, AS_DOUBLE) == 0)
+		Error("Image type is not numeric");
 
-	/* Determine the maximum number of consecutive pixels that can */
-	/* be read in at one time and the number of non-contiguous     */
-	/* sections that span the y and z dimensions                   */
-	if (Xlength != Image->Dimv[Xdim])
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
+
+	Size = SliceSize(Image);
+	if (Size <= 0) Error("Image has no pixels");
+	SliceCnt = Image->PixelCnt / Size;
+	Acc = (STATSACC *)calloc(SliceCnt, sizeof(STATSACC));
+	if (Acc == NULL) Error("Allocation error");
+	for (i=0; i<SliceCnt; i++)
 	{
-		ReadBytes = Xlength * Image->PixelSize;
-		Yloop = Ylength;
-		Zloop = Zlength;
+		Acc[i].Min = HUGE_VAL;
+		Acc[i].Max = -HUGE_VAL;
 	}
-	else if (Ylength != Image->Dimv[Ydim]) 
+
+	/* Add each block to the slices it covers */
+	if ((Pixels = GetBlock()) == NULL)
 	{
-		ReadBytes = Ylength * Xlength * Image->PixelSize;
-		Yloop = 1;
-		Zloop = Zlength;
+		free(Acc);
+		Error("Allocation error");
 	}
-	else 
+	for (Low=0; Low<Image->PixelCnt; Low=High+1)
 	{
-		ReadBytes = Zlength * Ylength * Xlength * Image->PixelSize;
-		Yloop = 1;
-		Zloop = 1;
+		High = Low + BLOCKBYTES / Image->PixelSize - 1;
+		if (High >= Image->PixelCnt) High = Image->PixelCnt - 1;
+		if (imread64(Image, Low, High, (GREYTYPE *)Pixels) == INVALID)
+		{
+			PutBlock(Pixels);
+			free(Acc);
+			Error("Could not read pixels");
+		}
+		for (i=Low; i<=High; i=Next)
+		{
+			Next = (i / Size + 1) * Size;
+			if (Next > High + 1) Next = High + 1;
+			_imstatsfunc(Pixels + (i - Low) * Image->PixelSize,
+				Image->PixelFormat, Next - i, &Acc[i / Size]);
+		}
 	}
-	    
-	/* Calculate position of first pixel in image */
-	FirstPixel = ((Endpts[Zdim][0] * Image->Dimv[Xdim] * Image->Dimv[Ydim])
-		+ (Endpts[Ydim][0] * Image->Dimv[Xdim]) 
-		+  Endpts[Xdim][0]) * Image->PixelSize
-		+ Image->Address[aPIXELS];
-
-	/* if the pixels have not been uncompressed, do so now */
-	if(Image->Compressed && !Image->PixelsAccessed)
-		decompressImage(Image);
-
-	/* Seek to first pixel in image */
-	if(Image->Compressed)
+	PutBlock(Pixels);
+
+	/* Keep the index and save it as text */
+	if (Image->SliceStats != NULL) free(Image->SliceStats);
+	Image->SliceStats = (double *)malloc(SliceCnt * SLICEVALS * sizeof(double));
+	Length = 50 + (size_t)SliceCnt * SLICEVALS * 25;
+	Data = (char *)malloc(Length);
+	if (Image->SliceStats == NULL || Data == NULL)
 	{
-		Cnt = (int)lseek(Image->UCPixelsFd,
-			(long)FirstPixel - Image->Address[aPIXELS], FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		free(Acc);
+		if (Data != NULL) free(Data);
+		DropStats(Image);
+		Error("Allocation error");
 	}
-	else
+	Length = sprintf(Data, "%lld %lld", (long long)SliceCnt, (long long)Size);
+	Min = HUGE_VAL;
+	Max = -HUGE_VAL;
+	for (i=0; i<SliceCnt; i++)
 	{
-		Cnt = (int)lseek(Image->Fd, (long)FirstPixel, FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		Slice = Image->SliceStats + i * SLICEVALS;
+		Slice[4] = (double)(Size - Acc[i].NaNCount);
+		Slice[0] = Slice[4] > 0 ? Acc[i].Min : 0;
+		Slice[1] = Slice[4] > 0 ? Acc[i].Max : 0;
+		Slice[2] = (Acc[i].Sum[0] + Acc[i].Sum[1]) +
+			(Acc[i].Sum[2] + Acc[i].Sum[3]);
+		Slice[3] = (Acc[i].SumSq[0] + Acc[i].SumSq[1]) +
+			(Acc[i].SumSq[2] + Acc[i].SumSq[3]);
+		if (Acc[i].Min < Min) Min = Acc[i].Min;
+		if (Acc[i].Max > Max) Max = Acc[i].Max;
+		Length += sprintf(Data + Length, "\n%.17g %.17g %.17g %.17g %.0f",
+			Slice[0], Slice[1], Slice[2], Slice[3], Slice[4]);
 	}
+	free(Acc);
+
+	if (Min > Max) Min = Max = 0;
+	PutMaxMin(Image, Min, Max);
+	Status = VALID;
+	if (Image->nImgFormat == 0) Status = PutStatsField(Image, SLICEINFO, Data);
+	free(Data);
+	return(Status);
+}
 
-	/* Loop reading/writing pixel data in sections */
-	PixelPtr = (char *) Pixels;
-	for (i=0; i<Zloop; i++)
-	{
-		for (j=0; j<Yloop; j++)
-		{
-
-			/* Read data from file into buffer */
-			if (Mode == READMODE)
-			{
-				if(Image->Compressed)
-				{
-					/* Read pixels into buffer from decompressed pixels file */
-					Cnt = read(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-					if (Cnt != ReadBytes) Error("Compressed pixel read failed");
-				}
-				else
-				{
-					Cnt = read(Image->Fd, (char *)PixelPtr, ReadBytes);
-					if (Cnt != ReadBytes) Error("Pixel read failed");
-				}
-
-				/* Swap the byte order of pixels read in if Needed */
-				if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
-			}
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine returns the Min, Max, Sum, SumSq, Count and        */
+/*           NaNCount statistics (see imgetstats) of the slices within       */
+/*           Endpts, which gives a range for each dimension but the last     */
+/*           two.  For a 3D image {{s,s}} is slice s; for a 4D image         */
+/*           {{f,f},{0,Dimv[1]-1}} is frame f.  The answer comes from the    */
+/*           slice index without reading pixels; the index is built by       */
+/*           imindex on first use if the image does not have one.            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imgetslicestats (IMAGE *Image, int Endpts[][2], IMSTATS *Stats)
+{
+	int Coord[nDIMV];
+	IMINDEX Index;
+	IMINDEX Slices;
+	double *Slice;
+	int Outer;
+	int i;
 
-			/* write to file from buffer */
-			else
-			{
-				/* Swap the byte order of pixels written out if Needed */
-				if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
+	/* Check parameters */
+	if (Image == NULL) Error("Null image pointer");
+	if (Stats == NULL) Error("Null statistics pointer");
+	Outer = Image->Dimc - 2;
+	for (i=0; i<Outer; i++)
+	{
+		if (Endpts == NULL) Error("Null endpoints pointer");
+		if (Endpts[i][0] < 0 || Endpts[i][1] >= Image->Dimv[i] ||
+			Endpts[i][0] > Endpts[i][1]) Error("Invalid endpoints");
+		Coord[i] = Endpts[i][0];
+	}
 
-				if (Image->Compressed) 
-				{
-					/* Write pixels into decompressed pixel file */
-					Cnt = write(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-					if (Cnt != ReadBytes) Error("Compressed pixel write failed");
-				}
-				else
-				{
-					Cnt = write(Image->Fd, (char *)PixelPtr, ReadBytes);
-					if (Cnt != ReadBytes) Error("Pixel write failed");
-				}
-			}
-   
-			/* Advance buffer pointer */
-			PixelPtr += ReadBytes;
-   
-			/* Seek to next line of pixels to read/write */
-			if(Image->Compressed)
-			{
-				Cnt = (int)lseek(Image->UCPixelsFd, (long)Yskipcnt, FROMHERE);
-				if(Cnt == -1) Error("Seek next pixel failed");
-			}
-			else
-			{
-				Cnt = (int)lseek(Image->Fd, (long)Yskipcnt, FROMHERE);
-				if (Cnt == -1) Error("Seek next pixel failed");
-			}
-		}
+	/* Check that file is open */
+	if (Image->Fd == EOF) Error("Image not open");
 
-		/* Seek to next slice of pixels to read/write */
-		if(Image->Compressed)
+	if (LoadIndex(Image) == INVALID && imindex(Image) == INVALID)
+		return(INVALID);
+
+	/* Merge the slices, stepping through the outer dimensions */
+	Stats->Min = HUGE_VAL;
+	Stats->Max = -HUGE_VAL;
+	Stats->Sum = Stats->SumSq = 0;
+	Stats->Count = 0;
+	Slices = 0;
+	do
+	{
+		Index = 0;
+		for (i=0; i<Outer; i++)
+			Index = Index * Image->Dimv[i] + Coord[i];
+		Slice = Image->SliceStats + Index * SLICEVALS;
+		if (Slice[4] > 0)
 		{
-			Cnt = (int)lseek(Image->UCPixelsFd, (long)Zskipcnt, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
+			if (Slice[0] < Stats->Min) Stats->Min = Slice[0];
+			if (Slice[1] > Stats->Max) Stats->Max = Slice[1];
 		}
-		else
+		Stats->Sum += Slice[2];
+		Stats->SumSq += Slice[3];
+		Stats->Count += (IMINDEX)Slice[4];
+		Slices++;
+
+		for (i=Outer-1; i>=0; i--)
 		{
-			Cnt = (int)lseek(Image->Fd, (long)Zskipcnt, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
+			if (++Coord[i] <= Endpts[i][1]) break;
+			Coord[i] = Endpts[i][0];
 		}
-	}
+	} while (i >= 0);
 
-	Image->PixelsModified = TRUE;
+	Stats->NaNCount = Slices * SliceSize(Image) - Stats->Count;
+	if (Stats->Count == 0) Stats->Min = Stats->Max = 0;
 	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads and writes pixels to N dimensional images.   */
-/*           The minimum number of I/O calls are used.                       */
+/* Purpose:  These routines answer percentile queries from a histogram of    */
+/*           the whole image (see LoadHisto).  BuildHisto makes it with      */
+/*           imgetstats, from a count of every value of 8 and 16 bit pixels  */
+/*           or with HISTOBINS buckets over [Min..Max] for wider pixels.     */
+/*           RankValue returns the value of the pixel of rank Rank (0 is     */
+/*           the smallest), exactly for one bucket per value and otherwise   */
+/*           assuming the pixels are spread evenly through their bucket.     */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int GetPutND(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode)
+static int BuildHisto(IMAGE *Image)
 {
-	int SliceSize[nDIMV];
-	int ReadCnt[nDIMV];
-	int SkipCnt[nDIMV];
-	int Index[nDIMV];
-	int Dimc;
-	int ReadBytes;
-	int NextPixel;
-	int i;
-	int Cnt;
-	char *PixelPtr;
-
-	if (Mode != READMODE && Image->nImgFormat != 0) Error("Can not write this format image file");
-
-	/* Determine size of one "slice" in each dimension */
-	Dimc = Image->Dimc;
-	SliceSize[Dimc-1] = Image->PixelSize;
-	for (i=Dimc-2; i>=0; i--)
-		SliceSize[i] = SliceSize[i+1] * Image->Dimv[i+1];
-
-	/* Determine number of "slices" to read and skip in each dimension */
-	for (i=0; i<Dimc; i++)
-	{
-		ReadCnt[i] = Endpts[i][1] - Endpts[i][0] + 1;
-		SkipCnt[i] = Image->Dimv[i] - ReadCnt[i];
-	}
-	ReadBytes = ReadCnt[Dimc-1] * SliceSize[Dimc-1];
-    
-	/* if the pixels have not been uncompressed, do so now */
-	if(Image->Compressed && !Image->PixelsAccessed)
-		decompressImage(Image);
+	IMSTATS *Histo;
 
-	/* Seek to beginning of pixels */
-	if(Image->Compressed)
+	if ((Histo = (IMSTATS *)malloc(sizeof(IMSTATS))) == NULL)
+		Error("Allocation error");
+	if (Image->PixelSize <= (int) sizeof(GREYTYPE))
 	{
-		Cnt = (int)lseek(Image->UCPixelsFd, (long)0, FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		Histo->Bins = MAXVAL - MINVAL + 1;
+		Histo->Low = MINVAL;
+		Histo->High = MAXVAL + 1;
 	}
 	else
 	{
-		Cnt = (int)lseek(Image->Fd, (long)Image->Address[aPIXELS], FROMBEG);
-		if (Cnt == -1) Error("Seek first pixel failed");
+		Histo->Bins = HISTOBINS;
+		Histo->Low = Histo->High = 0;
 	}
-
-	/* Find offset to first pixel */
-	NextPixel = 0;
-	for (i=0; i<Dimc; i++)
+	Histo->Histogram = (IMINDEX *)malloc(Histo->Bins * sizeof(IMINDEX));
+	if (Histo->Histogram == NULL)
 	{
-		NextPixel = NextPixel + SliceSize[i]*Endpts[i][0];
-		Index[i] = Endpts[i][0];
+		free(Histo);
+		Error("Allocation error");
 	}
-
-	/* Loop reading and skipping pixels */
-	PixelPtr = (char *) Pixels;
-	while (Index[0] <= Endpts[0][1])
+	if (imgetstats(Image, Histo) == INVALID)
 	{
-		/* Seek to next line of pixels to read/write */
-		if(Image->Compressed)
-		{
-			Cnt = (int)lseek(Image->UCPixelsFd, (long)NextPixel, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
-		}
-		else
-		{
-			Cnt = (int)lseek(Image->Fd, (long)NextPixel, FROMHERE);
-			if (Cnt == -1) Error("Seek next pixel failed");
-		}
-
-		/* read data from file into buffer */
-		if (Mode == READMODE)
-		{
-			if(Image->Compressed)
-			{
-				/* Read pixels into buffer from decompressed pixels file */
-				Cnt = read(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Compressed pixel read failed");
-			}
-			else
-			{
-				Cnt = read(Image->Fd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Pixel read failed");
-			}
-
-			/* Swap the byte order of pixels read in if Needed */
-			if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
-		}
+		free(Histo->Histogram);
+		free(Histo);
+		return(INVALID);
+	}
+	Image->PixelHisto = Histo;
+	return(PutHisto(Image, Histo));
+}
 
-		/* write data from buffer to file */
-		else
-		{
-			/* Swap the byte order of pixels written out if Needed */
-			if (Image->SwapNeeded) Swap(PixelPtr, ReadBytes, Image->PixelFormat);
+static double RankValue(IMSTATS *Histo, int Exact, IMINDEX Rank)
+{
+	double Width;
+	double Value;
+	IMINDEX Below;
+	int i;
 
-			if (Image->Compressed) 
-			{
-				/* Write pixels into decompressed pixel file */
-				Cnt = write(Image->UCPixelsFd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Compressed pixel write failed");
-			}
-			else
-			{
-				Cnt = write(Image->Fd, (char *)PixelPtr, ReadBytes);
-				if (Cnt != ReadBytes) Error("Pixel write failed");
-			}
-		}
-  
-		/* Advance buffer pointer */
-		PixelPtr += ReadBytes;
-		Index[Dimc-1] = Endpts[Dimc-1][1] + 1;
- 
-		/* Find offset to next pixel */
-		NextPixel = 0;
-		for (i=Dimc-1; i>=0; i--)
-		{
-			if (Index[i] > Endpts[i][1])
-			{
-				NextPixel = NextPixel + SkipCnt[i] * SliceSize[i];
-				if (i > 0) 
-				{
-					Index[i] = Endpts[i][0];
-					Index[i-1]++;
-				}
-			}
-		}
+	Below = 0;
+	for (i=0; i<Histo->Bins-1; i++)
+	{
+		if (Rank < Below + Histo->Histogram[i]) break;
+		Below += Histo->Histogram[i];
 	}
-
-	Image->PixelsModified = TRUE;
-	return(VALID);
+	if (Exact) return(Histo->Low + i);
+	if (Histo->Histogram[i] == 0) return(Histo->Max);
+
+	Width = (Histo->High - Histo->Low) / Histo->Bins;
+	Value = Histo->Low + Width * (i + (Rank - Below + 0.5) /
+		Histo->Histogram[i]);
+	if (Value < Histo->Min) Value = Histo->Min;
+	if (Value > Histo->Max) Value = Histo->Max;
+	return(Value);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads all useful image information from the        */
-/*           image image header.  This routine can be used in place of       */
-/*           imdim, imbounds, and imgetdesc.                                 */
+/* Purpose:  This routine returns the Percent percentile (0 to 100) of the   */
+/*           pixels of a numeric image, ignoring NaN pixels.  Like most      */
+/*           statistics packages, it interpolates linearly between the two   */
+/*           pixels closest to rank Percent / 100 * (Count - 1).  The        */
+/*           answer is exact for 8 and 16 bit pixels and within one bucket   */
+/*           of HISTOBINS over [Min..Max] for wider pixels.  The histogram   */
+/*           behind it is made on the first call and saved with the image,   */
+/*           so later calls, even after reopening, read no pixels.           */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imheader (IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int
-	*Dimc, int *Dimv, int *MaxMin)
+int imgetpercentile (IMAGE *Image, double Percent, double *Value)
 {
-	int i;
+	IMSTATS *Histo;
+	IMINDEX Rank;
+	double Rest;
+	double Low;
+	int Exact;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
-	if (PixFormat == NULL) Error("Null pixformat pointer");
-	if (PixSize == NULL) Error("Null pixsize pointer");
-	if (PixCnt == NULL) Error("Null pixcnt pointer");
-	if (Dimc == NULL) Error("Null dimc pointer");
-	if (Dimv == NULL) Error("Null dimv pointer");
-	if (MaxMin == NULL) Error("Null maxmin pointer");
+	if (Value == NULL) Error("Null value pointer");
+	if (!(Percent >= 0 && Percent <= 100)) Error("Invalid percentile");
 
 	/* Check that file is open */
 	if (Image->Fd == EOF) Error("Image not open");
 
-	/* Copy data */
-	*PixFormat = Image->PixelFormat;
-	*PixSize = Image->PixelSize;
-	*PixCnt = Image->PixelCnt;
-	*Dimc = Image->Dimc;
-	for (i=0; i<*Dimc; i++)
-		Dimv[i] = Image->Dimv[i];
-
-	/* Get correct MINMAX field */
-	imgetdesc(Image, MINMAX, MaxMin);
-   
+	if (LoadHisto(Image) == INVALID && BuildHisto(Image) == INVALID)
+		return(INVALID);
+	Histo = Image->PixelHisto;
+	if (Histo->Count <= 0) Error("Image has no pixels that are not NaN");
+
+	/* Interpolate between the pixels either side of the rank */
+	Exact = Image->PixelSize <= (int) sizeof(GREYTYPE);
+	Rest = Percent / 100 * (Histo->Count - 1);
+	Rank = (IMINDEX)Rest;
+	if (Rank > Histo->Count - 1) Rank = Histo->Count - 1;
+	Rest -= Rank;
+	Low = RankValue(Histo, Exact, Rank);
+	*Value = Low;
+	if (Rest > 0 && Rank < Histo->Count - 1)
+		*Value = Low + Rest * (RankValue(Histo, Exact, Rank + 1) - Low);
 	return(VALID);
 }
-
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine reads all useful image information from the        */
-/*           image image header.  This routine can be used in place of       */
-/*           imdim, imbounds, and imgetdesc.                                 */
-/*                                                                           */
-/*           This version also returns information about compression used    */
-/*           in the image (on/off, type, compression ratio)                  */
+/* Purpose:  These routines find the pixels above a threshold for            */
+/*           imgetabove and imgetbbox.  FindAbove reads only the zones whose */
+/*           largest value is above the threshold, runs of them up to        */
+/*           BLOCKBYTES at a time.  Without a zone map it reads every zone   */
+/*           and builds the map as it goes.  AddAbove records one pixel:     */
+/*           its index, and its coordinates in the bounding box, which only  */
+/*           need dividing out once per row.                                 */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imheaderC (IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int
-	*Dimc, int *Dimv, int *MaxMin, int *Compressed, int *CompMethod, float
-	*CompRatio)
+typedef struct {
+   IMAGE *Image;
+   IMINDEX *Indices;		/* first MaxCnt pixel indices, or NULL */
+   IMINDEX MaxCnt;
+   IMINDEX Count;
+   int (*Box)[2];		/* bounding box, or NULL */
+   IMINDEX RowStart;		/* row of the last pixel added */
+   } ABOVE;
+
+static void AddAbove(ABOVE *Query, IMINDEX Index)
 {
+	IMAGE *Image = Query->Image;
+	IMINDEX RowLen;
+	IMINDEX Row;
+	int Coord;
 	int i;
-	
+
+	if (Query->Indices != NULL && Query->Count < Query->MaxCnt)
+		Query->Indices[Query->Count] = Index;
+	Query->Count++;
+	if (Query->Box == NULL) return;
+
+	RowLen = Image->Dimv[Image->Dimc-1];
+	if (Index < Query->RowStart || Index >= Query->RowStart + RowLen)
+	{
+		Query->RowStart = Index - Index % RowLen;
+		Row = Index / RowLen;
+		for (i=Image->Dimc-2; i>=0; i--)
+		{
+			Coord = (int)(Row % Image->Dimv[i]);
+			Row /= Image->Dimv[i];
+			if (Coord < Query->Box[i][0]) Query->Box[i][0] = Coord;
+			if (Coord > Query->Box[i][1]) Query->Box[i][1] = Coord;
+		}
+	}
+	Coord = (int)(Index - Query->RowStart);
+	i = Image->Dimc - 1;
+	if (Coord < Query->Box[i][0]) Query->Box[i][0] = Coord;
+	if (Coord > Query->Box[i][1]) Query->Box[i][1] = Coord;
+}
+
+#define ABOVEFORMAT(Type)\
+   {\
+   const Type *P = (const Type *)Pixels;\
+   for (i = 0; i < Cnt; i++)\
+      if ((double)P[i] > Threshold) AddAbove(Query, First + i);\
+   }
+
+static void AboveBlock(const char *Pixels, int Format, IMINDEX First,
+	IMINDEX Cnt, double Threshold, ABOVE *Query)
+{
+	IMINDEX i;
+
+	switch (Format) {
+		case BYTE        : ABOVEFORMAT(BYTETYPE); break;
+		case GREY        :
+		case COLOR       :
+		case SHORT       : ABOVEFORMAT(SHORTTYPE); break;
+		case USERPACKED  : ABOVEFORMAT(USERTYPE); break;
+		case LONG        : ABOVEFORMAT(LONGTYPE); break;
+		case REAL        : ABOVEFORMAT(REALTYPE); break;
+	}
+}
+
+static int FindAbove(IMAGE *Image, double Threshold, ABOVE *Query)
+{
+	char *Pixels;
+	double *Map;
+	IMINDEX ZoneCnt, BlockZones;
+	IMINDEX Low, High;
+	IMINDEX z, Run;
+	IMINDEX First, Cnt;
+	int Build;
+
 	/* Check parameters */
-	if (Image == NULL) Error("Null image pointer");
-	if (PixFormat == NULL) Error("Null pixformat pointer");
-	if (PixSize == NULL) Error("Null pixsize pointer");
-	if (PixCnt == NULL) Error("Null pixcnt pointer");
-	if (Dimc == NULL) Error("Null dimc pointer");
-	if (Dimv == NULL) Error("Null dimv pointer");
-	if (MaxMin == NULL) Error("Null maxmin pointer");
+	if (ConvertSize(Image->PixelFormat, AS_DOUBLE) == 0)
+		Error("Image type is not numeric");
 
 	/* Check that file is open */
 	if (Image->Fd == EOF) Error("Image not open");
 
-	/* Copy data */
-	*PixFormat = Image->PixelFormat;
-	*PixSize = Image->PixelSize;
-	*PixCnt = Image->PixelCnt;
-	*Dimc = Image->Dimc;
-	for (i=0; i<*Dimc; i++)
-		Dimv[i] = Image->Dimv[i];
+	Build = (UseZones(Image) == INVALID);
+	Map = Build ? NewZones(Image) : Image->ZoneMap;
+	if (Map == NULL || (Pixels = GetBlock()) == NULL)
+	{
+		if (Build && Map != NULL) free(Map);
+		Error("Allocation error");
+	}
 
-	/* Get correct MINMAX field */
-	imgetdesc(Image, MINMAX, MaxMin);
-   
-	*Compressed = Image->Compressed;
-	*CompMethod = Image->CompressionMethod;
-	*CompRatio = (float)(Image->Address[aINFO] - Image->Address[aPIXELS]) / 
-		(float)(Image->PixelCnt * Image->PixelSize);
+	ZoneCnt = (Image->PixelCnt + ZONEPIXELS - 1) / ZONEPIXELS;
+	BlockZones = BLOCKBYTES / ((IMINDEX)ZONEPIXELS * Image->PixelSize);
+	for (z=0; z<ZoneCnt; z=Run)
+	{
+		/* Gather a run of zones that may hold pixels above */
+		for (Run=z; Run<ZoneCnt && Run-z<BlockZones; Run++)
+			if (!Build && !(Map[2*Run+1] > Threshold)) break;
+		if (Run == z)
+		{
+			Run++;
+			continue;
+		}
 
-	return(VALID);
-}
+		Low = z * ZONEPIXELS;
+		High = Run * ZONEPIXELS - 1;
+		if (High >= Image->PixelCnt) High = Image->PixelCnt - 1;
+		if (imread64(Image, Low, High, (GREYTYPE *)Pixels) == INVALID)
+		{
+			PutBlock(Pixels);
+			if (Build) free(Map);
+			Error("Could not read pixels");
+		}
+		for (First=Low; First<=High; First+=ZONEPIXELS)
+		{
+			Cnt = High - First + 1;
+			if (Cnt > ZONEPIXELS) Cnt = ZONEPIXELS;
+			if (Build)
+				ZoneRange(Pixels + (First - Low) * Image->PixelSize,
+					Image->PixelFormat, Cnt, Map + 2 * (First / ZONEPIXELS));
+			if (Map[2 * (First / ZONEPIXELS) + 1] > Threshold)
+				AboveBlock(Pixels + (First - Low) * Image->PixelSize,
+					Image->PixelFormat, First, Cnt, Threshold, Query);
+		}
+	}
+	PutBlock(Pixels);
 
-/*---------------------------------------------------------------------------*/
-/*                                                                           */
-/*	Purpose:  returns the compression information for the image          */
-/*                                                                           */
-/*---------------------------------------------------------------------------*/
-int imgetcompinfo (IMAGE *Image, int *Compressed, int *CompMethod, float *CompRatio)
-{
-	*Compressed = Image->Compressed;
-	*CompMethod = Image->CompressionMethod;
-	*CompRatio = (float)(Image->Address[aINFO] - Image->Address[aPIXELS]) / 
-		(float)(Image->PixelCnt * Image->PixelSize);
+	if (Build)
+	{
+		Image->ZoneMap = Map;
+		PutZones(Image);
+	}
 	return(VALID);
 }
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine returns the pixel format and dimension count.      */
+/* Purpose:  This routine finds the pixels of a numeric image greater than   */
+/*           Threshold.  Count receives how many there are and Indices, if   */
+/*           not NULL, the pixel indices (as for imread) of the first MaxCnt */
+/*           of them in file order.  The image's zone map, the range of      */
+/*           each ZONEPIXELS pixels, lets zones with nothing above the       */
+/*           threshold be skipped unread.  The map is built by the first     */
+/*           query, or while writing with OPT_ZONEMAP, and saved with the    */
+/*           image.                                                          */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imdim (IMAGE *Image, int *PixFormat, int *Dimc)
+int imgetabove (IMAGE *Image, double Threshold, IMINDEX *Indices,
+	IMINDEX MaxCnt, IMINDEX *Count)
 {
+	ABOVE Query;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
-	if (PixFormat == NULL) Error("Null pixformat pointer");
-	if (Dimc == NULL) Error("Null dimc pointer");
-
-	/* Check that file is open */
-	if (Image->Fd == EOF) Error("Image not open");
-
-	/* Copy data */
-	*PixFormat = Image->PixelFormat;
-	*Dimc = Image->Dimc;
-
+	if (Count == NULL) Error("Null count pointer");
+	if (Indices != NULL && MaxCnt < 0) Error("Invalid index count");
+
+	Query.Image = Image;
+	Query.Indices = Indices;
+	Query.MaxCnt = MaxCnt;
+	Query.Count = 0;
+	Query.Box = NULL;
+	Query.RowStart = 0;
+	if (FindAbove(Image, Threshold, &Query) == INVALID) return(INVALID);
+	*Count = Query.Count;
 	return(VALID);
 }
 
-
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
-/* Purpose:  This routine returns the image dimension vector.                */
+/* Purpose:  This routine sets Endpts to the bounding box of the pixels of a */
+/*           numeric image greater than Threshold, skipping zones as         */
+/*           imgetabove does.  If there are none, every range is [0..-1].    */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
-int imbounds (IMAGE *Image, int *Dimv)
+int imgetbbox (IMAGE *Image, double Threshold, int Endpts[][2])
 {
+	ABOVE Query;
 	int i;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
-	if (Dimv == NULL) Error("Null dimv pointer");
-
-	/* Check that file is open */
-	if (Image->Fd == EOF) Error("Image not open");
+	if (Endpts == NULL) Error("Null endpoints pointer");
 
-	/* Copy data */
 	for (i=0; i<Image->Dimc; i++)
-		Dimv[i] = Image->Dimv[i];
-   
+	{
+		Endpts[i][0] = INT_MAX;
+		Endpts[i][1] = -1;
+	}
+	Query.Image = Image;
+	Query.Indices = NULL;
+	Query.MaxCnt = 0;
+	Query.Count = 0;
+	Query.Box = Endpts;
+	Query.RowStart = -Image->PixelCnt - 1;
+	if (FindAbove(Image, Threshold, &Query) == INVALID) return(INVALID);
+	if (Query.Count == 0)
+		for (i=0; i<Image->Dimc; i++)
+			Endpts[i][0] = 0;
 	return(VALID);
 }
 
-
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /* Purpose:  This routine reads the MAXMIN or HISTO field from the image.    */
@@ -2648,20 +8412,34 @@ int imbounds (IMAGE *Image, int *Dimv)
 /*           4096th bucket.  While this seems like a bit of a hack, it was   */
 /*           the best solution given historical contraints.  Ideally, the    */
 /*           size of the histogram array should be [MinPixel..MaxPixel].     */
+/*           The histogram is computed from a count of every pixel value     */
+/*           made in one pass, which also gives the MAXMIN field.  Other     */
+/*           numeric formats take both fields from imgetstats.               */
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 int imgetdesc (IMAGE *Image, int Type, int Buffer[])
 {
-	GREYTYPE Pixels[MAXGET];
-	int Low, High;
+	IMINDEX *Count;
 	int TempMax, TempMin;
-	int PixelCnt;
-	int Index;
 	int i;
 
 	/* Check parameters */
 	if (Image == NULL) Error("Null image pointer");
-	if (Image->PixelFormat != GREY) Error("Image type is not GREY");
+
+	/* Handle numeric images that are not GREY */
+	if (Image->PixelFormat != GREY)
+	{
+		if (StatsDesc(Image, Type) == INVALID) return(INVALID);
+		if (Type == MINMAX)
+		{
+			Buffer[0] = Image->MaxMin[0];
+			Buffer[1] = Image->MaxMin[1];
+		}
+		else if (Type == HISTO)
+			for (i=0; i<nHISTOGRAM; i++)
+				Buffer[i] = Image->Histogram[i];
+		return(VALID);
+	}
 
 	/* Handle request for MINMAX field */
 	if (Type == MINMAX)
@@ -2677,26 +8455,10 @@ int imgetdesc (IMAGE *Image, int Type, int Buffer[])
 			/* Compute new MaxMin field */
 			TempMin = MAXVAL;
 			TempMax = MINVAL;
-
-			/* Loop reading pixels */
-			for (Low=0; Low<Image->PixelCnt; Low=Low+MAXGET)
-			{
-				/* Compute read range */
-				High = Low + MAXGET - 1;
-				if (High >= Image->PixelCnt) High = Image->PixelCnt -1;
-
-				/* Read pixels */
-				if (imread(Image, Low, High, Pixels) == INVALID)
-					Error("Could not read pixels");
-            
-				/* Search for new MaxMin Values */
-				PixelCnt = High - Low + 1;
-				for (i=0; i<PixelCnt; i++)
-				{
-					if (Pixels[i]<TempMin) TempMin = Pixels[i];
-					if (Pixels[i]>TempMax) TempMax = Pixels[i];
-				}
-			}
+			if (TrackedCounts(Image))
+				CountRange(Image->HistoCount, &TempMin, &TempMax);
+			else if (ScanPixels(Image, &TempMin, &TempMax, NULL) == INVALID)
+				Error("Could not read pixels");
 
 			/* Save new MaxMin field */
 			Image->ValidMaxMin = TRUE;
@@ -2716,45 +8478,29 @@ int imgetdesc (IMAGE *Image, int Type, int Buffer[])
 		}
 		else
 		{
-			/* Compute MAX and MIN pixel values JG1 */
-			if (imgetdesc(Image, MINMAX, Buffer) == INVALID)
-				Error("Could not obtain minmax values");
-			TempMin = Buffer[0];
-			TempMax = Buffer[1];
-         
-			/* Compute new Histogram field */
-			for(i=0; i<nHISTOGRAM; i++)
-				Buffer[i] = 0;
-
-			/* Loop reading pixels */
-			for (Low=0; Low<Image->PixelCnt; Low=Low+MAXGET)
+			/* Count every pixel value in one pass, unless the counts */
+			/* were kept while the image was written                  */
+			if (TrackedCounts(Image))
+				Count = Image->HistoCount;
+			else if (LoadHisto(Image) == VALID)
+				Count = Image->PixelHisto->Histogram;
+			else
 			{
-				/* Compute read range */
-				High = Low + MAXGET - 1;
-				if (High >= Image->PixelCnt) High = Image->PixelCnt -1;
- 
-				/* Read pixels */
-				if (imread(Image, Low, High, Pixels) == INVALID)
-					Error("Could not read pixels");
-            
-				/* Update Histogram and handle any pixels out of range */
-				for (i=0; i<=(High-Low); i++)
+				Count = (IMINDEX *)calloc(MAXVAL - MINVAL + 1, sizeof(IMINDEX));
+				if (Count == NULL) Error("Allocation error");
+				if (ScanPixels(Image, NULL, NULL, Count) == INVALID)
 				{
-					/* Determine index into histogram map JG1 */
-					Index = Pixels[i] - TempMin;
-					if (Index < 0)
-						Buffer[ 0 ]++;
-					else if (Index >= nHISTOGRAM)
-						Buffer[ nHISTOGRAM-1 ]++;
-					else
-						Buffer[ Index ]++;
+					free(Count);
+					Error("Could not read pixels");
 				}
 			}
 
 			/* Save new Histogram field */
-			Image->ValidHistogram = TRUE;
+			FoldCounts(Image, Count);
+			if (Count != Image->HistoCount && (Image->PixelHisto == NULL ||
+				Count != Image->PixelHisto->Histogram)) free(Count);
 			for (i=0; i<nHISTOGRAM; i++)
-				Image->Histogram[i] = Buffer[i];
+				Buffer[i] = Image->Histogram[i];
 		}
 	}
 
@@ -2964,7 +8710,7 @@ int imputinfo (IMAGE *Image, char *Name, char *Data)
 int imcopyinfo (IMAGE *Image1, IMAGE *Image2)
 {
 	int Length;
-	int i;
+	int i, j;
 
 	/* Check parameters */
 	if (Image1 == NULL) Error("Null image pointer");
@@ -2978,17 +8724,21 @@ int imcopyinfo (IMAGE *Image1, IMAGE *Image2)
 	Image2->InfoCnt = 0;
 	for (i=0; i<Image1->InfoCnt; i++)
 	{
+		/* Statistics describe the pixels of Image1 only */
+		if (IsStatsField(Image1->InfoName[i])) continue;
+		j = Image2->InfoCnt;
+
 		/* Copy name field */
 		Length = (int) strlen(Image1->InfoName[i]) + 1;
-		Image2->InfoName[i] = (char *)malloc((unsigned)Length);
-		if (Image2->InfoName[i] == NULL) Error("Allocation error");
-		strcpy(Image2->InfoName[i], Image1->InfoName[i]);
+		Image2->InfoName[j] = (char *)malloc((unsigned)Length);
+		if (Image2->InfoName[j] == NULL) Error("Allocation error");
+		strcpy(Image2->InfoName[j], Image1->InfoName[i]);
 
 		/* Copy data field */
 		Length = (int) strlen(Image1->InfoData[i]) + 1;
-		Image2->InfoData[i] = (char *)malloc((unsigned)Length);
-		if (Image2->InfoData[i] == NULL) Error("Allocation error");
-		strcpy(Image2->InfoData[i], Image1->InfoData[i]);
+		Image2->InfoData[j] = (char *)malloc((unsigned)Length);
+		if (Image2->InfoData[j] == NULL) Error("Allocation error");
+		strcpy(Image2->InfoData[j], Image1->InfoData[i]);
 
 		/* Increment field counter */
 		Image2->InfoCnt ++;
@@ -3057,6 +8807,27 @@ char *imerror (void)
 	return(Message);
 }
 
+#ifdef IMAGE_IOSTATS
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine returns the number of pixel I/O system calls and   */
+/*           bytes moved since the last reset.  It is only compiled when     */
+/*           IMAGE_IOSTATS is defined and is meant for benchmarks.           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+int imiostats (long *Calls, long *Bytes, int Reset)
+{
+	if (Calls != NULL) *Calls = _imiocalls;
+	if (Bytes != NULL) *Bytes = _imiobytes;
+	if (Reset)
+	{
+		_imiocalls = 0;
+		_imiobytes = 0;
+	}
+	return(VALID);
+}
+#endif
+
 
 
 
@@ -3097,6 +8868,10 @@ int im_snap (int xdim, int ydim, int pixformat, char *name, char *newtitle,
 	if ((image = imcreat(name, DEFAULT, pixformat, dimc, dimv)) ==
 		INVALID) Error("Can not create snapshot image");
 
+	/* Count the pixels as they are written, so the descriptors below */
+	/* do not have to read them back                                  */
+	imsetopt(image, OPT_TRACKHISTO, TRUE);
+
 	/* Write out new image file */
 	if (imwrite(image, 0, pixcnt - 1, (GREYTYPE*) pixel) == INVALID) {
 		Error("Can not write pixels to snapshot image\n");
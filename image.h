@@ -28,8 +28,8 @@
 #include <io.h>
 #include <stdio.h>
 #else
-#ifdef SYSV
 #include <sys/types.h>
+#ifdef SYSV
 #ifndef __FCNTL_HEADER__	/* Because system V does not do this */
 #define __FCNTL_HEADER__	/* 	in fcntl.h		     */
 #include <fcntl.h>
@@ -46,6 +46,13 @@
 #endif
 #endif
 
+/* 64 bit pixel counts and file addresses */
+#ifdef WIN32
+typedef __int64 IMINDEX;
+#else
+typedef long long IMINDEX;
+#endif
+
 /* Boolean values */
 #define TRUE		1
 #define FALSE		0
@@ -69,6 +76,7 @@
 #define REAL		0004
 #define COMPLEX		0005
 #define INT             0006
+#define INT64           0007	/* for Swap only */
 
 /* Pixel format types */
 typedef short GREYTYPE;
@@ -93,11 +101,40 @@ typedef struct { float re, im; } COMPLEXTYPE;
 
 /* currently support up to 10 compression methods */
 #define MAX_NUM_COMP_METHODS 10
+
+/* Compression methods 0 to 9 are the commands of the compression config */
+/* file, the rest are codecs built into the library (see imsetcodec).     */
+#define MAX_NUM_CODECS	16
+#define CODEC_ZLIB	10
+#define CODEC_ZSTD	11
+#define CODEC_LZ4	12
+
+/* Prefilters for GREY and SHORT pixels compressed with a codec.  They  */
+/* are chosen when an image is compressed, with IMAGE_PREFILTER set to  */
+/* their sum or to "delta", "shuffle" or "delta+shuffle".               */
+#define PREFILTER_DELTA		1
+#define PREFILTER_SHUFFLE	2
  
 /* Constants for imgetdesc calls */
 #define MINMAX		0
 #define HISTO		1
 
+/* Buffer types for imread_as and imgetpix_as */
+#define AS_FLOAT	1
+#define AS_DOUBLE	2
+#define AS_INT32	3
+#define AS_UINT16	4
+
+/* Options for imsetopt */
+#define OPT_COALESCE	1
+#define OPT_DIRECTIO	2
+#define OPT_STREAMING	3
+#define OPT_PARALLEL	4
+#define OPT_TRACKHISTO	5
+#define OPT_SLICEINDEX	6
+#define OPT_ZONEMAP	7
+#define OPT_UCMEMORY	8
+
 /* Protection modes for imcreat */
 #define UOWNER		0600
 #define UGROUP		0060
@@ -121,11 +158,26 @@ typedef struct { float re, im; } COMPLEXTYPE;
 #define TITLESIZE	nTITLE
 #define MAXPIX		(nHISTOGRAM-1)
 
+/* Pixel statistics from imgetstats */
+typedef struct {
+   double Min;			/* Computed fields */
+   double Max;
+   double Sum;
+   double SumSq;
+   IMINDEX Count;		/* pixels that are not NaN */
+   IMINDEX NaNCount;
+
+   int   Bins;			/* Histogram request, 0 for none */
+   double Low;			/* [Min..Max] if Low >= High */
+   double High;
+   IMINDEX *Histogram;		/* Bins counts, supplied by the caller */
+   } IMSTATS;
+
 /* Structure for image information (everything but pixels) */
 typedef struct {
    int   Fd;			/* Computed fields */
    int   PixelSize;
-   int   PixelCnt;
+   IMINDEX PixelCnt;
    int   SwapNeeded;
 
    int	 Compressed;		/* is pixel data compressed? */
@@ -134,8 +186,16 @@ typedef struct {
    int	 PixelsModified;	/* have the pixels been modified yet? */
    int	 UCPixelsFd;		/* where is the uncompressed data? */
    char	 UCPixelsFileName[256];	/* name of the uncompressed data file */
-
-   int   Address[nADDRESS];	/* Header fields from file */
+   char	*UCPixels;		/* or the uncompressed data in memory */
+   int	 Chunked;		/* compressed in independent chunks? */
+   IMINDEX ChunkSlice;		/* bytes per slice, split into chunks */
+   IMINDEX ChunkBytes;		/* bytes per chunk (less at slice end) */
+   IMINDEX ChunkCnt;
+   IMINDEX *ChunkTable;		/* ChunkCnt+1 compressed chunk offsets */
+   char *ChunkState;		/* which chunks are decompressed, changed */
+   int	 Prefilter;		/* PREFILTER_ flags applied to each chunk */
+
+   IMINDEX Address[nADDRESS];	/* Header fields from file */
    char  Title[nTITLE];
    int   ValidMaxMin;
    int   MaxMin[nMAXMIN];
@@ -151,8 +211,36 @@ typedef struct {
 
    int   nImgFormat;
 
+   char *MapBase;		/* Pixel mapping from immap */
+   char *MapPixels;
+   size_t MapLength;
+   int   MapWritable;
+
+   int   Coalesce;		/* Access options (see imsetopt) */
+   int   DirectIO;
+   int   DirectFd;		/* O_DIRECT descriptor, or -1 */
+   int   Streaming;
+   int   Parallel;		/* imgetdesc on the worker pool */
+   IMINDEX UCMemory;		/* largest image decompressed to memory */
+   int   TrackHisto;		/* count GREY values as they are written */
+   IMINDEX *HistoCount;
+   IMINDEX HistoNext;		/* next pixel to write, or -1 */
+   int   SliceIndex;		/* build the slice index at imclose */
+   double *SliceStats;		/* slice index (see imindex) */
+   IMSTATS *PixelHisto;		/* histogram for imgetpercentile */
+   int   TrackZones;		/* keep the zone map as pixels are written */
+   double *ZoneTrack;
+   IMINDEX ZoneNext;		/* next pixel to write, or -1 */
+   double *ZoneMap;		/* zone map (see imgetabove) */
+   IMINDEX HintStart;		/* Last read, for readahead hints */
+   IMINDEX HintDelta;
+
    } IMAGE;
 
+/* Handle for asynchronous pixel reads */
+typedef struct imasync IMASYNC;
+typedef void (*IMCALLBACK)(IMASYNC *Handle, int Status, void *Data);
+
 /* compression structure */
 typedef struct
 {
@@ -161,6 +249,19 @@ typedef struct
   char decompressionCommand[80];
 } compMethod;
 
+/* In memory codec.  Bound gives the largest compressed length of Length */
+/* bytes.  Compress and Decompress return the length of their output, or */
+/* -1 if it does not fit in OutLen bytes or the input is damaged.        */
+typedef struct
+{
+  char *Name;
+  IMINDEX (*Bound)(IMINDEX Length);
+  IMINDEX (*Compress)(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen);
+  IMINDEX (*Decompress)(IMAGE *Image, char *In, IMINDEX InLen,
+	char *Out, IMINDEX OutLen);
+} IMCODEC;
+
 /* Function Declarations */
 
 #ifdef __cplusplus
@@ -175,25 +276,45 @@ IMAGE *imopen(char *ImName, int Mode);
 int imclose(IMAGE *Image);
 int imcloseC(IMAGE *Image);
 int imcloseU(IMAGE *Image);
-int Swap(char *Buffer, int Length, int Type);
+int Swap(char *Buffer, IMINDEX Length, int Type);
 int Swapheader(IMAGE *Image);
 int readCompressionConfigFile(void);
 int fillInCompressionCommand(char *specific, char *generic, char *infile, char *outfile, IMAGE *Image);
 int compressImage(IMAGE *Image);
 int decompressImage(IMAGE *Image);
+int imsetcodec(int Method, IMCODEC *Codec);
 int imread(IMAGE *Image, int LoIndex, int HiIndex, GREYTYPE *Buffer);
-int imwrite(IMAGE *Image, int LoIndex, int HiIndex, GREYTYPE *Buffer);
+int imwrite(IMAGE *Image, int LoIndex, int HiIndex, const GREYTYPE *Buffer);
+int imread64(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex, GREYTYPE *Buffer);
+int imwrite64(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex, const GREYTYPE *Buffer);
+int imread_as(IMAGE *Image, IMINDEX LoIndex, IMINDEX HiIndex, void *Buffer, int Type, double Slope, double Intercept);
 int imgetpix(IMAGE *Image, int Endpts[][2], int Coarseness[], GREYTYPE *Pixels);
-int imputpix(IMAGE *Image, int Endpts[][2], int Coarseness[], GREYTYPE *Pixels);
+int imgetpix_batch(IMAGE *Image, int nRegions, int (*Endpts[])[2], GREYTYPE *Buffers[]);
+int imgetpix_as(IMAGE *Image, int Endpts[][2], int *Coarseness, void *Pixels, int Type, double Slope, double Intercept);
+int imputpix(IMAGE *Image, int Endpts[][2], int Coarseness[], const GREYTYPE *Pixels);
 int GetPut2D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode);
 int GetPut3D(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode);
 int GetPutND(IMAGE *Image, int Endpts[][2], GREYTYPE *Pixels, int Mode);
+int GetPutCoarse(IMAGE *Image, int Endpts[][2], int *Coarseness, GREYTYPE *Pixels, int Mode);
+int immap(IMAGE *Image, void **Pixels, int *Strides);
+int imunmap(IMAGE *Image);
+IMASYNC *imgetpix_async(IMAGE *Image, int Endpts[][2], int *Coarseness, GREYTYPE *Pixels, IMCALLBACK Callback, void *Data);
+int imasync_poll(IMASYNC *Handle);
+int imasync_wait(IMASYNC *Handle);
 int imheader(IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int *Dimc, int *Dimv, int *MaxMin);
 int imheaderC(IMAGE *Image, int *PixFormat, int *PixSize, int *PixCnt, int *Dimc, int *Dimv, int *MaxMin, int *Compressed, int *CompMethod, float *CompRatio);
+int impixcnt(IMAGE *Image, IMINDEX *PixCnt);
+int imsetopt(IMAGE *Image, int Option, int Value);
 int imgetcompinfo(IMAGE *Image, int *Compressed, int *CompMethod, float *CompRatio);
 int imdim(IMAGE *Image, int *PixFormat, int *Dimc);
 int imbounds(IMAGE *Image, int *Dimv);
 int imgetdesc(IMAGE *Image, int Type, int Buffer[]);
+int imgetstats(IMAGE *Image, IMSTATS *Stats);
+int imindex(IMAGE *Image);
+int imgetslicestats(IMAGE *Image, int Endpts[][2], IMSTATS *Stats);
+int imgetpercentile(IMAGE *Image, double Percent, double *Value);
+int imgetabove(IMAGE *Image, double Threshold, IMINDEX *Indices, IMINDEX MaxCnt, IMINDEX *Count);
+int imgetbbox(IMAGE *Image, double Threshold, int Endpts[][2]);
 int imtest(IMAGE *Image, int Type);
 int imgettitle(IMAGE *Image, char *Title);
 int imputtitle(IMAGE *Image, char *Title);
@@ -202,6 +323,9 @@ int imputinfo(IMAGE *Image, char *Name, char *Data);
 int imcopyinfo(IMAGE *Image1, IMAGE *Image2);
 char **iminfoids(IMAGE *Image);
 char *imerror(void);
+#ifdef IMAGE_IOSTATS
+int imiostats(long *Calls, long *Bytes, int Reset);
+#endif
 int im_snap(int xdim, int ydim, int pixformat, char *name, char *newtitle, char *pixel);
 
 #ifdef __cplusplus
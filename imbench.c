@@ -0,0 +1,913 @@
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Program:  IMBENCH.C                                                       */
+/*                                                                           */
+/* Purpose:  Benchmarks for the pixel access routines in image.c.  The       */
+/*           library must be compiled with IMAGE_IOSTATS so that the         */
+/*           number of pixel I/O system calls can be reported:               */
+/*                                                                           */
+/*              cc -O2 -DIMAGE_IOSTATS imbench.c image.c -lm -o imbench      */
+/*              imbench [scratch.im [zdim ydim xdim]]                        */
+/*                                                                           */
+/*           swap    - Reports the speed of Swap for each pixel format in    */
+/*                     GB/s.  Run with IMAGE_NOSIMD set to time the scalar   */
+/*                     version.                                              */
+/*                                                                           */
+/*           subwin  - Reads a 256x256 window from every slice of a 3D       */
+/*                     GREY image, once a row at a time (the I/O pattern     */
+/*                     of the old lseek/read loop, which also needed one     */
+/*                     lseek per row) and once with a single imgetpix call.  */
+/*                                                                           */
+/*           thumb   - Reads every THUMBSTEP-th pixel in each dimension of   */
+/*                     the 3D image with one imgetpix call.                  */
+/*                                                                           */
+/*           rois    - Reads ROIS random 8x8x8 cubes from the 3D image,      */
+/*                     once with an imgetpix call each and once with a       */
+/*                     single imgetpix_batch call, each from a cold page     */
+/*                     cache (where the system can drop it) and again from   */
+/*                     a warm one.  Then reads them with imgetpix_async,     */
+/*                     ASYNCDEPTH at a time, and checks the pixels against   */
+/*                     the batch.  Build with HAVE_IO_URING to time the      */
+/*                     io_uring backend.                                     */
+/*                                                                           */
+/*           float   - Reads the whole 3D image as float with a scale and    */
+/*                     offset, once with imread and a second conversion      */
+/*                     pass and once with imread_as.                         */
+/*                                                                           */
+/*           desc    - Computes the MINMAX and HISTO fields of the 3D image  */
+/*                     with imgetdesc, each on a freshly opened image.       */
+/*                                                                           */
+/*           stats   - Copies the 3D image to a REAL image and computes      */
+/*                     its statistics, once with imread_as and a loop, once  */
+/*                     with imgetstats and once more with imgetstats after   */
+/*                     reopening the image, which uses the saved results.    */
+/*                     Then builds the slice index with imindex and queries  */
+/*                     every slice with imgetslicestats.  Last, finds the    */
+/*                     1st and 99th percentiles with imgetpercentile and     */
+/*                     boxes the pixels above the 99th twice with imgetbbox, */
+/*                     the second time skipping zones using the zone map.    */
+/*                                                                           */
+/*           codecs  - Writes CODECSLICES slices of the 3D image as separate */
+/*                     compressed 2D images and reads them back, once for    */
+/*                     each compression method available: method 0 of the    */
+/*                     config file and the built in zlib, zstd and lz4.      */
+/*                     Then compresses the whole 3D image and times reading  */
+/*                     its middle slice, which only decompresses the chunks  */
+/*                     of that slice unless the method is a config command.  */
+/*                     Last, reads it slice by slice with the decompressed   */
+/*                     pixels in memory and spilled to a file.               */
+/*                                                                           */
+/*           prefilter - Compresses a CT-like 3D image with the first built  */
+/*                     in codec and each prefilter (none, delta, shuffle and */
+/*                     both), and reads it back.                             */
+/*                                                                           */
+/*           frames  - Reads a 64x64 window from every slice of every frame  */
+/*                     of a 4D GREY image with GetPutND, once merging only   */
+/*                     touching runs (OPT_COALESCE 0) and once merging runs  */
+/*                     up to 64K apart.                                      */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "image.h"
+
+/* Default scratch image and its size */
+#define BENCHFILE	"/tmp/imbench.im"
+#define ZDIM		300
+#define YDIM		512
+#define XDIM		512
+#define WINDOW		256
+
+/* Buffer size and repetitions for the swap benchmark */
+#define SWAPBYTES	(64 << 20)
+#define SWAPREPS	8
+
+/* Sampling step for the thumb benchmark */
+#define THUMBSTEP	4
+
+/* Regions for the rois benchmark */
+#define ROIS		2000
+#define ROISIZE		8
+#define ASYNCDEPTH	16
+
+/* REAL scratch image for the stats benchmark */
+#define STATSFILE	"/tmp/imbenchreal.im"
+
+/* Compressed slices for the codecs benchmark */
+#define CODECFILE	"/tmp/imbenchslice.im"
+#define CODECSLICES	100
+
+/* 4D scratch image for the frames benchmark */
+#define FRAMEFILE	"/tmp/imbench4d.im"
+#define FRAMES		24
+#define FWINDOW		64
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine returns the wall clock time in seconds.            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static double Now(void)
+{
+	struct timeval Time;
+
+	gettimeofday(&Time, NULL);
+	return(Time.tv_sec + Time.tv_usec * 1e-6);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine prints one line of benchmark results.              */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void Report(char *Name, double Seconds)
+{
+	long Calls;
+	long Bytes;
+
+	imiostats(&Calls, &Bytes, TRUE);
+	printf("%-24s %10ld calls %12ld bytes %10.2f ms\n",
+		Name, Calls, Bytes, Seconds * 1000.0);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine asks the system to drop the cached pages of an     */
+/*           image file, so the next read comes from the disk.  Pages of a   */
+/*           file on tmpfs can not be dropped.                               */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void DropCache(IMAGE *Image)
+{
+#if !defined(WIN32) && defined(POSIX_FADV_DONTNEED)
+	fsync(Image->Fd);
+	posix_fadvise(Image->Fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+	(void)Image;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Swap benchmark.  Swaps a SWAPBYTES buffer SWAPREPS times for    */
+/*           each pixel format with multi-byte words.                        */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchSwap(void)
+{
+	static struct { char *Name; int Format; } Formats[] = {
+		{ "GREY", GREY }, { "SHORT", SHORT }, { "LONG", LONG },
+		{ "REAL", REAL }, { "COMPLEX", COMPLEX }, { "USERPACKED", USERPACKED },
+		{ "INT64", INT64 } };
+	char *Buffer;
+	double Start;
+	double Seconds;
+	int f;
+	int i;
+
+	Buffer = (char *)malloc(SWAPBYTES);
+	if (Buffer == NULL) return(INVALID);
+	memset(Buffer, 0x5a, SWAPBYTES);
+
+	for (f=0; f<(int)(sizeof(Formats)/sizeof(Formats[0])); f++)
+	{
+		Start = Now();
+		for (i=0; i<SWAPREPS; i++)
+			Swap(Buffer, SWAPBYTES, Formats[f].Format);
+		Seconds = Now() - Start;
+		printf("swap %-19s %10.2f GB/s\n", Formats[f].Name,
+			(double)SWAPBYTES * SWAPREPS / Seconds / 1e9);
+	}
+
+	free(Buffer);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  This routine creates the scratch image, filled with a ramp.     */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMAGE *MakeImage(char *Name, int Dimc, int *Dimv)
+{
+	IMAGE *Image;
+	GREYTYPE *Slice;
+	int SliceCnt;
+	int SlabCnt;
+	int i;
+	int z;
+
+	unlink(Name);
+	Image = imcreat(Name, DEFAULT, GREY, Dimc, Dimv);
+	if (Image == NULL) return(NULL);
+
+	/* Write one slice of the last two dimensions at a time */
+	SliceCnt = Dimv[Dimc-2] * Dimv[Dimc-1];
+	SlabCnt = 1;
+	for (i=0; i<Dimc-2; i++)
+		SlabCnt = SlabCnt * Dimv[i];
+	Slice = (GREYTYPE *)malloc(SliceCnt * sizeof(GREYTYPE));
+	for (z=0; z<SlabCnt; z++)
+	{
+		for (i=0; i<SliceCnt; i++)
+			Slice[i] = (GREYTYPE)((z + i) & 0x7fff);
+		imwrite(Image, z * SliceCnt, (z + 1) * SliceCnt - 1, Slice);
+	}
+	free(Slice);
+	return(Image);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Subwindow benchmark.  Reads the centre WINDOWxWINDOW pixels of  */
+/*           every slice.                                                    */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchSubwindow(IMAGE *Image, int Dimv[3])
+{
+	int Endpts[3][2];
+	int Coarseness[3] = {1, 1, 1};
+	GREYTYPE *Pixels;
+	GREYTYPE *PixelPtr;
+	double Start;
+	int Window;
+	int y;
+	int z;
+
+	Window = WINDOW;
+	if (Window > Dimv[1]) Window = Dimv[1];
+	if (Window > Dimv[2]) Window = Dimv[2];
+	Pixels = (GREYTYPE *)malloc(
+		(size_t)Dimv[0] * Window * Window * sizeof(GREYTYPE));
+	if (Pixels == NULL) return(INVALID);
+
+	Endpts[0][0] = 0;
+	Endpts[0][1] = Dimv[0] - 1;
+	Endpts[1][0] = (Dimv[1] - Window) / 2;
+	Endpts[1][1] = Endpts[1][0] + Window - 1;
+	Endpts[2][0] = (Dimv[2] - Window) / 2;
+	Endpts[2][1] = Endpts[2][0] + Window - 1;
+
+	/* One call per row */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	PixelPtr = Pixels;
+	for (z=0; z<Dimv[0]; z++)
+	{
+		int Row[3][2];
+
+		Row[2][0] = Endpts[2][0];
+		Row[2][1] = Endpts[2][1];
+		Row[0][0] = Row[0][1] = z;
+		for (y=Endpts[1][0]; y<=Endpts[1][1]; y++)
+		{
+			Row[1][0] = Row[1][1] = y;
+			if (imgetpix(Image, Row, Coarseness, PixelPtr) == INVALID)
+				return(INVALID);
+			PixelPtr += Window;
+		}
+	}
+	Report("subwin row-at-a-time", Now() - Start);
+
+	/* One call for the whole window */
+	Start = Now();
+	if (imgetpix(Image, Endpts, Coarseness, Pixels) == INVALID)
+		return(INVALID);
+	Report("subwin imgetpix", Now() - Start);
+
+	free(Pixels);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Thumbnail benchmark.  Reads the whole image subsampled.         */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchThumb(IMAGE *Image, int Dimv[3])
+{
+	int Endpts[3][2];
+	int Coarseness[3];
+	GREYTYPE *Pixels;
+	double Start;
+	int i;
+
+	for (i=0; i<3; i++)
+	{
+		Endpts[i][0] = 0;
+		Endpts[i][1] = Dimv[i] - 1;
+		Coarseness[i] = THUMBSTEP;
+	}
+	Pixels = (GREYTYPE *)malloc(sizeof(GREYTYPE) *
+		(size_t)((Dimv[0] - 1) / THUMBSTEP + 1) *
+		((Dimv[1] - 1) / THUMBSTEP + 1) * ((Dimv[2] - 1) / THUMBSTEP + 1));
+	if (Pixels == NULL) return(INVALID);
+
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetpix(Image, Endpts, Coarseness, Pixels) == INVALID)
+		return(INVALID);
+	Report("thumb imgetpix", Now() - Start);
+
+	free(Pixels);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  ROI benchmark.  Reads ROIS cubes at random positions.           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchRois(IMAGE *Image, int Dimv[3])
+{
+	int (*Endpts[ROIS])[2];
+	GREYTYPE *Buffers[ROIS];
+	GREYTYPE *Copies[ROIS];
+	IMASYNC *Handles[ASYNCDEPTH];
+	int Coarseness[3] = {1, 1, 1};
+	size_t Bytes;
+	int Size;
+	double Start;
+	int r;
+	int i;
+
+	Size = ROISIZE;
+	for (i=0; i<3; i++)
+		if (Size > Dimv[i]) Size = Dimv[i];
+
+	srand(1);
+	for (r=0; r<ROIS; r++)
+	{
+		Endpts[r] = (int (*)[2])malloc(3 * sizeof(*Endpts[r]));
+		Buffers[r] = (GREYTYPE *)malloc(Size * Size * Size * sizeof(GREYTYPE));
+		if (Endpts[r] == NULL || Buffers[r] == NULL) return(INVALID);
+		for (i=0; i<3; i++)
+		{
+			Endpts[r][i][0] = rand() % (Dimv[i] - Size + 1);
+			Endpts[r][i][1] = Endpts[r][i][0] + Size - 1;
+		}
+	}
+
+	/* One call per region, then one call for all regions, from disk */
+	DropCache(Image);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	for (r=0; r<ROIS; r++)
+		if (imgetpix(Image, Endpts[r], Coarseness, Buffers[r]) == INVALID)
+			return(INVALID);
+	Report("rois imgetpix cold", Now() - Start);
+	DropCache(Image);
+	Start = Now();
+	if (imgetpix_batch(Image, ROIS, Endpts, Buffers) == INVALID)
+		return(INVALID);
+	Report("rois imgetpix_batch cold", Now() - Start);
+
+	/* One call per region */
+	Start = Now();
+	for (r=0; r<ROIS; r++)
+		if (imgetpix(Image, Endpts[r], Coarseness, Buffers[r]) == INVALID)
+			return(INVALID);
+	Report("rois imgetpix", Now() - Start);
+
+	/* One call for all regions */
+	Start = Now();
+	if (imgetpix_batch(Image, ROIS, Endpts, Buffers) == INVALID)
+		return(INVALID);
+	Report("rois imgetpix_batch", Now() - Start);
+
+	/* Asynchronous calls, a few in flight */
+	Bytes = Size * Size * Size * sizeof(GREYTYPE);
+	for (r=0; r<ROIS; r++)
+	{
+		if ((Copies[r] = (GREYTYPE *)malloc(Bytes)) == NULL) return(INVALID);
+		memset(Copies[r], 0, Bytes);
+	}
+	Start = Now();
+	for (r=0; r<ROIS+ASYNCDEPTH; r++)
+	{
+		if (r >= ASYNCDEPTH &&
+			imasync_wait(Handles[r % ASYNCDEPTH]) == INVALID) return(INVALID);
+		if (r < ROIS && (Handles[r % ASYNCDEPTH] = imgetpix_async(Image,
+			Endpts[r], Coarseness, Copies[r], NULL, NULL)) == NULL)
+			return(INVALID);
+	}
+	Report("rois imgetpix_async", Now() - Start);
+	for (r=0; r<ROIS; r++)
+		if (memcmp(Copies[r], Buffers[r], Bytes) != 0)
+			fprintf(stderr, "imbench: imgetpix_async read region %d wrong\n", r);
+
+	for (r=0; r<ROIS; r++)
+	{
+		free(Endpts[r]);
+		free(Buffers[r]);
+		free(Copies[r]);
+	}
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Float benchmark.  Converts the whole image to float.            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchFloat(IMAGE *Image)
+{
+	IMINDEX PixelCnt;
+	IMINDEX i;
+	GREYTYPE *Pixels;
+	float *Values;
+	double Start;
+
+	impixcnt(Image, &PixelCnt);
+	Pixels = (GREYTYPE *)malloc((size_t)PixelCnt * sizeof(GREYTYPE));
+	Values = (float *)malloc((size_t)PixelCnt * sizeof(float));
+	if (Pixels == NULL || Values == NULL) return(INVALID);
+	memset(Values, 0, (size_t)PixelCnt * sizeof(float));
+
+	/* Read, then convert */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imread64(Image, 0, PixelCnt - 1, Pixels) == INVALID)
+		return(INVALID);
+	for (i=0; i<PixelCnt; i++)
+		Values[i] = Pixels[i] * 0.5f + 10.0f;
+	Report("float imread + loop", Now() - Start);
+	free(Pixels);
+
+	/* Read and convert together */
+	Start = Now();
+	if (imread_as(Image, 0, PixelCnt - 1, Values, AS_FLOAT, 0.5, 10.0) ==
+		INVALID) return(INVALID);
+	Report("float imread_as", Now() - Start);
+
+	free(Values);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Descriptor benchmark.  The image is closed and reopened so      */
+/*           that neither field is already valid.                            */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static IMAGE *BenchDesc(IMAGE *Image, char *Name)
+{
+	int Histogram[nHISTOGRAM];
+	double Start;
+
+	imclose(Image);
+	if ((Image = imopen(Name, READ)) == NULL) return(NULL);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetdesc(Image, MINMAX, Histogram) == INVALID) return(NULL);
+	Report("desc MINMAX", Now() - Start);
+
+	imclose(Image);
+	if ((Image = imopen(Name, READ)) == NULL) return(NULL);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetdesc(Image, HISTO, Histogram) == INVALID) return(NULL);
+	Report("desc HISTO", Now() - Start);
+
+	return(Image);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Statistics benchmark.  The loop is what a caller without        */
+/*           imgetstats has to run every time the image is opened.           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchStats(IMAGE *Image, int Dimv[3])
+{
+	IMAGE *Real;
+	IMSTATS Stats;
+	int Endpts[1][2];
+	int Box[3][2];
+	IMINDEX PixelCnt;
+	IMINDEX i;
+	float *Values;
+	double Min, Max, Sum, SumSq;
+	double Start;
+
+	impixcnt(Image, &PixelCnt);
+	Values = (float *)malloc((size_t)PixelCnt * sizeof(float));
+	if (Values == NULL) return(INVALID);
+	if (imread_as(Image, 0, PixelCnt - 1, Values, AS_FLOAT, 0.37, 0.5) ==
+		INVALID) return(INVALID);
+	unlink(STATSFILE);
+	if ((Real = imcreat(STATSFILE, DEFAULT, REAL, 3, Dimv)) == NULL)
+		return(INVALID);
+	if (imwrite64(Real, 0, PixelCnt - 1, (GREYTYPE *)Values) == INVALID)
+		return(INVALID);
+	imclose(Real);
+	if ((Real = imopen(STATSFILE, UPDATE)) == NULL) return(INVALID);
+
+	/* Read, then loop */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imread_as(Real, 0, PixelCnt - 1, Values, AS_FLOAT, 1.0, 0.0) ==
+		INVALID) return(INVALID);
+	Min = Max = Values[0];
+	Sum = SumSq = 0;
+	for (i=0; i<PixelCnt; i++)
+	{
+		if (Values[i] < Min) Min = Values[i];
+		if (Values[i] > Max) Max = Values[i];
+		Sum += Values[i];
+		SumSq += (double) Values[i] * Values[i];
+	}
+	Report("stats imread_as + loop", Now() - Start);
+	free(Values);
+
+	/* Scan once and save */
+	Stats.Bins = 0;
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetstats(Real, &Stats) == INVALID) return(INVALID);
+	Report("stats imgetstats", Now() - Start);
+	if (Stats.Min != Min || Stats.Max != Max)
+		fprintf(stderr, "imbench: stats differ\n");
+	imclose(Real);
+
+	/* Reuse the saved results */
+	if ((Real = imopen(STATSFILE, READ)) == NULL) return(INVALID);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetstats(Real, &Stats) == INVALID) return(INVALID);
+	Report("stats imgetstats reopened", Now() - Start);
+
+	/* Index the slices, then query each one */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imindex(Real) == INVALID) return(INVALID);
+	Report("stats imindex", Now() - Start);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	for (Endpts[0][0]=0; Endpts[0][0]<Dimv[0]; Endpts[0][0]++)
+	{
+		Endpts[0][1] = Endpts[0][0];
+		if (imgetslicestats(Real, Endpts, &Stats) == INVALID)
+			return(INVALID);
+	}
+	Report("stats imgetslicestats", Now() - Start);
+
+	/* Window at the 1st and 99th percentiles */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetpercentile(Real, 1.0, &Min) == INVALID ||
+		imgetpercentile(Real, 99.0, &Max) == INVALID) return(INVALID);
+	Report("stats imgetpercentile", Now() - Start);
+
+	/* Box the brightest pixels, building the zone map, then reuse it */
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetbbox(Real, Max, Box) == INVALID) return(INVALID);
+	Report("stats imgetbbox", Now() - Start);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetbbox(Real, Max, Box) == INVALID) return(INVALID);
+	Report("stats imgetbbox zoned", Now() - Start);
+	imclose(Real);
+	unlink(STATSFILE);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Codecs benchmark.  Writes and reads back CODECSLICES slices as  */
+/*           compressed images with each available compression method.       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchCodecs(IMAGE *Image, int Dimv[3])
+{
+	static int Methods[] = { 0, CODEC_ZLIB, CODEC_ZSTD, CODEC_LZ4 };
+	IMAGE *Slice;
+	GREYTYPE *Pixels;
+	char Setting[16];
+	char Name[64];
+	char *Method;
+	int Compressed;
+	int CompMethod;
+	float CompRatio;
+	int SliceCnt;
+	int Slices;
+	int Spill;
+	int m;
+	int z;
+	double Start;
+
+	SliceCnt = Dimv[1] * Dimv[2];
+	Slices = Dimv[0] < CODECSLICES ? Dimv[0] : CODECSLICES;
+	Pixels = (GREYTYPE *)malloc(SliceCnt * sizeof(GREYTYPE));
+	if (Pixels == NULL) return(INVALID);
+
+	for (m=0; m<(int)(sizeof(Methods)/sizeof(Methods[0])); m++)
+	{
+		/* Skip methods this build does not have */
+		sprintf(Setting, "%d", Methods[m]);
+		setenv("IMAGE_COMPRESS", Setting, 1);
+		unlink(CODECFILE);
+		if ((Slice = imcreat(CODECFILE, DEFAULT, GREY, 2, &Dimv[1])) == NULL)
+			break;
+		imgetcompinfo(Slice, &Compressed, &CompMethod, &CompRatio);
+		imclose(Slice);
+		if (!Compressed || CompMethod != Methods[m]) continue;
+
+		/* Write each slice to its own image */
+		imiostats(NULL, NULL, TRUE);
+		Start = Now();
+		for (z=0; z<Slices; z++)
+		{
+			if (imread(Image, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels)
+				== INVALID) break;
+			unlink(CODECFILE);
+			if ((Slice = imcreat(CODECFILE, DEFAULT, GREY, 2, &Dimv[1])) == NULL)
+				break;
+			imwrite(Slice, 0, SliceCnt - 1, Pixels);
+			imclose(Slice);
+		}
+		Method = NULL;
+		if ((Slice = imopen(CODECFILE, READ)) != NULL)
+		{
+			Method = imgetinfo(Slice, "Pixel Compression Method");
+			imclose(Slice);
+		}
+		sprintf(Name, "codecs %.10s write", Method ? Method : Setting);
+		Report(Name, Now() - Start);
+
+		/* Read the last one back as often */
+		imiostats(NULL, NULL, TRUE);
+		Start = Now();
+		for (z=0; z<Slices; z++)
+		{
+			if ((Slice = imopen(CODECFILE, READ)) == NULL) break;
+			imread(Slice, 0, SliceCnt - 1, Pixels);
+			imclose(Slice);
+		}
+		sprintf(Name, "codecs %.10s read", Method ? Method : Setting);
+		Report(Name, Now() - Start);
+
+		/* Compress the whole volume, then read its middle slice */
+		unlink(CODECFILE);
+		if ((Slice = imcreat(CODECFILE, DEFAULT, GREY, 3, Dimv)) == NULL)
+			break;
+		for (z=0; z<Slices; z++)
+		{
+			if (imread(Image, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels)
+				== INVALID) break;
+			imwrite(Slice, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels);
+		}
+		imclose(Slice);
+		imiostats(NULL, NULL, TRUE);
+		Start = Now();
+		if ((Slice = imopen(CODECFILE, READ)) != NULL)
+		{
+			z = Dimv[0] / 2;
+			imread(Slice, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels);
+			imclose(Slice);
+		}
+		sprintf(Name, "codecs %.10s 1 of 3D", Method ? Method : Setting);
+		Report(Name, Now() - Start);
+
+		/* Read it slice by slice, decompressed to memory or to a file */
+		for (Spill=FALSE; Spill<=TRUE; Spill++)
+		{
+			imiostats(NULL, NULL, TRUE);
+			Start = Now();
+			if ((Slice = imopen(CODECFILE, READ)) != NULL)
+			{
+				if (Spill) imsetopt(Slice, OPT_UCMEMORY, 0);
+				for (z=0; z<Slices; z++)
+					imread(Slice, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels);
+				imclose(Slice);
+			}
+			sprintf(Name, "codecs %.10s 3D %s", Method ? Method : Setting,
+				Spill ? "spilled" : "in memory");
+			Report(Name, Now() - Start);
+		}
+		if (Method != NULL) free(Method);
+	}
+	unsetenv("IMAGE_COMPRESS");
+	unlink(CODECFILE);
+	free(Pixels);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Prefilter benchmark.  Compresses CODECSLICES slices of a        */
+/*           shaded disk with a little noise on a flat background, like a    */
+/*           CT study, with the first codec built in and each prefilter,     */
+/*           then reads them back.  The bytes read are about the compressed  */
+/*           size.                                                           */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchPrefilter(int Dimv[3])
+{
+	static char *Filters[] = { "0", "delta", "shuffle", "delta+shuffle" };
+	static char *Labels[] = { "none", "delta", "shuffle", "both" };
+	static int Methods[] = { CODEC_ZLIB, CODEC_ZSTD, CODEC_LZ4 };
+	IMAGE *Volume;
+	GREYTYPE *Pixels;
+	char Setting[16];
+	char Name[64];
+	int Compressed;
+	int CompMethod;
+	float CompRatio;
+	int Vdimv[3];
+	int SliceCnt;
+	int Dx;
+	int Dy;
+	int f;
+	int m;
+	int x;
+	int y;
+	int z;
+	double Start;
+
+	Vdimv[0] = Dimv[0] < CODECSLICES ? Dimv[0] : CODECSLICES;
+	Vdimv[1] = Dimv[1];
+	Vdimv[2] = Dimv[2];
+	SliceCnt = Dimv[1] * Dimv[2];
+	Pixels = (GREYTYPE *)malloc(SliceCnt * sizeof(GREYTYPE));
+	if (Pixels == NULL) return(INVALID);
+
+	/* Use the first codec this build has */
+	for (m=0; m<(int)(sizeof(Methods)/sizeof(Methods[0])); m++)
+	{
+		sprintf(Setting, "%d", Methods[m]);
+		setenv("IMAGE_COMPRESS", Setting, 1);
+		unlink(CODECFILE);
+		if ((Volume = imcreat(CODECFILE, DEFAULT, GREY, 2, &Dimv[1])) == NULL)
+			break;
+		imgetcompinfo(Volume, &Compressed, &CompMethod, &CompRatio);
+		imclose(Volume);
+		if (Compressed && CompMethod == Methods[m]) break;
+	}
+
+	for (f=0; f<(int)(sizeof(Filters)/sizeof(Filters[0])) &&
+		m<(int)(sizeof(Methods)/sizeof(Methods[0])); f++)
+	{
+		setenv("IMAGE_PREFILTER", Filters[f], 1);
+		unlink(CODECFILE);
+		imiostats(NULL, NULL, TRUE);
+		Start = Now();
+		if ((Volume = imcreat(CODECFILE, DEFAULT, GREY, 3, Vdimv)) == NULL)
+			break;
+		srand(1);
+		for (z=0; z<Vdimv[0]; z++)
+		{
+			for (y=0; y<Dimv[1]; y++)
+				for (x=0; x<Dimv[2]; x++)
+				{
+					Dx = x - Dimv[2] / 2;
+					Dy = y - Dimv[1] / 2;
+					Pixels[y * Dimv[2] + x] = (GREYTYPE)((9 * (Dx * Dx + Dy * Dy)
+						< Dimv[1] * Dimv[2] ? 1200 - (Dx * Dx + Dy * Dy) / 256 + z
+						: 24) + rand() % 4);
+				}
+			imwrite(Volume, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels);
+		}
+		imclose(Volume);
+		sprintf(Name, "prefilter %s write", Labels[f]);
+		Report(Name, Now() - Start);
+
+		imiostats(NULL, NULL, TRUE);
+		Start = Now();
+		if ((Volume = imopen(CODECFILE, READ)) != NULL)
+		{
+			for (z=0; z<Vdimv[0]; z++)
+				imread(Volume, z * SliceCnt, (z + 1) * SliceCnt - 1, Pixels);
+			imclose(Volume);
+		}
+		sprintf(Name, "prefilter %s read", Labels[f]);
+		Report(Name, Now() - Start);
+	}
+	unsetenv("IMAGE_PREFILTER");
+	unsetenv("IMAGE_COMPRESS");
+	unlink(CODECFILE);
+	free(Pixels);
+	return(VALID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/* Purpose:  Frames benchmark.  Reads the centre FWINDOWxFWINDOW pixels of   */
+/*           every slice of every frame of a 4D image.                       */
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static int BenchFrames(IMAGE *Image, int Dimv[4])
+{
+	int Endpts[4][2];
+	int Coarseness[4] = {1, 1, 1, 1};
+	GREYTYPE *Pixels;
+	double Start;
+	int i;
+
+	Pixels = (GREYTYPE *)malloc(
+		(size_t)Dimv[0] * Dimv[1] * FWINDOW * FWINDOW * sizeof(GREYTYPE));
+	if (Pixels == NULL) return(INVALID);
+
+	for (i=0; i<2; i++)
+	{
+		Endpts[i][0] = 0;
+		Endpts[i][1] = Dimv[i] - 1;
+	}
+	for (i=2; i<4; i++)
+	{
+		Endpts[i][0] = (Dimv[i] - FWINDOW) / 2;
+		Endpts[i][1] = Endpts[i][0] + FWINDOW - 1;
+	}
+
+	/* Merge touching runs only */
+	imsetopt(Image, OPT_COALESCE, 0);
+	imiostats(NULL, NULL, TRUE);
+	Start = Now();
+	if (imgetpix(Image, Endpts, Coarseness, Pixels) == INVALID)
+		return(INVALID);
+	Report("frames no merging", Now() - Start);
+
+	/* Merge runs separated by short gaps */
+	imsetopt(Image, OPT_COALESCE, 64 << 10);
+	Start = Now();
+	if (imgetpix(Image, Endpts, Coarseness, Pixels) == INVALID)
+		return(INVALID);
+	Report("frames merged", Now() - Start);
+
+	free(Pixels);
+	return(VALID);
+}
+
+int main(int argc, char **argv)
+{
+	IMAGE *Image;
+	char *Name;
+	int Dimv[3];
+	int Dimv4[4];
+
+	Name = (argc > 1) ? argv[1] : BENCHFILE;
+	Dimv[0] = (argc > 4) ? atoi(argv[2]) : ZDIM;
+	Dimv[1] = (argc > 4) ? atoi(argv[3]) : YDIM;
+	Dimv[2] = (argc > 4) ? atoi(argv[4]) : XDIM;
+
+	if (BenchSwap() == INVALID)
+		fprintf(stderr, "imbench: out of memory\n");
+
+	printf("image %s: %d x %d x %d GREY\n", Name, Dimv[0], Dimv[1], Dimv[2]);
+	if ((Image = MakeImage(Name, 3, Dimv)) == NULL)
+	{
+		fprintf(stderr, "imbench: %s\n", imerror());
+		exit(1);
+	}
+
+	if (BenchSubwindow(Image, Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if (BenchThumb(Image, Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if (BenchRois(Image, Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if (BenchFloat(Image) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if ((Image = BenchDesc(Image, Name)) == NULL)
+	{
+		fprintf(stderr, "imbench: %s\n", imerror());
+		exit(1);
+	}
+	if (BenchStats(Image, Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if (BenchCodecs(Image, Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+	if (BenchPrefilter(Dimv) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+
+	imclose(Image);
+	unlink(Name);
+
+	Dimv4[0] = FRAMES;
+	Dimv4[1] = Dimv[0] / 10 > 0 ? Dimv[0] / 10 : 1;
+	Dimv4[2] = Dimv[1] / 4 > FWINDOW ? Dimv[1] / 4 : FWINDOW;
+	Dimv4[3] = Dimv[2] / 4 > FWINDOW ? Dimv[2] / 4 : FWINDOW;
+	printf("image %s: %d x %d x %d x %d GREY\n", FRAMEFILE,
+		Dimv4[0], Dimv4[1], Dimv4[2], Dimv4[3]);
+	if ((Image = MakeImage(FRAMEFILE, 4, Dimv4)) == NULL)
+	{
+		fprintf(stderr, "imbench: %s\n", imerror());
+		exit(1);
+	}
+
+	if (BenchFrames(Image, Dimv4) == INVALID)
+		fprintf(stderr, "imbench: %s\n", imerror());
+
+	imclose(Image);
+	unlink(FRAMEFILE);
+	return(0);
+}